@@ -48,5 +48,6 @@ echo "Setting up fixtures"
 ./scripts/travis/postgresql-setup.sh
 ./scripts/travis/mysql-setup.sh
 ./scripts/travis/ldap-setup.sh
+./scripts/travis/rest-setup.sh
 # Travis doesn't have Redis 3.0 available yet
 # ./scripts/travis/redis-setup.sh
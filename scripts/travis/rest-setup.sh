@@ -0,0 +1,6 @@
+#!/bin/sh -e
+
+#
+#  Start the HTTP stub server used by the rlm_rest tests
+#
+nohup python ./src/tests/modules/rest/stub_server.py 8080 > /dev/null 2>&1 &
@@ -0,0 +1,66 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_BATCH_H
+#define _FR_BATCH_H
+/**
+ * $Id$
+ *
+ * @file include/batch.h
+ * @brief Run operations from concurrent requests together.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSIDH(batch_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_batch fr_batch_t;
+typedef struct fr_batch_entry fr_batch_entry_t;
+
+/** An operation waiting to be run
+ *
+ * Usually lives on the stack of the request waiting for it.
+ */
+struct fr_batch_entry {
+	void			*data;		//!< Operation to run, owned by the caller.
+	bool			taken;		//!< Removed from the queue, to be run.
+	bool			done;		//!< Batch containing the entry has been run.
+	fr_batch_entry_t	*next;		//!< Next entry in the batch.
+};
+
+/** Run every operation in a batch
+ *
+ * Called without any locks held.  The entries must not be touched after
+ * the callback returns.
+ *
+ * @param[in] request which is running the batch.
+ * @param[in] list of entries in the batch, in the order they were added.
+ * @param[in] num Number of entries in the list.
+ * @param[in] uctx passed to #fr_batch_alloc.
+ */
+typedef void (*fr_batch_run_t)(REQUEST *request, fr_batch_entry_t *list, uint32_t num, void *uctx);
+
+fr_batch_t	*fr_batch_alloc(TALLOC_CTX *ctx, uint32_t max_size, struct timeval const *max_latency,
+				fr_batch_run_t run, void *uctx);
+
+void		fr_batch_add(fr_batch_t *batch, REQUEST *request, fr_batch_entry_t *entry, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_BATCH_H */
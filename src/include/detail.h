@@ -44,6 +44,24 @@ typedef enum detail_entry_state_t {
 	STATE_REPLIED
 } detail_entry_state_t;
 
+/** An entry read from the detail file, which hasn't yet been acknowledged
+ *
+ */
+typedef struct detail_entry_t {
+	detail_entry_state_t	state;
+	off_t			offset;			//!< Where the entry starts in the file.
+	off_t			end;			//!< Where the next entry starts in the file.
+	off_t			timestamp_offset;	//!< Where the "Timestamp" line is, for marking the entry done.
+	time_t			timestamp;		//!< When the entry was written.
+	fr_ipaddr_t		client_ip;		//!< Client the original packet came from.
+	VALUE_PAIR		*vps;			//!< Contents of the entry.
+	uint32_t		seq;			//!< Sequence number of the most recent packet sent
+							//!< for the entry.
+	time_t			running;		//!< When the most recent packet was sent, or when
+							//!< the server failed to reply to it.
+	int			tries;			//!< How many packets have been sent for the entry.
+} detail_entry_t;
+
 typedef struct listen_detail_t {
 	fr_event_t	*ev;	/* has to be first entry (ugh) */
 	char const 	*name;			//!< Identifier used in log messages
@@ -62,11 +80,12 @@ typedef struct listen_detail_t {
 	detail_file_state_t 	file_state;
 	detail_entry_state_t 	entry_state;
 	time_t		timestamp;
-	time_t		running;
 	fr_ipaddr_t	client_ip;
 
 	off_t		last_offset;
+	off_t		entry_offset;		//!< Where the entry being read starts.
 	off_t		timestamp_offset;
+	off_t		acked_offset;		//!< Every entry before this offset has been acknowledged.
 	bool		done_entry;		//!< Are we done reading this entry?
 	bool		track;			//!< Do we track progress through the file?
 
@@ -78,7 +97,13 @@ typedef struct listen_detail_t {
 	int		packets;
 	int		tries;
 	bool		one_shot;
-	int		outstanding;
+
+	uint32_t	max_outstanding;	//!< Maximum number of entries in the window.
+	detail_entry_t	*entries;		//!< Window of entries being processed, in file order.
+	uint32_t	head;			//!< Oldest entry in the window.
+	int		outstanding;		//!< Number of entries in the window.
+	bool		file_done;		//!< Nothing more to read from the file.
+
 	int		has_rtt;
 	int		srtt;
 	int		rttvar;
@@ -37,6 +37,19 @@ typedef	void (*fr_event_callback_t)(void *, struct timeval *now);
 typedef	void (*fr_event_status_t)(struct timeval *);
 typedef void (*fr_event_fd_handler_t)(fr_event_list_t *el, int sock, void *ctx);
 
+/*
+ *	Flags for the "type" argument of fr_event_fd_insert().
+ */
+#define FR_EVENT_FD_EDGE	(1)	//!< Edge-triggered.  The handler MUST read until
+					//!< the socket returns EAGAIN, or it will not be
+					//!< called again.  Ignored when using select().
+#define FR_EVENT_FD_WRITE	(2)	//!< Call the handler when the socket is writable.
+					//!< Unless FR_EVENT_FD_READ is also set, it is not
+					//!< called when the socket is readable.
+#define FR_EVENT_FD_READ	(4)	//!< Call the handler when the socket is readable.
+					//!< This is the default, so it's only needed with
+					//!< FR_EVENT_FD_WRITE.
+
 fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status);
 
 int fr_event_list_num_fds(fr_event_list_t *el);
@@ -83,8 +83,22 @@ typedef struct {
 
 	map_proc_inst_t		*proc_inst;	//!< Instantiation data for #MOD_MAP.
 	bool			done_pass2;
+
+	fr_hash_table_t		*cases;		//!< #MOD_SWITCH literal case values.
+	modcallable		*default_case;	//!< #MOD_SWITCH default case, if #cases is set.
+	bool			dynamic_cases;	//!< #MOD_SWITCH has cases which aren't in #cases.
 } modgroup;
 
+/** A literal case value, in #modgroup.cases
+ *
+ */
+typedef struct {
+	PW_TYPE			type;		//!< Of the value.
+	value_data_t const	*data;		//!< The value.
+	modcallable		*c;		//!< #MOD_CASE to run.
+	unsigned int		position;	//!< Of the case in the switch.
+} unlang_case_t;
+
 typedef struct {
 	modcallable mc;
 	module_instance_t *modinst;
@@ -422,6 +422,29 @@ void		fr_timespec_subtract(struct timespec *out, struct timespec const *end, str
 int		fr_timeval_from_str(struct timeval *out, char const *in);
 int8_t		fr_pointer_cmp(void const *a, void const *b);
 void		fr_quick_sort(void const *to_sort[], int min_idx, int max_idx, fr_cmp_t cmp);
+
+/** Find the index of the lowest set bit
+ *
+ * Used to search bitmaps of free IDs and addresses.
+ *
+ * @param[in] word to search.  Must not be zero.
+ * @return the index of the lowest set bit, where 0 is the least significant bit.
+ */
+static inline int fr_low_bit(uint64_t word)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(word);
+#else
+	int bit = 0;
+
+	while (!(word & 1)) {
+		word >>= 1;
+		bit++;
+	}
+
+	return bit;
+#endif
+}
 /*
  *	Define TALLOC_DEBUG to check overflows with talloc.
  *	we can't use valgrind, because the memory used by
@@ -605,6 +628,60 @@ void		*fr_fifo_pop(fr_fifo_t *fi);
 void		*fr_fifo_peek(fr_fifo_t *fi);
 unsigned int	fr_fifo_num_elements(fr_fifo_t *fi);
 
+/*
+ *	Longest prefix match tries
+ */
+#define FR_TRIE_MAX_BITS	(128)
+
+typedef struct	fr_trie_t fr_trie_t;
+typedef bool	(*fr_trie_match_t)(void const *uctx, void const *data);
+fr_trie_t	*fr_trie_create(TALLOC_CTX *ctx, uint32_t max_bits);
+int		fr_trie_insert(fr_trie_t *trie, uint8_t const *key, uint32_t bits, void *data);
+void		*fr_trie_find(fr_trie_t *trie, uint8_t const *key, uint32_t bits);
+void		*fr_trie_lookup(fr_trie_t *trie, uint8_t const *key, uint32_t *bits,
+			       fr_trie_match_t match, void const *uctx);
+void		*fr_trie_remove(fr_trie_t *trie, uint8_t const *key, uint32_t bits);
+uint32_t	fr_trie_num_elements(fr_trie_t *trie);
+
+/*
+ *	Bounded lock-free queues
+ */
+typedef struct	fr_atomic_queue_t fr_atomic_queue_t;
+fr_atomic_queue_t *fr_atomic_queue_create(TALLOC_CTX *ctx, int size);
+bool		fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data);
+bool		fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data);
+int		fr_atomic_queue_num_elements(fr_atomic_queue_t *aq);
+int		fr_atomic_queue_size(fr_atomic_queue_t *aq);
+
+/*
+ *	Memory mapped indexes of text files
+ */
+#define FR_FILE_INDEX_LIST_KEYS		0x01	//!< Key field is a comma separated list of keys.
+#define FR_FILE_INDEX_QUOTED		0x02	//!< Fields may be quoted, as in RFC 4180.
+#define FR_FILE_INDEX_IGNORE_NIS	0x04	//!< Lines starting with '+' or '-' were skipped.
+
+typedef struct fr_file_index_info_t {
+	uint32_t	key_field;			//!< Field the keys were taken from, counting from 0.
+	char		delimiter;			//!< Field delimiter.
+	uint32_t	flags;				//!< FR_FILE_INDEX_* flags.
+	time_t		source_mtime;			//!< mtime of the file the index was built from.
+	uint64_t	source_size;			//!< Size of the file the index was built from.
+	uint64_t	num_records;			//!< Number of keys in the index.
+} fr_file_index_info_t;
+
+typedef struct	fr_file_index_t fr_file_index_t;
+typedef struct	fr_file_index_builder_t fr_file_index_builder_t;
+fr_file_index_t	*fr_file_index_open(TALLOC_CTX *ctx, char const *filename);
+void		fr_file_index_info(fr_file_index_t const *idx, fr_file_index_info_t *info);
+char const	*fr_file_index_find(fr_file_index_t const *idx, uint64_t *iter,
+				    char const *key, size_t key_len, size_t *line_len);
+
+fr_file_index_builder_t *fr_file_index_builder_create(TALLOC_CTX *ctx, char const *filename,
+						      fr_file_index_info_t const *info, mode_t mode);
+uint64_t	fr_file_index_builder_add(fr_file_index_builder_t *b, char const *key, size_t key_len,
+					  char const *line, size_t line_len, uint64_t line_offset);
+int		fr_file_index_builder_commit(fr_file_index_builder_t *b);
+
 /*
  *	socket.c
  */
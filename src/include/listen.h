@@ -16,6 +16,7 @@
 #ifndef _FR_LISTEN_H
 #define _FR_LISTEN_H
 #include <freeradius-devel/pcap.h>
+#include <freeradius-devel/udp.h>
 /**
  * $Id$
  *
@@ -116,6 +117,17 @@ struct rad_listen {
 typedef const char* (*rad_pcap_filter_builder)(rad_listen_t *);
 #endif
 
+#ifdef WITH_UDP_BATCH
+/*
+ *	The client for a source address in a batch of received
+ *	packets, so that each source is only looked up once.
+ */
+typedef struct listen_batch_client_t {
+	fr_ipaddr_t		ipaddr;		//!< Source address of the packets.
+	RADCLIENT		*client;	//!< Client they're from, or NULL if unknown.
+} listen_batch_client_t;
+#endif
+
 /*
  *	This shouldn't really be exposed...
  */
@@ -152,6 +164,21 @@ typedef struct listen_socket_t {
 						//!< configuration of SO_RCVBUF, as SO_SNDBUF
 						//!< controls the maximum datagram size.
 
+	uint32_t		readers;	//!< Number of SO_REUSEPORT copies of this socket, each
+						//!< served by its own reader thread.  0 or 1 disables.
+
+	uint32_t		batch_size;	//!< Maximum number of datagrams to read or write
+						//!< per system call.  0 or 1 disables batching.
+#ifdef WITH_UDP_BATCH
+	udp_batch_t		*recv_batch;	//!< Datagrams read by the last call to recv.
+	listen_batch_client_t	*recv_clients;	//!< Clients found for the sources in recv_batch.
+
+	pthread_mutex_t		send_mutex;	//!< Protects send_batch and sending.
+	udp_batch_t		*send_batch;	//!< Replies waiting to be written.
+	udp_batch_t		*send_spare;	//!< Replies being written by the flushing thread.
+	bool			sending;	//!< Whether a thread is currently flushing replies.
+#endif
+
 #ifdef WITH_TCP
 	/* for a proxy connecting to home servers */
 	time_t			last_packet;
@@ -180,6 +207,7 @@ int listen_bootstrap(CONF_SECTION *server, CONF_SECTION *cs, char const *server_
 void listen_free(rad_listen_t **head);
 int listen_init(rad_listen_t **head, bool spawn_flag);
 rad_listen_t *proxy_new_listener(TALLOC_CTX *ctx, home_server_t *home, uint16_t src_port);
+bool listen_is_reader(rad_listen_t const *this);
 RADCLIENT *client_listener_find(rad_listen_t *listener, fr_ipaddr_t const *ipaddr, uint16_t src_port);
 
 #ifdef __cplusplus
@@ -149,6 +149,23 @@ typedef struct vp_cursor {
 	VALUE_PAIR	*next;					//!< Next attribute to process.
 } vp_cursor_t;
 
+/** A list of VALUE_PAIRs which can be appended to, and searched, in constant time
+ *
+ * The list is still a normal singly linked list starting at head, so it may be iterated
+ * over with a #vp_cursor_t initialised with &list->head.
+ *
+ * If the list is modified other than with #fr_pair_head_add or #fr_pair_head_remove,
+ * #fr_pair_head_reset must be called before the list is used again, as tail and index
+ * may point to freed pairs.
+ */
+typedef struct vp_list {
+	VALUE_PAIR	*head;					//!< First pair in the list.
+	VALUE_PAIR	*tail;					//!< Last pair in the list, NULL if not yet known.
+	uint32_t	count;					//!< Number of pairs in the list, if tail is known.
+	fr_hash_table_t	*index;					//!< First pair with each vendor and attribute
+								//!< number.  Built on demand.
+} vp_list_t;
+
 /** A VALUE_PAIR in string format.
  *
  * Used to represent pairs in the legacy 'users' file format.
@@ -224,6 +241,15 @@ int		fr_pair_update_by_num(TALLOC_CTX *ctx, VALUE_PAIR **list,
 				      value_data_t *value);
 void		fr_pair_delete_by_num(VALUE_PAIR **head, unsigned int vendor, unsigned int attr, int8_t tag);
 
+/* Constant time appends and searches */
+void		fr_pair_head_init(vp_list_t *list, VALUE_PAIR *vps);
+void		fr_pair_head_reset(vp_list_t *list);
+void		fr_pair_head_add(vp_list_t *list, VALUE_PAIR *vp);
+VALUE_PAIR	*fr_pair_head_remove(vp_list_t *list, VALUE_PAIR *vp);
+VALUE_PAIR	*fr_pair_head_find_by_da(vp_list_t *list, fr_dict_attr_t const *da, int8_t tag);
+VALUE_PAIR	*fr_pair_head_find_by_num(vp_list_t *list, unsigned int vendor, unsigned int attr, int8_t tag);
+void		fr_pair_head_free(vp_list_t *list);
+
 /* Sorting */
 typedef		int8_t (*fr_cmp_t)(void const *a, void const *b);
 
@@ -102,6 +102,9 @@ typedef struct home_server {
 	uint32_t		max_response_timeouts;
 	uint32_t		max_outstanding;	//!< Maximum outstanding requests.
 	uint32_t		currently_outstanding;
+	uint32_t		response_time;		//!< Moving average of the time taken to respond
+							//!< (in microseconds).  0 if no responses have
+							//!< been received.
 
 	time_t			last_packet_sent;
 	time_t			last_packet_recv;
@@ -153,7 +156,9 @@ typedef enum home_pool_type_t {
 	HOME_POOL_FAIL_OVER,
 	HOME_POOL_CLIENT_BALANCE,
 	HOME_POOL_CLIENT_PORT_BALANCE,
-	HOME_POOL_KEYED_BALANCE
+	HOME_POOL_KEYED_BALANCE,
+	HOME_POOL_CONSISTENT_BALANCE,		//!< Jump consistent hash of Load-Balance-Key.
+	HOME_POOL_LATENCY_BALANCE		//!< Fewest outstanding requests, weighted by response time.
 } home_pool_type_t;
 
 
@@ -202,6 +207,8 @@ int		realm_realm_add( REALM *r, CONF_SECTION *cs);
 
 void		home_server_update_request(home_server_t *home, REQUEST *request);
 home_server_t	*home_server_ldb(char const *realmname, home_pool_t *pool, REQUEST *request);
+void		home_server_response_time(home_server_t *home, struct timeval const *sent, struct timeval const *now);
+void		home_server_response_timeout(home_server_t *home, struct timeval const *response_window);
 home_server_t	*home_server_find(fr_ipaddr_t *ipaddr, uint16_t port, int proto);
 
 home_server_t	*home_server_afrom_cs(TALLOC_CTX *ctx, realm_config_t *rc, CONF_SECTION *cs);
@@ -0,0 +1,64 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_RELOAD_H
+#define _FR_RELOAD_H
+/**
+ * $Id$
+ *
+ * @file include/reload.h
+ * @brief API for reloading data read from files, without blocking readers.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSIDH(reload_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct reload_t reload_t;
+
+/** Load data from a file
+ *
+ * Called from a background thread when reloading.  Any allocations
+ * should be made in a NULL ctx, and not in the module instance.
+ *
+ * @param[in] filename to read.
+ * @param[in] uctx passed to reload_init().
+ * @return
+ *	- The new data.
+ *	- NULL on error.  The previous data stays in use.
+ */
+typedef void *(*reload_load_t)(char const *filename, void *uctx);
+
+/** Free data which is no longer in use
+ *
+ * @param[in] data to free.
+ * @param[in] uctx passed to reload_init().
+ */
+typedef void (*reload_free_t)(void *data, void *uctx);
+
+reload_t	*reload_init(TALLOC_CTX *ctx, char const *name, char const *filename, uint32_t interval,
+			     reload_load_t load, reload_free_t free_func, void *uctx);
+
+void		*reload_acquire(reload_t *rl, unsigned int *ref);
+
+void		reload_release(reload_t *rl, unsigned int ref);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_RELOAD_H */
@@ -35,6 +35,13 @@ typedef uint64_t fr_uint_t;
 typedef uint32_t fr_uint_t;
 #endif
 
+/*
+ *	With "readers", several threads update the global, client and
+ *	listener counters at the same time, so they're incremented
+ *	atomically.
+ */
+#define FR_STATS_ADD(_x, _n) (void) __atomic_fetch_add(&(_x), _n, __ATOMIC_RELAXED)
+
 #ifdef WITH_STATS
 typedef struct fr_stats_t {
 	fr_uint_t	total_requests;
@@ -90,8 +97,8 @@ int fr_snmp_process(REQUEST *request);
 int fr_snmp_init(void);
 
 
-#define FR_STATS_INC(_x, _y) radius_ ## _x ## _stats._y++;if (listener) listener->stats._y++;if (client) client->_x._y++;
-#define FR_STATS_TYPE_INC(_x) _x++
+#define FR_STATS_INC(_x, _y) FR_STATS_ADD(radius_ ## _x ## _stats._y, 1);if (listener) FR_STATS_ADD(listener->stats._y, 1);if (client) FR_STATS_ADD(client->_x._y, 1);
+#define FR_STATS_TYPE_INC(_x) FR_STATS_ADD(_x, 1)
 
 #else  /* WITH_STATS */
 #define request_stats_init(_x)
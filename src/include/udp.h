@@ -52,6 +52,32 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
 		 struct timeval *when);
 
+/*
+ *	Batched I/O, using recvmmsg() and sendmmsg() to move many
+ *	datagrams per system call.
+ */
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#  define WITH_UDP_BATCH
+typedef struct udp_batch udp_batch_t;
+
+udp_batch_t *udp_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t data_len);
+
+unsigned int udp_batch_count(udp_batch_t const *batch);
+
+int udp_recv_batch(int sockfd, udp_batch_t *batch);
+
+ssize_t udp_batch_get(udp_batch_t *batch, unsigned int i, uint8_t **data,
+		      fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+		      fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+		      struct timeval *when);
+
+int udp_batch_add(udp_batch_t *batch, void const *data, size_t data_len,
+		  fr_ipaddr_t *src_ipaddr, uint16_t src_port, int if_index,
+		  fr_ipaddr_t *dst_ipaddr, uint16_t dst_port);
+
+int udp_send_batch(int sockfd, udp_batch_t *batch);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -41,6 +41,9 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t fromlen,
 	       struct sockaddr *to, socklen_t tolen,
 	       int if_index);
+void udpfromto_cmsg_dst(struct msghdr *msgh, struct sockaddr *to, socklen_t *tolen,
+			int *if_index, struct timeval *when);
+void udpfromto_cmsg_src(struct msghdr *msgh, struct sockaddr *from, int if_index);
 #endif
 
 #ifdef __cplusplus
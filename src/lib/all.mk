@@ -5,10 +5,12 @@
 #
 TARGET		:= libfreeradius-radius.a
 
-SOURCES		:= cbuff.c \
+SOURCES		:= atomic_queue.c \
+		   cbuff.c \
 		   cursor.c \
 		   debug.c \
 		   dict.c \
+		   file_index.c \
 		   filters.c \
 		   hash.c \
 		   hmacmd5.c \
@@ -36,6 +38,7 @@ SOURCES		:= cbuff.c \
 		   strlcpy.c \
 		   socket.c \
 		   token.c \
+		   trie.c \
 		   udpfromto.c \
 		   value.c \
 		   fifo.c \
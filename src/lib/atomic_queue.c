@@ -0,0 +1,225 @@
+/*
+ * atomic_queue.c	Bounded lock-free multi-producer, multi-consumer
+ *			queue of pointers.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/*
+ *	Dmitry Vyukov's bounded MPMC queue.  Each slot carries a
+ *	sequence number, which tells producers and consumers whether
+ *	the slot is free for the current lap of the ring.  Producers
+ *	and consumers only contend on the head and tail counters
+ *	respectively, and never take a lock.
+ */
+#define CACHE_LINE_SIZE	64
+
+typedef _Atomic(int64_t) fr_atomic_int64_t;
+
+typedef struct fr_atomic_queue_entry_t {
+	fr_atomic_int64_t	seq;		//!< Sequence number of the slot.
+	void			*data;		//!< User data.
+} fr_atomic_queue_entry_t;
+
+struct fr_atomic_queue_t {
+	fr_atomic_int64_t	head;		//!< Position of the next push.
+	uint8_t			pad0[CACHE_LINE_SIZE - sizeof(fr_atomic_int64_t)];
+
+	fr_atomic_int64_t	tail;		//!< Position of the next pop.
+	uint8_t			pad1[CACHE_LINE_SIZE - sizeof(fr_atomic_int64_t)];
+
+	int64_t			mask;		//!< size - 1.
+	int			size;		//!< Number of slots, a power of 2.
+
+	fr_atomic_queue_entry_t	entry[];
+};
+
+#define LOAD_RELAXED(_x) atomic_load_explicit(&(_x), memory_order_relaxed)
+#define LOAD_ACQUIRE(_x) atomic_load_explicit(&(_x), memory_order_acquire)
+#define STORE_RELEASE(_x, _y) atomic_store_explicit(&(_x), _y, memory_order_release)
+#define CAS(_x, _e, _d) atomic_compare_exchange_weak_explicit(&(_x), _e, _d, memory_order_relaxed, memory_order_relaxed)
+
+/** Create a new atomic queue
+ *
+ * @param ctx to allocate the queue in.
+ * @param size of the queue.  Rounded up to a power of 2.
+ * @return
+ *	- New queue.
+ *	- NULL on error.
+ */
+fr_atomic_queue_t *fr_atomic_queue_create(TALLOC_CTX *ctx, int size)
+{
+	fr_atomic_queue_t	*aq;
+	int			i, slots;
+
+	if ((size <= 0) || (size > (1 << 30))) {
+		fr_strerror_printf("Invalid atomic queue size %d", size);
+		return NULL;
+	}
+
+	for (slots = 1; slots < size; slots <<= 1);
+
+	aq = talloc_zero_size(ctx, sizeof(*aq) + (slots * sizeof(aq->entry[0])));
+	if (!aq) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	talloc_set_name_const(aq, "fr_atomic_queue_t");
+
+	for (i = 0; i < slots; i++) {
+		atomic_init(&aq->entry[i].seq, i);
+		aq->entry[i].data = NULL;
+	}
+
+	aq->size = slots;
+	aq->mask = slots - 1;
+	atomic_init(&aq->head, 0);
+	atomic_init(&aq->tail, 0);
+
+	return aq;
+}
+
+/** Push a pointer into the queue
+ *
+ * May be called concurrently from any number of threads.
+ *
+ * @param aq to push to.
+ * @param data to push.
+ * @return
+ *	- true on success.
+ *	- false if the queue is full.
+ */
+bool fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data)
+{
+	fr_atomic_queue_entry_t	*entry;
+	int64_t			head, seq, diff;
+
+	head = LOAD_RELAXED(aq->head);
+	for (;;) {
+		entry = &aq->entry[head & aq->mask];
+		seq = LOAD_ACQUIRE(entry->seq);
+		diff = seq - head;
+
+		/*
+		 *	The slot still holds data from the previous lap,
+		 *	so the queue is full.
+		 */
+		if (diff < 0) return false;
+
+		/*
+		 *	The slot is free.  Try to claim it.  On failure
+		 *	the CAS updates "head", and we try again.
+		 */
+		if (diff == 0) {
+			if (CAS(aq->head, &head, head + 1)) break;
+			continue;
+		}
+
+		/*
+		 *	Another producer claimed the slot first.
+		 */
+		head = LOAD_RELAXED(aq->head);
+	}
+
+	entry->data = data;
+	STORE_RELEASE(entry->seq, head + 1);
+
+	return true;
+}
+
+/** Pop a pointer from the queue
+ *
+ * May be called concurrently from any number of threads.
+ *
+ * @param aq to pop from.
+ * @param[out] p_data where to write the data.
+ * @return
+ *	- true on success.
+ *	- false if the queue is empty.
+ */
+bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data)
+{
+	fr_atomic_queue_entry_t	*entry;
+	int64_t			tail, seq, diff;
+
+	tail = LOAD_RELAXED(aq->tail);
+	for (;;) {
+		entry = &aq->entry[tail & aq->mask];
+		seq = LOAD_ACQUIRE(entry->seq);
+		diff = seq - (tail + 1);
+
+		/*
+		 *	Nothing has been written to the slot yet.
+		 */
+		if (diff < 0) return false;
+
+		if (diff == 0) {
+			if (CAS(aq->tail, &tail, tail + 1)) break;
+			continue;
+		}
+
+		tail = LOAD_RELAXED(aq->tail);
+	}
+
+	*p_data = entry->data;
+	entry->data = NULL;
+
+	/*
+	 *	Mark the slot as free for the next lap.
+	 */
+	STORE_RELEASE(entry->seq, tail + aq->mask + 1);
+
+	return true;
+}
+
+/** Return the number of elements in the queue
+ *
+ * The result is approximate if other threads are pushing or
+ * popping at the same time.
+ */
+int fr_atomic_queue_num_elements(fr_atomic_queue_t *aq)
+{
+	int64_t head, tail;
+
+	tail = LOAD_ACQUIRE(aq->tail);
+	head = LOAD_ACQUIRE(aq->head);
+
+	if (head <= tail) return 0;
+	if ((head - tail) > aq->size) return aq->size;
+
+	return head - tail;
+}
+
+/** Return the maximum number of elements the queue can hold
+ *
+ */
+int fr_atomic_queue_size(fr_atomic_queue_t *aq)
+{
+	return aq->size;
+}
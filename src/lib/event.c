@@ -37,14 +37,43 @@ RCSID("$Id$")
 #endif
 #endif	/* HAVE_KQUEUE */
 
+/*
+ *	On Linux, use epoll.  It has no limit on the number of FDs,
+ *	and adding / removing them doesn't require re-building
+ *	the FD set.
+ */
+#if !defined(HAVE_KQUEUE) && defined(HAVE_EPOLL_CREATE1) && defined(HAVE_SYS_EPOLL_H)
+#define HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 typedef struct fr_event_fd_t {
 	int			fd;
+	int			type;		//!< FR_EVENT_FD_* flags the FD was inserted with.
 	fr_event_fd_handler_t	handler;
 	void			*ctx;
 } fr_event_fd_t;
 
+#define FR_EVENT_FD_TYPES	(FR_EVENT_FD_EDGE | FR_EVENT_FD_WRITE | FR_EVENT_FD_READ)
+
+/*
+ *	Readable is the default, unless the caller only asked for
+ *	writable.
+ */
+#define FR_EVENT_FD_WANT_READ(_type)	(!((_type) & FR_EVENT_FD_WRITE) || ((_type) & FR_EVENT_FD_READ))
+#define FR_EVENT_FD_WANT_WRITE(_type)	((_type) & FR_EVENT_FD_WRITE)
+
 #define FR_EV_MAX_FDS (256)
 
+#ifdef HAVE_EPOLL
+/*
+ *	The readers table is indexed by FD, and grows as needed.
+ *	FR_EV_MAX_FDS is then only the maximum number of events
+ *	we service per call to epoll_wait().
+ */
+#define FR_EV_MIN_FDS (64)
+#endif
+
 #undef USEC
 #define USEC (1000000)
 
@@ -59,16 +88,26 @@ struct fr_event_list_t {
 	bool		dispatch;
 
 	int		num_readers;
-#ifndef HAVE_KQUEUE
+#if defined(HAVE_KQUEUE)
+	int		kq;
+	struct kevent	events[FR_EV_MAX_FDS]; /* so it doesn't go on the stack every time */
+
+	fr_event_fd_t	readers[FR_EV_MAX_FDS];
+
+#elif defined(HAVE_EPOLL)
+	int		epfd;
+	struct epoll_event events[FR_EV_MAX_FDS]; /* so it doesn't go on the stack every time */
+
+	int		max_readers;	//!< Number of entries in the readers table.
+	fr_event_fd_t	*readers;	//!< Indexed by FD.
+
+#else
 	int		max_readers;
 
 	bool		changed;
 
-#else
-	int		kq;
-	struct kevent	events[FR_EV_MAX_FDS]; /* so it doesn't go on the stack every time */
-#endif
 	fr_event_fd_t	readers[FR_EV_MAX_FDS];
+#endif
 };
 
 /*
@@ -109,8 +148,10 @@ static int _event_list_free(fr_event_list_t *list)
 
 	fr_heap_delete(el->times);
 
-#ifdef HAVE_KQUEUE
+#if defined(HAVE_KQUEUE)
 	close(el->kq);
+#elif defined(HAVE_EPOLL)
+	close(el->epfd);
 #endif
 
 	return 0;
@@ -119,7 +160,9 @@ static int _event_list_free(fr_event_list_t *list)
 
 fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status)
 {
+#ifndef HAVE_EPOLL
 	int i;
+#endif
 	fr_event_list_t *el;
 
 	el = talloc_zero(ctx, fr_event_list_t);
@@ -134,19 +177,33 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status)
 		return NULL;
 	}
 
+#ifndef HAVE_EPOLL
 	for (i = 0; i < FR_EV_MAX_FDS; i++) {
 		el->readers[i].fd = -1;
 	}
+#endif
 
-#ifndef HAVE_KQUEUE
-	el->changed = true;	/* force re-set of fds's */
-
-#else
+#if defined(HAVE_KQUEUE)
 	el->kq = kqueue();
 	if (el->kq < 0) {
 		talloc_free(el);
 		return NULL;
 	}
+
+#elif defined(HAVE_EPOLL)
+	/*
+	 *	The readers table is allocated on the first call to
+	 *	fr_event_fd_insert().
+	 */
+	el->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (el->epfd < 0) {
+		fr_strerror_printf("Failed creating epoll instance: %s", fr_syserror(errno));
+		talloc_free(el);
+		return NULL;
+	}
+
+#else
+	el->changed = true;	/* force re-set of fds's */
 #endif
 
 	el->status = status;
@@ -326,6 +383,9 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 {
 	int i;
 	fr_event_fd_t *ef;
+#ifdef HAVE_EPOLL
+	struct epoll_event evset;
+#endif
 
 	if (!el) {
 		fr_strerror_printf("Invalid arguments (NULL event list)");
@@ -347,18 +407,20 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		return 0;
 	}
 
-	if (type != 0) {
+	if ((type & ~FR_EVENT_FD_TYPES) != 0) {
 		fr_strerror_printf("Invalid type %i", type);
 		return 0;
 	}
 
+#ifndef HAVE_EPOLL
 	if (el->num_readers >= FR_EV_MAX_FDS) {
 		fr_strerror_printf("Too many readers");
 		return 0;
 	}
+#endif
 	ef = NULL;
 
-#ifdef HAVE_KQUEUE
+#if defined(HAVE_KQUEUE)
 	/*
 	 *	We need to store TWO fields with the event.  kqueue
 	 *	only lets us store one.  If we put the two fields into
@@ -375,18 +437,27 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 	 *	good guess, and makes the lookups mostly O(1).
 	 */
 	for (i = 0; i < FR_EV_MAX_FDS; i++) {
-		int j;
-		struct kevent evset;
+		int j, num = 0;
+		struct kevent evset[2];
 
 		j = (i + fd) & (FR_EV_MAX_FDS - 1);
 
 		if (el->readers[j].fd >= 0) continue;
 
 		/*
-		 *	We want to read from the FD.
+		 *	Read and write are separate filters, with the
+		 *	same udata.  EV_CLEAR gives us edge-triggered
+		 *	behaviour.
 		 */
-		EV_SET(&evset, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, &el->readers[j]);
-		if (kevent(el->kq, &evset, 1, NULL, 0, NULL) < 0) {
+		if (FR_EVENT_FD_WANT_READ(type)) {
+			EV_SET(&evset[num++], fd, EVFILT_READ,
+			       EV_ADD | EV_ENABLE | ((type & FR_EVENT_FD_EDGE) ? EV_CLEAR : 0), 0, 0, &el->readers[j]);
+		}
+		if (FR_EVENT_FD_WANT_WRITE(type)) {
+			EV_SET(&evset[num++], fd, EVFILT_WRITE,
+			       EV_ADD | EV_ENABLE | ((type & FR_EVENT_FD_EDGE) ? EV_CLEAR : 0), 0, 0, &el->readers[j]);
+		}
+		if (kevent(el->kq, evset, num, NULL, 0, NULL) < 0) {
 			fr_strerror_printf("Failed inserting event for FD %i: %s", fd, fr_syserror(errno));
 			return 0;
 		}
@@ -396,6 +467,61 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		break;
 	}
 
+#elif defined(HAVE_EPOLL)
+	/*
+	 *	The readers table is indexed by FD, so lookups,
+	 *	insertions and deletions are all O(1).  Grow it
+	 *	(by doubling) if the FD is outside of the table.
+	 */
+	if (fd >= el->max_readers) {
+		int num;
+
+		num = el->max_readers ? el->max_readers : FR_EV_MIN_FDS;
+		while (num <= fd) num <<= 1;
+
+		ef = talloc_realloc(el, el->readers, fr_event_fd_t, num);
+		if (!ef) {
+			fr_strerror_printf("Out of memory");
+			return 0;
+		}
+
+		for (i = el->max_readers; i < num; i++) {
+			ef[i].fd = -1;
+		}
+
+		el->readers = ef;
+		el->max_readers = num;
+	}
+
+	ef = &el->readers[fd];
+
+	/*
+	 *	Be fail-safe on multiple inserts.
+	 */
+	if (ef->fd == fd) {
+		if ((ef->handler != handler) || (ef->ctx != ctx)) {
+			fr_strerror_printf("Multiple handlers for same FD");
+			return 0;
+		}
+
+		/*
+		 *	No change.
+		 */
+		return 1;
+	}
+
+	memset(&evset, 0, sizeof(evset));
+	if (FR_EVENT_FD_WANT_READ(type)) evset.events |= EPOLLIN;
+	if (FR_EVENT_FD_WANT_WRITE(type)) evset.events |= EPOLLOUT;
+	if (type & FR_EVENT_FD_EDGE) evset.events |= EPOLLET;
+	evset.data.fd = fd;
+
+	if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, fd, &evset) < 0) {
+		fr_strerror_printf("Failed inserting event for FD %i: %s", fd, fr_syserror(errno));
+		return 0;
+	}
+	el->num_readers++;
+
 #else  /* HAVE_KQUEUE */
 
 	for (i = 0; i <= el->max_readers; i++) {
@@ -431,10 +557,11 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 	}
 
 	ef->fd = fd;
+	ef->type = type;
 	ef->handler = handler;
 	ef->ctx = ctx;
 
-#ifndef HAVE_KQUEUE
+#if !defined(HAVE_KQUEUE) && !defined(HAVE_EPOLL)
 	el->changed = true;
 #endif
 
@@ -443,16 +570,18 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 
 int fr_event_fd_delete(fr_event_list_t *el, int type, int fd)
 {
+#ifndef HAVE_EPOLL
 	int i;
+#endif
 
 	if (!el || (fd < 0)) return 0;
 
-	if (type != 0) return 0;
+	if ((type & ~FR_EVENT_FD_TYPES) != 0) return 0;
 
-#ifdef HAVE_KQUEUE
+#if defined(HAVE_KQUEUE)
 	for (i = 0; i < FR_EV_MAX_FDS; i++) {
 		int j;
-		struct kevent evset;
+		struct kevent evset[2];
 
 		j = (i + fd) & (FR_EV_MAX_FDS - 1);
 
@@ -465,8 +594,14 @@ int fr_event_fd_delete(fr_event_list_t *el, int type, int fd)
 		 *	the kernel has removed it from the list.  So
 		 *	we ignore the return code from kevent().
 		 */
-		EV_SET(&evset, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-		(void) kevent(el->kq, &evset, 1, NULL, 0, NULL);
+		if (FR_EVENT_FD_WANT_READ(el->readers[j].type)) {
+			EV_SET(&evset[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+			(void) kevent(el->kq, &evset[0], 1, NULL, 0, NULL);
+		}
+		if (FR_EVENT_FD_WANT_WRITE(el->readers[j].type)) {
+			EV_SET(&evset[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+			(void) kevent(el->kq, &evset[1], 1, NULL, 0, NULL);
+		}
 
 		el->readers[j].fd = -1;
 		el->num_readers--;
@@ -474,6 +609,21 @@ int fr_event_fd_delete(fr_event_list_t *el, int type, int fd)
 		return 1;
 	}
 
+#elif defined(HAVE_EPOLL)
+	if ((fd >= el->max_readers) || (el->readers[fd].fd != fd)) return 0;
+
+	/*
+	 *	The caller MAY have closed it, in which case the
+	 *	kernel has removed it from the epoll set.  So we
+	 *	ignore the return code from epoll_ctl().
+	 */
+	(void) epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	el->readers[fd].fd = -1;
+	el->num_readers--;
+
+	return 1;
+
 #else
 
 	for (i = 0; i < el->max_readers; i++) {
@@ -508,11 +658,14 @@ int fr_event_loop(fr_event_list_t *el)
 {
 	int i, rcode;
 	struct timeval when, *wake;
-#ifdef HAVE_KQUEUE
+#if defined(HAVE_KQUEUE)
 	struct timespec ts_when, *ts_wake;
+#elif defined(HAVE_EPOLL)
+	int timeout;
 #else
 	int maxfd = 0;
 	fd_set read_fds, master_fds;
+	fd_set write_fds, master_write_fds;
 
 	el->changed = true;
 #endif
@@ -521,15 +674,17 @@ int fr_event_loop(fr_event_list_t *el)
 	el->dispatch = true;
 
 	while (!el->exit) {
-#ifndef HAVE_KQUEUE
+#if !defined(HAVE_KQUEUE) && !defined(HAVE_EPOLL)
 		/*
 		 *	Cache the list of FD's to watch.
 		 */
 		if (el->changed) {
 #ifdef __clang_analyzer__
 			memset(&master_fds, 0, sizeof(master_fds));
+			memset(&master_write_fds, 0, sizeof(master_write_fds));
 #else
 			FD_ZERO(&master_fds);
+			FD_ZERO(&master_write_fds);
 #endif
 			for (i = 0; i < el->max_readers; i++) {
 				if (el->readers[i].fd < 0) continue;
@@ -537,7 +692,12 @@ int fr_event_loop(fr_event_list_t *el)
 				if (el->readers[i].fd > maxfd) {
 					maxfd = el->readers[i].fd;
 				}
-				FD_SET(el->readers[i].fd, &master_fds);
+				if (FR_EVENT_FD_WANT_READ(el->readers[i].type)) {
+					FD_SET(el->readers[i].fd, &master_fds);
+				}
+				if (FR_EVENT_FD_WANT_WRITE(el->readers[i].type)) {
+					FD_SET(el->readers[i].fd, &master_write_fds);
+				}
 			}
 
 			el->changed = false;
@@ -591,9 +751,29 @@ int fr_event_loop(fr_event_list_t *el)
 		 */
 		if (el->status) el->status(wake);
 
-#ifndef HAVE_KQUEUE
+#if defined(HAVE_EPOLL)
+		/*
+		 *	Round up to the next millisecond, so that we
+		 *	don't spin waiting for a timer which is about
+		 *	to fire.
+		 */
+		if (wake) {
+			timeout = (when.tv_sec * 1000) + ((when.tv_usec + 999) / 1000);
+		} else {
+			timeout = -1;
+		}
+
+		rcode = epoll_wait(el->epfd, el->events, FR_EV_MAX_FDS, timeout);
+		if ((rcode < 0) && (errno != EINTR)) {
+			fr_strerror_printf("Failed in epoll_wait: %s", fr_syserror(errno));
+			el->dispatch = false;
+			return -1;
+		}
+
+#elif !defined(HAVE_KQUEUE)
 		read_fds = master_fds;
-		rcode = select(maxfd + 1, &read_fds, NULL, NULL, wake);
+		write_fds = master_write_fds;
+		rcode = select(maxfd + 1, &read_fds, &write_fds, NULL, wake);
 		if ((rcode < 0) && (errno != EINTR)) {
 			fr_strerror_printf("Failed in select: %s", fr_syserror(errno));
 			el->dispatch = false;
@@ -622,7 +802,29 @@ int fr_event_loop(fr_event_list_t *el)
 
 		if (rcode <= 0) continue;
 
-#ifndef HAVE_KQUEUE
+#if defined(HAVE_EPOLL)
+		/*
+		 *	Loop over all of the events, servicing them.
+		 *	EPOLLHUP and EPOLLERR are passed to the handler,
+		 *	which SHOULD notice the error and delete the FD.
+		 */
+		for (i = 0; i < rcode; i++) {
+			int fd = el->events[i].data.fd;
+			fr_event_fd_t *ef;
+
+			/*
+			 *	A previous handler may have deleted
+			 *	this FD.
+			 */
+			if (fd >= el->max_readers) continue;
+
+			ef = &el->readers[fd];
+			if (ef->fd < 0) continue;
+
+			ef->handler(el, ef->fd, ef->ctx);
+		}
+
+#elif !defined(HAVE_KQUEUE)
 		/*
 		 *	Loop over all of the sockets to see if there's
 		 *	an event for that socket.
@@ -632,7 +834,7 @@ int fr_event_loop(fr_event_list_t *el)
 
 			if (ef->fd < 0) continue;
 
-			if (!FD_ISSET(ef->fd, &read_fds)) continue;
+			if (!FD_ISSET(ef->fd, &read_fds) && !FD_ISSET(ef->fd, &write_fds)) continue;
 
 			ef->handler(el, ef->fd, ef->ctx);
 
@@ -662,9 +864,9 @@ int fr_event_loop(fr_event_list_t *el)
 			}
 
 			/*
-			 *	Else it's our event.  We only set
-			 *	EVFILT_READ, so it must be a read
-			 *	event.
+			 *	Else it's our event.  It's either
+			 *	readable or writable, the handler
+			 *	works out which.
 			 */
 			ef->handler(el, ef->fd, ef->ctx);
 		}
@@ -0,0 +1,483 @@
+/*
+ * file_index.c	Read only hash indexes of text files, which are
+ *		built offline, and mapped into memory.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ *	The file is laid out as:
+ *
+ *	header | lines and keys | slots
+ *
+ *	Lines and keys are stored with a trailing NUL, so lines can
+ *	be returned directly from the mapping.  The slots are an
+ *	open addressing hash table with linear probing, keyed on
+ *	fr_hash() of the key.  Records with the same key are
+ *	inserted in the order they were added, and so are found in
+ *	that order.
+ *
+ *	Everything is in host byte order.  An index has to be built
+ *	on a machine with the same byte order as the one using it.
+ */
+#define FILE_INDEX_MAGIC	"FRINDEX"
+#define FILE_INDEX_VERSION	1
+#define FILE_INDEX_BYTE_ORDER	0x01020304
+
+typedef struct file_index_header_t {
+	char		magic[8];		//!< FILE_INDEX_MAGIC.
+	uint32_t	version;		//!< FILE_INDEX_VERSION.
+	uint32_t	byte_order;		//!< FILE_INDEX_BYTE_ORDER, as written.
+
+	uint64_t	file_size;		//!< Size of the index file.
+	uint64_t	num_records;		//!< Number of keys in the index.
+	uint64_t	num_slots;		//!< Number of hash slots, a power of 2.
+	uint64_t	slots_offset;		//!< Where the slots start.
+
+	int64_t		source_mtime;		//!< mtime of the file the index was built from.
+	uint64_t	source_size;		//!< Size of the file the index was built from.
+
+	uint32_t	key_field;		//!< Field the keys were taken from.
+	uint32_t	flags;			//!< FR_FILE_INDEX_* flags.
+	char		delimiter;		//!< Field delimiter.
+	char		pad[7];
+} file_index_header_t;
+
+typedef struct file_index_slot_t {
+	uint64_t	key_offset;		//!< Offset of the key.  0 if the slot is empty.
+	uint64_t	line_offset;		//!< Offset of the line.
+	uint32_t	key_len;		//!< Length of the key.
+	uint32_t	line_len;		//!< Length of the line.
+	uint32_t	hash;			//!< fr_hash() of the key.
+	uint32_t	pad;
+} file_index_slot_t;
+
+struct fr_file_index_t {
+	uint8_t const		*data;		//!< Start of the mapping.
+	size_t			size;		//!< Length of the mapping.
+	file_index_header_t const *header;
+	file_index_slot_t const	*slots;
+	uint64_t		mask;		//!< num_slots - 1.
+};
+
+struct fr_file_index_builder_t {
+	char const		*filename;	//!< Index to write.
+	char			*tmp;		//!< Where the index is written until it's committed.
+	int			fd;		//!< Open on tmp.
+	mode_t			mode;		//!< Permissions for the index.
+	uint64_t		offset;		//!< Where the next line or key is written.
+
+	file_index_header_t	header;
+
+	file_index_slot_t	*records;	//!< Slots for the records added so far.
+	uint64_t		num_records;
+	uint64_t		max_records;	//!< Allocated size of records.
+};
+
+static int _file_index_free(fr_file_index_t *idx)
+{
+	void *data;
+
+	memcpy(&data, &idx->data, sizeof(data)); /* const work-arounds */
+	munmap(data, idx->size);
+
+	return 0;
+}
+
+/** Map an index into memory
+ *
+ * The index is mapped read only and shared, so every process using the
+ * same index shares the same pages.  The mapping stays valid even if
+ * the index file is replaced, until the returned handle is freed.
+ *
+ * @param[in] ctx to allocate the handle in.
+ * @param[in] filename of the index.
+ * @return
+ *	- New index handle.
+ *	- NULL on error, with the error available from fr_strerror().
+ */
+fr_file_index_t *fr_file_index_open(TALLOC_CTX *ctx, char const *filename)
+{
+	fr_file_index_t			*idx;
+	file_index_header_t const	*header;
+	struct stat			st;
+	void				*data;
+	int				fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Failed checking %s: %s", filename, fr_syserror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if ((size_t) st.st_size < sizeof(*header)) {
+		fr_strerror_printf("%s is too short to be an index", filename);
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping %s: %s", filename, fr_syserror(errno));
+		return NULL;
+	}
+
+	header = data;
+	if (memcmp(header->magic, FILE_INDEX_MAGIC, sizeof(FILE_INDEX_MAGIC)) != 0) {
+		fr_strerror_printf("%s is not an index", filename);
+	error:
+		munmap(data, st.st_size);
+		return NULL;
+	}
+
+	if (header->byte_order != FILE_INDEX_BYTE_ORDER) {
+		fr_strerror_printf("%s was built on a machine with a different byte order", filename);
+		goto error;
+	}
+
+	if (header->version != FILE_INDEX_VERSION) {
+		fr_strerror_printf("%s has unsupported version %u", filename, header->version);
+		goto error;
+	}
+
+	if ((header->file_size != (uint64_t) st.st_size) ||
+	    !header->num_slots || (header->num_slots & (header->num_slots - 1)) ||
+	    (header->num_records >= header->num_slots) ||
+	    (header->slots_offset & 0x07) || (header->slots_offset < sizeof(*header)) ||
+	    (header->slots_offset > header->file_size) ||
+	    (((header->file_size - header->slots_offset) / sizeof(file_index_slot_t)) < header->num_slots)) {
+		fr_strerror_printf("%s is truncated or corrupt", filename);
+		goto error;
+	}
+
+#ifdef MADV_RANDOM
+	(void) madvise(data, st.st_size, MADV_RANDOM);
+#endif
+
+	idx = talloc_zero(ctx, fr_file_index_t);
+	if (!idx) {
+		fr_strerror_printf("Out of memory");
+		goto error;
+	}
+	idx->data = data;
+	idx->size = st.st_size;
+	idx->header = header;
+	idx->slots = (file_index_slot_t const *) (idx->data + header->slots_offset);
+	idx->mask = header->num_slots - 1;
+	talloc_set_destructor(idx, _file_index_free);
+
+	return idx;
+}
+
+/** Return information about how an index was built
+ *
+ * @param[in] idx to get information for.
+ * @param[out] info where to write the information.
+ */
+void fr_file_index_info(fr_file_index_t const *idx, fr_file_index_info_t *info)
+{
+	info->key_field = idx->header->key_field;
+	info->delimiter = idx->header->delimiter;
+	info->flags = idx->header->flags;
+	info->source_mtime = idx->header->source_mtime;
+	info->source_size = idx->header->source_size;
+	info->num_records = idx->header->num_records;
+}
+
+/** Find the lines with a given key
+ *
+ * Call with *iter set to 0 to find the first line, and call again with
+ * the same iter to find the next one.
+ *
+ * @param[in] idx to search.
+ * @param[in,out] iter search state.
+ * @param[in] key to find.
+ * @param[in] key_len length of key.
+ * @param[out] line_len length of the returned line.  May be NULL.
+ * @return
+ *	- The line, NUL terminated.  It points into the index, and is
+ *	  valid until the index is freed.
+ *	- NULL if there are no more lines with the key.
+ */
+char const *fr_file_index_find(fr_file_index_t const *idx, uint64_t *iter,
+			       char const *key, size_t key_len, size_t *line_len)
+{
+	file_index_slot_t const	*slot;
+	uint32_t		hash;
+	uint64_t		i;
+
+	hash = fr_hash(key, key_len);
+
+	for (i = *iter; i <= idx->mask; i++) {
+		slot = &idx->slots[(hash + i) & idx->mask];
+		if (!slot->key_offset) break;
+
+		if ((slot->hash != hash) || (slot->key_len != key_len)) continue;
+
+		/*
+		 *	Don't trust the offsets in the file.
+		 */
+		if ((slot->key_offset >= idx->size) || ((idx->size - slot->key_offset) <= key_len) ||
+		    (slot->line_offset >= idx->size) || ((idx->size - slot->line_offset) <= slot->line_len)) break;
+
+		if (memcmp(idx->data + slot->key_offset, key, key_len) != 0) continue;
+
+		*iter = i + 1;
+		if (line_len) *line_len = slot->line_len;
+
+		return (char const *) (idx->data + slot->line_offset);
+	}
+
+	*iter = idx->mask + 1;
+
+	return NULL;
+}
+
+static int _file_index_builder_free(fr_file_index_builder_t *b)
+{
+	if (b->fd >= 0) close(b->fd);
+	if (b->tmp) unlink(b->tmp);
+
+	return 0;
+}
+
+/** Start building a new index
+ *
+ * The index is written to a temporary file, which replaces filename
+ * when fr_file_index_builder_commit() is called.  If the builder is
+ * freed before then, the temporary file is removed.
+ *
+ * @param[in] ctx to allocate the builder in.
+ * @param[in] filename of the index to write.
+ * @param[in] info describing the source file.  num_records is ignored.
+ * @param[in] mode permissions for the index.  Usually the same as the
+ *	source file, as indexes contain a copy of its contents.
+ * @return
+ *	- New builder.
+ *	- NULL on error, with the error available from fr_strerror().
+ */
+fr_file_index_builder_t *fr_file_index_builder_create(TALLOC_CTX *ctx, char const *filename,
+						      fr_file_index_info_t const *info, mode_t mode)
+{
+	fr_file_index_builder_t *b;
+
+	b = talloc_zero(ctx, fr_file_index_builder_t);
+	if (!b) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	b->fd = -1;
+	b->mode = mode;
+	talloc_set_destructor(b, _file_index_builder_free);
+
+	b->filename = talloc_typed_strdup(b, filename);
+	b->tmp = talloc_typed_asprintf(b, "%s.XXXXXX", filename);
+	if (!b->filename || !b->tmp) {
+		talloc_free(b);
+		goto oom;
+	}
+
+	b->fd = mkstemp(b->tmp);
+	if (b->fd < 0) {
+		fr_strerror_printf("Failed creating %s: %s", b->tmp, fr_syserror(errno));
+		TALLOC_FREE(b->tmp);
+		talloc_free(b);
+		return NULL;
+	}
+
+	memcpy(b->header.magic, FILE_INDEX_MAGIC, sizeof(FILE_INDEX_MAGIC));
+	b->header.version = FILE_INDEX_VERSION;
+	b->header.byte_order = FILE_INDEX_BYTE_ORDER;
+	b->header.source_mtime = info->source_mtime;
+	b->header.source_size = info->source_size;
+	b->header.key_field = info->key_field;
+	b->header.flags = info->flags;
+	b->header.delimiter = info->delimiter;
+
+	b->offset = sizeof(b->header);
+
+	return b;
+}
+
+/*
+ *	Write data, NUL terminated and padded to 8 bytes.
+ */
+static int file_index_builder_write(fr_file_index_builder_t *b, char const *data, size_t len, uint64_t *offset)
+{
+	static char		zero[8];
+	size_t			pad = 8 - (len & 0x07);
+	struct iovec		iov[2];
+
+	memcpy(&iov[0].iov_base, &data, sizeof(iov[0].iov_base)); /* const work-arounds */
+	iov[0].iov_len = len;
+	iov[1].iov_base = zero;
+	iov[1].iov_len = pad;
+
+	if (lseek(b->fd, b->offset, SEEK_SET) < 0) {
+	error:
+		fr_strerror_printf("Failed writing %s: %s", b->tmp, fr_syserror(errno));
+		return -1;
+	}
+	if (fr_writev(b->fd, iov, 2, NULL) < 0) goto error;
+
+	*offset = b->offset;
+	b->offset += len + pad;
+
+	return 0;
+}
+
+/** Add a line to the index
+ *
+ * @param[in] b to add the line to.
+ * @param[in] key the line should be found by.
+ * @param[in] key_len length of the key.
+ * @param[in] line to add, without the trailing end of line.
+ * @param[in] line_len length of the line.
+ * @param[in] line_offset of a line which was added previously, to index
+ *	the same line under another key.  0 to add a new line.
+ * @return
+ *	- The offset of the line, to pass as line_offset for other
+ *	  keys of the same line.
+ *	- 0 on error.
+ */
+uint64_t fr_file_index_builder_add(fr_file_index_builder_t *b, char const *key, size_t key_len,
+				   char const *line, size_t line_len, uint64_t line_offset)
+{
+	file_index_slot_t *slot;
+
+	if ((key_len > UINT32_MAX) || (line_len > UINT32_MAX)) {
+		fr_strerror_printf("Line too long");
+		return 0;
+	}
+
+	if (b->num_records == b->max_records) {
+		file_index_slot_t	*records;
+		uint64_t		max = b->max_records ? b->max_records * 2 : 1024;
+
+		records = talloc_realloc(b, b->records, file_index_slot_t, max);
+		if (!records) {
+			fr_strerror_printf("Out of memory");
+			return 0;
+		}
+		b->records = records;
+		b->max_records = max;
+	}
+
+	if (!line_offset && (file_index_builder_write(b, line, line_len, &line_offset) < 0)) return 0;
+
+	slot = &b->records[b->num_records];
+	memset(slot, 0, sizeof(*slot));
+
+	if (file_index_builder_write(b, key, key_len, &slot->key_offset) < 0) return 0;
+	slot->line_offset = line_offset;
+	slot->key_len = key_len;
+	slot->line_len = line_len;
+	slot->hash = fr_hash(key, key_len);
+
+	b->num_records++;
+
+	return line_offset;
+}
+
+/** Write the hash table and header, and move the index into place
+ *
+ * The index is renamed over the old one, so processes which already
+ * have the old index mapped keep using it, and new ones see the new one.
+ *
+ * @param[in] b to commit.  Should be freed afterwards.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error, with the error available from fr_strerror().
+ */
+int fr_file_index_builder_commit(fr_file_index_builder_t *b)
+{
+	file_index_slot_t	*slots;
+	uint64_t		num_slots, i, j;
+	size_t			len;
+
+	/*
+	 *	Keep the table at most 3/4 full, so probe
+	 *	sequences stay short.
+	 */
+	for (num_slots = 16; num_slots < ((b->num_records * 4) / 3) + 1; num_slots <<= 1);
+
+	slots = talloc_zero_array(b, file_index_slot_t, num_slots);
+	if (!slots) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < b->num_records; i++) {
+		for (j = b->records[i].hash & (num_slots - 1);
+		     slots[j].key_offset;
+		     j = (j + 1) & (num_slots - 1));
+		slots[j] = b->records[i];
+	}
+	TALLOC_FREE(b->records);
+
+	len = num_slots * sizeof(slots[0]);
+
+	b->header.num_records = b->num_records;
+	b->header.num_slots = num_slots;
+	b->header.slots_offset = b->offset;
+	b->header.file_size = b->offset + len;
+
+	if ((lseek(b->fd, b->offset, SEEK_SET) < 0) ||
+	    (write(b->fd, slots, len) != (ssize_t) len) ||
+	    (lseek(b->fd, 0, SEEK_SET) < 0) ||
+	    (write(b->fd, &b->header, sizeof(b->header)) != (ssize_t) sizeof(b->header))) {
+		fr_strerror_printf("Failed writing %s: %s", b->tmp, fr_syserror(errno));
+		talloc_free(slots);
+		return -1;
+	}
+	talloc_free(slots);
+
+	if ((fchmod(b->fd, b->mode) < 0) || (fsync(b->fd) < 0)) {
+		fr_strerror_printf("Failed writing %s: %s", b->tmp, fr_syserror(errno));
+		return -1;
+	}
+
+	close(b->fd);
+	b->fd = -1;
+
+	if (rename(b->tmp, b->filename) < 0) {
+		fr_strerror_printf("Failed renaming %s to %s: %s", b->tmp, b->filename, fr_syserror(errno));
+		return -1;
+	}
+	TALLOC_FREE(b->tmp);
+
+	return 0;
+}
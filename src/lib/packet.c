@@ -24,8 +24,10 @@ RCSID("$Id$")
 
 #include	<freeradius-devel/libradius.h>
 #include	<freeradius-devel/udp.h>
+#include	<freeradius-devel/rad_assert.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 
 /*
  *	See if two packets are identical.
@@ -255,7 +257,7 @@ typedef struct fr_packet_socket_t {
 	int		proto;
 #endif
 
-	uint8_t		id[32];
+	uint64_t	id[4];		//!< Bitmap of allocated IDs.
 } fr_packet_socket_t;
 
 
@@ -264,24 +266,56 @@ typedef struct fr_packet_socket_t {
 #define SOCKOFFSET_MASK (MAX_SOCKETS - 1)
 #define SOCK2OFFSET(sockfd) ((sockfd * FNV_MAGIC_PRIME) & SOCKOFFSET_MASK)
 
+#define NUM_STRIPES (64)
+#define STRIPE_MASK (NUM_STRIPES - 1)
+#define NUM_ALLOC_HINTS (256)
+
+/*
+ *	Packets are spread over a number of hash tables, each with
+ *	its own lock, so that threads inserting, finding, and
+ *	yanking different packets rarely wait for each other.
+ */
+typedef struct fr_packet_stripe_t {
+	pthread_mutex_t	mutex;
+	fr_hash_table_t	*ht;
+} fr_packet_stripe_t;
+
 /*
  *	Structure defining a list of packets (incoming or outgoing)
  *	that should be managed.
+ *
+ *	The socket table, and the ID bitmaps in it, have a lock of
+ *	their own, so ID allocation doesn't normally wait for packets
+ *	to be found, and vice versa.
+ *
+ *	The socket lock may be taken while a stripe lock is held, as
+ *	fr_packet_list_walk() callbacks free IDs (e.g. process.c's
+ *	remove_from_proxy_hash_nl() calling fr_packet_list_id_free()).
+ *	The lock order is therefore stripe, then socket.  Nothing may
+ *	take a stripe lock whilst holding the socket lock.
  */
 struct fr_packet_list_t {
-	rbtree_t	*tree;
+	fr_packet_stripe_t stripes[NUM_STRIPES];
 
 	int		alloc_id;
 	uint32_t	num_outgoing;
 	int		last_recv;
 	int		num_sockets;
 
+	pthread_mutex_t	mutex;		//!< Protects the sockets, and the counters above.
+
+	uint16_t	alloc_hint[NUM_ALLOC_HINTS];	//!< Offset + 1 of the socket last used
+							//!< for a destination, by hash of the
+							//!< destination.
+
 	fr_packet_socket_t sockets[MAX_SOCKETS];
 };
 
 
 /*
  *	Ugh.  Doing this on every sent/received packet is not nice.
+ *
+ *	Must be called with pl->mutex held.
  */
 static fr_packet_socket_t *fr_socket_find(fr_packet_list_t *pl,
 					  int sockfd)
@@ -308,13 +342,17 @@ bool fr_packet_list_socket_freeze(fr_packet_list_t *pl, int sockfd)
 		return false;
 	}
 
+	pthread_mutex_lock(&pl->mutex);
 	ps = fr_socket_find(pl, sockfd);
 	if (!ps) {
+		pthread_mutex_unlock(&pl->mutex);
 		fr_strerror_printf("No such socket");
 		return false;
 	}
 
 	ps->dont_use = true;
+	pthread_mutex_unlock(&pl->mutex);
+
 	return true;
 }
 
@@ -324,10 +362,16 @@ bool fr_packet_list_socket_thaw(fr_packet_list_t *pl, int sockfd)
 
 	if (!pl) return false;
 
+	pthread_mutex_lock(&pl->mutex);
 	ps = fr_socket_find(pl, sockfd);
-	if (!ps) return false;
+	if (!ps) {
+		pthread_mutex_unlock(&pl->mutex);
+		return false;
+	}
 
 	ps->dont_use = false;
+	pthread_mutex_unlock(&pl->mutex);
+
 	return true;
 }
 
@@ -338,13 +382,16 @@ bool fr_packet_list_socket_del(fr_packet_list_t *pl, int sockfd)
 
 	if (!pl) return false;
 
+	pthread_mutex_lock(&pl->mutex);
 	ps = fr_socket_find(pl, sockfd);
-	if (!ps) return false;
-
-	if (ps->num_outgoing != 0) return false;
+	if (!ps || (ps->num_outgoing != 0)) {
+		pthread_mutex_unlock(&pl->mutex);
+		return false;
+	}
 
 	ps->sockfd = -1;
 	pl->num_sockets--;
+	pthread_mutex_unlock(&pl->mutex);
 
 	return true;
 }
@@ -357,18 +404,13 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	int i, start;
 	struct sockaddr_storage	src;
 	socklen_t		sizeof_src;
-	fr_packet_socket_t	*ps;
+	fr_packet_socket_t	my_ps, *ps;
 
 	if (!pl || !dst_ipaddr || (dst_ipaddr->af == AF_UNSPEC)) {
 		fr_strerror_printf("Invalid argument");
 		return false;
 	}
 
-	if (pl->num_sockets >= MAX_SOCKETS) {
-		fr_strerror_printf("Too many open sockets");
-		return false;
-	}
-
 #ifndef WITH_TCP
 	if (proto != IPPROTO_UDP) {
 		fr_strerror_printf("only UDP is supported");
@@ -376,27 +418,10 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	}
 #endif
 
-	ps = NULL;
-	i = start = SOCK2OFFSET(sockfd);
-
-	do {
-		if (pl->sockets[i].sockfd == -1) {
-			ps =  &pl->sockets[i];
-			break;
-		}
-
-		i = (i + 1) & SOCKOFFSET_MASK;
-	} while (i != start);
-
-	if (!ps) {
-		fr_strerror_printf("All socket entries are full");
-		return false;
-	}
-
-	memset(ps, 0, sizeof(*ps));
-	ps->ctx = ctx;
+	memset(&my_ps, 0, sizeof(my_ps));
+	my_ps.ctx = ctx;
 #ifdef WITH_TCP
-	ps->proto = proto;
+	my_ps.proto = proto;
 #endif
 
 	/*
@@ -414,30 +439,94 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 		return false;
 	}
 
-	if (!fr_ipaddr_from_sockaddr(&src, sizeof_src, &ps->src_ipaddr,
-				&ps->src_port)) {
+	if (!fr_ipaddr_from_sockaddr(&src, sizeof_src, &my_ps.src_ipaddr,
+				&my_ps.src_port)) {
 		fr_strerror_printf("Failed to get IP");
 		return false;
 	}
 
-	ps->dst_ipaddr = *dst_ipaddr;
-	ps->dst_port = dst_port;
+	my_ps.dst_ipaddr = *dst_ipaddr;
+	my_ps.dst_port = dst_port;
 
-	ps->src_any = fr_is_inaddr_any(&ps->src_ipaddr);
-	if (ps->src_any < 0) return false;
+	my_ps.src_any = fr_is_inaddr_any(&my_ps.src_ipaddr);
+	if (my_ps.src_any < 0) return false;
 
-	ps->dst_any = fr_is_inaddr_any(&ps->dst_ipaddr);
-	if (ps->dst_any < 0) return false;
+	my_ps.dst_any = fr_is_inaddr_any(&my_ps.dst_ipaddr);
+	if (my_ps.dst_any < 0) return false;
 
-	/*
-	 *	As the last step before returning.
-	 */
-	ps->sockfd = sockfd;
+	my_ps.sockfd = sockfd;
+
+	pthread_mutex_lock(&pl->mutex);
+	if (pl->num_sockets >= MAX_SOCKETS) {
+		pthread_mutex_unlock(&pl->mutex);
+		fr_strerror_printf("Too many open sockets");
+		return false;
+	}
+
+	ps = NULL;
+	i = start = SOCK2OFFSET(sockfd);
+
+	do {
+		if (pl->sockets[i].sockfd == -1) {
+			ps =  &pl->sockets[i];
+			break;
+		}
+
+		i = (i + 1) & SOCKOFFSET_MASK;
+	} while (i != start);
+
+	if (!ps) {
+		pthread_mutex_unlock(&pl->mutex);
+		fr_strerror_printf("All socket entries are full");
+		return false;
+	}
+
+	*ps = my_ps;
 	pl->num_sockets++;
+	pthread_mutex_unlock(&pl->mutex);
 
 	return true;
 }
 
+/*
+ *	Hash the fields compared by fr_packet_cmp().
+ */
+static uint32_t packet_ipaddr_hash(fr_ipaddr_t const *ipaddr, uint32_t hash)
+{
+	switch (ipaddr->af) {
+	case AF_INET:
+		return fr_hash_update(&ipaddr->ipaddr.ip4addr, sizeof(ipaddr->ipaddr.ip4addr), hash);
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case AF_INET6:
+		return fr_hash_update(&ipaddr->ipaddr.ip6addr, sizeof(ipaddr->ipaddr.ip6addr), hash);
+#endif
+
+	default:
+		return hash;
+	}
+}
+
+static uint32_t packet_hash(RADIUS_PACKET const *packet)
+{
+	uint32_t hash;
+
+	hash = fr_hash(&packet->id, sizeof(packet->id));
+	hash = fr_hash_update(&packet->sockfd, sizeof(packet->sockfd), hash);
+	hash = fr_hash_update(&packet->src_port, sizeof(packet->src_port), hash);
+	hash = fr_hash_update(&packet->dst_port, sizeof(packet->dst_port), hash);
+	hash = packet_ipaddr_hash(&packet->src_ipaddr, hash);
+
+	return packet_ipaddr_hash(&packet->dst_ipaddr, hash);
+}
+
+static uint32_t packet_entry_hash(void const *data)
+{
+	RADIUS_PACKET const * const *packet = data;
+
+	return packet_hash(*packet);
+}
+
 static int packet_entry_cmp(void const *one, void const *two)
 {
 	RADIUS_PACKET const * const *a = one;
@@ -446,11 +535,29 @@ static int packet_entry_cmp(void const *one, void const *two)
 	return fr_packet_cmp(*a, *b);
 }
 
+/*
+ *	Use different bits of the hash for the stripe, and the
+ *	bucket in the stripe's hash table.
+ */
+static inline fr_packet_stripe_t *packet_stripe(fr_packet_list_t *pl, RADIUS_PACKET const *packet)
+{
+	return &pl->stripes[(packet_hash(packet) >> 24) & STRIPE_MASK];
+}
+
 void fr_packet_list_free(fr_packet_list_t *pl)
 {
+	int i;
+
 	if (!pl) return;
 
-	rbtree_free(pl->tree);
+	for (i = 0; i < NUM_STRIPES; i++) {
+		if (!pl->stripes[i].ht) continue;
+
+		fr_hash_table_free(pl->stripes[i].ht);
+		pthread_mutex_destroy(&pl->stripes[i].mutex);
+	}
+	pthread_mutex_destroy(&pl->mutex);
+
 	talloc_free(pl);
 }
 
@@ -465,10 +572,16 @@ fr_packet_list_t *fr_packet_list_create(int alloc_id)
 
 	pl = talloc_zero(NULL, fr_packet_list_t);
 	if (!pl) return NULL;
-	pl->tree = rbtree_create(pl, packet_entry_cmp, NULL, 0);
-	if (!pl->tree) {
-		fr_packet_list_free(pl);
-		return NULL;
+
+	pthread_mutex_init(&pl->mutex, NULL);
+
+	for (i = 0; i < NUM_STRIPES; i++) {
+		pl->stripes[i].ht = fr_hash_table_create(pl, packet_entry_hash, packet_entry_cmp, NULL);
+		if (!pl->stripes[i].ht) {
+			fr_packet_list_free(pl);
+			return NULL;
+		}
+		pthread_mutex_init(&pl->stripes[i].mutex, NULL);
 	}
 
 	for (i = 0; i < MAX_SOCKETS; i++) {
@@ -488,17 +601,35 @@ fr_packet_list_t *fr_packet_list_create(int alloc_id)
 bool fr_packet_list_insert(fr_packet_list_t *pl,
 			    RADIUS_PACKET **request_p)
 {
+	fr_packet_stripe_t	*stripe;
+	int			ret;
+
 	if (!pl || !request_p || !*request_p) return 0;
 
-	return rbtree_insert(pl->tree, request_p);
+	stripe = packet_stripe(pl, *request_p);
+
+	pthread_mutex_lock(&stripe->mutex);
+	ret = fr_hash_table_insert(stripe->ht, request_p);
+	pthread_mutex_unlock(&stripe->mutex);
+
+	return (ret != 0);
 }
 
 RADIUS_PACKET **fr_packet_list_find(fr_packet_list_t *pl,
 				      RADIUS_PACKET *request)
 {
+	fr_packet_stripe_t	*stripe;
+	RADIUS_PACKET		**packet_p;
+
 	if (!pl || !request) return 0;
 
-	return rbtree_finddata(pl->tree, &request);
+	stripe = packet_stripe(pl, request);
+
+	pthread_mutex_lock(&stripe->mutex);
+	packet_p = fr_hash_table_finddata(stripe->ht, &request);
+	pthread_mutex_unlock(&stripe->mutex);
+
+	return packet_p;
 }
 
 
@@ -508,14 +639,23 @@ RADIUS_PACKET **fr_packet_list_find(fr_packet_list_t *pl,
  */
 RADIUS_PACKET **fr_packet_list_find_byreply(fr_packet_list_t *pl, RADIUS_PACKET *reply)
 {
-	RADIUS_PACKET my_request, *request;
-	fr_packet_socket_t *ps;
+	RADIUS_PACKET my_request;
+	fr_packet_socket_t *ps, my_ps;
 
 	if (!pl || !reply) return NULL;
 
+	/*
+	 *	Copy the socket, so the lock isn't held while we
+	 *	look for the packet.
+	 */
+	pthread_mutex_lock(&pl->mutex);
 	ps = fr_socket_find(pl, reply->sockfd);
+	if (ps) my_ps = *ps;
+	pthread_mutex_unlock(&pl->mutex);
 	if (!ps) return NULL;
 
+	ps = &my_ps;
+
 	/*
 	 *	Initialize request from reply, AND from the source
 	 *	IP & port of this socket.  The client may have bound
@@ -557,32 +697,175 @@ RADIUS_PACKET **fr_packet_list_find_byreply(fr_packet_list_t *pl, RADIUS_PACKET
 #ifdef WITH_TCP
 	my_request.proto = reply->proto;
 #endif
-	request = &my_request;
 
-	return rbtree_finddata(pl->tree, &request);
+	return fr_packet_list_find(pl, &my_request);
 }
 
 
 bool fr_packet_list_yank(fr_packet_list_t *pl, RADIUS_PACKET *request)
 {
-	rbnode_t *node;
+	fr_packet_stripe_t	*stripe;
+	void			*yanked;
 
 	if (!pl || !request) return false;
 
-	node = rbtree_find(pl->tree, &request);
-	if (!node) return false;
+	stripe = packet_stripe(pl, request);
 
-	rbtree_delete(pl->tree, node);
-	return true;
+	pthread_mutex_lock(&stripe->mutex);
+	yanked = fr_hash_table_yank(stripe->ht, &request);
+	pthread_mutex_unlock(&stripe->mutex);
+
+	return (yanked != NULL);
 }
 
 uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 {
+	int		i;
+	uint32_t	num_elements = 0;
+
 	if (!pl) return 0;
 
-	return rbtree_num_elements(pl->tree);
+	for (i = 0; i < NUM_STRIPES; i++) {
+		pthread_mutex_lock(&pl->stripes[i].mutex);
+		num_elements += fr_hash_table_num_elements(pl->stripes[i].ht);
+		pthread_mutex_unlock(&pl->stripes[i].mutex);
+	}
+
+	return num_elements;
 }
 
+/*
+ *	Whether a socket can be used to send a request.
+ */
+static bool fr_socket_match(fr_packet_socket_t const *ps, int proto, RADIUS_PACKET const *request, int src_any)
+{
+	if (ps->sockfd == -1) return false; /* paranoia */
+
+	/*
+	 *	This socket is marked as "don't use for new
+	 *	packets".  But we can still receive packets
+	 *	that are outstanding.
+	 */
+	if (ps->dont_use) return false;
+
+	/*
+	 *	All IDs are allocated: ignore it.
+	 */
+	if (ps->num_outgoing == 256) return false;
+
+#ifdef WITH_TCP
+	if (ps->proto != proto) return false;
+#endif
+
+	/*
+	 *	Address families don't match, skip it.
+	 */
+	if (ps->src_ipaddr.af != request->dst_ipaddr.af) return false;
+
+	/*
+	 *	MUST match dst port, if we have one.
+	 */
+	if ((ps->dst_port != 0) &&
+	    (ps->dst_port != request->dst_port)) return false;
+
+	/*
+	 *	MUST match requested src port, if one has been given.
+	 */
+	if ((request->src_port != 0) &&
+	    (ps->src_port != request->src_port)) return false;
+
+	/*
+	 *	We don't care about the source IP, but this
+	 *	socket is link local, and the requested
+	 *	destination is not link local.  Ignore it.
+	 */
+	if (src_any && (ps->src_ipaddr.af == AF_INET) &&
+	    (((ps->src_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) == 127) &&
+	    (((request->dst_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) != 127)) return false;
+
+	/*
+	 *	We're sourcing from *, and they asked for a
+	 *	specific source address: ignore it.
+	 */
+	if (ps->src_any && !src_any) return false;
+
+	/*
+	 *	We're sourcing from a specific IP, and they
+	 *	asked for a source IP that isn't us: ignore
+	 *	it.
+	 */
+	if (!ps->src_any && !src_any &&
+	    (fr_ipaddr_cmp(&request->src_ipaddr,
+			   &ps->src_ipaddr) != 0)) return false;
+
+	/*
+	 *	UDP sockets are allowed to match
+	 *	destination IPs exactly, OR a socket
+	 *	with destination * is allowed to match
+	 *	any requested destination.
+	 *
+	 *	TCP sockets must match the destination
+	 *	exactly.  They *always* have dst_any=0,
+	 *	so the first check always matches.
+	 */
+	if (!ps->dst_any &&
+	    (fr_ipaddr_cmp(&request->dst_ipaddr,
+			   &ps->dst_ipaddr) != 0)) return false;
+
+	/*
+	 *	Otherwise, this socket is OK to use.
+	 */
+	return true;
+}
+
+/*
+ *	Allocate a free ID from a socket, starting from a random
+ *	ID.  Must be called with pl->mutex held, and the socket
+ *	must have a free ID.
+ */
+static int fr_socket_id_alloc(fr_packet_socket_t *ps)
+{
+	int		i, word, shift;
+	uint32_t	start = fr_rand();
+	uint64_t	free_ids;
+
+	for (i = 0; i < 4; i++) {
+		word = (start + i) & 0x03;
+		free_ids = ~ps->id[word];
+		if (!free_ids) continue;
+
+		/*
+		 *	Prefer the first free ID at, or after a random
+		 *	offset in the word.
+		 */
+		shift = (start >> 2) & 0x3f;
+		if (free_ids >> shift) {
+			shift += fr_low_bit(free_ids >> shift);
+		} else {
+			shift = fr_low_bit(free_ids);
+		}
+
+		ps->id[word] |= ((uint64_t) 1) << shift;
+
+		return (word * 64) + shift;
+	}
+
+	return -1;
+}
+
+static inline void fr_socket_id_free(fr_packet_socket_t *ps, int id)
+{
+	ps->id[(id >> 6) & 0x03] &= ~(((uint64_t) 1) << (id & 0x3f));
+}
+
+static inline int fr_alloc_hint(RADIUS_PACKET const *request)
+{
+	uint32_t hash;
+
+	hash = fr_hash(&request->dst_port, sizeof(request->dst_port));
+
+	return packet_ipaddr_hash(&request->dst_ipaddr, hash) & (NUM_ALLOC_HINTS - 1);
+}
 
 /*
  *	1 == ID was allocated & assigned
@@ -591,10 +874,9 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
  *	Note that this ALSO assigns a socket to use, and updates
  *	packet->request->src_ipaddr && packet->request->src_port
  *
- *	In multi-threaded systems, the calls to id_alloc && id_free
- *	should be protected by a mutex.  This does NOT have to be
- *	the same mutex as the one protecting the insert/find/yank
- *	calls!
+ *	The list has its own locks, so calls to id_alloc, id_free,
+ *	insert, find and yank don't need to be protected by the
+ *	caller.
  *
  *	We assume that the packet has dst_ipaddr && dst_port
  *	already initialized.  We will use those to find an
@@ -606,10 +888,11 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET **request_p, void **pctx)
 {
-	int i, j, k, fd, id, start_i, start_j, start_k;
+	int i, id, start_i, hint;
 	int src_any = 0;
-	fr_packet_socket_t *ps= NULL;
+	fr_packet_socket_t *ps = NULL;
 	RADIUS_PACKET *request = *request_p;
+	void *ctx;
 
 	if ((request->dst_ipaddr.af == AF_UNSPEC) ||
 	    (request->dst_port == 0)) {
@@ -646,145 +929,53 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 		return false;
 	}
 
-	/*
-	 *	FIXME: Go to an LRU system.  This prevents ID re-use
-	 *	for as long as possible.  The main problem with that
-	 *	approach is that it requires us to populate the
-	 *	LRU/FIFO when we add a new socket, or a new destination,
-	 *	which can be expensive.
-	 *
-	 *	The LRU can be avoided if the caller takes care to free
-	 *	Id's only when all responses have been received, OR after
-	 *	a timeout.
-	 *
-	 *	Right now, the random approach is almost OK... it's
-	 *	brute-force over all of the available ID's, BUT using
-	 *	random numbers for everything spreads the load a bit.
-	 *
-	 *	The old method had a hash lookup on allocation AND
-	 *	on free.  The new method has brute-force on allocation,
-	 *	and near-zero cost on free.
-	 */
-
-	id = fd = -1;
-	start_i = fr_rand() & SOCKOFFSET_MASK;
-
-#define ID_i ((i + start_i) & SOCKOFFSET_MASK)
-	for (i = 0; i < MAX_SOCKETS; i++) {
-		if (pl->sockets[ID_i].sockfd == -1) continue; /* paranoia */
-
-		ps = &(pl->sockets[ID_i]);
-
-		/*
-		 *	This socket is marked as "don't use for new
-		 *	packets".  But we can still receive packets
-		 *	that are outstanding.
-		 */
-		if (ps->dont_use) continue;
-
-		/*
-		 *	All IDs are allocated: ignore it.
-		 */
-		if (ps->num_outgoing == 256) continue;
-
-#ifdef WITH_TCP
-		if (ps->proto != proto) continue;
-#endif
-
-		/*
-		 *	Address families don't match, skip it.
-		 */
-		if (ps->src_ipaddr.af != request->dst_ipaddr.af) continue;
-
-		/*
-		 *	MUST match dst port, if we have one.
-		 */
-		if ((ps->dst_port != 0) &&
-		    (ps->dst_port != request->dst_port)) continue;
-
-		/*
-		 *	MUST match requested src port, if one has been given.
-		 */
-		if ((request->src_port != 0) &&
-		    (ps->src_port != request->src_port)) continue;
-
-		/*
-		 *	We don't care about the source IP, but this
-		 *	socket is link local, and the requested
-		 *	destination is not link local.  Ignore it.
-		 */
-		if (src_any && (ps->src_ipaddr.af == AF_INET) &&
-		    (((ps->src_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) == 127) &&
-		    (((request->dst_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) != 127)) continue;
+	hint = fr_alloc_hint(request);
 
-		/*
-		 *	We're sourcing from *, and they asked for a
-		 *	specific source address: ignore it.
-		 */
-		if (ps->src_any && !src_any) continue;
-
-		/*
-		 *	We're sourcing from a specific IP, and they
-		 *	asked for a source IP that isn't us: ignore
-		 *	it.
-		 */
-		if (!ps->src_any && !src_any &&
-		    (fr_ipaddr_cmp(&request->src_ipaddr,
-				   &ps->src_ipaddr) != 0)) continue;
+	pthread_mutex_lock(&pl->mutex);
 
-		/*
-		 *	UDP sockets are allowed to match
-		 *	destination IPs exactly, OR a socket
-		 *	with destination * is allowed to match
-		 *	any requested destination.
-		 *
-		 *	TCP sockets must match the destination
-		 *	exactly.  They *always* have dst_any=0,
-		 *	so the first check always matches.
-		 */
-		if (!ps->dst_any &&
-		    (fr_ipaddr_cmp(&request->dst_ipaddr,
-				   &ps->dst_ipaddr) != 0)) continue;
-
-		/*
-		 *	Otherwise, this socket is OK to use.
-		 */
+	/*
+	 *	Try the socket we used last time for this
+	 *	destination.  Usually it still has free IDs, so
+	 *	we don't have to look at every socket.
+	 */
+	if (pl->alloc_hint[hint]) {
+		ps = &pl->sockets[pl->alloc_hint[hint] - 1];
+		if (!fr_socket_match(ps, proto, request, src_any)) ps = NULL;
+	}
 
-		/*
-		 *	Look for a free Id, starting from a random number.
-		 */
-		start_j = fr_rand() & 0x1f;
-#define ID_j ((j + start_j) & 0x1f)
-		for (j = 0; j < 32; j++) {
-			if (ps->id[ID_j] == 0xff) continue;
+	/*
+	 *	Otherwise look at all of the sockets, starting from
+	 *	a random one, to spread the load a bit.
+	 */
+	if (!ps) {
+		start_i = fr_rand() & SOCKOFFSET_MASK;
 
+		for (i = 0; i < MAX_SOCKETS; i++) {
+			fr_packet_socket_t *this = &pl->sockets[(i + start_i) & SOCKOFFSET_MASK];
 
-			start_k = fr_rand() & 0x07;
-#define ID_k ((k + start_k) & 0x07)
-			for (k = 0; k < 8; k++) {
-				if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
+			if (!fr_socket_match(this, proto, request, src_any)) continue;
 
-				ps->id[ID_j] |= (1 << ID_k);
-				id = (ID_j * 8) + ID_k;
-				fd = i;
-				break;
-			}
-			if (fd >= 0) break;
+			ps = this;
+			pl->alloc_hint[hint] = (ps - pl->sockets) + 1;
+			break;
 		}
-#undef ID_i
-#undef ID_j
-#undef ID_k
-		break;
 	}
 
 	/*
 	 *	Ask the caller to allocate a new ID.
 	 */
-	if (fd < 0) {
+	if (!ps) {
+		pthread_mutex_unlock(&pl->mutex);
 		fr_strerror_printf("Failed finding socket, caller must allocate a new one");
 		return false;
 	}
 
+	id = fr_socket_id_alloc(ps);
+	rad_assert(id >= 0);
+
+	ps->num_outgoing++;
+	pl->num_outgoing++;
+
 	/*
 	 *	Set the ID, source IP, and source port.
 	 */
@@ -793,22 +984,29 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	request->sockfd = ps->sockfd;
 	request->src_ipaddr = ps->src_ipaddr;
 	request->src_port = ps->src_port;
+	ctx = ps->ctx;
+
+	pthread_mutex_unlock(&pl->mutex);
 
 	/*
 	 *	If we managed to insert it, we're done.
 	 */
 	if (fr_packet_list_insert(pl, request_p)) {
-		if (pctx) *pctx = ps->ctx;
-		ps->num_outgoing++;
-		pl->num_outgoing++;
+		if (pctx) *pctx = ctx;
 		return true;
 	}
 
 	/*
-	 *	Mark the ID as free.  This is the one line from
-	 *	id_free() that we care about here.
+	 *	Mark the ID as free.
 	 */
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	pthread_mutex_lock(&pl->mutex);
+	ps = fr_socket_find(pl, request->sockfd);
+	if (ps) {
+		fr_socket_id_free(ps, request->id);
+		ps->num_outgoing--;
+	}
+	pl->num_outgoing--;
+	pthread_mutex_unlock(&pl->mutex);
 
 	request->id = -1;
 	request->sockfd = -1;
@@ -831,19 +1029,18 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 
 	if (yank && !fr_packet_list_yank(pl, request)) return false;
 
+	pthread_mutex_lock(&pl->mutex);
 	ps = fr_socket_find(pl, request->sockfd);
-	if (!ps) return false;
-
-#if 0
-	if (!ps->id[(request->id >> 3) & 0x1f] & (1 << (request->id & 0x07))) {
-		fr_exit(1);
+	if (!ps) {
+		pthread_mutex_unlock(&pl->mutex);
+		return false;
 	}
-#endif
 
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	fr_socket_id_free(ps, request->id);
 
 	ps->num_outgoing--;
 	pl->num_outgoing--;
+	pthread_mutex_unlock(&pl->mutex);
 
 	request->id = -1;
 	request->src_ipaddr.af = AF_UNSPEC; /* id_alloc checks this */
@@ -853,17 +1050,94 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 }
 
 /*
- *	We always walk RBTREE_DELETE_ORDER, which is like RBTREE_IN_ORDER, except that
+ *	fr_hash_table_walk() passes its callback the packet, not the
+ *	RADIUS_PACKET ** which was inserted, and which walk callbacks
+ *	expect.  So the packets are collected first, and each one is
+ *	yanked to get the entry back.
+ */
+static int packet_collect(void *ctx, void *data)
+{
+	RADIUS_PACKET ***next = ctx;
+
+	**next = data;
+	(*next)++;
+
+	return 0;
+}
+
+/*
+ *	The callback returns the same values as for an rbtree walk
+ *	in RBTREE_DELETE_ORDER, i.e.
  *	<0 means error, stop
  *	0  means OK, continue
  *	1  means delete current node and stop
  *	2  means delete current node and continue
+ *
+ *	The callback is called with the lock for the packet held, so
+ *	it must not insert, find or yank packets.  It may free IDs
+ *	with yank = false, but must not otherwise change the packet
+ *	unless it is deleted.
+ *
+ *	The callback may change the packet (e.g. by freeing its ID)
+ *	before asking for it to be deleted, after which it can't be
+ *	found by its hash.  So the packet is removed from the table
+ *	first, and put back if the callback wants to keep it.
  */
 int fr_packet_list_walk(fr_packet_list_t *pl, void *ctx, rb_walker_t callback)
 {
+	int		i, rcode = 0;
+	uint32_t	j, num;
+	RADIUS_PACKET	**packets, **next, **packet_p;
+
 	if (!pl || !callback) return 0;
 
-	return rbtree_walk(pl->tree, RBTREE_DELETE_ORDER, callback, ctx);
+	for (i = 0; i < NUM_STRIPES; i++) {
+		fr_packet_stripe_t *stripe = &pl->stripes[i];
+
+		pthread_mutex_lock(&stripe->mutex);
+		num = fr_hash_table_num_elements(stripe->ht);
+		if (!num) {
+			pthread_mutex_unlock(&stripe->mutex);
+			continue;
+		}
+
+		packets = talloc_array(NULL, RADIUS_PACKET *, num);
+		if (!packets) {
+			pthread_mutex_unlock(&stripe->mutex);
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+
+		next = packets;
+		fr_hash_table_walk(stripe->ht, packet_collect, &next);
+
+		for (j = 0; j < num; j++) {
+			packet_p = fr_hash_table_yank(stripe->ht, &packets[j]);
+			if (!packet_p) continue;
+
+			rcode = callback(ctx, packet_p);
+			switch (rcode) {
+			case 1:
+				break;
+
+			case 2:
+				rcode = 0;
+				break;
+
+			default:
+				fr_hash_table_insert(stripe->ht, packet_p);
+				break;
+			}
+			if (rcode != 0) break;
+		}
+		pthread_mutex_unlock(&stripe->mutex);
+		talloc_free(packets);
+
+		if (rcode < 0) return rcode;
+		if (rcode != 0) return 0;
+	}
+
+	return 0;
 }
 
 int fr_packet_list_fd_set(fr_packet_list_t *pl, fd_set *set)
@@ -938,7 +1212,7 @@ uint32_t fr_packet_list_num_incoming(fr_packet_list_t *pl)
 
 	if (!pl) return 0;
 
-	num_elements = rbtree_num_elements(pl->tree);
+	num_elements = fr_packet_list_num_elements(pl);
 	if (num_elements < pl->num_outgoing) return 0; /* panic! */
 
 	return num_elements - pl->num_outgoing;
@@ -834,6 +834,287 @@ void fr_pair_delete_by_num(VALUE_PAIR **head, unsigned int vendor, unsigned int
 	}
 }
 
+/*
+ *	Lists shorter than this are searched linearly, as building
+ *	the index would cost more than it saves.
+ */
+#define PAIR_HEAD_INDEX_MIN	(16)
+
+static uint32_t pair_head_index_hash(void const *data)
+{
+	VALUE_PAIR const *vp = data;
+	uint32_t hash;
+
+	hash = fr_hash(&vp->da->vendor, sizeof(vp->da->vendor));
+	return fr_hash_update(&vp->da->attr, sizeof(vp->da->attr), hash);
+}
+
+static int pair_head_index_cmp(void const *one, void const *two)
+{
+	VALUE_PAIR const *a = one;
+	VALUE_PAIR const *b = two;
+
+	if (a->da->vendor < b->da->vendor) return -1;
+	if (a->da->vendor > b->da->vendor) return +1;
+
+	if (a->da->attr < b->da->attr) return -1;
+	if (a->da->attr > b->da->attr) return +1;
+
+	return 0;
+}
+
+/** Find the last pair in the list, and count the pairs
+ *
+ */
+static void pair_head_wind(vp_list_t *list)
+{
+	VALUE_PAIR *vp;
+
+	if (!list->tail) {
+		list->count = 0;
+		if (!list->head) return;
+
+		list->tail = list->head;
+		list->count = 1;
+	}
+
+	for (vp = list->tail; vp->next; vp = vp->next) {
+		VERIFY_VP(vp);
+		list->count++;
+	}
+
+	list->tail = vp;
+}
+
+/** Build the index of the first pair with each vendor and attribute number
+ *
+ * Later pairs with the same numbers are found by walking the list from the first one,
+ * so it doesn't matter if nested attributes with different parents share numbers.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, in which case the list is searched linearly.
+ */
+static int pair_head_index(vp_list_t *list)
+{
+	VALUE_PAIR *vp;
+
+	list->index = fr_hash_table_create(NULL, pair_head_index_hash, pair_head_index_cmp, NULL);
+	if (!list->index) return -1;
+
+	for (vp = list->head; vp; vp = vp->next) {
+		VERIFY_VP(vp);
+		if (fr_hash_table_finddata(list->index, vp)) continue;
+
+		if (!fr_hash_table_insert(list->index, vp)) {
+			fr_hash_table_free(list->index);
+			list->index = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Find the first pair which might match, using the index
+ *
+ * @return
+ *	- The first pair with the same vendor and attribute numbers.
+ *	- NULL if there is no such pair.
+ *	- list->head if the list should be searched linearly.
+ */
+static VALUE_PAIR *pair_head_start(vp_list_t *list, fr_dict_attr_t const *da)
+{
+	VALUE_PAIR find = { .da = da };
+
+	if (!list->index) {
+		pair_head_wind(list);
+		if (list->count < PAIR_HEAD_INDEX_MIN) return list->head;
+
+		if (pair_head_index(list) < 0) return list->head;
+	}
+
+	return fr_hash_table_finddata(list->index, &find);
+}
+
+/** Initialise a list head
+ *
+ * @param[out] list to initialise.
+ * @param[in] vps to place in the list.  May be NULL.
+ */
+void fr_pair_head_init(vp_list_t *list, VALUE_PAIR *vps)
+{
+	memset(list, 0, sizeof(*list));
+
+	list->head = vps;
+}
+
+/** Discard the tail pointer and index of a list head
+ *
+ * Must be called after the list is modified other than with #fr_pair_head_add,
+ * and when the list head is no longer needed, to free the index.
+ *
+ * @param[in] list to reset.
+ */
+void fr_pair_head_reset(vp_list_t *list)
+{
+	fr_hash_table_free(list->index);
+	list->index = NULL;
+
+	list->tail = NULL;
+	list->count = 0;
+}
+
+/** Add a VP to the end of the list, in constant time
+ *
+ * @param[in] list to add the VP to.
+ * @param[in] add VP to add to list.
+ */
+void fr_pair_head_add(vp_list_t *list, VALUE_PAIR *add)
+{
+	if (!add) return;
+
+	VERIFY_VP(add);
+
+	/*
+	 *	Something may have been appended to the list
+	 *	with a cursor, so wind forward from the tail.
+	 */
+	pair_head_wind(list);
+
+	if (!list->tail) {
+		list->head = add;
+	} else {
+		(void)fr_cond_assert(list->tail != add);
+		list->tail->next = add;
+	}
+
+	/*
+	 *	add may be the start of a list of VPs.
+	 */
+	list->tail = add;
+	list->count++;
+
+	for (; add; add = add->next) {
+		if (list->index && !fr_hash_table_finddata(list->index, add)) {
+			if (!fr_hash_table_insert(list->index, add)) {
+				fr_hash_table_free(list->index);
+				list->index = NULL;
+			}
+		}
+	}
+
+	pair_head_wind(list);
+}
+
+/** Remove a VP from the list
+ *
+ * The tail pointer and index are updated, so the list head remains valid.
+ *
+ * @param[in] list to remove the VP from.
+ * @param[in] vp to remove.  Must be a single VP, not a list.
+ * @return
+ *	- The VP, which the caller must free.
+ *	- NULL if the VP is not in the list.
+ */
+VALUE_PAIR *fr_pair_head_remove(vp_list_t *list, VALUE_PAIR *vp)
+{
+	VALUE_PAIR **last, *prev = NULL, *next;
+
+	VERIFY_VP(vp);
+
+	for (last = &list->head; *last; last = &(*last)->next) {
+		if (*last == vp) break;
+		prev = *last;
+	}
+	if (!*last) return NULL;
+
+	*last = vp->next;
+
+	if (list->tail) {
+		if (list->tail == vp) list->tail = prev;
+		list->count--;
+	}
+
+	/*
+	 *	If this was the first pair with its numbers, the
+	 *	next one (if any) takes its place in the index.
+	 */
+	if (list->index && (fr_hash_table_finddata(list->index, vp) == vp)) {
+		fr_hash_table_delete(list->index, vp);
+
+		for (next = vp->next; next; next = next->next) {
+			if (pair_head_index_cmp(next, vp) != 0) continue;
+
+			if (!fr_hash_table_insert(list->index, next)) {
+				fr_hash_table_free(list->index);
+				list->index = NULL;
+			}
+			break;
+		}
+	}
+
+	vp->next = NULL;
+
+	return vp;
+}
+
+/** Find the pair with the matching DAs
+ *
+ * @param[in] list to search.
+ * @param[in] da to match.
+ * @param[in] tag to match. TAG_ANY matches any tag, TAG_NONE matches tagless VPs.
+ * @return
+ *	- The first matching #VALUE_PAIR.
+ *	- NULL if no #VALUE_PAIR matches.
+ */
+VALUE_PAIR *fr_pair_head_find_by_da(vp_list_t *list, fr_dict_attr_t const *da, int8_t tag)
+{
+	VALUE_PAIR	*start;
+	vp_cursor_t 	cursor;
+
+	if (!fr_cond_assert(da)) return NULL;
+
+	start = pair_head_start(list, da);
+	if (!start) return NULL;
+
+	(void) fr_cursor_init(&cursor, &start);
+	return fr_cursor_next_by_da(&cursor, da, tag);
+}
+
+/** Find the pair with the matching attribute
+ *
+ * @param[in] list to search.
+ * @param[in] vendor to match.
+ * @param[in] attr to match.
+ * @param[in] tag to match. TAG_ANY matches any tag, TAG_NONE matches tagless VPs.
+ * @return
+ *	- The first matching #VALUE_PAIR.
+ *	- NULL if no #VALUE_PAIR matches.
+ */
+VALUE_PAIR *fr_pair_head_find_by_num(vp_list_t *list, unsigned int vendor, unsigned int attr, int8_t tag)
+{
+	VALUE_PAIR	*start;
+	vp_cursor_t 	cursor;
+	fr_dict_attr_t	find_da = { .vendor = vendor, .attr = attr };
+
+	start = pair_head_start(list, &find_da);
+	if (!start) return NULL;
+
+	(void) fr_cursor_init(&cursor, &start);
+	return fr_cursor_next_by_num(&cursor, vendor, attr, tag);
+}
+
+/** Free all the pairs in a list, and its index
+ *
+ * @param[in] list to free.
+ */
+void fr_pair_head_free(vp_list_t *list)
+{
+	fr_pair_head_reset(list);
+	fr_pair_list_free(&list->head);
+}
+
 int8_t fr_pair_cmp_by_da_tag(void const *a, void const *b)
 {
 	VALUE_PAIR const *my_a = a;
@@ -1537,9 +1818,16 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 	VALUE_PAIR *i, *found;
 	VALUE_PAIR *head_new, **tail_new;
 	VALUE_PAIR **tail_from;
+	vp_list_t list;
 
 	if (!to || !from || !*from) return;
 
+	/*
+	 *	Index the "to" list, so that each attribute in the
+	 *	"from" list doesn't require a walk over it.
+	 */
+	fr_pair_head_init(&list, *to);
+
 	/*
 	 *	We're editing the "to" list while we're adding new
 	 *	attributes to it.  We don't want the new attributes to
@@ -1555,7 +1843,7 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 	 */
 	tail_from = from;
 	while ((i = *tail_from) != NULL) {
-		VALUE_PAIR *j;
+		VALUE_PAIR *j, *next, *prev;
 
 		VERIFY_VP(i);
 
@@ -1588,7 +1876,7 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 		 *	it doesn't already exist.
 		 */
 		case T_OP_EQ:
-			found = fr_pair_find_by_da(*to, i->da, TAG_ANY);
+			found = fr_pair_head_find_by_da(&list, i->da, TAG_ANY);
 			if (!found) goto do_add;
 
 			tail_from = &(i->next);
@@ -1599,7 +1887,7 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 		 *	of the same vendor/attr which already exists.
 		 */
 		case T_OP_SET:
-			found = fr_pair_find_by_da(*to, i->da, TAG_ANY);
+			found = fr_pair_head_find_by_da(&list, i->da, TAG_ANY);
 			if (!found) goto do_add;
 
 			/*
@@ -1634,9 +1922,27 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 
 			/*
 			 *	Delete *all* of the attributes
-			 *	of the same number.
+			 *	of the same number, in one pass.
+			 *
+			 *	found is the first pair with its
+			 *	numbers, so it's the one in the index,
+			 *	and the index doesn't change.
 			 */
-			fr_pair_delete_by_num(&found->next, found->da->vendor, found->da->attr, TAG_ANY);
+			for (prev = found, j = found->next; j; j = next) {
+				next = j->next;
+
+				if ((j->da->vendor != found->da->vendor) || (j->da->attr != found->da->attr)) {
+					prev = j;
+					continue;
+				}
+
+				prev->next = next;
+				if (list.tail) {
+					if (list.tail == j) list.tail = prev;
+					list.count--;
+				}
+				talloc_free(j);
+			}
 
 			/*
 			 *	Remove this attribute from the
@@ -1665,7 +1971,9 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 	/*
 	 *	Take the "new" list, and append it to the "to" list.
 	 */
-	fr_pair_add(to, head_new);
+	fr_pair_head_add(&list, head_new);
+	*to = list.head;
+	fr_pair_head_reset(&list);
 }
 
 /** Move matching pairs between VALUE_PAIR lists
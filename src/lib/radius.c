@@ -1510,11 +1510,9 @@ int fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 int fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
 {
 	int			packet_length;
-	uint32_t		num_attributes;
 	uint8_t			*ptr;
 	radius_packet_t		*hdr;
-	VALUE_PAIR		*head = NULL;
-	vp_cursor_t		cursor, out;
+	vp_list_t		decoded, out;
 	fr_radius_ctx_t		decoder_ctx = {
 					.original = original,
 					.packet = packet,
@@ -1526,30 +1524,34 @@ int fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 	hdr = (radius_packet_t *)packet->data;
 	ptr = hdr->data;
 	packet_length = packet->data_len - RADIUS_HDR_LEN;
-	num_attributes = 0;
 
-	fr_cursor_init(&cursor, &head);
+	fr_pair_head_init(&decoded, NULL);
 
 	/*
 	 *	Loop over the attributes, decoding them into VPs.
 	 */
 	while (packet_length > 0) {
-		ssize_t my_len;
+		ssize_t		my_len;
+		VALUE_PAIR	*vps = NULL;
+		vp_cursor_t	cursor;
 
 		/*
 		 *	This may return many VPs
 		 */
+		fr_cursor_init(&cursor, &vps);
 		my_len = fr_radius_decode_pair(packet, &cursor, fr_dict_root(fr_dict_internal), ptr, packet_length,
 					       &decoder_ctx);
 		if (my_len < 0) {
-			fr_pair_list_free(&head);
+			fr_pair_list_free(&vps);
+			fr_pair_head_free(&decoded);
 			return -1;
 		}
 
 		/*
-		 *	Count the ones which were just added
+		 *	Appending them counts them, without walking
+		 *	the ones we've already decoded.
 		 */
-		while (fr_cursor_next(&cursor)) num_attributes++;
+		fr_pair_head_add(&decoded, vps);
 
 		/*
 		 *	VSA's may not have been counted properly in
@@ -1557,16 +1559,16 @@ int fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 		 *	then without using the dictionary.  We
 		 *	therefore enforce the limits here, too.
 		 */
-		if ((fr_max_attributes > 0) && (num_attributes > fr_max_attributes)) {
+		if ((fr_max_attributes > 0) && (decoded.count > fr_max_attributes)) {
 			char host_ipaddr[INET6_ADDRSTRLEN];
 
-			fr_pair_list_free(&head);
+			fr_pair_head_free(&decoded);
 			fr_strerror_printf("Possible DoS attack from host %s: Too many attributes in request "
 					   "(received %d, max %d are allowed)",
 					   inet_ntop(packet->src_ipaddr.af,
 						     &packet->src_ipaddr.ipaddr,
 						     host_ipaddr, sizeof(host_ipaddr)),
-					   num_attributes, fr_max_attributes);
+					   decoded.count, fr_max_attributes);
 			return -1;
 		}
 
@@ -1574,9 +1576,11 @@ int fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 		packet_length -= my_len;
 	}
 
-	fr_cursor_init(&out, &packet->vps);
-	fr_cursor_last(&out);		/* Move insertion point to the end of the list */
-	fr_cursor_merge(&out, head);
+	fr_pair_head_init(&out, packet->vps);
+	fr_pair_head_add(&out, decoded.head);
+	packet->vps = out.head;
+	fr_pair_head_reset(&out);
+	fr_pair_head_reset(&decoded);
 
 	/*
 	 *	Merge information from the outside world into our
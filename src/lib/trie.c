@@ -0,0 +1,481 @@
+/*
+ * trie.c	Path-compressed binary (Patricia) trie, for longest
+ *		prefix matching of IP addresses.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/*
+ *	Readers never take a lock.  Writers are serialised by the
+ *	trie mutex, and only ever publish fully initialised nodes,
+ *	with a single release store into the parent.
+ *
+ *	Nodes which are no longer needed after a remove are unlinked
+ *	from the trie, but their child pointers are left alone, and
+ *	they are only freed after TRIE_RETIRE_DELAY seconds.  A reader
+ *	which is part way through a lookup always sees a consistent
+ *	path.
+ */
+#define TRIE_RETIRE_DELAY	(120)
+
+typedef struct fr_trie_node_t fr_trie_node_t;
+typedef _Atomic(fr_trie_node_t *) fr_trie_node_ptr_t;
+typedef _Atomic(void *) fr_trie_data_ptr_t;
+
+struct fr_trie_node_t {
+	uint8_t			key[FR_TRIE_MAX_BITS / 8];	//!< Prefix, with bits past "bits" zeroed.
+	uint32_t		bits;				//!< Length of the prefix.
+	fr_trie_data_ptr_t	data;				//!< User data, or NULL for glue nodes.
+	fr_trie_node_ptr_t	child[2];			//!< Indexed by bit "bits" of the key.
+
+	fr_trie_node_t		*next_retired;			//!< Next node waiting to be freed.
+	time_t			retired;			//!< When the node was unlinked.
+};
+
+struct fr_trie_t {
+	fr_trie_node_ptr_t	root;
+	uint32_t		max_bits;
+	uint32_t		num_elements;
+	pthread_mutex_t		mutex;
+
+	fr_trie_node_t		*retired_head;			//!< Unlinked nodes, oldest first.
+	fr_trie_node_t		*retired_tail;
+};
+
+#define LOAD(_x) atomic_load_explicit(&(_x), memory_order_acquire)
+#define STORE(_x, _y) atomic_store_explicit(&(_x), _y, memory_order_release)
+
+/*
+ *	Return bit "n" of the key, counting from the most significant
+ *	bit of the first byte.
+ */
+static inline int trie_bit(uint8_t const *key, uint32_t n)
+{
+	return (key[n >> 3] >> (7 - (n & 0x07))) & 0x01;
+}
+
+/*
+ *	Return the number of leading bits that two keys have in
+ *	common, up to "max".
+ */
+static uint32_t trie_common_bits(uint8_t const *a, uint8_t const *b, uint32_t max)
+{
+	uint32_t i;
+	uint8_t xor;
+
+	for (i = 0; (i * 8) < max; i++) {
+		xor = a[i] ^ b[i];
+		if (!xor) continue;
+
+		i *= 8;
+		while (!(xor & 0x80)) {
+			xor <<= 1;
+			i++;
+		}
+
+		return (i < max) ? i : max;
+	}
+
+	return max;
+}
+
+/*
+ *	Whether the first "bits" of two keys are the same.
+ */
+static inline bool trie_match(uint8_t const *a, uint8_t const *b, uint32_t bits)
+{
+	uint32_t bytes = bits >> 3;
+
+	if (bytes && (memcmp(a, b, bytes) != 0)) return false;
+
+	if (bits & 0x07) {
+		uint8_t mask = 0xff << (8 - (bits & 0x07));
+
+		if ((a[bytes] ^ b[bytes]) & mask) return false;
+	}
+
+	return true;
+}
+
+static fr_trie_node_t *trie_node_alloc(fr_trie_t *trie, uint8_t const *key, uint32_t bits, void *data)
+{
+	fr_trie_node_t *node;
+	uint32_t bytes = bits >> 3;
+
+	node = talloc_zero(trie, fr_trie_node_t);
+	if (!node) return NULL;
+
+	memcpy(node->key, key, bytes);
+	if (bits & 0x07) node->key[bytes] = key[bytes] & (0xff << (8 - (bits & 0x07)));
+	node->bits = bits;
+
+	atomic_init(&node->data, data);
+	atomic_init(&node->child[0], NULL);
+	atomic_init(&node->child[1], NULL);
+
+	return node;
+}
+
+/*
+ *	Free nodes which were unlinked long enough ago that no
+ *	lookup can still be using them.
+ */
+static void trie_reap(fr_trie_t *trie, time_t now)
+{
+	fr_trie_node_t *node;
+
+	while ((node = trie->retired_head) != NULL) {
+		if ((node->retired + TRIE_RETIRE_DELAY) >= now) break;
+
+		trie->retired_head = node->next_retired;
+		if (!trie->retired_head) trie->retired_tail = NULL;
+
+		talloc_free(node);
+	}
+}
+
+/*
+ *	Replace a node with one of its children (or NULL), and queue
+ *	it to be freed.
+ */
+static void trie_unlink(fr_trie_t *trie, fr_trie_node_ptr_t *parent, fr_trie_node_t *node,
+			fr_trie_node_t *child, time_t now)
+{
+	STORE(*parent, child);
+
+	node->retired = now;
+	node->next_retired = NULL;
+	if (trie->retired_tail) {
+		trie->retired_tail->next_retired = node;
+	} else {
+		trie->retired_head = node;
+	}
+	trie->retired_tail = node;
+}
+
+static int _trie_free(fr_trie_t *trie)
+{
+	pthread_mutex_destroy(&trie->mutex);
+
+	return 0;
+}
+
+/** Create a new trie
+ *
+ * Lookups may run concurrently with each other, and with one
+ * insert or remove.  Inserts and removes are serialised internally.
+ *
+ * @param ctx to allocate the trie in.
+ * @param max_bits the length of the keys, 32 for IPv4 and 128 for IPv6.
+ * @return
+ *	- New trie.
+ *	- NULL on error.
+ */
+fr_trie_t *fr_trie_create(TALLOC_CTX *ctx, uint32_t max_bits)
+{
+	fr_trie_t *trie;
+
+	if (!max_bits || (max_bits > FR_TRIE_MAX_BITS)) {
+		fr_strerror_printf("Invalid trie key length %u", max_bits);
+		return NULL;
+	}
+
+	trie = talloc_zero(ctx, fr_trie_t);
+	if (!trie) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	trie->max_bits = max_bits;
+	atomic_init(&trie->root, NULL);
+	pthread_mutex_init(&trie->mutex, NULL);
+	talloc_set_destructor(trie, _trie_free);
+
+	return trie;
+}
+
+/** Add a prefix to the trie
+ *
+ * @param trie to insert into.
+ * @param key the prefix.  Bits past "bits" are ignored.
+ * @param bits length of the prefix.
+ * @param data to associate with the prefix.  Must not be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the prefix already exists, or on error.
+ */
+int fr_trie_insert(fr_trie_t *trie, uint8_t const *key, uint32_t bits, void *data)
+{
+	fr_trie_node_ptr_t *parent;
+	fr_trie_node_t *node, *new, *glue;
+	uint32_t common;
+	int rcode = -1;
+
+	if (!data || (bits > trie->max_bits)) {
+		fr_strerror_printf("Invalid trie prefix");
+		return -1;
+	}
+
+	pthread_mutex_lock(&trie->mutex);
+
+	trie_reap(trie, time(NULL));
+
+	parent = &trie->root;
+	while ((node = LOAD(*parent)) != NULL) {
+		common = trie_common_bits(node->key, key, (node->bits < bits) ? node->bits : bits);
+
+		/*
+		 *	The node is a prefix of the key.  Either it's
+		 *	an exact match, or we go further down.
+		 */
+		if (common == node->bits) {
+			if (node->bits == bits) {
+				if (LOAD(node->data)) {
+					fr_strerror_printf("Prefix already exists");
+					goto done;
+				}
+
+				STORE(node->data, data);
+				goto inserted;
+			}
+
+			parent = &node->child[trie_bit(key, node->bits)];
+			continue;
+		}
+
+		new = trie_node_alloc(trie, key, bits, data);
+		if (!new) goto oom;
+
+		/*
+		 *	The key is a prefix of the node.  The new node
+		 *	goes above it.
+		 */
+		if (common == bits) {
+			atomic_init(&new->child[trie_bit(node->key, bits)], node);
+			STORE(*parent, new);
+			goto inserted;
+		}
+
+		/*
+		 *	The key and the node diverge part way down the
+		 *	node's prefix.  Add a glue node at that point,
+		 *	with the node and the new key as its children.
+		 */
+		glue = trie_node_alloc(trie, key, common, NULL);
+		if (!glue) {
+			talloc_free(new);
+			goto oom;
+		}
+
+		atomic_init(&glue->child[trie_bit(key, common)], new);
+		atomic_init(&glue->child[trie_bit(node->key, common)], node);
+		STORE(*parent, glue);
+		goto inserted;
+	}
+
+	new = trie_node_alloc(trie, key, bits, data);
+	if (!new) goto oom;
+	STORE(*parent, new);
+
+inserted:
+	trie->num_elements++;
+	rcode = 0;
+
+done:
+	pthread_mutex_unlock(&trie->mutex);
+	return rcode;
+
+oom:
+	fr_strerror_printf("Out of memory");
+	goto done;
+}
+
+/*
+ *	Find the node for an exact prefix.
+ */
+static fr_trie_node_t *trie_find_node(fr_trie_t *trie, uint8_t const *key, uint32_t bits)
+{
+	fr_trie_node_t *node;
+
+	node = LOAD(trie->root);
+	while (node && (node->bits <= bits)) {
+		if (!trie_match(node->key, key, node->bits)) return NULL;
+
+		if (node->bits == bits) return node;
+
+		node = LOAD(node->child[trie_bit(key, node->bits)]);
+	}
+
+	return NULL;
+}
+
+/** Find the data for an exact prefix
+ *
+ * @param trie to search.
+ * @param key the prefix.
+ * @param bits length of the prefix.
+ * @return
+ *	- The data associated with the prefix.
+ *	- NULL if the prefix is not in the trie.
+ */
+void *fr_trie_find(fr_trie_t *trie, uint8_t const *key, uint32_t bits)
+{
+	fr_trie_node_t *node;
+
+	if (bits > trie->max_bits) return NULL;
+
+	node = trie_find_node(trie, key, bits);
+	if (!node) return NULL;
+
+	return LOAD(node->data);
+}
+
+/** Find the data for the longest prefix which matches a key
+ *
+ * @param trie to search.
+ * @param key to look up, of trie->max_bits length.
+ * @param[out] bits length of the matching prefix.  May be NULL.
+ * @param match if not NULL, called for the data of each matching prefix.
+ *	Prefixes for which it returns false are skipped, so the next
+ *	shorter prefix may be returned instead.
+ * @param uctx passed to match.
+ * @return
+ *	- The data associated with the longest matching prefix.
+ *	- NULL if no prefix matches.
+ */
+void *fr_trie_lookup(fr_trie_t *trie, uint8_t const *key, uint32_t *bits, fr_trie_match_t match, void const *uctx)
+{
+	fr_trie_node_t *node;
+	void *data, *found = NULL;
+
+	node = LOAD(trie->root);
+	while (node) {
+		if (!trie_match(node->key, key, node->bits)) break;
+
+		data = LOAD(node->data);
+		if (data && (!match || match(uctx, data))) {
+			found = data;
+			if (bits) *bits = node->bits;
+		}
+
+		if (node->bits == trie->max_bits) break;
+
+		node = LOAD(node->child[trie_bit(key, node->bits)]);
+	}
+
+	return found;
+}
+
+/** Remove a prefix from the trie
+ *
+ * Nodes which are no longer needed are removed from the trie, and
+ * glue nodes with only one child are replaced by that child.  The
+ * caller must not free the data until any concurrent lookups which
+ * may have returned it have finished.
+ *
+ * @param trie to remove the prefix from.
+ * @param key the prefix.
+ * @param bits length of the prefix.
+ * @return
+ *	- The data which was associated with the prefix.
+ *	- NULL if the prefix was not in the trie.
+ */
+void *fr_trie_remove(fr_trie_t *trie, uint8_t const *key, uint32_t bits)
+{
+	fr_trie_node_ptr_t *path[FR_TRIE_MAX_BITS + 1];
+	fr_trie_node_t *node, *child0, *child1;
+	void *data = NULL;
+	time_t now;
+	int depth = 0;
+
+	if (bits > trie->max_bits) return NULL;
+
+	pthread_mutex_lock(&trie->mutex);
+
+	now = time(NULL);
+	trie_reap(trie, now);
+
+	/*
+	 *	Find the node, remembering the parent pointer of
+	 *	every node on the way down.
+	 */
+	path[0] = &trie->root;
+	while ((node = LOAD(*path[depth])) != NULL) {
+		if ((node->bits > bits) || !trie_match(node->key, key, node->bits)) goto done;
+
+		if (node->bits == bits) break;
+
+		path[depth + 1] = &node->child[trie_bit(key, node->bits)];
+		depth++;
+	}
+	if (!node) goto done;
+
+	data = LOAD(node->data);
+	if (!data) goto done;
+
+	STORE(node->data, NULL);
+	trie->num_elements--;
+
+	/*
+	 *	Prune on the way back up.  A node without data is
+	 *	only needed if it has two children.
+	 */
+	while (depth >= 0) {
+		node = LOAD(*path[depth]);
+		if (LOAD(node->data)) break;
+
+		child0 = LOAD(node->child[0]);
+		child1 = LOAD(node->child[1]);
+		if (child0 && child1) break;
+
+		trie_unlink(trie, path[depth], node, child0 ? child0 : child1, now);
+
+		/*
+		 *	The parent still has the same number of
+		 *	children, so it doesn't need to change.
+		 */
+		if (child0 || child1) break;
+
+		depth--;
+	}
+
+done:
+	pthread_mutex_unlock(&trie->mutex);
+
+	return data;
+}
+
+/** Return the number of prefixes in the trie
+ *
+ */
+uint32_t fr_trie_num_elements(fr_trie_t *trie)
+{
+	return trie->num_elements;
+}
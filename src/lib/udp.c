@@ -239,3 +239,355 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 
 	return received;
 }
+
+#ifdef WITH_UDP_BATCH
+#define UDP_BATCH_CMSG_LEN	(256)
+
+/** A set of datagrams which are received or sent with a single system call
+ *
+ * When receiving, "peer" is the source of each datagram, and "local" is the
+ * address it was received on.  When sending, "peer" is the destination, and
+ * "local" is the (optional) source address.
+ *
+ * A batch is only ever used with one socket, so the address the socket is
+ * bound to is looked up once, and cached.
+ */
+struct udp_batch {
+	unsigned int		num;		//!< Maximum number of datagrams in the batch.
+	unsigned int		count;		//!< Number of datagrams currently in the batch.
+	size_t			data_len;	//!< Size of the buffer for each datagram.
+
+	struct sockaddr_storage	bound;		//!< Address the socket is bound to.
+	socklen_t		sizeof_bound;	//!< Length of the bound address, 0 until it's known.
+
+	struct mmsghdr		*msgvec;	//!< Passed to recvmmsg() / sendmmsg().
+	struct iovec		*iov;		//!< One per datagram, pointing into data.
+	struct sockaddr_storage	*peer;		//!< Remote address of each datagram.
+	struct sockaddr_storage	*local;		//!< Local address of each datagram.
+	socklen_t		*sizeof_local;	//!< Length of each local address, 0 if unset.
+	int			*if_index;	//!< Interface of each datagram.
+	struct timeval		*when;		//!< When each datagram was received.
+
+	uint8_t			*data;		//!< num * data_len bytes of datagram data.
+	uint8_t			*cbuf;		//!< num * UDP_BATCH_CMSG_LEN bytes of control data.
+};
+
+/** Allocate a batch of datagram buffers
+ *
+ * @param[in] ctx to allocate the batch in.
+ * @param[in] num maximum number of datagrams in the batch.
+ * @param[in] data_len maximum size of each datagram.
+ * @return
+ *	- A new batch.
+ *	- NULL on error.
+ */
+udp_batch_t *udp_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t data_len)
+{
+	udp_batch_t *batch;
+
+	if (!num || !data_len) {
+		fr_strerror_printf("Invalid batch size");
+		return NULL;
+	}
+
+	batch = talloc_zero(ctx, udp_batch_t);
+	if (!batch) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		talloc_free(batch);
+		return NULL;
+	}
+
+	batch->num = num;
+	batch->data_len = data_len;
+
+	batch->msgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->peer = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->local = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->sizeof_local = talloc_zero_array(batch, socklen_t, num);
+	batch->if_index = talloc_zero_array(batch, int, num);
+	batch->when = talloc_zero_array(batch, struct timeval, num);
+	batch->data = talloc_array(batch, uint8_t, num * data_len);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDP_BATCH_CMSG_LEN);
+
+	if (!batch->msgvec || !batch->iov || !batch->peer || !batch->local || !batch->sizeof_local ||
+	    !batch->if_index || !batch->when || !batch->data || !batch->cbuf) goto oom;
+
+	return batch;
+}
+
+/** Return the number of datagrams currently held in a batch
+ *
+ */
+unsigned int udp_batch_count(udp_batch_t const *batch)
+{
+	return batch->count;
+}
+
+/** Get the address the socket is bound to, the first time the batch is used
+ *
+ */
+static int udp_batch_bound(int sockfd, udp_batch_t *batch)
+{
+	socklen_t sizeof_bound = sizeof(batch->bound);
+
+	if (batch->sizeof_bound) return 0;
+
+	if (getsockname(sockfd, (struct sockaddr *)&batch->bound, &sizeof_bound) < 0) {
+		fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+		return -1;
+	}
+	batch->sizeof_bound = sizeof_bound;
+
+	return 0;
+}
+
+/** Read as many datagrams as are available, up to the size of the batch
+ *
+ * Does not block.  Any datagrams previously held in the batch are discarded.
+ *
+ * @param[in] sockfd we're reading from.  Must be the same for every call with this batch.
+ * @param[in] batch to read into.
+ * @return
+ *	- >= 0 the number of datagrams read.
+ *	- < 0 on error.
+ */
+int udp_recv_batch(int sockfd, udp_batch_t *batch)
+{
+	struct timeval		now;
+	unsigned int		i;
+	int			received;
+
+	batch->count = 0;
+
+	/*
+	 *	recvmmsg() doesn't provide the local port, so get it
+	 *	(and the bound address) the first time we read.
+	 */
+	if (udp_batch_bound(sockfd, batch) < 0) return -1;
+
+	for (i = 0; i < batch->num; i++) {
+		struct msghdr *msgh = &batch->msgvec[i].msg_hdr;
+
+		batch->iov[i].iov_base = batch->data + (i * batch->data_len);
+		batch->iov[i].iov_len = batch->data_len;
+
+		msgh->msg_name = &batch->peer[i];
+		msgh->msg_namelen = sizeof(batch->peer[i]);
+		msgh->msg_iov = &batch->iov[i];
+		msgh->msg_iovlen = 1;
+		msgh->msg_control = batch->cbuf + (i * UDP_BATCH_CMSG_LEN);
+		msgh->msg_controllen = UDP_BATCH_CMSG_LEN;
+		msgh->msg_flags = 0;
+	}
+
+	received = recvmmsg(sockfd, batch->msgvec, batch->num, MSG_DONTWAIT, NULL);
+	if (received < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("udp_recv_batch failed: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < (unsigned int) received; i++) {
+		batch->local[i] = batch->bound;
+		batch->sizeof_local[i] = batch->sizeof_bound;
+		batch->if_index[i] = 0;
+		batch->when[i].tv_sec = 0;
+
+#ifdef WITH_UDPFROMTO
+		udpfromto_cmsg_dst(&batch->msgvec[i].msg_hdr,
+				   (struct sockaddr *)&batch->local[i], &batch->sizeof_local[i],
+				   &batch->if_index[i], &batch->when[i]);
+#endif
+		if (!batch->when[i].tv_sec) batch->when[i] = now;
+	}
+
+	batch->count = received;
+
+	return received;
+}
+
+/** Get a datagram which was read by udp_recv_batch()
+ *
+ * @param[in] batch to get the datagram from.
+ * @param[in] i index of the datagram.
+ * @param[out] data where the datagram data starts.  Remains owned by the batch,
+ *	and is overwritten by the next call to udp_recv_batch().
+ * @param[out] src_ipaddr of the packet.
+ * @param[out] src_port of the packet.
+ * @param[out] dst_ipaddr of the packet.
+ * @param[out] dst_port of the packet.
+ * @param[out] if_index of the interface that received the packet.
+ * @param[out] when the packet was received.
+ * @return
+ *	- > 0 on success (number of bytes in the datagram).
+ *	- < 0 if the datagram is unusable.
+ */
+ssize_t udp_batch_get(udp_batch_t *batch, unsigned int i, uint8_t **data,
+		      fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+		      fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+		      struct timeval *when)
+{
+	struct msghdr *msgh;
+
+	if (i >= batch->count) {
+		fr_strerror_printf("Invalid datagram index %u", i);
+		return -1;
+	}
+
+	msgh = &batch->msgvec[i].msg_hdr;
+
+	if (!fr_ipaddr_from_sockaddr(&batch->peer[i], msgh->msg_namelen, src_ipaddr, src_port)) {
+		FR_DEBUG_STRERROR_PRINTF("Unknown address family");
+		return -1;
+	}
+
+	if (!fr_ipaddr_from_sockaddr(&batch->local[i], batch->sizeof_local[i], dst_ipaddr, dst_port)) {
+		FR_DEBUG_STRERROR_PRINTF("Unknown address family");
+		return -1;
+	}
+
+	*if_index = batch->if_index[i];
+	*when = batch->when[i];
+	*data = batch->iov[i].iov_base;
+
+	return batch->msgvec[i].msg_len;
+}
+
+/** Copy a datagram into a batch, for sending with udp_send_batch()
+ *
+ * @param[in] batch to add the datagram to.
+ * @param[in] data pointer to data to send.
+ * @param[in] data_len length of data to send.
+ * @param[in] src_ipaddr of the packet.
+ * @param[in] src_port of the packet.
+ * @param[in] if_index of the packet.
+ * @param[in] dst_ipaddr of the packet.
+ * @param[in] dst_port of the packet.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the batch is full, or the datagram can't be added.
+ */
+int udp_batch_add(udp_batch_t *batch, void const *data, size_t data_len,
+		  UDP_UNUSED fr_ipaddr_t *src_ipaddr, UDP_UNUSED uint16_t src_port, int if_index,
+		  fr_ipaddr_t *dst_ipaddr, uint16_t dst_port)
+{
+	unsigned int	i = batch->count;
+	struct msghdr	*msgh;
+	socklen_t	sizeof_peer;
+
+	if (i >= batch->num) {
+		fr_strerror_printf("Batch is full");
+		return -1;
+	}
+
+	if (data_len > batch->data_len) {
+		fr_strerror_printf("Datagram too large for batch, %zu > %zu", data_len, batch->data_len);
+		return -1;
+	}
+
+	if (!fr_ipaddr_to_sockaddr(dst_ipaddr, dst_port, &batch->peer[i], &sizeof_peer)) return -1;
+
+	batch->sizeof_local[i] = 0;
+#ifdef WITH_UDPFROMTO
+	/*
+	 *	And if they don't specify a source IP address, don't
+	 *	use udpfromto.
+	 */
+	if ((src_ipaddr->af != AF_UNSPEC) && (dst_ipaddr->af != AF_UNSPEC) &&
+	    !fr_is_inaddr_any(src_ipaddr)) {
+		fr_ipaddr_to_sockaddr(src_ipaddr, src_port, &batch->local[i], &batch->sizeof_local[i]);
+	}
+#endif
+	batch->if_index[i] = if_index;
+
+	memcpy(batch->data + (i * batch->data_len), data, data_len);
+	batch->iov[i].iov_base = batch->data + (i * batch->data_len);
+	batch->iov[i].iov_len = data_len;
+
+	msgh = &batch->msgvec[i].msg_hdr;
+	memset(msgh, 0, sizeof(*msgh));
+	msgh->msg_name = &batch->peer[i];
+	msgh->msg_namelen = sizeof_peer;
+	msgh->msg_iov = &batch->iov[i];
+	msgh->msg_iovlen = 1;
+
+	batch->count++;
+
+	return 0;
+}
+
+/** Send all of the datagrams in a batch, and empty it
+ *
+ * A datagram which can't be sent is skipped, and the rest of the batch
+ * is still sent.
+ *
+ * @param[in] sockfd we're writing to.  Must be the same for every call with this batch.
+ * @param[in] batch to send.
+ * @return
+ *	- >= 0 the number of datagrams sent.
+ *	- < 0 if one or more datagrams could not be sent.
+ */
+int udp_send_batch(int sockfd, udp_batch_t *batch)
+{
+	unsigned int	i, sent = 0, failed = 0;
+#ifdef WITH_UDPFROMTO
+	bool		bound_any = false;
+	fr_ipaddr_t	bound;
+	uint16_t	port;
+
+	/*
+	 *	Setting the source address only makes sense (and is
+	 *	only permitted on some platforms) for sockets bound
+	 *	to INADDR_ANY.
+	 */
+	if ((udp_batch_bound(sockfd, batch) == 0) &&
+	    fr_ipaddr_from_sockaddr(&batch->bound, batch->sizeof_bound, &bound, &port)) {
+		bound_any = fr_is_inaddr_any(&bound);
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		struct msghdr *msgh = &batch->msgvec[i].msg_hdr;
+
+		if (!bound_any || !batch->sizeof_local[i]) continue;
+
+		msgh->msg_control = batch->cbuf + (i * UDP_BATCH_CMSG_LEN);
+		memset(msgh->msg_control, 0, UDP_BATCH_CMSG_LEN);
+		udpfromto_cmsg_src(msgh, (struct sockaddr *)&batch->local[i], batch->if_index[i]);
+		if (!msgh->msg_controllen) msgh->msg_control = NULL;
+	}
+#endif
+
+	i = 0;
+	while (i < batch->count) {
+		int rcode;
+
+		rcode = sendmmsg(sockfd, batch->msgvec + i, batch->count - i, 0);
+		if (rcode <= 0) {
+			if ((rcode < 0) && (errno == EINTR)) continue;
+
+			/*
+			 *	sendmmsg() stops at the first datagram
+			 *	which fails.  Skip it, and carry on.
+			 */
+			fr_strerror_printf("udp_send_batch failed: %s", fr_syserror(errno));
+			failed++;
+			i++;
+			continue;
+		}
+
+		i += rcode;
+		sent += rcode;
+	}
+
+	batch->count = 0;
+
+	if (failed) return -1;
+
+	return sent;
+}
+#endif
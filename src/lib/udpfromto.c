@@ -157,6 +157,74 @@ int udpfromto_init(int s)
 	return setsockopt(s, proto, flag, &opt, sizeof(opt));
 }
 
+/** Extract the destination address from the control messages of a received datagram
+ *
+ * @param[in] msgh as filled in by recvmsg() or recvmmsg().
+ * @param[in,out] to Destination address.  Must already be initialised with the
+ *	address the socket is bound to, as only the IP address is updated.
+ * @param[out] tolen Length of the structure pointed to by to.
+ * @param[out] if_index The interface which received the datagram (may be NULL).
+ * @param[out] when the packet was received (may be NULL).  Set to zero if no
+ *	SO_TIMESTAMP control message was present.
+ */
+void udpfromto_cmsg_dst(struct msghdr *msgh, struct sockaddr *to, socklen_t *tolen,
+			int *if_index, struct timeval *when)
+{
+	struct cmsghdr *cmsg;
+
+	if (if_index) *if_index = 0;
+	if (when) {
+		when->tv_sec = 0;
+		when->tv_usec = 0;
+	}
+
+	/* Process auxiliary received data in msgh */
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
+			*tolen = sizeof(struct sockaddr_in);
+			if (if_index) *if_index = i->ipi_ifindex;
+			break;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+			((struct sockaddr_in *)to)->sin_addr = *i;
+			*tolen = sizeof(struct sockaddr_in);
+			break;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i =
+				(struct in6_pktinfo *) CMSG_DATA(cmsg);
+			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
+			*tolen = sizeof(struct sockaddr_in6);
+			if (if_index) *if_index = i->ipi6_ifindex;
+			break;
+		}
+#endif
+
+#ifdef SO_TIMESTAMP
+		if (when && (cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == SO_TIMESTAMP)) {
+			memcpy(when, CMSG_DATA(cmsg), sizeof(*when));
+		}
+#endif
+	}
+}
+
 /** Read a packet from a file descriptor, retrieving additional header information
  *
  * Abstracts away the complexity of using the complexity of using recvmsg().
@@ -188,7 +256,6 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 	       int *if_index, struct timeval *when)
 {
 	struct msghdr msgh;
-	struct cmsghdr *cmsg;
 	struct iovec iov;
 	char cbuf[256];
 	int err;
@@ -292,61 +359,83 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 
 	if (fromlen) *fromlen = msgh.msg_namelen;
 
-	if (if_index) *if_index = 0;
-	if (when) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
-	}
+	udpfromto_cmsg_dst(&msgh, to, tolen, if_index, when);
 
-	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh,cmsg)) {
+	if (when && !when->tv_sec) gettimeofday(when, NULL);
 
-#ifdef IP_PKTINFO
-		if ((cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == IP_PKTINFO)) {
-			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
-			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
-			*tolen = sizeof(struct sockaddr_in);
-			if (if_index) *if_index = i->ipi_ifindex;
-			break;
-		}
-#endif
+	return err;
+}
 
-#ifdef IP_RECVDSTADDR
-		if ((cmsg->cmsg_level == IPPROTO_IP) &&
-		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
-			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
-			((struct sockaddr_in *)to)->sin_addr = *i;
-			*tolen = sizeof(struct sockaddr_in);
-			break;
-		}
-#endif
+/** Add a control message to an outbound datagram, setting its source address and interface
+ *
+ * @param[in,out] msgh to add the control message to.  msg_control must point to a
+ *	zeroed buffer of at least 256 bytes.  msg_controllen will be set.
+ * @param[in] from The source address.
+ * @param[in] if_index The interface on which to send the datagram.  If automatic
+ *	interface selection is desired, value should be 0.
+ */
+void udpfromto_cmsg_src(struct msghdr *msgh, struct sockaddr *from, int if_index)
+{
+	msgh->msg_controllen = 0;
 
-#ifdef IPV6_PKTINFO
-		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
-		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
-			struct in6_pktinfo *i =
-				(struct in6_pktinfo *) CMSG_DATA(cmsg);
-			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
-			*tolen = sizeof(struct sockaddr_in6);
-			if (if_index) *if_index = i->ipi6_ifindex;
-			break;
-		}
-#endif
+# if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
+	if (from->sa_family == AF_INET) {
+		struct sockaddr_in *s4 = (struct sockaddr_in *) from;
 
-#ifdef SO_TIMESTAMP
-		if (when && (cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == SO_TIMESTAMP)) {
-			memcpy(when, CMSG_DATA(cmsg), sizeof(*when));
-		}
-#endif
+#  ifdef IP_PKTINFO
+		struct cmsghdr *cmsg;
+		struct in_pktinfo *pkt;
+
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
+
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = SOL_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
+
+		pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->ipi_spec_dst = s4->sin_addr;
+		pkt->ipi_ifindex = if_index;
+#  endif
+
+#  ifdef IP_SENDSRCADDR
+		struct cmsghdr *cmsg;
+		struct in_addr *in;
+
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
+
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_SENDSRCADDR;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
+
+		in = (struct in_addr *) CMSG_DATA(cmsg);
+		*in = s4->sin_addr;
+#  endif
 	}
+#endif
 
-	if (when && !when->tv_sec) gettimeofday(when, NULL);
+#  if defined(IPV6_PKTINFO)
+	if (from->sa_family == AF_INET6) {
+		struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) from;
 
-	return err;
+		struct cmsghdr *cmsg;
+		struct in6_pktinfo *pkt;
+
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
+
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
+
+		pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->ipi6_addr = s6->sin6_addr;
+		pkt->ipi6_ifindex = if_index;
+	}
+#  endif	/* IPV6_PKTINFO */
 }
 
 /** Send packet via a file descriptor, setting the src address and outbound interface
@@ -449,67 +538,8 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 	msgh.msg_name = to;
 	msgh.msg_namelen = tolen;
 
-# if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
-	if (from->sa_family == AF_INET) {
-		struct sockaddr_in *s4 = (struct sockaddr_in *) from;
-
-#  ifdef IP_PKTINFO
-		struct cmsghdr *cmsg;
-		struct in_pktinfo *pkt;
-
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
-
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = SOL_IP;
-		cmsg->cmsg_type = IP_PKTINFO;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
-
-		pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
-		memset(pkt, 0, sizeof(*pkt));
-		pkt->ipi_spec_dst = s4->sin_addr;
-		pkt->ipi_ifindex = if_index;
-#  endif
-
-#  ifdef IP_SENDSRCADDR
-		struct cmsghdr *cmsg;
-		struct in_addr *in;
-
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
-
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = IPPROTO_IP;
-		cmsg->cmsg_type = IP_SENDSRCADDR;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
-
-		in = (struct in_addr *) CMSG_DATA(cmsg);
-		*in = s4->sin_addr;
-#  endif
-	}
-#endif
-
-#  if defined(IPV6_PKTINFO)
-	if (from->sa_family == AF_INET6) {
-		struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) from;
-
-		struct cmsghdr *cmsg;
-		struct in6_pktinfo *pkt;
-
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
-
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = IPPROTO_IPV6;
-		cmsg->cmsg_type = IPV6_PKTINFO;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
-
-		pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
-		memset(pkt, 0, sizeof(*pkt));
-		pkt->ipi6_addr = s6->sin6_addr;
-		pkt->ipi6_ifindex = if_index;
-	}
-#  endif	/* IPV6_PKTINFO */
+	msgh.msg_control = cbuf;
+	udpfromto_cmsg_src(&msgh, from, if_index);
 
 	return sendmsg(s, &msgh, flags);
 }
@@ -5,6 +5,7 @@ SUBMAKEFILES := \
     radmin.mk \
     radattr.mk \
     radwho.mk \
+    radindex.mk \
     radsnmp.mk \
     radlast.mk \
     radtest.mk \
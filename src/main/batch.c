@@ -0,0 +1,197 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Run operations from concurrent requests together.
+ * @file main/batch.c
+ *
+ * Used to group database queries into one transaction, or commands into
+ * one pipeline, without a separate thread to run them.
+ *
+ * A request which adds an operation when no batch is being run runs its
+ * operation straight away, so batching adds no latency when the server is
+ * idle.  Operations added while a batch is being run are queued.  When the
+ * batch finishes, one of the waiting requests takes every queued operation,
+ * and runs them as the next batch.  The other requests wait for it to finish.
+ *
+ * A batch is also started if the queue reaches the maximum size, or if a
+ * request has waited for longer than the maximum latency, so requests don't
+ * queue behind a batch which is slow to complete.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/batch.h>
+
+struct fr_batch {
+	uint32_t		max_size;	//!< Maximum number of operations per batch.
+	struct timeval		max_latency;	//!< Maximum time to wait for a running batch to finish.
+
+	fr_batch_run_t		run;		//!< Runs a batch.
+	void			*uctx;		//!< Passed to run.
+
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	pthread_cond_t		cond;		//!< Signalled when a batch is taken, and when
+						//!< a batch has been run.
+	fr_batch_entry_t	*head;		//!< Queued operations.
+	fr_batch_entry_t	**tail;		//!< Where to add the next operation.
+	uint32_t		num;		//!< Number of queued operations.
+	uint32_t		running;	//!< Number of batches being run.
+};
+
+static int _batch_free(fr_batch_t *batch)
+{
+	pthread_mutex_destroy(&batch->mutex);
+	pthread_cond_destroy(&batch->cond);
+
+	return 0;
+}
+
+/** Allocate a batch queue
+ *
+ * @param[in] ctx to allocate the queue in.
+ * @param[in] max_size Maximum number of operations per batch.
+ * @param[in] max_latency Maximum time an operation waits for a running batch to finish,
+ *	before a new batch is started.
+ * @param[in] run Callback to run a batch.
+ * @param[in] uctx passed to run.
+ * @return new batch queue.
+ */
+fr_batch_t *fr_batch_alloc(TALLOC_CTX *ctx, uint32_t max_size, struct timeval const *max_latency,
+			   fr_batch_run_t run, void *uctx)
+{
+	fr_batch_t *batch;
+
+	rad_assert(max_size > 0);
+
+	MEM(batch = talloc_zero(ctx, fr_batch_t));
+	batch->max_size = max_size;
+	batch->max_latency = *max_latency;
+	batch->run = run;
+	batch->uctx = uctx;
+	batch->tail = &batch->head;
+
+	pthread_mutex_init(&batch->mutex, NULL);
+	pthread_cond_init(&batch->cond, NULL);
+	talloc_set_destructor(batch, _batch_free);
+
+	return batch;
+}
+
+/*
+ *	Remove the queued operations.  Must be called with the mutex held.
+ */
+static fr_batch_entry_t *batch_take(fr_batch_t *batch, uint32_t *num)
+{
+	fr_batch_entry_t *list, *entry;
+
+	list = batch->head;
+	for (entry = list; entry; entry = entry->next) entry->taken = true;
+	*num = batch->num;
+
+	batch->head = NULL;
+	batch->tail = &batch->head;
+	batch->num = 0;
+	batch->running++;
+
+	pthread_cond_broadcast(&batch->cond);
+
+	return list;
+}
+
+/*
+ *	Run a batch, and wake the requests waiting for it, and for
+ *	it to finish.
+ */
+static void batch_run(fr_batch_t *batch, REQUEST *request, fr_batch_entry_t *list, uint32_t num)
+{
+	fr_batch_entry_t *entry;
+
+	batch->run(request, list, num, batch->uctx);
+
+	/*
+	 *	Entries belong to the waiting requests, so can't be
+	 *	touched once they've been marked as done.
+	 */
+	pthread_mutex_lock(&batch->mutex);
+	for (entry = list; entry; entry = entry->next) entry->done = true;
+	batch->running--;
+	pthread_cond_broadcast(&batch->cond);
+	pthread_mutex_unlock(&batch->mutex);
+}
+
+/** Run an operation as part of a batch
+ *
+ * Blocks until the batch containing the operation has been run.  The request
+ * waits for at most the maximum latency before its batch is started, plus the
+ * time taken to run it.
+ *
+ * @param[in] batch queue to add the operation to.
+ * @param[in] request The current request.
+ * @param[in] entry to add.  Must remain valid until this function returns.
+ * @param[in] data Operation to run, passed to the run callback in entry->data.
+ */
+void fr_batch_add(fr_batch_t *batch, REQUEST *request, fr_batch_entry_t *entry, void *data)
+{
+	fr_batch_entry_t	*list;
+	uint32_t		num = 0;
+	struct timeval		now, when_tv;
+	struct timespec		when;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->data = data;
+
+	pthread_mutex_lock(&batch->mutex);
+	*batch->tail = entry;
+	batch->tail = &entry->next;
+	batch->num++;
+
+	/*
+	 *	Nothing to wait for, or nothing more can be added.
+	 */
+	if (!batch->running || (batch->num >= batch->max_size)) goto run;
+
+	gettimeofday(&now, NULL);
+	fr_timeval_add(&when_tv, &now, &batch->max_latency);
+	when.tv_sec = when_tv.tv_sec;
+	when.tv_nsec = when_tv.tv_usec * 1000;
+
+	/*
+	 *	Wait for the running batches to finish, for another
+	 *	request to take the queue, or for the latency to pass.
+	 */
+	RDEBUG3("Waiting for running batch");
+	while (!entry->taken && batch->running) {
+		if (pthread_cond_timedwait(&batch->cond, &batch->mutex, &when) == ETIMEDOUT) break;
+	}
+
+	if (entry->taken) {
+		while (!entry->done) pthread_cond_wait(&batch->cond, &batch->mutex);
+		pthread_mutex_unlock(&batch->mutex);
+		return;
+	}
+
+run:
+	list = batch_take(batch, &num);
+	pthread_mutex_unlock(&batch->mutex);
+
+	batch_run(batch, request, list, num);
+}
@@ -40,9 +40,20 @@ RCSID("$Id$")
 #endif
 #endif
 
+/*
+ *	Clients are kept in longest prefix match tries, one per
+ *	address family and transport protocol.  Clients with
+ *	"proto = *" go into the IPPROTO_IP trie, and match packets
+ *	for any protocol.
+ */
+#ifdef WITH_TCP
+#  define CLIENT_PROTO_MAX (3)
+#else
+#  define CLIENT_PROTO_MAX (1)
+#endif
+
 struct radclient_list {
-	rbtree_t	*trees[129]; /* for 0..128, inclusive. */
-	uint32_t       	min_prefix;
+	fr_trie_t	*tries[2][CLIENT_PROTO_MAX];	/* IPv4 and IPv6 */
 };
 
 
@@ -99,29 +110,79 @@ void client_free(RADCLIENT *client)
 }
 
 /*
- *	Callback for comparing two clients.
+ *	Return the trie index for an address family.
  */
-static int client_ipaddr_cmp(void const *one, void const *two)
+static int client_af_index(int af)
 {
-	RADCLIENT const *a = one;
-	RADCLIENT const *b = two;
-#ifndef WITH_TCP
+	switch (af) {
+	case AF_INET:
+		return 0;
 
-	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
-#else
-	int rcode;
+	case AF_INET6:
+		return 1;
 
-	rcode = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
-	if (rcode != 0) return rcode;
+	default:
+		return -1;
+	}
+}
 
-	/*
-	 *	Wildcard match
-	 */
-	if ((a->proto == IPPROTO_IP) ||
-	    (b->proto == IPPROTO_IP)) return 0;
+/*
+ *	Return the trie index for a protocol.
+ */
+static int client_proto_index(UNUSED int proto)
+{
+#ifdef WITH_TCP
+	switch (proto) {
+	case IPPROTO_UDP:
+		return 1;
+
+	case IPPROTO_TCP:
+		return 2;
 
-	return (a->proto - b->proto);
+	default:
+		break;
+	}
 #endif
+
+	return 0;
+}
+
+/*
+ *	The trie key for an address.
+ */
+static uint8_t const *client_key(fr_ipaddr_t const *ipaddr)
+{
+	if (ipaddr->af == AF_INET) return (uint8_t const *) &ipaddr->ipaddr.ip4addr;
+
+	return (uint8_t const *) &ipaddr->ipaddr.ip6addr;
+}
+
+/*
+ *	Find a client with exactly the same network and protocol.
+ *	Clients with "proto = *" conflict with clients of any
+ *	other protocol.
+ */
+static RADCLIENT *client_find_exact(RADCLIENT_LIST const *clients, RADCLIENT const *client)
+{
+	fr_trie_t * const *tries;
+	RADCLIENT *old;
+	int i, idx;
+
+	i = client_af_index(client->ipaddr.af);
+	if (i < 0) return NULL;
+	tries = clients->tries[i];
+
+	idx = client_proto_index(client->proto);
+
+	for (i = 0; i < CLIENT_PROTO_MAX; i++) {
+		if ((idx != 0) && (i != 0) && (i != idx)) continue;
+		if (!tries[i]) continue;
+
+		old = fr_trie_find(tries[i], client_key(&client->ipaddr), client->ipaddr.prefix);
+		if (old) return old;
+	}
+
+	return NULL;
 }
 
 #ifdef WITH_STATS
@@ -144,9 +205,9 @@ void client_list_free(RADCLIENT_LIST *clients)
 	if (!clients) clients = root_clients;
 	if (!clients) return;	/* Clients may not have been initialised yet */
 
-	for (i = 0; i <= 128; i++) {
-		if (clients->trees[i]) rbtree_free(clients->trees[i]);
-		clients->trees[i] = NULL;
+	for (i = 0; i < CLIENT_PROTO_MAX; i++) {
+		TALLOC_FREE(clients->tries[0][i]);
+		TALLOC_FREE(clients->tries[1][i]);
 	}
 
 	if (clients == root_clients) {
@@ -176,8 +237,6 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 
 	if (!clients) return NULL;
 
-	clients->min_prefix = 128;
-
 	return clients;
 }
 
@@ -192,6 +251,8 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
 	RADCLIENT *old;
+	fr_trie_t **tries;
+	int af, idx;
 	char buffer[FR_IPADDR_PREFIX_STRLEN];
 
 	if (!client) return false;
@@ -280,11 +341,17 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	}
 
 	/*
-	 *	Create a tree for it.
+	 *	Create a trie for it.
 	 */
-	if (!clients->trees[client->ipaddr.prefix]) {
-		clients->trees[client->ipaddr.prefix] = rbtree_create(clients, client_ipaddr_cmp, NULL, 0);
-		if (!clients->trees[client->ipaddr.prefix]) {
+	af = client_af_index(client->ipaddr.af);
+	if (af < 0) return false;
+
+	tries = clients->tries[af];
+	idx = client_proto_index(client->proto);
+	if (!tries[idx]) {
+		tries[idx] = fr_trie_create(clients, (client->ipaddr.af == AF_INET) ? 32 : 128);
+		if (!tries[idx]) {
+			ERROR("Failed creating client trie: %s", fr_strerror());
 			return false;
 		}
 	}
@@ -294,7 +361,7 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	/*
 	 *	Cannot insert the same client twice.
 	 */
-	old = rbtree_finddata(clients->trees[client->ipaddr.prefix], client);
+	old = client_find_exact(clients, client);
 	if (old) {
 		/*
 		 *	If it's a complete duplicate, then free the new
@@ -328,7 +395,8 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	/*
 	 *	Other error adding client: likely is fatal.
 	 */
-	if (!rbtree_insert(clients->trees[client->ipaddr.prefix], client)) {
+	if (fr_trie_insert(tries[idx], client_key(&client->ipaddr), client->ipaddr.prefix, client) < 0) {
+		ERROR("Failed to add client %s: %s", client->shortname, fr_strerror());
 		return false;
 	}
 
@@ -364,10 +432,6 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	if (tree_num) rbtree_insert(tree_num, client);
 #endif
 
-	if (client->ipaddr.prefix < clients->min_prefix) {
-		clients->min_prefix = client->ipaddr.prefix;
-	}
-
 	(void) talloc_steal(clients, client); /* reparent it */
 
 	return true;
@@ -377,6 +441,8 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 #ifdef WITH_DYNAMIC_CLIENTS
 void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
+	int af, idx;
+
 	if (!client) return;
 
 	if (!clients) clients = root_clients;
@@ -390,7 +456,18 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 #ifdef WITH_STATS
 	rbtree_deletebydata(tree_num, client);
 #endif
-	rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+
+	/*
+	 *	Lookups in other threads may still be using the
+	 *	client.  client_free() delays freeing it.
+	 */
+	af = client_af_index(client->ipaddr.af);
+	if (af < 0) return;
+
+	idx = client_proto_index(client->proto);
+	if (clients->tries[af][idx]) {
+		fr_trie_remove(clients->tries[af][idx], client_key(&client->ipaddr), client->ipaddr.prefix);
+	}
 }
 #endif
 
@@ -425,45 +502,61 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
 #endif
 
 
+/*
+ *	IPv6 clients are also matched on the scope ID.
+ */
+static bool client_zone_match(void const *uctx, void const *data)
+{
+	fr_ipaddr_t const *ipaddr = uctx;
+	RADCLIENT const *client = data;
+
+	if (ipaddr->af != AF_INET6) return true;
+
+	return (client->ipaddr.zone_id == ipaddr->zone_id);
+}
+
 /*
  *	Find a client in the RADCLIENTS list.
+ *
+ *	This does not lock the list, and is safe to call while
+ *	another thread adds or deletes clients.
  */
 RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
 {
-	int32_t i, max_prefix;
-	RADCLIENT myclient;
+	fr_trie_t * const *tries;
+	RADCLIENT *client, *found = NULL;
+	uint32_t bits, found_bits = 0;
+	int i, idx;
 
 	if (!clients) clients = root_clients;
 
 	if (!clients || !ipaddr) return NULL;
 
-	switch (ipaddr->af) {
-	case AF_INET:
-		max_prefix = 32;
-		break;
-
-	case AF_INET6:
-		max_prefix = 128;
-		break;
-
-	default :
-		return NULL;
-	}
+	i = client_af_index(ipaddr->af);
+	if (i < 0) return NULL;
+	tries = clients->tries[i];
 
-	for (i = max_prefix; i >= (int32_t) clients->min_prefix; i--) {
-		void *data;
+	/*
+	 *	Look in the trie for the protocol, and in the trie
+	 *	for "proto = *".  The longest prefix wins.  A lookup
+	 *	for IPPROTO_IP matches clients of any protocol.
+	 */
+	idx = client_proto_index(proto);
 
-		if (!clients->trees[i]) continue;
+	for (i = 0; i < CLIENT_PROTO_MAX; i++) {
+		if ((idx != 0) && (i != 0) && (i != idx)) continue;
+		if (!tries[i]) continue;
 
-		myclient.ipaddr = *ipaddr;
-		myclient.proto = proto;
-		fr_ipaddr_mask(&myclient.ipaddr, i);
+		client = fr_trie_lookup(tries[i], client_key(ipaddr), &bits, client_zone_match, ipaddr);
+		if (!client) continue;
 
-		data = rbtree_finddata(clients->trees[i], &myclient);
-		if (data) return data;
+		if (!found || (bits > found_bits)) {
+			found = client;
+			found_bits = bits;
+		}
 	}
 
-	return NULL;
+	return found;
 }
 
 /*
@@ -2582,6 +2582,8 @@ static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
 		cprintf(listener, "packets\t0\n");
 		cprintf(listener, "tries\t0\n");
 		cprintf(listener, "offset\t0\n");
+		cprintf(listener, "acked\t0\n");
+		cprintf(listener, "outstanding\t0\n");
 		cprintf(listener, "size\t0\n");
 		return CMD_OK;
 	}
@@ -2589,6 +2591,8 @@ static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
 	cprintf(listener, "packets\t%d\n", data->packets);
 	cprintf(listener, "tries\t%d\n", data->tries);
 	cprintf(listener, "offset\t%u\n", (unsigned int) data->offset);
+	cprintf(listener, "acked\t%u\n", (unsigned int) data->acked_offset);
+	cprintf(listener, "outstanding\t%d\n", data->outstanding);
 	cprintf(listener, "size\t%u\n", (unsigned int) buf.st_size);
 
 	return CMD_OK;
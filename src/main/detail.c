@@ -62,13 +62,42 @@ static FR_NAME_NUMBER state_names[] = {
 
 
 /*
- *	If we're limiting outstanding packets, then mark the response
- *	as being sent.
+ *	Sent from the threads processing requests to the reader
+ *	thread, when a request from the detail file is done.
+ *
+ *	Writes of less than PIPE_BUF bytes to a pipe are atomic, so
+ *	many threads can send acks at the same time.
+ */
+typedef struct detail_ack_t {
+	uint32_t		seq;		//!< Sequence number of the packet the ack is for.
+	detail_entry_state_t	state;		//!< STATE_REPLIED or STATE_NO_REPLY.
+	int			rtt;		//!< Round trip time in microseconds, or -1 if unknown.
+} detail_ack_t;
+
+/*
+ *	The packet ID, ports and destination address of packets
+ *	read from the detail file are generated from a counter, so
+ *	together they give the sequence number of the packet.
+ *
+ *	Packets are freed before their ack is processed, so their
+ *	address can't be used to identify them.
+ */
+static uint32_t detail_packet_seq(RADIUS_PACKET const *packet)
+{
+	return (packet->id & 0xff) |
+	       (((packet->src_port - 1024) & 0xff) << 8) |
+	       (((packet->dst_port - 1024) & 0xff) << 16) |
+	       ((ntohl(packet->dst_ipaddr.ipaddr.ip4addr.s_addr) & 0xff) << 24);
+}
+
+/*
+ *	Tell the reader thread that we're done with a request, so
+ *	that it can either move on, or retry the entry.
  */
 int detail_send(rad_listen_t *listener, REQUEST *request)
 {
-	char c = 0;
 	listen_detail_t *data = listener->data;
+	detail_ack_t ack = { .seq = detail_packet_seq(request->packet), .rtt = -1 };
 
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == detail_send);
@@ -78,44 +107,14 @@ int detail_send(rad_listen_t *listener, REQUEST *request)
 	 *	caller it's OK to read more "detail" file stuff.
 	 */
 	if (request->reply->code == 0) {
-		data->delay_time = data->retry_interval * USEC;
-		data->signal = 1;
-		data->entry_state = STATE_NO_REPLY;
+		ack.state = STATE_NO_REPLY;
 
 		RDEBUG("detail (%s): No response to request.  Will retry in %d seconds",
 		       data->name, data->retry_interval);
 	} else {
-		int rtt;
 		struct timeval now;
-		/*
-		 *	We call gettimeofday a lot.  But it should be OK,
-		 *	because there's nothing else to do.
-		 */
-		gettimeofday(&now, NULL);
 
-		/*
-		 *	If we haven't sent a packet in the last second, reset
-		 *	the RTT.
-		 */
-		now.tv_sec -= 1;
-		if (timercmp(&data->last_packet, &now, <)) {
-			data->has_rtt = false;
-		}
-		now.tv_sec += 1;
-
-		/*
-		 *	Only one detail packet may be outstanding at a time,
-		 *	so it's safe to update some entries in the detail
-		 *	structure.
-		 *
-		 *	We keep smoothed round trip time (SRTT), but not round
-		 *	trip timeout (RTO).  We use SRTT to calculate a rough
-		 *	load factor.
-		 */
-		rtt = now.tv_sec - request->packet->timestamp.tv_sec;
-		rtt *= USEC;
-		rtt += now.tv_usec;
-		rtt -= request->packet->timestamp.tv_usec;
+		gettimeofday(&now, NULL);
 
 		/*
 		 *	If we're proxying, the RTT is our processing time,
@@ -127,48 +126,85 @@ int detail_send(rad_listen_t *listener, REQUEST *request)
 		 *	So, to be safe, we over-estimate the total cost of
 		 *	processing the packet.
 		 */
-		if (!data->has_rtt) {
-			data->has_rtt = true;
-			data->srtt = rtt;
-			data->rttvar = rtt / 2;
+		ack.state = STATE_REPLIED;
+		ack.rtt = now.tv_sec - request->packet->timestamp.tv_sec;
+		ack.rtt *= USEC;
+		ack.rtt += now.tv_usec;
+		ack.rtt -= request->packet->timestamp.tv_usec;
 
-		} else {
-			data->rttvar -= data->rttvar >> 2;
-			data->rttvar += (data->srtt - rtt);
-			data->srtt -= data->srtt >> 3;
-			data->srtt += rtt >> 3;
-		}
+		RDEBUG3("detail (%s): Received response for request %" PRIu64, data->name, request->number);
+	}
 
-		/*
-		 *	Calculate the time we wait before sending the next
-		 *	packet.
-		 *
-		 *	rtt / (rtt + delay) = load_factor / 100
-		 */
-		data->delay_time = (data->srtt * (100 - data->load_factor)) / (data->load_factor);
+	if (write(data->child_pipe[1], &ack, sizeof(ack)) < 0) {
+		RERROR("detail (%s): Failed writing ack to reader thread: %s", data->name, fr_syserror(errno));
+	}
 
-		/*
-		 *	Cap delay at no less than 4 packets/s.  If the
-		 *	end system can't handle this, then it's very
-		 *	broken.
-		 */
-		if (data->delay_time > (USEC / 4)) data->delay_time= USEC / 4;
+	return 0;
+}
 
-		RDEBUG3("detail (%s): Received response for request %" PRIu64 ".  "
-			"Will read the next packet in %d seconds",
-			data->name, request->number, data->delay_time / USEC);
+/*
+ *	Update the smoothed round trip time, and the delay between
+ *	reading entries.  Only called from the reader thread.
+ */
+static void detail_rtt_update(listen_detail_t *data, int rtt)
+{
+	struct timeval now;
+
+	/*
+	 *	We call gettimeofday a lot.  But it should be OK,
+	 *	because there's nothing else to do.
+	 */
+	gettimeofday(&now, NULL);
 
-		data->last_packet = now;
-		data->signal = 1;
-		data->entry_state = STATE_REPLIED;
-		data->counter++;
+	/*
+	 *	If we haven't sent a packet in the last second, reset
+	 *	the RTT.
+	 */
+	now.tv_sec -= 1;
+	if (timercmp(&data->last_packet, &now, <)) {
+		data->has_rtt = false;
 	}
+	now.tv_sec += 1;
 
-	if (write(data->child_pipe[1], &c, 1) < 0) {
-		RERROR("detail (%s): Failed writing ack to reader thread: %s", data->name, fr_syserror(errno));
+	/*
+	 *	We keep smoothed round trip time (SRTT), but not round
+	 *	trip timeout (RTO).  We use SRTT to calculate a rough
+	 *	load factor.
+	 */
+	if (!data->has_rtt) {
+		data->has_rtt = true;
+		data->srtt = rtt;
+		data->rttvar = rtt / 2;
+
+	} else {
+		data->rttvar -= data->rttvar >> 2;
+		data->rttvar += (data->srtt - rtt);
+		data->srtt -= data->srtt >> 3;
+		data->srtt += rtt >> 3;
 	}
 
-	return 0;
+	/*
+	 *	Calculate the time we wait before sending the next
+	 *	packet.
+	 *
+	 *	rtt / (rtt + delay) = load_factor / 100
+	 *
+	 *	With a window of entries in flight, each entry only
+	 *	has to account for its share of the load.
+	 */
+	data->delay_time = (data->srtt * (100 - data->load_factor)) /
+			   (data->load_factor * data->max_outstanding);
+
+	/*
+	 *	Cap delay at no less than 4 packets/s.  If the
+	 *	end system can't handle this, then it's very
+	 *	broken.
+	 */
+	if (data->delay_time > (USEC / 4)) data->delay_time= USEC / 4;
+
+	DEBUG3("detail (%s): Will read the next packet in %d seconds", data->name, data->delay_time / USEC);
+
+	data->last_packet = now;
 }
 
 
@@ -285,11 +321,16 @@ static int detail_open(rad_listen_t *this)
 
 	data->client_ip.af = AF_UNSPEC;
 	data->timestamp = 0;
-	data->offset = data->last_offset = data->timestamp_offset = 0;
+	data->offset = data->last_offset = data->entry_offset = data->timestamp_offset = 0;
+	data->acked_offset = 0;
 	data->packets = 0;
 	data->tries = 0;
 	data->done_entry = false;
 
+	rad_assert(data->outstanding == 0);
+	data->head = 0;
+	data->file_done = false;
+
 	return 1;
 }
 
@@ -311,11 +352,11 @@ static int detail_open(rad_listen_t *this)
  */
 int detail_recv(rad_listen_t *listener)
 {
-	char c = 0;
 	ssize_t rcode;
 	RADIUS_PACKET *packet;
 	listen_detail_t *data = listener->data;
 	RAD_REQUEST_FUNP fun = NULL;
+	detail_ack_t ack = { .rtt = -1 };
 
 	/*
 	 *	Block until there's a packet ready.
@@ -323,6 +364,8 @@ int detail_recv(rad_listen_t *listener)
 	rcode = read(data->master_pipe[0], &packet, sizeof(packet));
 	if (rcode <= 0) return rcode;
 
+	ack.seq = detail_packet_seq(packet);
+
 	if (DEBUG_ENABLED2) {
 		VALUE_PAIR *vp;
 		vp_cursor_t cursor;
@@ -347,16 +390,16 @@ int detail_recv(rad_listen_t *listener)
 		break;
 
 	default:
-		data->entry_state = STATE_REPLIED;
+		ack.state = STATE_REPLIED;
 		goto signal_thread;
 	}
 
 	if (!request_receive(NULL, listener, packet, &data->detail_client, fun)) {
-		data->entry_state = STATE_NO_REPLY;	/* try again later */
+		ack.state = STATE_NO_REPLY;	/* try again later */
 
 	signal_thread:
 		fr_radius_free(&packet);
-		if (write(data->child_pipe[1], &c, 1) < 0) {
+		if (write(data->child_pipe[1], &ack, sizeof(ack)) < 0) {
 			ERROR("detail (%s): Failed writing ack to reader thread: %s", data->name,
 			      fr_syserror(errno));
 		}
@@ -368,14 +411,305 @@ int detail_recv(rad_listen_t *listener)
 	return 0;
 }
 
+/*
+ *	Find an entry in the window which needs to be sent again,
+ *	because the server didn't reply to it, or because it's been
+ *	running for too long.
+ */
+static detail_entry_t *detail_entry_retry(listen_detail_t *data)
+{
+	int		i;
+	time_t		now = time(NULL);
+	detail_entry_t	*entry;
+
+	for (i = 0; i < data->outstanding; i++) {
+		entry = &data->entries[(data->head + i) % data->max_outstanding];
+
+		switch (entry->state) {
+		case STATE_RUNNING:
+			if (now < (entry->running + (int)data->retry_interval)) continue;
+
+			DEBUG("detail (%s): No response to detail request.  Retrying", data->name);
+			return entry;
+
+		/*
+		 *	If there's no reply, keep retransmitting
+		 *	the entry forever, waiting retry_interval
+		 *	between attempts.  The rest of the window
+		 *	carries on in the meantime.
+		 */
+		case STATE_NO_REPLY:
+			if (now < (entry->running + (int)data->retry_interval)) continue;
+			return entry;
+
+		default:
+			continue;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *	Create a packet from an entry in the window.
+ */
+static RADIUS_PACKET *detail_packet_alloc(listen_detail_t *data, detail_entry_t *entry)
+{
+	VALUE_PAIR	*vp;
+	RADIUS_PACKET	*packet;
+	time_t		timestamp = entry->timestamp;
+
+	entry->tries++;
+	data->tries = entry->tries;
+
+	/*
+	 *	Allocate the packet.  If we fail, it's a serious
+	 *	problem.
+	 */
+	packet = fr_radius_alloc(NULL, true);
+	if (!packet) {
+		ERROR("detail (%s): FATAL: Failed allocating memory for detail", data->name);
+		fr_exit(1);
+	}
+
+	memset(packet, 0, sizeof(*packet));
+	packet->sockfd = -1;
+	packet->src_ipaddr.af = AF_INET;
+	packet->src_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_NONE);
+
+	/*
+	 *	If everything's OK, this is a waste of memory.
+	 *	Otherwise, it lets us re-send the original packet
+	 *	contents, unmolested.
+	 */
+	packet->vps = fr_pair_list_copy(packet, entry->vps);
+
+	packet->code = PW_CODE_ACCOUNTING_REQUEST;
+	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TYPE, TAG_ANY);
+	if (vp) packet->code = vp->vp_integer;
+
+	gettimeofday(&packet->timestamp, NULL);
+
+	/*
+	 *	Remember where it came from, so that we don't
+	 *	proxy it to the place it came from...
+	 */
+	if (entry->client_ip.af != AF_UNSPEC) {
+		packet->src_ipaddr = entry->client_ip;
+	}
+
+	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IP_ADDRESS, TAG_ANY);
+	if (vp) {
+		packet->src_ipaddr.af = AF_INET;
+		packet->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+		packet->src_ipaddr.prefix = 32;
+	} else {
+		vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IPV6_ADDRESS, TAG_ANY);
+		if (vp) {
+			packet->src_ipaddr.af = AF_INET6;
+			memcpy(&packet->src_ipaddr.ipaddr.ip6addr,
+			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
+			packet->src_ipaddr.prefix = 128;
+		}
+	}
+
+	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_DST_IP_ADDRESS, TAG_ANY);
+	if (vp) {
+		packet->dst_ipaddr.af = AF_INET;
+		packet->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+		packet->dst_ipaddr.prefix = 32;
+	} else {
+		vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_DST_IPV6_ADDRESS, TAG_ANY);
+		if (vp) {
+			packet->dst_ipaddr.af = AF_INET6;
+			memcpy(&packet->dst_ipaddr.ipaddr.ip6addr,
+			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
+			packet->dst_ipaddr.prefix = 128;
+		}
+	}
+
+	/*
+	 *	Generate packet ID, ports, IP via a counter.
+	 */
+	packet->id = data->counter & 0xff;
+	packet->src_port = 1024 + ((data->counter >> 8) & 0xff);
+	packet->dst_port = 1024 + ((data->counter >> 16) & 0xff);
+
+	packet->dst_ipaddr.af = AF_INET;
+	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((data->counter >> 24) & 0xff));
+
+	/*
+	 *	Create / update accounting attributes.
+	 */
+	if (packet->code == PW_CODE_ACCOUNTING_REQUEST) {
+		/*
+		 *	Prefer the Event-Timestamp in the packet, if it
+		 *	exists.  That is when the event occurred, whereas the
+		 *	"Timestamp" field is when we wrote the packet to the
+		 *	detail file, which could have been much later.
+		 */
+		vp = fr_pair_find_by_num(packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY);
+		if (vp) {
+			timestamp = vp->vp_integer;
+		}
+
+		/*
+		 *	Look for Acct-Delay-Time, and update
+		 *	based on Acct-Delay-Time += (time(NULL) - timestamp)
+		 */
+		vp = fr_pair_find_by_num(packet->vps, 0, PW_ACCT_DELAY_TIME, TAG_ANY);
+		if (!vp) {
+			vp = fr_pair_afrom_num(packet, 0, PW_ACCT_DELAY_TIME);
+			rad_assert(vp != NULL);
+			fr_pair_add(&packet->vps, vp);
+		}
+		if (timestamp != 0) {
+			vp->vp_integer += time(NULL) - timestamp;
+		}
+	}
+
+	/*
+	 *	Set the transmission count.
+	 */
+	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TRANSMIT_COUNTER, TAG_ANY);
+	if (!vp) {
+		vp = fr_pair_afrom_num(packet, 0, PW_PACKET_TRANSMIT_COUNTER);
+		rad_assert(vp != NULL);
+		fr_pair_add(&packet->vps, vp);
+	}
+	vp->vp_integer = entry->tries;
+
+	entry->state = STATE_RUNNING;
+	entry->running = packet->timestamp.tv_sec;
+	entry->seq = data->counter;
+	data->counter++;
+
+	return packet;
+}
+
+/*
+ *	Handle an ack for a packet sent from the reader thread.
+ *
+ *	Returns true if the entry was processed, in which case the
+ *	reader should pace itself before sending more.
+ */
+static bool detail_ack(listen_detail_t *data, detail_ack_t const *ack)
+{
+	int		i;
+	detail_entry_t	*entry = NULL;
+
+	for (i = 0; i < data->outstanding; i++) {
+		entry = &data->entries[(data->head + i) % data->max_outstanding];
+
+		if ((entry->state == STATE_RUNNING) && (entry->seq == ack->seq)) break;
+	}
+
+	/*
+	 *	An ack for a packet we've since retried.
+	 */
+	if (i == data->outstanding) {
+		DEBUG3("detail (%s): Ignoring ack for old packet", data->name);
+		return false;
+	}
+
+	/*
+	 *	Retry the entry later, without holding up the rest
+	 *	of the window.
+	 */
+	if (ack->state == STATE_NO_REPLY) {
+		entry->state = STATE_NO_REPLY;
+		entry->running = time(NULL);
+		return false;
+	}
+
+	if (ack->rtt >= 0) detail_rtt_update(data, ack->rtt);
+
+	entry->state = STATE_REPLIED;
+
+	if (data->track) {
+		rad_assert(data->fp != NULL);
+
+		if (fseek(data->fp, entry->timestamp_offset, SEEK_SET) < 0) {
+			WARN("detail (%s): Failed seeking to timestamp offset: %s",
+			     data->name, fr_syserror(errno));
+		} else if (fwrite("\tDone", 1, 5, data->fp) < 5) {
+			WARN("detail (%s): Failed marking request as done: %s",
+			     data->name, fr_syserror(errno));
+		} else if (fflush(data->fp) != 0) {
+			WARN("detail (%s): Failed flushing marked detail file to disk: %s",
+			     data->name, fr_syserror(errno));
+		}
+
+		if (fseek(data->fp, data->offset, SEEK_SET) < 0) {
+			WARN("detail (%s): Failed seeking to next detail request: %s",
+			     data->name, fr_syserror(errno));
+		}
+	}
+
+	fr_pair_list_free(&entry->vps);
+
+	/*
+	 *	Move the low-water mark past every entry at the start
+	 *	of the window which has been acknowledged.  The file
+	 *	isn't removed until the window is empty.
+	 */
+	while (data->outstanding > 0) {
+		entry = &data->entries[data->head];
+		if (entry->state != STATE_REPLIED) break;
+
+		data->acked_offset = entry->end;
+		data->head = (data->head + 1) % data->max_outstanding;
+		data->outstanding--;
+	}
+
+	return true;
+}
+
+/*
+ *	Process every ack waiting in the pipe, without blocking.
+ *
+ *	This has to be done before each write to the master, as
+ *	the master blocks writing acks if the pipe fills up, and so
+ *	stops reading packets.
+ *
+ *	Returns true if any entries were processed.
+ */
+static bool detail_ack_drain(listen_detail_t *data)
+{
+	detail_ack_t	ack;
+	ssize_t		rcode;
+	bool		processed = false;
+
+	while ((rcode = read(data->child_pipe[0], &ack, sizeof(ack))) == sizeof(ack)) {
+		if (detail_ack(data, &ack)) processed = true;
+	}
+
+	if ((rcode < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+		ERROR("detail (%s): Failed getting detail packet ack from master: %s",
+		      data->name, fr_syserror(errno));
+	}
+
+	return processed;
+}
+
+/*
+ *	Return the next packet to send.  Entries which need to be
+ *	retried are sent first.  Then, if the window isn't full, we
+ *	read a new entry from the detail file.
+ */
 static RADIUS_PACKET *detail_poll(rad_listen_t *listener)
 {
 	char		key[256], op[8], value[1024];
 	vp_cursor_t	cursor;
 	VALUE_PAIR	*vp;
-	RADIUS_PACKET	*packet;
 	char		buffer[2048];
 	listen_detail_t *data = listener->data;
+	detail_entry_t	*entry;
+
+	entry = detail_entry_retry(data);
+	if (entry) return detail_packet_alloc(data, entry);
+
+	if (data->outstanding >= (int)data->max_outstanding) return NULL;
 
 	switch (data->file_state) {
 	case STATE_UNOPENED:
@@ -448,13 +782,19 @@ open_file:
 	}
 
 
+	/*
+	 *	We've read everything we're going to from the file.
+	 *	It can be removed once every entry in it has been
+	 *	acknowledged.
+	 */
+	if (data->file_done) goto cleanup;
+
 	switch (data->entry_state) {
 	case STATE_HEADER:
 	do_header:
 		data->done_entry = false;
 		data->timestamp_offset = 0;
 
-		data->tries = 0;
 		if (!data->fp) {
 			data->file_state = STATE_UNOPENED;
 			goto open_file;
@@ -480,12 +820,16 @@ open_file:
 		 */
 		if (feof(data->fp)) {
 		cleanup:
+			data->file_done = true;
+			if (data->outstanding > 0) return NULL;
+
 			DEBUG("detail (%s): Unlinking %s", data->name, data->filename_work);
 			unlink(data->filename_work);
 			if (data->fp) fclose(data->fp);
 			data->fp = NULL;
 			data->work_fd = -1;
 			data->file_state = STATE_UNOPENED;
+			data->file_done = false;
 			rad_assert(data->vps == NULL);
 
 			if (data->one_shot) {
@@ -516,53 +860,12 @@ open_file:
 		goto alloc_packet;
 
 	/*
-	 *	Periodically check what's going on.
-	 *	If the request is taking too long,
-	 *	retry it.
+	 *	These states are only used by entries in the
+	 *	window.
 	 */
 	case STATE_RUNNING:
-		if (time(NULL) < (data->running + (int)data->retry_interval)) {
-			return NULL;
-		}
-
-		DEBUG("detail (%s): No response to detail request.  Retrying", data->name);
-		/* FALL-THROUGH */
-
-	/*
-	 *	If there's no reply, keep
-	 *	retransmitting the current packet
-	 *	forever.
-	 */
 	case STATE_NO_REPLY:
-		data->entry_state = STATE_QUEUED;
-		goto alloc_packet;
-
-	/*
-	 *	We have a reply.  Clean up the old
-	 *	request, and go read another one.
-	 */
 	case STATE_REPLIED:
-		if (data->track) {
-			rad_assert(data->fp != NULL);
-
-			if (fseek(data->fp, data->timestamp_offset, SEEK_SET) < 0) {
-				WARN("detail (%s): Failed seeking to timestamp offset: %s",
-				     data->name, fr_syserror(errno));
-			} else if (fwrite("\tDone", 1, 5, data->fp) < 5) {
-				WARN("detail (%s): Failed marking request as done: %s",
-				     data->name, fr_syserror(errno));
-			} else if (fflush(data->fp) != 0) {
-				WARN("detail (%s): Failed flushing marked detail file to disk: %s",
-				     data->name, fr_syserror(errno));
-			}
-
-			if (fseek(data->fp, data->offset, SEEK_SET) < 0) {
-				WARN("detail (%s): Failed seeking to next detail request: %s",
-				     data->name, fr_syserror(errno));
-			}
-		}
-
-		fr_pair_list_free(&data->vps);
 		data->entry_state = STATE_HEADER;
 		goto do_header;
 	}
@@ -606,6 +909,7 @@ open_file:
 
 			if (sscanf(buffer, "%*s %*s %*d %*d:%*d:%*d %d", &y)) {
 				data->entry_state = STATE_VPS;
+				data->entry_offset = data->last_offset;
 			}
 			continue;
 		}
@@ -694,7 +998,6 @@ open_file:
 	 */
 	if (ferror(data->fp)) goto cleanup;
 
-	data->tries = 0;
 	data->packets++;
 
 	/*
@@ -708,8 +1011,6 @@ open_file:
 		goto do_header;
 	}
 
-	data->tries++;
-
 	/*
 	 *	The writer doesn't check that the record was
 	 *	completely written.  If the disk is full, this can
@@ -734,126 +1035,22 @@ open_file:
 	}
 
 	/*
-	 *	Allocate the packet.  If we fail, it's a serious
-	 *	problem.
+	 *	Add the entry to the window.
 	 */
-	packet = fr_radius_alloc(NULL, true);
-	if (!packet) {
-		ERROR("detail (%s): FATAL: Failed allocating memory for detail", data->name);
-		fr_exit(1);
-	}
-
-	memset(packet, 0, sizeof(*packet));
-	packet->sockfd = -1;
-	packet->src_ipaddr.af = AF_INET;
-	packet->src_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_NONE);
-
-	/*
-	 *	If everything's OK, this is a waste of memory.
-	 *	Otherwise, it lets us re-send the original packet
-	 *	contents, unmolested.
-	 */
-	packet->vps = fr_pair_list_copy(packet, data->vps);
-
-	packet->code = PW_CODE_ACCOUNTING_REQUEST;
-	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TYPE, TAG_ANY);
-	if (vp) packet->code = vp->vp_integer;
-
-	gettimeofday(&packet->timestamp, NULL);
-
-	/*
-	 *	Remember where it came from, so that we don't
-	 *	proxy it to the place it came from...
-	 */
-	if (data->client_ip.af != AF_UNSPEC) {
-		packet->src_ipaddr = data->client_ip;
-	}
-
-	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IP_ADDRESS, TAG_ANY);
-	if (vp) {
-		packet->src_ipaddr.af = AF_INET;
-		packet->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
-		packet->src_ipaddr.prefix = 32;
-	} else {
-		vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IPV6_ADDRESS, TAG_ANY);
-		if (vp) {
-			packet->src_ipaddr.af = AF_INET6;
-			memcpy(&packet->src_ipaddr.ipaddr.ip6addr,
-			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
-			packet->src_ipaddr.prefix = 128;
-		}
-	}
-
-	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_DST_IP_ADDRESS, TAG_ANY);
-	if (vp) {
-		packet->dst_ipaddr.af = AF_INET;
-		packet->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
-		packet->dst_ipaddr.prefix = 32;
-	} else {
-		vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_DST_IPV6_ADDRESS, TAG_ANY);
-		if (vp) {
-			packet->dst_ipaddr.af = AF_INET6;
-			memcpy(&packet->dst_ipaddr.ipaddr.ip6addr,
-			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
-			packet->dst_ipaddr.prefix = 128;
-		}
-	}
-
-	/*
-	 *	Generate packet ID, ports, IP via a counter.
-	 */
-	packet->id = data->counter & 0xff;
-	packet->src_port = 1024 + ((data->counter >> 8) & 0xff);
-	packet->dst_port = 1024 + ((data->counter >> 16) & 0xff);
-
-	packet->dst_ipaddr.af = AF_INET;
-	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((data->counter >> 24) & 0xff));
-
-	/*
-	 *	Create / update accounting attributes.
-	 */
-	if (packet->code == PW_CODE_ACCOUNTING_REQUEST) {
-		/*
-		 *	Prefer the Event-Timestamp in the packet, if it
-		 *	exists.  That is when the event occurred, whereas the
-		 *	"Timestamp" field is when we wrote the packet to the
-		 *	detail file, which could have been much later.
-		 */
-		vp = fr_pair_find_by_num(packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY);
-		if (vp) {
-			data->timestamp = vp->vp_integer;
-		}
-
-		/*
-		 *	Look for Acct-Delay-Time, and update
-		 *	based on Acct-Delay-Time += (time(NULL) - timestamp)
-		 */
-		vp = fr_pair_find_by_num(packet->vps, 0, PW_ACCT_DELAY_TIME, TAG_ANY);
-		if (!vp) {
-			vp = fr_pair_afrom_num(packet, 0, PW_ACCT_DELAY_TIME);
-			rad_assert(vp != NULL);
-			fr_pair_add(&packet->vps, vp);
-		}
-		if (data->timestamp != 0) {
-			vp->vp_integer += time(NULL) - data->timestamp;
-		}
-	}
-
-	/*
-	 *	Set the transmission count.
-	 */
-	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TRANSMIT_COUNTER, TAG_ANY);
-	if (!vp) {
-		vp = fr_pair_afrom_num(packet, 0, PW_PACKET_TRANSMIT_COUNTER);
-		rad_assert(vp != NULL);
-		fr_pair_add(&packet->vps, vp);
-	}
-	vp->vp_integer = data->tries;
+	entry = &data->entries[(data->head + data->outstanding) % data->max_outstanding];
+	memset(entry, 0, sizeof(*entry));
+	entry->offset = data->entry_offset;
+	entry->end = data->offset;
+	entry->timestamp_offset = data->timestamp_offset;
+	entry->timestamp = data->timestamp;
+	entry->client_ip = data->client_ip;
+	entry->vps = data->vps;
+	data->vps = NULL;
+	data->outstanding++;
 
-	data->entry_state = STATE_RUNNING;
-	data->running = packet->timestamp.tv_sec;
+	data->entry_state = STATE_HEADER;
 
-	return packet;
+	return detail_packet_alloc(data, entry);
 }
 
 /*
@@ -958,52 +1155,63 @@ int detail_decode(UNUSED rad_listen_t *this, UNUSED REQUEST *request)
 
 static void *detail_handler_thread(void *arg)
 {
-	char c;
 	rad_listen_t *this = arg;
 	listen_detail_t *data = this->data;
 
 	while (true) {
-		RADIUS_PACKET *packet;
+		RADIUS_PACKET	*packet;
+		fd_set		fds;
+		struct timeval	wake;
+		int		fd = data->child_pipe[0];
 
-		while ((packet = detail_poll(this)) == NULL) {
-			usleep(detail_delay(data));
-
-			/*
-			 *	If we're supposed to exit then tell
-			 *	the master thread we've exited.
-			 */
-			if (data->child_pipe[0] < 0) {
-				packet = NULL;
-				if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
-					ERROR("detail (%s): Failed writing exit status to master: %s",
-					      data->name, fr_syserror(errno));
-				}
-				return NULL;
+		/*
+		 *	If we're supposed to exit then tell
+		 *	the master thread we've exited.
+		 */
+		if (fd < 0) {
+			packet = NULL;
+			if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
+				ERROR("detail (%s): Failed writing exit status to master: %s",
+				      data->name, fr_syserror(errno));
 			}
+			return NULL;
 		}
 
 		/*
-		 *	Keep retrying forever.
-		 *
-		 *	FIXME: cap the retries.
+		 *	Send retries and new entries, until the
+		 *	window is full, or there's nothing to read.
 		 */
-		do {
+		while ((packet = detail_poll(this)) != NULL) {
+			(void) detail_ack_drain(data);
+
 			if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
 				ERROR("detail (%s): Failed passing detail packet pointer to master: %s",
 				      data->name, fr_syserror(errno));
 			}
+		}
 
-			if (read(data->child_pipe[0], &c, 1) < 0) {
-				ERROR("detail (%s): Failed getting detail packet ack from master: %s",
-				      data->name, fr_syserror(errno));
-				break;
-			}
+		/*
+		 *	Nothing is in flight, so there's nothing to
+		 *	wait for.  Poll for the file again later.
+		 */
+		if (data->outstanding == 0) {
+			usleep(detail_delay(data));
+			continue;
+		}
 
-			if (data->delay_time > 0) usleep(data->delay_time);
+		/*
+		 *	Wait for an ack.  Wake up every second, so that
+		 *	entries which have been running for too long
+		 *	are retried.
+		 */
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		wake.tv_sec = 1;
+		wake.tv_usec = 0;
+
+		if (select(fd + 1, &fds, NULL, NULL, &wake) <= 0) continue;
 
-			packet = detail_poll(this);
-			if (!packet) break;
-		} while (data->entry_state != STATE_REPLIED);
+		if (detail_ack_drain(data) && (data->delay_time > 0)) usleep(data->delay_time);
 	}
 
 	return NULL;
@@ -1018,6 +1226,7 @@ static const CONF_PARSER detail_config[] = {
 	{ FR_CONF_OFFSET("retry_interval", PW_TYPE_INTEGER, listen_detail_t, retry_interval), .dflt = STRINGIFY(30) },
 	{ FR_CONF_OFFSET("one_shot", PW_TYPE_BOOLEAN, listen_detail_t, one_shot), .dflt = "no" },
 	{ FR_CONF_OFFSET("track", PW_TYPE_BOOLEAN, listen_detail_t, track), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_outstanding", PW_TYPE_INTEGER, listen_detail_t, max_outstanding), .dflt = STRINGIFY(1) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -1061,6 +1270,14 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, >=, 4);
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, <=, 3600);
 
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, >=, 1);
+	/*
+	 *	Every entry in flight may have a packet pointer in
+	 *	one pipe, and an ack in the other.  Keep both well
+	 *	below the capacity of a pipe.
+	 */
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, <=, 1024);
+
 	/*
 	 *	Only checking the config.  Don't start threads or anything else.
 	 */
@@ -1112,6 +1329,10 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	data->delay_time = data->poll_interval * USEC;
 	data->signal = 1;
 
+	MEM(data->entries = talloc_zero_array(data, detail_entry_t, data->max_outstanding));
+	data->head = 0;
+	data->outstanding = 0;
+
 	/*
 	 *	Initialize the fake client.
 	 */
@@ -1150,6 +1371,15 @@ int detail_socket_open(UNUSED CONF_SECTION *cs, rad_listen_t *this)
 		fr_exit(1);
 	}
 
+	/*
+	 *	The reader thread drains acks between writing packets.
+	 */
+	if (fr_nonblock(data->child_pipe[0]) < 0) {
+		ERROR("detail (%s): Error setting internal pipe to non-blocking: %s",
+		      data->name, fr_syserror(errno));
+		fr_exit(1);
+	}
+
 	pthread_create(&data->pthread_id, NULL, detail_handler_thread, this);
 
 	this->fd = data->master_pipe[0];
@@ -817,9 +817,9 @@ void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool d
 {
 	int i, j, count, from_count, to_count, tailto;
 	vp_cursor_t cursor;
-	VALUE_PAIR *vp, *next, **last;
+	VALUE_PAIR *vp, *next;
 	VALUE_PAIR **from_list, **to_list;
-	VALUE_PAIR *append, **append_tail;
+	vp_list_t append, out;
 	VALUE_PAIR *to_copy;
 	bool *edited = NULL;
 	REQUEST *fixup = NULL;
@@ -853,8 +853,7 @@ void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool d
 	for (vp = fr_cursor_init(&cursor, to); vp; vp = fr_cursor_next(&cursor)) count++;
 	to_list = talloc_array(request, VALUE_PAIR *, count);
 
-	append = NULL;
-	append_tail = &append;
+	fr_pair_head_init(&append, NULL);
 
 	/*
 	 *	Move the lists to the arrays, and break the list
@@ -1041,10 +1040,9 @@ void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool d
 			do_append:
 				RDEBUG4("::: APPENDING %s FROM %d TO %d",
 				       from_list[i]->da->name, i, tailto);
-				*append_tail = from_list[i];
 				from_list[i]->op = T_OP_EQ;
+				fr_pair_head_add(&append, from_list[i]);
 				from_list[i] = NULL;
-				append_tail = &(*append_tail)->next;
 			}
 		}
 	}
@@ -1065,7 +1063,7 @@ void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool d
 	 *	Re-chain the "to" list.
 	 */
 	fr_pair_list_free(to);
-	last = to;
+	fr_pair_head_init(&out, NULL);
 
 	if (to == &request->packet->vps) {
 		fixup = request;
@@ -1088,15 +1086,17 @@ void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool d
 		 */
 		vp->op = T_OP_EQ;
 
-		*last = vp;
-		last = &(*last)->next;
+		fr_pair_head_add(&out, vp);
 	}
 
 	/*
 	 *	And finally add in the attributes we're appending to
 	 *	the tail of the "to" list.
 	 */
-	*last = append;
+	fr_pair_head_add(&out, append.head);
+	*to = out.head;
+	fr_pair_head_reset(&out);
+	fr_pair_head_reset(&append);
 
 	/*
 	 *	Fix dumb cache issues
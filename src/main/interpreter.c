@@ -549,6 +549,38 @@ static unlang_action_t unlang_switch(REQUEST *request, unlang_stack_t *stack,
 		tmpl_init(&vpt, TMPL_TYPE_UNPARSED, data.strvalue, len, T_SINGLE_QUOTED_STRING);
 	}
 
+	/*
+	 *	Look up the literal case values.  The case which
+	 *	appears first in the switch wins, even if it matches
+	 *	a later instance of the attribute.
+	 */
+	if (g->cases) {
+		VALUE_PAIR *vp;
+		vp_cursor_t cursor;
+		unlang_case_t my_case, *entry, *literal = NULL;
+		int err;
+
+		for (vp = tmpl_cursor_init(&err, &cursor, request, g->vpt);
+		     vp;
+		     vp = tmpl_cursor_next(&cursor, g->vpt)) {
+			my_case.type = vp->da->type;
+			my_case.data = &vp->data;
+
+			entry = fr_hash_table_finddata(g->cases, &my_case);
+			if (entry && (!literal || (entry->position < literal->position))) literal = entry;
+		}
+
+		if (literal) found = literal->c;
+
+		/*
+		 *	All of the cases were looked up, so we're done.
+		 */
+		if (!g->dynamic_cases) {
+			if (!found) found = g->default_case;
+			goto do_null_case;
+		}
+	}
+
 	/*
 	 *	Find either the exact matching name, or the
 	 *	"case {...}" statement.
@@ -556,6 +588,12 @@ static unlang_action_t unlang_switch(REQUEST *request, unlang_stack_t *stack,
 	for (this = g->children; this; this = this->next) {
 		rad_assert(this->type == MOD_CASE);
 
+		/*
+		 *	Nothing before the matching literal case
+		 *	matched.
+		 */
+		if (this == found) break;
+
 		h = mod_callabletogroup(this);
 
 		/*
@@ -566,6 +604,12 @@ static unlang_action_t unlang_switch(REQUEST *request, unlang_stack_t *stack,
 			continue;
 		}
 
+		/*
+		 *	Already looked up.
+		 */
+		if (g->cases && (h->vpt->type == TMPL_TYPE_DATA) &&
+		    (h->vpt->tmpl_data_type == g->vpt->tmpl_da->type)) continue;
+
 		/*
 		 *	If we're switching over an attribute
 		 *	AND we haven't pre-parsed the data for
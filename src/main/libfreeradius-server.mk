@@ -1,6 +1,7 @@
 TARGET	:= libfreeradius-server.a
 
-SOURCES	:=	conffile.c \
+SOURCES	:=	batch.c \
+		conffile.c \
 		connection.c \
 		evaluate.c \
 		exec.c \
@@ -10,8 +11,10 @@ SOURCES	:=	conffile.c \
 		map_proc.c \
 		map.c \
 		regex.c \
+		reload.c \
 		request.c \
 		trigger.c \
+		threads.c \
 		tmpl.c \
 		util.c \
 		version.c \
@@ -338,10 +338,14 @@ int listen_bootstrap(CONF_SECTION *server, CONF_SECTION *cs, char const *server_
 
 
 /*
- *	Find a per-socket client.
+ *	Find a per-socket client, creating it if it's dynamic.
+ *
+ *	A new dynamic client is created from "packet", if it's been
+ *	read already.  Otherwise, the packet is peeked at on the socket.
  */
-RADCLIENT *client_listener_find(rad_listen_t *listener,
-				fr_ipaddr_t const *ipaddr, uint16_t src_port)
+static RADCLIENT *client_listener_find_packet(rad_listen_t *listener,
+					      fr_ipaddr_t const *ipaddr, uint16_t src_port,
+					      RADIUS_PACKET const *packet)
 {
 #ifdef WITH_DYNAMIC_CLIENTS
 	int rcode;
@@ -499,13 +503,31 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 
 	request->listener = listener;
 	request->client = client;
-	request->packet = fr_radius_recv(NULL, listener->fd, UDP_FLAGS_PEEK, false);
-	if (!request->packet) {				/* badly formed, etc */
-		talloc_free(request);
-		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
-		goto unknown;
+	if (packet) {
+		request->packet = fr_radius_copy(request, packet);
+		if (request->packet) {
+			request->packet->data = talloc_memdup(request->packet, packet->data, packet->data_len);
+			request->packet->data_len = packet->data_len;
+		}
+		if (!request->packet || !request->packet->data) {
+			talloc_free(request);
+			goto unknown;
+		}
+
+		if (!fr_radius_ok(request->packet, false, NULL)) {
+			talloc_free(request);
+			if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
+			goto unknown;
+		}
+	} else {
+		request->packet = fr_radius_recv(NULL, listener->fd, UDP_FLAGS_PEEK, false);
+		if (!request->packet) {				/* badly formed, etc */
+			talloc_free(request);
+			if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
+			goto unknown;
+		}
+		(void) talloc_steal(request, request->packet);
 	}
-	(void) talloc_steal(request, request->packet);
 	request->reply = fr_radius_alloc_reply(request, request->packet);
 	if (!request->reply) {
 		talloc_free(request);
@@ -584,6 +606,15 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 #endif
 }
 
+/*
+ *	Find a per-socket client.
+ */
+RADCLIENT *client_listener_find(rad_listen_t *listener,
+				fr_ipaddr_t const *ipaddr, uint16_t src_port)
+{
+	return client_listener_find_packet(listener, ipaddr, src_port, NULL);
+}
+
 static int listen_bind(rad_listen_t *this);
 
 #ifdef HAVE_LIBPCAP
@@ -1227,6 +1258,13 @@ static CONF_PARSER performance_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER performance_socket_config[] = {
+	{ FR_CONF_OFFSET("readers", PW_TYPE_INTEGER, listen_socket_t, readers), .dflt = "0" },
+	{ FR_CONF_OFFSET("batch_size", PW_TYPE_INTEGER, listen_socket_t, batch_size), .dflt = "0" },
+
+	CONF_PARSER_TERMINATOR
+};
+
 
 static CONF_PARSER limit_config[] = {
 	{ FR_CONF_OFFSET("max_pps", PW_TYPE_INTEGER, listen_socket_t, max_rate) },
@@ -1376,6 +1414,60 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		rcode = cf_section_parse(subcs, this,
 					 performance_config);
 		if (rcode < 0) return -1;
+
+		rcode = cf_section_parse(subcs, sock,
+					 performance_socket_config);
+		if (rcode < 0) return -1;
+
+		FR_INTEGER_BOUND_CHECK("batch_size", sock->batch_size, <=, 1024);
+		FR_INTEGER_BOUND_CHECK("readers", sock->readers, <=, 256);
+	}
+
+	if (sock->readers > 1) {
+#ifdef SO_REUSEPORT
+		if ((sock->proto != IPPROTO_UDP) ||
+		    ((this->type != RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+		     && (this->type != RAD_LISTEN_ACCT)
+#endif
+			    )) {
+			WARN("Ignoring \"readers\", it is only used for UDP authentication and accounting sockets");
+			sock->readers = 0;
+		}
+#else
+		WARN("Ignoring \"readers\", as SO_REUSEPORT is not available on this system");
+		sock->readers = 0;
+#endif
+	}
+
+	if (sock->batch_size > 1) {
+#ifdef WITH_UDP_BATCH
+		if ((sock->proto == IPPROTO_UDP) &&
+		    ((this->type == RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+		     || (this->type == RAD_LISTEN_ACCT)
+#endif
+			    )) {
+			sock->recv_batch = udp_batch_alloc(sock, sock->batch_size, MAX_PACKET_LEN);
+			sock->send_batch = udp_batch_alloc(sock, sock->batch_size, MAX_PACKET_LEN);
+			sock->send_spare = udp_batch_alloc(sock, sock->batch_size, MAX_PACKET_LEN);
+			sock->recv_clients = talloc_array(sock, listen_batch_client_t, sock->batch_size);
+			if (!sock->recv_batch || !sock->send_batch || !sock->send_spare || !sock->recv_clients) {
+				cf_log_err_cs(cs, "Failed allocating batch buffers: %s", fr_strerror());
+				return -1;
+			}
+
+			if (pthread_mutex_init(&sock->send_mutex, NULL) < 0) {
+				cf_log_err_cs(cs, "Failed initializing mutex: %s", fr_syserror(errno));
+				TALLOC_FREE(sock->send_batch);
+				return -1;
+			}
+		} else {
+			WARN("Ignoring \"batch_size\", it is only used for UDP authentication and accounting sockets");
+		}
+#else
+		WARN("Ignoring \"batch_size\", as recvmmsg() and sendmmsg() are not available on this system");
+#endif
 	}
 
 	subcs = cf_section_sub_find(cs, "limit");
@@ -1618,10 +1710,276 @@ int common_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 	return 0;
 }
 
+#ifdef WITH_UDP_BATCH
+/*
+ *	Queue a reply, to be written with sendmmsg().
+ *
+ *	There's no timer.  Whichever thread finds no flush in
+ *	progress writes everything which is queued, including
+ *	replies queued by other threads while it was writing.  So
+ *	under load, replies accumulate into batches, and when the
+ *	server is quiet each reply is written immediately.
+ */
+static int common_socket_send_batch(rad_listen_t *listener, REQUEST *request)
+{
+	listen_socket_t	*sock = listener->data;
+	RADIUS_PACKET	*reply = request->reply;
+	int		rcode = 0;
+
+	/*
+	 *	Maybe it's a fake packet.  Don't send it.
+	 */
+	if (reply->sockfd < 0) return 0;
+
+	if (!reply->data) {
+		if (fr_radius_encode(reply, request->packet, request->client->secret) < 0) goto error;
+		if (fr_radius_sign(reply, request->packet, request->client->secret) < 0) goto error;
+	}
+
+	pthread_mutex_lock(&sock->send_mutex);
+	if (udp_batch_add(sock->send_batch, reply->data, reply->data_len,
+			  &reply->src_ipaddr, reply->src_port, reply->if_index,
+			  &reply->dst_ipaddr, reply->dst_port) < 0) {
+		pthread_mutex_unlock(&sock->send_mutex);
+
+		/*
+		 *	The queue is full.  Don't wait for the thread
+		 *	which is flushing it, just write the reply.
+		 */
+		if (fr_radius_send(reply, request->packet, request->client->secret) < 0) goto error;
+		return 0;
+	}
+
+	if (sock->sending) {
+		pthread_mutex_unlock(&sock->send_mutex);
+		return 0;
+	}
+	sock->sending = true;
+
+	while (udp_batch_count(sock->send_batch) > 0) {
+		udp_batch_t *batch = sock->send_batch;
+
+		sock->send_batch = sock->send_spare;
+		sock->send_spare = batch;
+		pthread_mutex_unlock(&sock->send_mutex);
+
+		if (udp_send_batch(listener->fd, batch) < 0) {
+			RERROR("Failed sending replies: %s", fr_strerror());
+			rcode = -1;
+		}
+
+		pthread_mutex_lock(&sock->send_mutex);
+	}
+
+	sock->sending = false;
+	pthread_mutex_unlock(&sock->send_mutex);
+
+	return rcode;
+
+error:
+	RERROR("Failed sending reply: %s", fr_strerror());
+	return -1;
+}
+
+#ifdef WITH_ACCOUNTING
+#  define BATCH_STATS_INC(_y) do { \
+	if (listener->type == RAD_LISTEN_ACCT) { FR_STATS_INC(acct, _y); } else { FR_STATS_INC(auth, _y); } \
+} while (0)
+#else
+#  define BATCH_STATS_INC(_y) do { FR_STATS_INC(auth, _y); } while (0)
+#endif
+
+/*
+ *	Read a batch of packets with recvmmsg(), and run each one
+ *	through the same checks as auth_socket_recv() and
+ *	acct_socket_recv().
+ */
+static int common_socket_recv_batch(rad_listen_t *listener)
+{
+	listen_socket_t	*sock = listener->data;
+	int		i, received, processed = 0;
+	unsigned int	num_clients = 0;
+
+	received = udp_recv_batch(listener->fd, sock->recv_batch);
+	if (received < 0) {
+		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
+		return 0;
+	}
+
+	for (i = 0; i < received; i++) {
+		ssize_t		data_len;
+		size_t		packet_len;
+		uint8_t		*data;
+		unsigned int	code, j;
+		fr_ipaddr_t	src_ipaddr, dst_ipaddr;
+		uint16_t	src_port, dst_port;
+		int		if_index;
+		struct timeval	when;
+		bool		require_ma = false;
+		RADIUS_PACKET	*packet;
+		RAD_REQUEST_FUNP fun = NULL;
+		RADCLIENT	*client = NULL;
+		TALLOC_CTX	*ctx;
+
+		data_len = udp_batch_get(sock->recv_batch, i, &data,
+					 &src_ipaddr, &src_port, &dst_ipaddr, &dst_port,
+					 &if_index, &when);
+		if (data_len < 0) continue;
+
+		BATCH_STATS_INC(total_requests);
+
+		/*
+		 *	The same header checks as fr_radius_recv_header().
+		 */
+		if (data_len < 4) {
+		malformed:
+			if (DEBUG_ENABLED) ERROR("Receive - Invalid packet header from client port %d", src_port);
+			BATCH_STATS_INC(total_malformed_requests);
+			continue;
+		}
+
+		packet_len = (data[2] << 8) | data[3];
+		if ((packet_len < RADIUS_HDR_LEN) || (packet_len > MAX_PACKET_LEN)) goto malformed;
+
+		code = data[0];
+
+		/*
+		 *	Each source is only looked up once per batch.
+		 */
+		for (j = 0; j < num_clients; j++) {
+			if (fr_ipaddr_cmp(&sock->recv_clients[j].ipaddr, &src_ipaddr) == 0) break;
+		}
+
+		if (j < num_clients) {
+			client = sock->recv_clients[j].client;
+			if (!client) {
+				BATCH_STATS_INC(total_invalid_requests);
+				continue;
+			}
+		}
+
+		ctx = talloc_pool(NULL, main_config.talloc_pool_size);
+		if (!ctx) {
+			BATCH_STATS_INC(total_packets_dropped);
+			continue;
+		}
+		talloc_set_name_const(ctx, "batch_listener_pool");
+
+		packet = fr_radius_alloc(ctx, false);
+		if (!packet) {
+			BATCH_STATS_INC(total_packets_dropped);
+			goto discard;
+		}
+
+		packet->src_ipaddr = src_ipaddr;
+		packet->src_port = src_port;
+		packet->dst_ipaddr = dst_ipaddr;
+		packet->dst_port = dst_port;
+		packet->if_index = if_index;
+		packet->timestamp = when;
+		packet->code = code;
+
+		/*
+		 *	Anything after the length given in the header
+		 *	is discarded.  If the datagram is shorter than
+		 *	the header says, fr_radius_ok() catches it.
+		 */
+		if ((size_t) data_len > packet_len) data_len = packet_len;
+
+		packet->data = talloc_memdup(packet, data, data_len);
+		packet->data_len = data_len;
+		if (!packet->data) {
+			BATCH_STATS_INC(total_packets_dropped);
+			goto discard;
+		}
+
+		if (!client) {
+			/*
+			 *	Dynamic clients are created from the
+			 *	packet we've already read, instead of by
+			 *	peeking at the socket.
+			 */
+			client = client_listener_find_packet(listener, &src_ipaddr, src_port, packet);
+
+			sock->recv_clients[num_clients].ipaddr = src_ipaddr;
+			sock->recv_clients[num_clients].client = client;
+			num_clients++;
+
+			if (!client) {
+				BATCH_STATS_INC(total_invalid_requests);
+				goto discard;
+			}
+		}
+
+		/*
+		 *	Some sanity checks, based on the packet code.
+		 */
+		switch (code) {
+		case PW_CODE_ACCESS_REQUEST:
+			if (listener->type != RAD_LISTEN_AUTH) goto bad_code;
+			FR_STATS_TYPE_INC(client->auth.total_requests);
+			fun = rad_authenticate;
+			break;
+
+#ifdef WITH_ACCOUNTING
+		case PW_CODE_ACCOUNTING_REQUEST:
+			if (listener->type != RAD_LISTEN_ACCT) goto bad_code;
+			FR_STATS_TYPE_INC(client->acct.total_requests);
+			fun = rad_accounting;
+			break;
+#endif
+
+		case PW_CODE_STATUS_SERVER:
+			if (!main_config.status_server) {
+				BATCH_STATS_INC(total_unknown_types);
+				WARN("Ignoring Status-Server request due to security configuration");
+				goto discard;
+			}
+			fun = rad_status_server;
+			break;
+
+		default:
+		bad_code:
+			BATCH_STATS_INC(total_unknown_types);
+
+			if (DEBUG_ENABLED) ERROR("Receive - Invalid packet code %d sent to %s port from "
+						 "client %s port %d", code,
+						 (listener->type == RAD_LISTEN_AUTH) ? "authentication" : "accounting",
+						 client->shortname, src_port);
+			goto discard;
+		} /* switch over packet types */
+
+		if (listener->type == RAD_LISTEN_AUTH) require_ma = client->message_authenticator;
+
+		if (!fr_radius_ok(packet, require_ma, NULL)) {
+			BATCH_STATS_INC(total_malformed_requests);
+			if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
+			goto discard;
+		}
+
+		packet->sockfd = listener->fd;
+		packet->vps = NULL;
+
+		if (!request_receive(ctx, listener, packet, client, fun)) {
+			BATCH_STATS_INC(total_packets_dropped);
+			goto discard;
+		}
+
+		processed++;
+		continue;
+
+	discard:
+		talloc_free(ctx);
+	}
+
+	return processed;
+}
+#endif	/* WITH_UDP_BATCH */
+
 /*
  *	Send an authentication response packet
  */
-static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *request)
+static int auth_socket_send(rad_listen_t *listener, REQUEST *request)
 {
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == auth_socket_send);
@@ -1640,6 +1998,10 @@ static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 	}
 #endif
 
+#ifdef WITH_UDP_BATCH
+	if (((listen_socket_t *) listener->data)->send_batch) return common_socket_send_batch(listener, request);
+#endif
+
 	if (fr_radius_send(request->reply, request->packet,
 			   request->client->secret) < 0) {
 		RERROR("Failed sending reply: %s",
@@ -1660,7 +2022,7 @@ static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 /*
  *	Send an accounting response packet (or not)
  */
-static int acct_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *request)
+static int acct_socket_send(rad_listen_t *listener, REQUEST *request)
 {
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == acct_socket_send);
@@ -1685,6 +2047,10 @@ static int acct_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 	}
 #  endif
 
+#  ifdef WITH_UDP_BATCH
+	if (((listen_socket_t *) listener->data)->send_batch) return common_socket_send_batch(listener, request);
+#  endif
+
 	if (fr_radius_send(request->reply, request->packet,
 			   request->client->secret) < 0) {
 		RERROR("Failed sending reply: %s",
@@ -1814,6 +2180,10 @@ static int auth_socket_recv(rad_listen_t *listener)
 	fr_ipaddr_t	src_ipaddr;
 	TALLOC_CTX	*ctx;
 
+#ifdef WITH_UDP_BATCH
+	if (((listen_socket_t *) listener->data)->recv_batch) return common_socket_recv_batch(listener);
+#endif
+
 	rcode = fr_radius_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
 	if (rcode < 0) return 0;
 
@@ -1928,6 +2298,10 @@ static int acct_socket_recv(rad_listen_t *listener)
 	fr_ipaddr_t	src_ipaddr;
 	TALLOC_CTX	*ctx;
 
+#ifdef WITH_UDP_BATCH
+	if (((listen_socket_t *) listener->data)->recv_batch) return common_socket_recv_batch(listener);
+#endif
+
 	rcode = fr_radius_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
 	if (rcode < 0) return 0;
 
@@ -2848,6 +3222,23 @@ static int listen_bind(rad_listen_t *this)
 		}
 	}
 
+#ifdef SO_REUSEPORT
+	/*
+	 *	Every copy of a socket with multiple readers binds to
+	 *	the same address and port.  The kernel spreads the
+	 *	packets across them, keeping each client on one socket.
+	 */
+	if (sock->readers > 1) {
+		int on = 1;
+
+		if (setsockopt(this->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			close(this->fd);
+			ERROR("Failed setting SO_REUSEPORT: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+#endif
+
 	/*
 	 *	Bind to the interface, IP address, and port.
 	 */
@@ -2900,6 +3291,18 @@ static int _listener_free(rad_listen_t *this)
 	 */
 	if (this->fd >= 0) close(this->fd);
 
+#ifdef WITH_UDP_BATCH
+	if ((this->type == RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+	    || (this->type == RAD_LISTEN_ACCT)
+#endif
+		) {
+		listen_socket_t *sock = this->data;
+
+		if (sock->send_batch) pthread_mutex_destroy(&sock->send_mutex);
+	}
+#endif
+
 #ifdef WITH_TCP
 	if ((this->type == RAD_LISTEN_AUTH)
 #ifdef WITH_ACCT
@@ -3223,6 +3626,27 @@ int listen_init(rad_listen_t **head,
 		this = lc->listener;
 		*last = this;
 		last = &(this->next);
+
+		/*
+		 *	Open the other copies of a socket which has
+		 *	multiple readers.
+		 */
+		if (listen_is_reader(this)) {
+			listen_socket_t	*sock = this->data;
+			uint32_t	i;
+
+			for (i = 1; i < sock->readers; i++) {
+				this = listen_parse(lc);
+				if (!this || (lc->proto->open(lc->cs, this) < 0)) {
+					ERROR("Failed creating reader %u for server \"%s\"", i, lc->server_name);
+					TALLOC_FREE(listen_ctx);
+					return -1;
+				}
+
+				*last = this;
+				last = &(this->next);
+			}
+		}
 	}
 
 	/*
@@ -3244,6 +3668,28 @@ int listen_init(rad_listen_t **head,
 	return 0;
 }
 
+/** Whether a listener is one of several SO_REUSEPORT copies of a socket
+ *
+ * Each copy is served by its own reader thread and event loop.
+ *
+ * @param[in] this listener to check.
+ * @return true if the listener should be given its own reader thread.
+ */
+bool listen_is_reader(rad_listen_t const *this)
+{
+	listen_socket_t const *sock;
+
+	if ((this->type != RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+	    && (this->type != RAD_LISTEN_ACCT)
+#endif
+		) return false;
+
+	sock = this->data;
+
+	return (sock->proto == IPPROTO_UDP) && (sock->readers > 1);
+}
+
 /** Free a linked list of listeners
  *
  * @param head of list to free.
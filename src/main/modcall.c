@@ -1876,6 +1876,168 @@ static modcallable *compile_group(modcallable *parent, rlm_components_t componen
 	return compile_children(g, parent, component, grouptype, parentgrouptype);
 }
 
+/** Get the bytes of a value which are compared for equality
+ *
+ * @return
+ *	- true if the type can be looked up in #modgroup.cases.
+ *	- false if "==" means something other than "same bytes" for the type.
+ */
+static bool case_value_bytes(uint8_t const **out, size_t *outlen, PW_TYPE type, value_data_t const *data)
+{
+	switch (type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		*out = data->octets;
+		*outlen = data->length;
+		return true;
+
+	case PW_TYPE_INTEGER:
+		*out = (uint8_t const *) &data->integer;
+		*outlen = sizeof(data->integer);
+		return true;
+
+	case PW_TYPE_DATE:
+		*out = (uint8_t const *) &data->date;
+		*outlen = sizeof(data->date);
+		return true;
+
+	case PW_TYPE_SIGNED:
+		*out = (uint8_t const *) &data->sinteger;
+		*outlen = sizeof(data->sinteger);
+		return true;
+
+	case PW_TYPE_INTEGER64:
+		*out = (uint8_t const *) &data->integer64;
+		*outlen = sizeof(data->integer64);
+		return true;
+
+	case PW_TYPE_BYTE:
+		*out = &data->byte;
+		*outlen = sizeof(data->byte);
+		return true;
+
+	case PW_TYPE_SHORT:
+		*out = (uint8_t const *) &data->ushort;
+		*outlen = sizeof(data->ushort);
+		return true;
+
+	case PW_TYPE_IPV4_ADDR:
+		*out = (uint8_t const *) &data->ipaddr;
+		*outlen = sizeof(data->ipaddr);
+		return true;
+
+	case PW_TYPE_IPV6_ADDR:
+		*out = (uint8_t const *) &data->ipv6addr;
+		*outlen = sizeof(data->ipv6addr);
+		return true;
+
+	case PW_TYPE_ETHERNET:
+		*out = data->ether;
+		*outlen = sizeof(data->ether);
+		return true;
+
+	case PW_TYPE_IFID:
+		*out = data->ifid;
+		*outlen = sizeof(data->ifid);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static uint32_t case_hash(void const *data)
+{
+	unlang_case_t const *a = data;
+	uint8_t const *p;
+	size_t len;
+
+	if (!case_value_bytes(&p, &len, a->type, a->data)) return 0;
+
+	return fr_hash(p, len);
+}
+
+static int case_cmp(void const *one, void const *two)
+{
+	unlang_case_t const *a = one;
+	unlang_case_t const *b = two;
+	uint8_t const *a_p, *b_p;
+	size_t a_len, b_len;
+
+	if (a->type != b->type) return a->type - b->type;
+
+	if (!case_value_bytes(&a_p, &a_len, a->type, a->data) ||
+	    !case_value_bytes(&b_p, &b_len, b->type, b->data)) return -1;
+
+	if (a_len != b_len) return (a_len < b_len) ? -1 : +1;
+
+	return memcmp(a_p, b_p, a_len);
+}
+
+/** Index the literal case values of a switch over an attribute
+ *
+ * The interpreter then finds the matching case with one lookup per attribute instance,
+ * instead of evaluating each case in turn.  Cases which aren't literal values of the
+ * attribute's type are still evaluated in order.
+ *
+ * @return
+ *	- 0 on success, or if the switch can't be indexed.
+ *	- -1 on error.
+ */
+static int compile_switch_cases(modgroup *g)
+{
+	modcallable *this;
+	modgroup *h;
+	unlang_case_t *entry;
+	unsigned int position = 0;
+	uint8_t const *p;
+	size_t len;
+
+	if (g->vpt->type != TMPL_TYPE_ATTR) return 0;
+
+	for (this = g->children; this; this = this->next, position++) {
+		rad_assert(this->type == MOD_CASE);
+
+		h = mod_callabletogroup(this);
+		if (!h->vpt) {
+			if (!g->default_case) g->default_case = this;
+			continue;
+		}
+
+		if ((h->vpt->type != TMPL_TYPE_DATA) ||
+		    (h->vpt->tmpl_data_type != g->vpt->tmpl_da->type) ||
+		    !case_value_bytes(&p, &len, h->vpt->tmpl_data_type, &h->vpt->tmpl_data_value)) {
+			g->dynamic_cases = true;
+			continue;
+		}
+
+		if (!g->cases) {
+			g->cases = fr_hash_table_create(g, case_hash, case_cmp, NULL);
+			if (!g->cases) return -1;
+		}
+
+		entry = talloc_zero(g->cases, unlang_case_t);
+		if (!entry) return -1;
+
+		entry->type = h->vpt->tmpl_data_type;
+		entry->data = &h->vpt->tmpl_data_value;
+		entry->c = this;
+		entry->position = position;
+
+		/*
+		 *	Duplicate values never match the later case.
+		 */
+		if (fr_hash_table_finddata(g->cases, entry)) {
+			talloc_free(entry);
+			continue;
+		}
+
+		if (!fr_hash_table_insert(g->cases, entry)) return -1;
+	}
+
+	return 0;
+}
+
 static modcallable *compile_switch(modcallable *parent, rlm_components_t component, CONF_SECTION *cs,
 				   grouptype_t grouptype, grouptype_t parentgrouptype, mod_type_t mod_type)
 {
@@ -1972,7 +2134,16 @@ static modcallable *compile_switch(modcallable *parent, rlm_components_t compone
 		return NULL;
 	}
 
-	return compile_children(g, parent, component, grouptype, parentgrouptype);
+	c = compile_children(g, parent, component, grouptype, parentgrouptype);
+	if (!c) return NULL;
+
+	if (compile_switch_cases(g) < 0) {
+		cf_log_err_cs(cs, "Failed indexing 'case' statements");
+		talloc_free(c);
+		return NULL;
+	}
+
+	return c;
 }
 
 static modcallable *compile_case(modcallable *parent, rlm_components_t component, CONF_SECTION *cs,
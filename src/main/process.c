@@ -59,6 +59,34 @@ time_t fr_start_time = (time_t)-1;
 static rbtree_t *pl = NULL;
 static fr_event_list_t *el = NULL;
 
+/** A reader thread, serving one SO_REUSEPORT copy of a listener
+ *
+ * Each reader runs its own event loop, and keeps its own tree of live
+ * requests for duplicate detection.  The kernel sends all packets from
+ * one client address to the same socket, so a duplicate always arrives
+ * at the reader which owns the original request.
+ */
+typedef struct event_reader_t {
+	rad_listen_t		*listener;	//!< Socket served by this reader.
+	fr_event_list_t		*el;		//!< Socket and request timer events.
+	rbtree_t		*pl;		//!< Live requests read from the socket.
+	int			wake[2];	//!< Pipe used to stop the reader.
+	pthread_t		pthread_id;	//!< Thread running the event loop.
+	struct event_reader_t	*next;
+} event_reader_t;
+
+static event_reader_t *readers = NULL;
+static bool readers_allowed = false;
+static _Thread_local event_reader_t *this_reader = NULL;
+
+/*
+ *	The event list and live request tree for the event loop run
+ *	by this thread.  Reader threads have their own, everything
+ *	else uses the main ones.
+ */
+#define CURRENT_EL (this_reader ? this_reader->el : el)
+#define CURRENT_PL (this_reader ? this_reader->pl : pl)
+
 fr_event_list_t *radius_event_list_corral(UNUSED event_corral_t hint) {
 	/* Currently we do not run a second event loop for modules. */
 	return el;
@@ -136,7 +164,7 @@ static void request_timer(void *ctx, struct timeval *now);
 static inline void state_machine_timer(char const *file, int line, REQUEST *request,
 				       struct timeval *when)
 {
-	if (!fr_event_insert(el, request_timer, request, when, &request->ev)) {
+	if (!fr_event_insert(CURRENT_EL, request_timer, request, when, &request->ev)) {
 		_rad_panic(file, line, "Failed to insert event");
 	}
 }
@@ -240,6 +268,13 @@ static TALLOC_CTX *proxy_ctx = NULL;
 #endif
 
 #ifdef WITH_PROXY
+/*
+ *	Protects opening new proxy sockets, and request->in_proxy_hash.
+ *
+ *	The proxy list has its own locks, but they only protect the list.
+ *	Requests are removed from the list and freed under this mutex, so
+ *	it must be held from finding a reply until its request is found.
+ */
 static pthread_mutex_t proxy_mutex;
 static bool proxy_no_new_sockets = false;
 #endif
@@ -252,7 +287,11 @@ static pthread_t NO_SUCH_CHILD_PID;
 
 static bool we_are_master(void)
 {
-	if (spawn_workers &&
+	/*
+	 *	Reader threads are the master for the requests they
+	 *	read.
+	 */
+	if (spawn_workers && !this_reader &&
 	    (pthread_equal(pthread_self(), NO_SUCH_CHILD_PID) == 0)) {
 		return false;
 	}
@@ -278,6 +317,8 @@ static bool we_are_master(void)
 
 
 static int event_new_fd(rad_listen_t *this);
+static int packet_entry_cmp(void const *one, void const *two);
+static int request_delete_cb(UNUSED void *ctx, void *data);
 
 /*
  *	We need mutexes around the event FD list *only* in certain
@@ -633,7 +674,7 @@ static void request_done(REQUEST *request, fr_state_action_t action)
 	 *	Remove it from the request hash.
 	 */
 	if (request->in_request_hash) {
-		if (!rbtree_deletebydata(pl, &request->packet)) {
+		if (!rbtree_deletebydata(CURRENT_PL, &request->packet)) {
 			rad_assert(0 == 1);
 		}
 		request->in_request_hash = false;
@@ -647,7 +688,7 @@ static void request_done(REQUEST *request, fr_state_action_t action)
 	if (request->in_proxy_hash) {
 		rad_assert(request->proxy != NULL);
 
-		fr_event_now(el, &now);
+		fr_event_now(CURRENT_EL, &now);
 		when = request->proxy->packet->timestamp;
 
 #ifdef WITH_COA
@@ -730,7 +771,7 @@ static void request_done(REQUEST *request, fr_state_action_t action)
 	} /* else don't print anything */
 
 	ASSERT_MASTER;
-	fr_event_delete(el, &request->ev);
+	fr_event_delete(CURRENT_EL, &request->ev);
 	request_free(request);
 }
 
@@ -837,7 +878,7 @@ static bool request_max_time(REQUEST *request)
 	/*
 	 *	The request is still running.  Enforce max_request_time.
 	 */
-	fr_event_now(el, &now);
+	fr_event_now(CURRENT_EL, &now);
 	when = request->packet->timestamp;
 	when.tv_sec += request->root->max_request_time;
 
@@ -977,7 +1018,7 @@ static void request_cleanup_delay(REQUEST *request, fr_state_action_t action)
 #endif
 
 	case FR_ACTION_TIMER:
-		fr_event_now(el, &now);
+		fr_event_now(CURRENT_EL, &now);
 
 		rad_assert(request->root->cleanup_delay > 0);
 
@@ -1049,7 +1090,7 @@ static void request_response_delay(REQUEST *request, fr_state_action_t action)
 #endif
 
 	case FR_ACTION_TIMER:
-		fr_event_now(el, &now);
+		fr_event_now(CURRENT_EL, &now);
 
 		/*
 		 *	See if it's time to send the reply.  If not,
@@ -1490,7 +1531,7 @@ static bool request_is_dup(rad_listen_t *listener, RADCLIENT *client, RADIUS_PAC
 	rad_child_state_t child_state;
 	REQUEST *request;
 
-	packet_p = rbtree_finddata(pl, &packet);
+	packet_p = rbtree_finddata(CURRENT_PL, &packet);
 	if (!packet_p) return false;
 
 	request = fr_packet2myptr(REQUEST, packet, packet_p);
@@ -1581,7 +1622,7 @@ static bool request_limit(rad_listen_t *listener, RADCLIENT *client, RADIUS_PACK
 	 *	Quench maximum number of outstanding requests.
 	 */
 	if (main_config.max_requests &&
-	    ((count = rbtree_num_elements(pl)) > main_config.max_requests)) {
+	    ((count = rbtree_num_elements(CURRENT_PL)) > main_config.max_requests)) {
 		RATE_LIMIT(ERROR("Dropping request (%d is too many): from client %s port %d - ID: %d", count,
 				 client->shortname,
 				 packet->src_port, packet->id);
@@ -1681,7 +1722,7 @@ int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *pack
 	 *	Remember the request in the list.
 	 */
 	if (!listener->nodup) {
-		if (!rbtree_insert(pl, &request->packet)) {
+		if (!rbtree_insert(CURRENT_PL, &request->packet)) {
 			RERROR("Failed to insert request in the list of live requests: discarding it");
 			request_done(request, FR_ACTION_DONE);
 			return 1;
@@ -1826,7 +1867,7 @@ static void tcp_socket_timer(void *ctx, struct timeval *now)
 
 	if (listener->status != RAD_LISTEN_STATUS_KNOWN) return;
 
-	fr_event_now(el, now);
+	fr_event_now(CURRENT_EL, now);
 
 	switch (listener->type) {
 #ifdef WITH_PROXY
@@ -2412,6 +2453,13 @@ int request_proxy_reply(RADIUS_PACKET *reply)
 		return 0;
 	}
 
+	/*
+	 *	Used by latency-balance pools.
+	 */
+	if (proxy->packet->code != PW_CODE_STATUS_SERVER) {
+		home_server_response_time(proxy->home_server, &proxy->packet->timestamp, &now);
+	}
+
 	/*
 	 *	Call the state machine to do something useful with the
 	 *	request.
@@ -2692,9 +2740,11 @@ static int request_will_proxy(REQUEST *request)
 	int rcode, pre_proxy_type = 0;
 	char const *realmname = NULL;
 	VALUE_PAIR *vp, *strippedname;
+	VALUE_PAIR *realm_vp, *pool_vp, *dst_vp, *dst_port_vp;
 	home_server_t *home;
 	REALM *realm = NULL;
 	home_pool_t *pool = NULL;
+	vp_list_t control;
 
 	VERIFY_REQUEST(request);
 
@@ -2704,7 +2754,20 @@ static int request_will_proxy(REQUEST *request)
 	if (request->in_proxy_hash) return 0;
 	if (request->reply->code != 0) return 0;
 
-	vp = fr_pair_find_by_num(request->control, 0, PW_PROXY_TO_REALM, TAG_ANY);
+	/*
+	 *	Look up everything which can select the destination
+	 *	at once, so large control lists are only walked to
+	 *	build the index.
+	 */
+	fr_pair_head_init(&control, request->control);
+	realm_vp = fr_pair_head_find_by_num(&control, 0, PW_PROXY_TO_REALM, TAG_ANY);
+	pool_vp = fr_pair_head_find_by_num(&control, 0, PW_HOME_SERVER_POOL, TAG_ANY);
+	dst_vp = fr_pair_head_find_by_num(&control, 0, PW_PACKET_DST_IP_ADDRESS, TAG_ANY);
+	if (!dst_vp) dst_vp = fr_pair_head_find_by_num(&control, 0, PW_PACKET_DST_IPV6_ADDRESS, TAG_ANY);
+	dst_port_vp = fr_pair_head_find_by_num(&control, 0, PW_PACKET_DST_PORT, TAG_ANY);
+	fr_pair_head_reset(&control);
+
+	vp = realm_vp;
 	if (vp) {
 		realm = realm_find2(vp->vp_strvalue);
 		if (!realm) {
@@ -2736,7 +2799,7 @@ static int request_will_proxy(REQUEST *request)
 			return 0;
 		}
 
-	} else if ((vp = fr_pair_find_by_num(request->control, 0, PW_HOME_SERVER_POOL, TAG_ANY)) != NULL) {
+	} else if ((vp = pool_vp) != NULL) {
 		int pool_type;
 
 		switch (request->packet->code) {
@@ -2766,8 +2829,7 @@ static int request_will_proxy(REQUEST *request)
 		/*
 		 *	Send it directly to a home server (i.e. NAS)
 		 */
-	} else if (((vp = fr_pair_find_by_num(request->control, 0, PW_PACKET_DST_IP_ADDRESS, TAG_ANY)) != NULL) ||
-		   ((vp = fr_pair_find_by_num(request->control, 0, PW_PACKET_DST_IPV6_ADDRESS, TAG_ANY)) != NULL)) {
+	} else if ((vp = dst_vp) != NULL) {
 		uint16_t dst_port;
 		fr_ipaddr_t dst_ipaddr;
 
@@ -2783,7 +2845,7 @@ static int request_will_proxy(REQUEST *request)
 			dst_ipaddr.prefix = 128;
 		}
 
-		vp = fr_pair_find_by_num(request->control, 0, PW_PACKET_DST_PORT, TAG_ANY);
+		vp = dst_port_vp;
 		if (!vp) {
 			if (request->packet->code == PW_CODE_ACCESS_REQUEST) {
 				dst_port = PW_AUTH_UDP_PORT;
@@ -3240,7 +3302,7 @@ static void request_ping(REQUEST *request, fr_state_action_t action)
 		/*
 		 *	Remove the request from any hashes
 		 */
-		fr_event_delete(el, &request->ev);
+		fr_event_delete(CURRENT_EL, &request->ev);
 		remove_from_proxy_hash(request);
 
 		/*
@@ -3661,6 +3723,11 @@ static bool proxy_keep_waiting(REQUEST *request, struct timeval *now)
 			mark_home_server_zombie(home, now, response_window);
 	}
 
+	/*
+	 *	Used by latency-balance pools.
+	 */
+	home_server_response_timeout(home, response_window);
+
 	FR_STATS_TYPE_INC(home->stats.total_timeouts);
 	if (home->type == HOME_TYPE_AUTH) {
 		if (request->proxy->listener) FR_STATS_TYPE_INC(request->proxy->listener->stats.total_timeouts);
@@ -3812,7 +3879,7 @@ static void proxy_wait_for_reply(REQUEST *request, fr_state_action_t action)
 	rad_assert(request->packet->code != PW_CODE_STATUS_SERVER);
 	rad_assert(request->proxy->home_server != NULL);
 
-	fr_event_now(el, &now);
+	fr_event_now(CURRENT_EL, &now);
 
 	switch (action) {
 	case FR_ACTION_DUP:
@@ -4146,7 +4213,7 @@ static bool coa_keep_waiting(REQUEST *request)
 		return false;
 	}
 
-	fr_event_now(el, &now);
+	fr_event_now(CURRENT_EL, &now);
 
 	if (request->delay == 0) {
 		/*
@@ -4465,7 +4532,7 @@ static void event_socket_handler(NDEBUG_UNUSED fr_event_list_t *xel, UNUSED int
 {
 	rad_listen_t *listener = talloc_get_type_abort(ctx, rad_listen_t);
 
-	rad_assert(xel == el);
+	rad_assert(xel == CURRENT_EL);
 
 	if ((listener->fd < 0)
 #ifdef WITH_DETAIL
@@ -4515,7 +4582,7 @@ static void listener_free_cb(void *ctx, UNUSED struct timeval *now)
 	char buffer[1024];
 
 	if (this->count > 0) {
-		fr_event_now(el, &this->when);
+		fr_event_now(CURRENT_EL, &this->when);
 		this->when.tv_sec += 3;
 
 		ASSERT_MASTER;
@@ -4569,7 +4636,7 @@ static int proxy_eol_cb(void *ctx, void *data)
 	 *	over the next second, so that we don't overload the
 	 *	server.
 	 */
-	fr_event_now(el, &when);
+	fr_event_now(CURRENT_EL, &when);
 	tv_add(&when, fr_rand() % USEC);
 	STATE_MACHINE_TIMER;
 
@@ -4580,6 +4647,133 @@ static int proxy_eol_cb(void *ctx, void *data)
 }
 #endif
 
+/** Stop a reader thread's event loop
+ *
+ */
+static void event_reader_wake(fr_event_list_t *xel, int fd, UNUSED void *ctx)
+{
+	uint8_t buffer[16];
+
+	if (read(fd, buffer, sizeof(buffer)) < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return;
+	}
+
+	fr_event_loop_exit(xel, 1);
+}
+
+static void *event_reader_thread(void *arg)
+{
+	event_reader_t *reader = arg;
+
+	this_reader = reader;
+
+	fr_event_loop(reader->el);
+
+	this_reader = NULL;
+
+	return NULL;
+}
+
+/** Run a listener in its own event loop, in its own thread
+ *
+ * @param this listener to read from.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int event_reader_start(rad_listen_t *this)
+{
+	event_reader_t *reader;
+	int rcode;
+
+	reader = talloc_zero(NULL, event_reader_t);
+	if (!reader) return -1;
+
+	reader->listener = this;
+	reader->wake[0] = reader->wake[1] = -1;
+
+	reader->el = fr_event_list_create(reader, NULL);
+	if (!reader->el) {
+		ERROR("Failed creating reader event list: %s", fr_strerror());
+	error:
+		if (reader->wake[0] >= 0) close(reader->wake[0]);
+		if (reader->wake[1] >= 0) close(reader->wake[1]);
+		if (reader->pl) rbtree_free(reader->pl);
+		talloc_free(reader);
+		return -1;
+	}
+
+	MEM(reader->pl = rbtree_create(NULL, packet_entry_cmp, NULL, 0));
+
+	if (pipe(reader->wake) < 0) {
+		ERROR("Error opening reader pipe: %s", fr_syserror(errno));
+		goto error;
+	}
+	if ((fr_nonblock(reader->wake[0]) < 0) ||
+	    (fcntl(reader->wake[0], F_SETFD, FD_CLOEXEC) < 0) ||
+	    (fcntl(reader->wake[1], F_SETFD, FD_CLOEXEC) < 0)) {
+		ERROR("Error setting reader pipe flags: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (!fr_event_fd_insert(reader->el, 0, reader->wake[0], event_reader_wake, reader) ||
+	    !fr_event_fd_insert(reader->el, 0, this->fd, event_socket_handler, this)) {
+		ERROR("Failed adding event handler for socket: %s", fr_strerror());
+		goto error;
+	}
+
+	rcode = pthread_create(&reader->pthread_id, NULL, event_reader_thread, reader);
+	if (rcode != 0) {
+		ERROR("Failed creating reader thread: %s", fr_syserror(rcode));
+		goto error;
+	}
+
+	reader->next = readers;
+	readers = reader;
+
+	return 0;
+}
+
+/** Stop all reader threads, and clean up the requests they still own
+ *
+ */
+static void event_reader_stop_all(void)
+{
+	event_reader_t *reader, *next;
+
+	for (reader = readers; reader != NULL; reader = reader->next) {
+		if (write(reader->wake[1], "", 1) < 0) {
+			ERROR("Failed stopping reader thread: %s", fr_syserror(errno));
+		}
+	}
+
+	for (reader = readers; reader != NULL; reader = next) {
+		next = reader->next;
+
+		pthread_join(reader->pthread_id, NULL);
+
+		/*
+		 *	The thread has exited, so we are now the
+		 *	owner of its requests.
+		 */
+		this_reader = reader;
+		rbtree_walk(reader->pl, RBTREE_DELETE_ORDER, request_delete_cb, NULL);
+		this_reader = NULL;
+
+		if (rbtree_num_elements(reader->pl) > 0) {
+			ERROR("Reader request list has %d requests still in it.",
+			      rbtree_num_elements(reader->pl));
+		}
+
+		rbtree_free(reader->pl);
+		close(reader->wake[0]);
+		close(reader->wake[1]);
+		talloc_free(reader);
+	}
+
+	readers = NULL;
+}
+
 static int event_new_fd(rad_listen_t *this)
 {
 	char buffer[1024];
@@ -4672,6 +4866,27 @@ static int event_new_fd(rad_listen_t *this)
 			break;
 		} /* switch over listener types */
 
+		/*
+		 *	SO_REUSEPORT copies of a socket each get their
+		 *	own event loop, in their own thread.
+		 */
+		if (listen_is_reader(this)) {
+			static bool warned = false;
+
+			if (readers_allowed) {
+				if (event_reader_start(this) < 0) fr_exit(1);
+
+				this->status = RAD_LISTEN_STATUS_KNOWN;
+				return 1;
+			}
+
+			if (!warned) {
+				WARN("Running 'readers' in the main event loop: "
+				     "separate readers require threads, and 'proxy_requests = no'");
+				warned = true;
+			}
+		}
+
 		/*
 		 *	All sockets: add the FD to the event handler.
 		 */
@@ -5135,6 +5350,16 @@ int radius_event_start(bool have_children)
 		MEM(pl = rbtree_create(NULL, packet_entry_cmp, NULL, 0));
 	}
 
+	/*
+	 *	Proxied requests are tracked by the main event loop,
+	 *	so sockets can only have their own readers when we
+	 *	don't proxy.
+	 */
+	readers_allowed = have_children;
+#ifdef WITH_PROXY
+	if (main_config.proxy_requests) readers_allowed = false;
+#endif
+
 #ifdef WITH_PROXY
 	if (main_config.proxy_requests && !check_config) {
 		/*
@@ -5295,7 +5520,7 @@ static int request_delete_cb(UNUSED void *ctx, void *data)
 
 	request->in_request_hash = false;
 	ASSERT_MASTER;
-	if (request->ev) fr_event_delete(el, &request->ev);
+	if (request->ev) fr_event_delete(CURRENT_EL, &request->ev);
 
 	if (main_config.memory_report) {
 		RDEBUG2("Cleaning up request packet ID %u with timestamp +%d",
@@ -5322,6 +5547,8 @@ void radius_event_free(void)
 {
 	ASSERT_MASTER;
 
+	event_reader_stop_all();
+
 #ifdef WITH_PROXY
 	/*
 	 *	There are requests in the proxy hash that aren't
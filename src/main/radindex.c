@@ -0,0 +1,294 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Build memory mapped indexes of passwd style and CSV files.
+ * @file main/radindex.c
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static char const *radindex_version = "radindex version " RADIUSD_VERSION_STRING
+#ifdef RADIUSD_VERSION_COMMIT
+" (git #" STRINGIFY(RADIUSD_VERSION_COMMIT) ")"
+#endif
+", built on " __DATE__ " at " __TIME__;
+
+#undef DEBUG
+#define DEBUG(fmt, ...)		if (fr_debug_lvl > 0) fprintf(fr_log_fp, "radindex (debug): " fmt "\n", ## __VA_ARGS__)
+
+#define ERROR(fmt, ...)		fprintf(fr_log_fp, "radindex (error): " fmt "\n", ## __VA_ARGS__)
+#define WARN(fmt, ...)		fprintf(fr_log_fp, "radindex (warning): " fmt "\n", ## __VA_ARGS__)
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "Usage: radindex [options] <file>\n");
+
+	fprintf(stderr, "  <file>                 passwd style or CSV file to index.\n");
+	fprintf(stderr, "  -d <delimiter>         Field delimiter (defaults to ':').\n");
+	fprintf(stderr, "  -h                     Print usage help information.\n");
+	fprintf(stderr, "  -k <field>             Key field, counting from 1 (defaults to 1).\n");
+	fprintf(stderr, "  -l                     The key field is a comma separated list of keys.\n");
+	fprintf(stderr, "  -n                     Skip NIS style lines, starting with '+' or '-'.\n");
+	fprintf(stderr, "  -o <index>             Write the index to this file (defaults to <file>.idx).\n");
+	fprintf(stderr, "  -q                     Fields may be quoted, as in RFC 4180.\n");
+	fprintf(stderr, "  -v                     Show program version information.\n");
+	fprintf(stderr, "  -x                     Increase debug level.\n");
+
+	exit(1);
+}
+
+/*
+ *	Find the key field in a line.  Quoted keys are unquoted
+ *	into "out", which must be at least as long as the line.
+ */
+static bool line_to_key(fr_file_index_info_t const *info, char const *line, char *out,
+			char const **key, size_t *key_len)
+{
+	char const	*p = line;
+	char const	*end;
+	char		*q;
+	uint32_t	i;
+
+	for (i = 0; i < info->key_field; i++) {
+		if ((info->flags & FR_FILE_INDEX_QUOTED) && (*p == '"')) {
+			for (p++; *p; p++) {
+				if (*p != '"') continue;
+				if (p[1] != '"') break;
+				p++;
+			}
+			if (!*p) return false;
+			p++;
+		}
+
+		p = strchr(p, info->delimiter);
+		if (!p) return false;
+		p++;
+	}
+
+	if (!(info->flags & FR_FILE_INDEX_QUOTED) || (*p != '"')) {
+		end = strchr(p, info->delimiter);
+		if (!end) end = p + strlen(p);
+
+		*key = p;
+		*key_len = end - p;
+		return true;
+	}
+
+	/*
+	 *	Double quotes to single quotes, and stop at the
+	 *	closing quote.
+	 */
+	for (p++, q = out; *p; p++) {
+		if (*p == '"') {
+			if (p[1] != '"') break;
+			p++;
+		}
+		*(q++) = *p;
+	}
+	if (!*p) return false;
+
+	*key = out;
+	*key_len = q - out;
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	int				c;
+	char const			*filename, *index_file = NULL;
+	fr_file_index_info_t		info;
+	fr_file_index_builder_t		*b;
+	struct stat			st;
+	FILE				*fp;
+	char				buffer[8192], unquoted[8192];
+	int				lineno = 0;
+	TALLOC_CTX			*ctx;
+
+	fr_log_fp = stderr;
+
+#ifndef NDEBUG
+	if (fr_fault_setup(getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("radindex");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	memset(&info, 0, sizeof(info));
+	info.delimiter = ':';
+
+	while ((c = getopt(argc, argv, "d:hk:lno:qvx")) != EOF) switch (c) {
+		case 'd':
+			if (!*optarg || optarg[1]) {
+				ERROR("Delimiter must be a single character");
+				usage();
+			}
+			info.delimiter = *optarg;
+			break;
+
+		case 'k':
+			if (!isdigit((int) *optarg) || (atoi(optarg) < 1)) usage();
+			info.key_field = atoi(optarg) - 1;
+			break;
+
+		case 'l':
+			info.flags |= FR_FILE_INDEX_LIST_KEYS;
+			break;
+
+		case 'n':
+			info.flags |= FR_FILE_INDEX_IGNORE_NIS;
+			break;
+
+		case 'o':
+			index_file = optarg;
+			break;
+
+		case 'q':
+			info.flags |= FR_FILE_INDEX_QUOTED;
+			break;
+
+		case 'v':
+			fprintf(stdout, "%s\n", radindex_version);
+			exit(EXIT_SUCCESS);
+
+		case 'x':
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) usage();
+	filename = argv[0];
+
+	ctx = talloc_init("radindex");
+	if (!index_file) index_file = talloc_typed_asprintf(ctx, "%s.idx", filename);
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		ERROR("Failed opening %s: %s", filename, fr_syserror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(fileno(fp), &st) < 0) {
+		ERROR("Failed checking %s: %s", filename, fr_syserror(errno));
+		exit(EXIT_FAILURE);
+	}
+	info.source_mtime = st.st_mtime;
+	info.source_size = st.st_size;
+
+	b = fr_file_index_builder_create(ctx, index_file, &info, st.st_mode & 0777);
+	if (!b) {
+		fr_perror("radindex");
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		char const	*key;
+		size_t		key_len, len;
+		uint64_t	line_offset;
+
+		lineno++;
+
+		len = strlen(buffer);
+		if (!len) continue;
+
+		if ((buffer[len - 1] != '\n') && !feof(fp)) {
+			ERROR("%s[%d]: Line too long", filename, lineno);
+		error:
+			talloc_free(ctx);
+			exit(EXIT_FAILURE);
+		}
+
+		while ((len > 0) && ((buffer[len - 1] == '\n') || (buffer[len - 1] == '\r'))) buffer[--len] = '\0';
+		if (!len) continue;
+
+		if ((info.flags & FR_FILE_INDEX_IGNORE_NIS) && ((*buffer == '+') || (*buffer == '-'))) continue;
+
+		if (!line_to_key(&info, buffer, unquoted, &key, &key_len)) {
+			WARN("%s[%d]: No key field, skipping", filename, lineno);
+			continue;
+		}
+		if (!key_len) continue;
+
+		if (!(info.flags & FR_FILE_INDEX_LIST_KEYS)) {
+			if (!fr_file_index_builder_add(b, key, key_len, buffer, len, 0)) {
+			add_error:
+				ERROR("%s[%d]: %s", filename, lineno, fr_strerror());
+				goto error;
+			}
+			info.num_records++;
+			continue;
+		}
+
+		/*
+		 *	Index the same line under each key in the list.
+		 */
+		line_offset = 0;
+		while (key_len > 0) {
+			char const	*comma;
+			size_t		this_len;
+
+			comma = memchr(key, ',', key_len);
+			this_len = comma ? (size_t) (comma - key) : key_len;
+
+			if (this_len > 0) {
+				line_offset = fr_file_index_builder_add(b, key, this_len, buffer, len, line_offset);
+				if (!line_offset) goto add_error;
+				info.num_records++;
+			}
+
+			if (!comma) break;
+			key_len -= this_len + 1;
+			key = comma + 1;
+		}
+	}
+
+	if (ferror(fp)) {
+		ERROR("Failed reading %s: %s", filename, fr_syserror(errno));
+		goto error;
+	}
+	fclose(fp);
+
+	if (fr_file_index_builder_commit(b) < 0) {
+		fr_perror("radindex");
+		goto error;
+	}
+
+	DEBUG("Indexed %" PRIu64 " keys from %s in %s", info.num_records, filename, index_file);
+
+	talloc_free(ctx);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,5 @@
+TARGET		:= radindex
+SOURCES		:= radindex.c
+
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -18,7 +18,6 @@ SOURCES := acct.c \
     soh.c \
     session.c \
     snmp.c \
-    threads.c \
     process.c
 
 ifneq ($(OPENSSL_LIBS),)
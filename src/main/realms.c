@@ -1270,6 +1270,8 @@ static int server_pool_add(realm_config_t *rc,
 			{ "client-balance", HOME_POOL_CLIENT_BALANCE },
 			{ "client-port-balance", HOME_POOL_CLIENT_PORT_BALANCE },
 			{ "keyed-balance", HOME_POOL_KEYED_BALANCE },
+			{ "consistent-balance", HOME_POOL_CONSISTENT_BALANCE },
+			{ "latency-balance", HOME_POOL_LATENCY_BALANCE },
 			{ NULL, 0 }
 		};
 
@@ -2416,6 +2418,164 @@ void home_server_update_request(home_server_t *home, REQUEST *request)
 	request->proxy->home_server = home;
 }
 
+/*
+ *	Whether a home server can be used for this request.  Zombies
+ *	are usable, but should only be chosen as a last resort.
+ */
+static bool home_server_usable(home_server_t const *home, REQUEST *request)
+{
+	/*
+	 *	Skip dead home servers.
+	 *
+	 *	Home servers that are unknown, alive, or zombie
+	 *	are used for proxying.
+	 */
+	if (home->state == HOME_STATE_IS_DEAD) return false;
+
+	/*
+	 *	This home server is too busy.  Choose another one.
+	 */
+	if (home->currently_outstanding >= home->max_outstanding) return false;
+
+#ifdef WITH_DETAIL
+	/*
+	 *	We read the packet from a detail file, AND it
+	 *	came from this server.  Don't re-proxy it
+	 *	there.
+	 */
+	if ((request->listener->type == RAD_LISTEN_DETAIL) &&
+	    (request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
+	    (fr_ipaddr_cmp(&home->ipaddr, &request->packet->src_ipaddr) == 0)) {
+		return false;
+	}
+#endif
+
+	/*
+	 *	Default virtual: ignore homes tied to a
+	 *	virtual.
+	 */
+	if (!request->server && home->parent_server) return false;
+
+	/*
+	 *	A virtual AND home is tied to virtual,
+	 *	ignore ones which don't match.
+	 */
+	if (request->server && home->parent_server &&
+	    strcmp(request->server, home->parent_server) != 0) {
+		return false;
+	}
+
+	/*
+	 *	Allow request->server && !home->parent_server
+	 *
+	 *	i.e. virtuals can proxy to globally defined
+	 *	homes.
+	 */
+	return true;
+}
+
+/*
+ *	Jump consistent hash, from "A Fast, Minimal Memory, Consistent
+ *	Hash Algorithm" (Lamping & Veach).  Maps a key to one of
+ *	"buckets" buckets, so that adding a bucket to the end only
+ *	moves 1/buckets of the keys.
+ */
+static int home_server_jump_hash(uint64_t key, int buckets)
+{
+	int64_t b = -1, j = 0;
+
+	while (j < buckets) {
+		b = j;
+		key = (key * 2862933555777941757ULL) + 1;
+		j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+	}
+
+	return b;
+}
+
+/*
+ *	Choose a live home server by consistent hashing.
+ *
+ *	If the chosen server can't be used, the key is hashed again,
+ *	so the requests for an unusable server are spread over all
+ *	the others, instead of all moving to its neighbour.
+ */
+static home_server_t *home_server_consistent(home_pool_t *pool, REQUEST *request, uint64_t key)
+{
+	int count;
+
+	for (count = 0; count < pool->num_home_servers; count++) {
+		home_server_t *home = pool->servers[home_server_jump_hash(key, pool->num_home_servers)];
+
+		if (home && home_server_usable(home, request) && (home->state != HOME_STATE_ZOMBIE)) {
+			RDEBUG3("PROXY Choosing %s: Consistent hash of Load-Balance-Key", home->log_name);
+			return home;
+		}
+
+		key = ((uint64_t) fr_hash_update(&key, sizeof(key), (uint32_t) key) << 32) | (key >> 32);
+	}
+
+	return NULL;
+}
+
+/*
+ *	The cost of sending a request to a home server, for
+ *	latency-balance pools.  Servers which haven't responded yet
+ *	are assumed to be as fast as the average.
+ */
+static uint64_t home_server_cost(home_server_t const *home, uint32_t average)
+{
+	uint32_t response_time = home->response_time ? home->response_time : average;
+
+	return ((uint64_t) home->currently_outstanding + 1) * (response_time ? response_time : 1);
+}
+
+/*
+ *	Exponentially weighted, with alpha = 1/8.
+ */
+static void home_server_response_update(home_server_t *home, uint64_t usec)
+{
+	if (usec > UINT32_MAX) usec = UINT32_MAX;
+	if (!usec) usec = 1;
+
+	if (!home->response_time) {
+		home->response_time = usec;
+	} else {
+		home->response_time = ((home->response_time * (uint64_t) 7) + usec) / 8;
+	}
+}
+
+/** Update a home server's average response time
+ *
+ * @param[in] home server which responded.
+ * @param[in] sent when the request was sent.
+ * @param[in] now when the response was received.
+ */
+void home_server_response_time(home_server_t *home, struct timeval const *sent, struct timeval const *now)
+{
+	struct timeval	diff;
+
+	if (timercmp(now, sent, <)) return;
+
+	timersub(now, sent, &diff);
+	home_server_response_update(home, ((uint64_t) diff.tv_sec * 1000000) + diff.tv_usec);
+}
+
+/** Update a home server's average response time when it didn't respond
+ *
+ * The request is counted as having taken the whole response window, so
+ * a server which stops responding looks slower, and latency-balance
+ * pools send it less traffic, instead of it keeping the average from
+ * its last reply.
+ *
+ * @param[in] home server which didn't respond.
+ * @param[in] response_window how long we waited for the response.
+ */
+void home_server_response_timeout(home_server_t *home, struct timeval const *response_window)
+{
+	home_server_response_update(home, ((uint64_t) response_window->tv_sec * 1000000) + response_window->tv_usec);
+}
+
 home_server_t *home_server_ldb(char const *realmname,
 			     home_pool_t *pool, REQUEST *request)
 {
@@ -2425,6 +2585,7 @@ home_server_t *home_server_ldb(char const *realmname,
 	home_server_t	*zombie = NULL;
 	VALUE_PAIR	*vp;
 	uint32_t	hash;
+	uint32_t	average = 0;
 
 	/*
 	 *	Determine how to pick choose the home server.
@@ -2493,6 +2654,43 @@ home_server_t *home_server_ldb(char const *realmname,
 		start = 0;
 		break;
 
+	case HOME_POOL_CONSISTENT_BALANCE:
+		start = 0;
+
+		if ((vp = fr_pair_find_by_num(request->control, 0, PW_LOAD_BALANCE_KEY, TAG_ANY)) != NULL) {
+			uint64_t key;
+
+			hash = fr_hash(vp->vp_strvalue, vp->vp_length);
+			key = ((uint64_t) hash << 32) | fr_hash_update(vp->vp_strvalue, vp->vp_length, ~hash);
+
+			found = home_server_consistent(pool, request, key);
+			if (found) goto update_and_return;
+		}
+		break;
+
+	case HOME_POOL_LATENCY_BALANCE:
+	{
+		uint64_t	total = 0;
+		uint32_t	responding = 0;
+
+		start = 0;
+
+		/*
+		 *	The average response time of the servers
+		 *	which have responded.
+		 */
+		for (count = 0; count < pool->num_home_servers; count++) {
+			home_server_t *home = pool->servers[count];
+
+			if (!home || !home->response_time) continue;
+
+			total += home->response_time;
+			responding++;
+		}
+		if (responding) average = total / responding;
+	}
+		break;
+
 	default:		/* this shouldn't happen... */
 		start = 0;
 		break;
@@ -2511,59 +2709,7 @@ home_server_t *home_server_ldb(char const *realmname,
 
 		if (!home) continue;
 
-		/*
-		 *	Skip dead home servers.
-		 *
-		 *	Home servers that are unknown, alive, or zombie
-		 *	are used for proxying.
-		 */
-		if (home->state == HOME_STATE_IS_DEAD) {
-			continue;
-		}
-
-		/*
-		 *	This home server is too busy.  Choose another one.
-		 */
-		if (home->currently_outstanding >= home->max_outstanding) {
-			continue;
-		}
-
-#ifdef WITH_DETAIL
-		/*
-		 *	We read the packet from a detail file, AND it
-		 *	came from this server.  Don't re-proxy it
-		 *	there.
-		 */
-		if ((request->listener->type == RAD_LISTEN_DETAIL) &&
-		    (request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
-		    (fr_ipaddr_cmp(&home->ipaddr, &request->packet->src_ipaddr) == 0)) {
-			continue;
-		}
-#endif
-
-		/*
-		 *	Default virtual: ignore homes tied to a
-		 *	virtual.
-		 */
-		if (!request->server && home->parent_server) {
-			continue;
-		}
-
-		/*
-		 *	A virtual AND home is tied to virtual,
-		 *	ignore ones which don't match.
-		 */
-		if (request->server && home->parent_server &&
-		    strcmp(request->server, home->parent_server) != 0) {
-			continue;
-		}
-
-		/*
-		 *	Allow request->server && !home->parent_server
-		 *
-		 *	i.e. virtuals can proxy to globally defined
-		 *	homes.
-		 */
+		if (!home_server_usable(home, request)) continue;
 
 		/*
 		 *	It's zombie, so we remember the first zombie
@@ -2578,7 +2724,7 @@ home_server_t *home_server_ldb(char const *realmname,
 		/*
 		 *	We've found the first "live" one.  Use that.
 		 */
-		if (pool->type != HOME_POOL_LOAD_BALANCE) {
+		if ((pool->type != HOME_POOL_LOAD_BALANCE) && (pool->type != HOME_POOL_LATENCY_BALANCE)) {
 			found = home;
 			break;
 		}
@@ -2592,6 +2738,33 @@ home_server_t *home_server_ldb(char const *realmname,
 			continue;
 		}
 
+		/*
+		 *	Prefer the server which is expected to finish
+		 *	its outstanding requests first.
+		 */
+		if (pool->type == HOME_POOL_LATENCY_BALANCE) {
+			uint64_t found_cost = home_server_cost(found, average);
+			uint64_t home_cost = home_server_cost(home, average);
+
+			RDEBUG3("PROXY %s %" PRIu64 "\t%s %" PRIu64,
+			       found->log_name, found_cost, home->log_name, home_cost);
+
+			if (home_cost < found_cost) {
+				RDEBUG3("PROXY Choosing %s: It's expected to respond sooner than %s",
+				       home->log_name, found->log_name);
+				found = home;
+				continue;
+			}
+
+			if (home_cost > found_cost) {
+				RDEBUG3("PROXY Skipping %s: It's expected to respond later than %s",
+				       home->log_name, found->log_name);
+				continue;
+			}
+
+			goto random;
+		}
+
 		RDEBUG3("PROXY %s %d\t%s %d",
 		       found->log_name, found->currently_outstanding,
 		       home->log_name, home->currently_outstanding);
@@ -2621,6 +2794,7 @@ home_server_t *home_server_ldb(char const *realmname,
 		 *	From the list of servers which have the same
 		 *	load, choose one at random.
 		 */
+	random:
 		if (((count + 1) * (fr_rand() & 0xffff)) < (uint32_t) 0x10000) {
 			found = home;
 		}
@@ -0,0 +1,275 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file reload.c
+ * @brief Reload data read from files when they change, without blocking readers.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/reload.h>
+
+#include <sys/stat.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/*
+ *	Readers register in one of two counters, selected by the
+ *	current epoch, and then load the data pointer.  The reload
+ *	thread swaps the pointer, advances the epoch, and waits
+ *	for the counter for the previous epoch to drain.  Once it
+ *	has, no reader can still be using the old data, and it's
+ *	freed.  Readers never take a lock, or wait.
+ */
+typedef _Atomic(void *) reload_data_ptr_t;
+
+struct reload_t {
+	char const		*name;			//!< Instance name, for log messages.
+	char const		*filename;		//!< File to watch.
+	uint32_t		interval;		//!< How often to check the file, in seconds.
+
+	reload_load_t		load;			//!< Reads the file.
+	reload_free_t		free;			//!< Frees data read by load.
+	void			*uctx;			//!< Passed to load and free.
+
+	struct stat		st;			//!< When the file was last loaded.
+
+	reload_data_ptr_t	data;			//!< Current data.
+	atomic_uint		epoch;			//!< Selects which counter readers use.
+	atomic_uint		active[2];		//!< Readers in each epoch.
+
+	pthread_t		thread;			//!< Reload thread.
+	bool			running;		//!< Whether the reload thread was started.
+	bool			stop;			//!< Tells the reload thread to exit.
+	pthread_mutex_t		mutex;			//!< Protects stop.
+	pthread_cond_t		cond;			//!< Signalled when stop is set.
+};
+
+/*
+ *	Whether the file has changed since we last loaded it.
+ */
+static bool reload_changed(reload_t *rl, struct stat *st)
+{
+	if (stat(rl->filename, st) < 0) {
+		ERROR("%s - Failed checking %s: %s", rl->name, rl->filename, fr_syserror(errno));
+		return false;
+	}
+
+	return ((st->st_mtime != rl->st.st_mtime) ||
+		(st->st_size != rl->st.st_size) ||
+		(st->st_ino != rl->st.st_ino) ||
+		(st->st_dev != rl->st.st_dev));
+}
+
+/*
+ *	Swap in the new data, and free the old data once
+ *	readers have finished with it.
+ */
+static void reload_swap(reload_t *rl, void *data)
+{
+	void		*old;
+	unsigned int	epoch;
+
+	old = atomic_exchange(&rl->data, data);
+	epoch = atomic_fetch_add(&rl->epoch, 1);
+
+	while (atomic_load(&rl->active[epoch & 0x01]) > 0) usleep(1000);
+
+	rl->free(old, rl->uctx);
+}
+
+static void *reload_thread(void *arg)
+{
+	reload_t	*rl = arg;
+	struct stat	st;
+	struct timeval	now;
+	struct timespec	when;
+	void		*data;
+
+	pthread_mutex_lock(&rl->mutex);
+	while (!rl->stop) {
+		gettimeofday(&now, NULL);
+		when.tv_sec = now.tv_sec + rl->interval;
+		when.tv_nsec = now.tv_usec * 1000;
+
+		pthread_cond_timedwait(&rl->cond, &rl->mutex, &when);
+		if (rl->stop) break;
+
+		pthread_mutex_unlock(&rl->mutex);
+
+		if (reload_changed(rl, &st)) {
+			INFO("%s - %s has changed, reloading", rl->name, rl->filename);
+
+			/*
+			 *	Remember the new version even if it fails
+			 *	to load, so we don't keep trying to load
+			 *	the same broken file.
+			 */
+			rl->st = st;
+
+			data = rl->load(rl->filename, rl->uctx);
+			if (!data) {
+				ERROR("%s - Failed reloading %s, continuing with previous data",
+				      rl->name, rl->filename);
+			} else {
+				reload_swap(rl, data);
+				INFO("%s - Reloaded %s", rl->name, rl->filename);
+			}
+		}
+
+		pthread_mutex_lock(&rl->mutex);
+	}
+	pthread_mutex_unlock(&rl->mutex);
+
+	return NULL;
+}
+
+static int _reload_free(reload_t *rl)
+{
+	void *data;
+
+	if (rl->running) {
+		pthread_mutex_lock(&rl->mutex);
+		rl->stop = true;
+		pthread_cond_signal(&rl->cond);
+		pthread_mutex_unlock(&rl->mutex);
+
+		pthread_join(rl->thread, NULL);
+	}
+
+	pthread_cond_destroy(&rl->cond);
+	pthread_mutex_destroy(&rl->mutex);
+
+	data = atomic_load(&rl->data);
+	if (data) rl->free(data, rl->uctx);
+
+	return 0;
+}
+
+/** Load data from a file, and reload it when the file changes
+ *
+ * The file is loaded before this function returns.  If interval is
+ * non-zero, a thread checks the file every interval seconds, and
+ * loads it again if its mtime, size or inode has changed.
+ *
+ * The data is freed when the returned handle is freed.
+ *
+ * @param[in] ctx to allocate the handle in.  Usually the module instance.
+ * @param[in] name to use in log messages.  Usually the module instance name.
+ * @param[in] filename to load.
+ * @param[in] interval how often to check the file, in seconds.  0 disables reloading.
+ * @param[in] load reads the file.
+ * @param[in] free_func frees data returned by load.
+ * @param[in] uctx passed to load and free_func.
+ * @return
+ *	- New reload handle.
+ *	- NULL if the file couldn't be loaded, or on error.
+ */
+reload_t *reload_init(TALLOC_CTX *ctx, char const *name, char const *filename, uint32_t interval,
+		      reload_load_t load, reload_free_t free_func, void *uctx)
+{
+	reload_t	*rl;
+	void		*data;
+
+	rad_assert(load && free_func);
+
+	MEM(rl = talloc_zero(ctx, reload_t));
+	rl->name = name;
+	rl->filename = talloc_typed_strdup(rl, filename);
+	rl->interval = interval;
+	rl->load = load;
+	rl->free = free_func;
+	rl->uctx = uctx;
+
+	atomic_init(&rl->data, NULL);
+	atomic_init(&rl->epoch, 0);
+	atomic_init(&rl->active[0], 0);
+	atomic_init(&rl->active[1], 0);
+
+	pthread_mutex_init(&rl->mutex, NULL);
+	pthread_cond_init(&rl->cond, NULL);
+	talloc_set_destructor(rl, _reload_free);
+
+	if (stat(filename, &rl->st) < 0) {
+		ERROR("%s - Failed checking %s: %s", name, filename, fr_syserror(errno));
+	error:
+		talloc_free(rl);
+		return NULL;
+	}
+
+	data = load(filename, uctx);
+	if (!data) goto error;
+	atomic_store(&rl->data, data);
+
+	if (!interval) return rl;
+
+	if (pthread_create(&rl->thread, NULL, reload_thread, rl) != 0) {
+		ERROR("%s - Failed creating reload thread: %s", name, fr_syserror(errno));
+		goto error;
+	}
+	rl->running = true;
+
+	return rl;
+}
+
+/** Get the current data
+ *
+ * Never blocks.  The data stays valid until the matching call to
+ * reload_release(), even if the file is reloaded in the meantime.
+ *
+ * @param[in] rl to get the data from.
+ * @param[out] ref to pass to reload_release().
+ * @return The current data.
+ */
+void *reload_acquire(reload_t *rl, unsigned int *ref)
+{
+	unsigned int epoch;
+
+	for (;;) {
+		epoch = atomic_load(&rl->epoch);
+		atomic_fetch_add(&rl->active[epoch & 0x01], 1);
+
+		/*
+		 *	If the epoch changed before we registered,
+		 *	the reload thread may not have seen us.
+		 */
+		if (atomic_load(&rl->epoch) == epoch) break;
+
+		atomic_fetch_sub(&rl->active[epoch & 0x01], 1);
+	}
+
+	*ref = epoch & 0x01;
+
+	return atomic_load(&rl->data);
+}
+
+/** Release data returned by reload_acquire()
+ *
+ * @param[in] rl the data was acquired from.
+ * @param[in] ref returned by reload_acquire().
+ */
+void reload_release(reload_t *rl, unsigned int ref)
+{
+	atomic_fetch_sub(&rl->active[ref], 1);
+}
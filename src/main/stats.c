@@ -79,25 +79,25 @@ void request_stats_final(REQUEST *request)
 		return;
 
 #undef INC_AUTH
-#define INC_AUTH(_x) radius_auth_stats._x++;request->listener->stats._x++;request->client->auth._x++;
+#define INC_AUTH(_x) FR_STATS_ADD(radius_auth_stats._x, 1);FR_STATS_ADD(request->listener->stats._x, 1);FR_STATS_ADD(request->client->auth._x, 1);
 
 #undef INC_ACCT
 #ifdef WITH_ACCOUNTING
-#define INC_ACCT(_x) radius_acct_stats._x++;request->listener->stats._x++;request->client->acct._x++
+#define INC_ACCT(_x) FR_STATS_ADD(radius_acct_stats._x, 1);FR_STATS_ADD(request->listener->stats._x, 1);FR_STATS_ADD(request->client->acct._x, 1)
 #else
 #define INC_ACCT(_x)
 #endif
 
 #undef INC_COA
 #ifdef WITH_COA
-#define INC_COA(_x) radius_coa_stats._x++;request->listener->stats._x++;request->client->coa._x++
+#define INC_COA(_x) FR_STATS_ADD(radius_coa_stats._x, 1);FR_STATS_ADD(request->listener->stats._x, 1);FR_STATS_ADD(request->client->coa._x, 1)
 #else
 #define INC_COA(_x)
 #endif
 
 #undef INC_DSC
 #ifdef WITH_DSC
-#define INC_DSC(_x) radius_dsc_stats._x++;request->listener->stats._x++;request->client->dsc._x++
+#define INC_DSC(_x) FR_STATS_ADD(radius_dsc_stats._x, 1);FR_STATS_ADD(request->listener->stats._x, 1);FR_STATS_ADD(request->client->dsc._x, 1)
 #else
 #define INC_DSC(_x)
 #endif
@@ -105,10 +105,9 @@ void request_stats_final(REQUEST *request)
 	/*
 	 *	Update the statistics.
 	 *
-	 *	Note that we do NOT do this in a child thread.
-	 *	Instead, we update the stats when a request is
-	 *	deleted, because only the main server thread calls
-	 *	this function, which makes it thread-safe.
+	 *	We update the stats when a request is deleted.  With
+	 *	"readers", each reader thread deletes its own requests,
+	 *	so the counters are incremented atomically.
 	 */
 	if (request->reply && (request->packet->code != PW_CODE_STATUS_SERVER)) switch (request->reply->code) {
 	case PW_CODE_ACCESS_ACCEPT:
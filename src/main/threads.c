@@ -29,6 +29,12 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 /*
  *	Other OS's have sem_init, OS X doesn't.
  */
@@ -90,7 +96,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
  *
  *	When the server is reaching overload, there are no threads in
  *	the idle queue.  In that case, the request is added to the
- *	idle_heap.  Any active threads will check the heap FIRST,
+ *	heap.  Any active threads will check the heap FIRST,
  *	before moving themselves to the idle list as described above.
  *	If there are requests in the heap, the thread stays in the
  *	active list, and processes the packet.
@@ -100,6 +106,25 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
  *	needed, marking old "idle" threads as cancelled, etc.  That
  *	work is done with the mutex released (if at all possible).
  *	This practice minimizes contention on the mutex.
+ *
+ *	To avoid having one mutex for the entire server, the queue
+ *	and the idle / active lists are split into "queue_shards"
+ *	shards.  Each shard has its own mutex, heap, and lists, and
+ *	each thread belongs to one shard.  The thread which enqueues
+ *	a request prefers a shard which has an idle thread.  If there
+ *	are no idle threads, the request goes into the heap of the
+ *	next shard, in round-robin order, and an idle thread in any
+ *	other shard is woken up to "steal" it.  When a thread has
+ *	finished a request, it checks the heap of its own shard, and
+ *	then tries to steal a request from the other shards.
+ *
+ *	The ordering given by "queue_priority" is therefore only
+ *	strict within a shard.  With one shard (the default), the
+ *	behaviour is the same as having one global queue.
+ *
+ *	The global pool mutex now only protects the management of the
+ *	pool (spawning and reaping threads), which happens at most
+ *	once a second.
  */
 #  define THREAD_IDLE		(1)
 #  define THREAD_ACTIVE		(2)
@@ -114,6 +139,8 @@ typedef struct THREAD_HANDLE {
 	struct THREAD_HANDLE	*prev;		//!< Previous thread handle (in the linked list).
 	struct THREAD_HANDLE	*next;		//!< Next thread handle (int the linked list).
 
+	struct thread_shard_t	*shard;		//!< The shard this thread takes requests from.
+
 	pthread_t		pthread_id;	//!< pthread_id.
 	int			thread_num;	//!< Server thread number, 1...number of threads.
 	int			status;		//!< Is the thread running or exited?
@@ -124,6 +151,29 @@ typedef struct THREAD_HANDLE {
 	sem_t			semaphore;	//!< used to signal the thread when there are new requests
 } THREAD_HANDLE;
 
+/*
+ *  One shard of the request queue.
+ */
+typedef struct thread_shard_t {
+	pthread_mutex_t		mutex;		//!< Protects everything in the shard.
+
+	fr_heap_t		*heap;		//!< Requests waiting for a thread, in priority order.
+	uint32_t		num_queued;	//!< Number of requests in the heap.
+	uint32_t		requests;	//!< Number of requests given to threads in this shard.
+
+	uint32_t		idle_threads;
+	uint32_t		active_threads;
+
+	THREAD_HANDLE		*idle_head;
+	THREAD_HANDLE		*idle_tail;
+
+	THREAD_HANDLE		*active_head;
+	THREAD_HANDLE		*active_tail;
+
+	time_t			last_complained; //!< When we last complained about blocked requests.
+	time_t			total_blocked;	//!< Number of blocked requests since then.
+} thread_shard_t;
+
 #endif	/* WITH_GCD */
 
 typedef struct thread_fork_t {
@@ -180,37 +230,28 @@ typedef struct THREAD_POOL {
 	char const	*queue_priority;
 
 	/*
-	 *	To ensure only one thread at a time touches the scheduler.
+	 *	To ensure only one thread at a time manages the pool.
 	 *
-	 *	Threads start off on the idle list.  As packets come
-	 *	in, the threads go to the active list.  If the idle
-	 *	list is empty, packets go to the idle_heap.
+	 *	The idle / active lists and the queue of waiting
+	 *	packets are in the shards.  See above.
 	 */
 	pthread_mutex_t	mutex;
 
 	bool		spawning;
-	time_t		managed;
+	atomic_uint_fast64_t managed;
 
 	uint32_t	max_queue_size;
-	uint32_t	num_queued;
-
-	uint32_t        requests;
+	atomic_uint_fast32_t num_queued;	//!< Total over all shards.
 
 	fr_heap_cmp_t	heap_cmp;
 
+	uint32_t	num_shards;
+	thread_shard_t	*shards;
+	atomic_uint_fast32_t next_shard;	//!< Round-robin counter for enqueueing.
+
 	uint32_t	total_threads;
-	uint32_t	active_threads;
-	uint32_t	idle_threads;
 	uint32_t	exited_threads;
 
-	fr_heap_t	*idle_heap;
-
-	THREAD_HANDLE	*idle_head;
-	THREAD_HANDLE	*idle_tail;
-
-	THREAD_HANDLE	*active_head;
-	THREAD_HANDLE	*active_tail;
-
 	THREAD_HANDLE	*exited_head;
 	THREAD_HANDLE	*exited_tail;
 #endif	/* WITH_GCD */
@@ -237,6 +278,7 @@ static const CONF_PARSER thread_config[] = {
 	{ FR_CONF_POINTER("max_requests_per_server", PW_TYPE_INTEGER, &thread_pool.max_requests_per_thread), .dflt = "0" },
 	{ FR_CONF_POINTER("cleanup_delay", PW_TYPE_INTEGER, &thread_pool.cleanup_delay), .dflt = "5" },
 	{ FR_CONF_POINTER("max_queue_size", PW_TYPE_INTEGER, &thread_pool.max_queue_size), .dflt = "65536" },
+	{ FR_CONF_POINTER("queue_shards", PW_TYPE_INTEGER, &thread_pool.num_shards), .dflt = "1" },
 	{ FR_CONF_POINTER("queue_priority", PW_TYPE_STRING, &thread_pool.queue_priority), .dflt = NULL },
 #ifdef WITH_STATS
 #ifdef WITH_ACCOUNTING
@@ -293,7 +335,124 @@ static void reap_children(void)
 #endif /* WNOHANG */
 
 #ifndef WITH_GCD
-static REQUEST *request_dequeue(void);
+static REQUEST *request_dequeue(thread_shard_t *shard);
+static void request_wake(thread_shard_t *queued);
+
+/*
+ *	Move a thread from the head of the idle list of its shard,
+ *	to the head of the active list.
+ *
+ *	Called with the shard mutex held.
+ */
+static void thread_idle_to_active(thread_shard_t *shard, THREAD_HANDLE *thread)
+{
+	rad_assert(thread->prev == NULL);
+	rad_assert(shard->idle_head == thread);
+
+	shard->idle_head = thread->next;
+	if (thread->next) {
+		thread->next->prev = NULL;
+	} else {
+		rad_assert(shard->idle_tail == thread);
+		shard->idle_tail = thread->prev;
+		rad_assert(shard->idle_threads == 1);
+	}
+	shard->idle_threads--;
+
+	thread->next = shard->active_head;
+	if (thread->next) {
+		rad_assert(shard->active_tail != NULL);
+		thread->next->prev = thread;
+	} else {
+		rad_assert(shard->active_tail == NULL);
+		shard->active_tail = thread;
+	}
+	shard->active_head = thread;
+	shard->active_threads++;
+}
+
+/*
+ *	Move a thread from the active list of its shard, to the head
+ *	of the idle list.
+ *
+ *	Called with the shard mutex held.
+ */
+static void thread_active_to_idle(thread_shard_t *shard, THREAD_HANDLE *thread)
+{
+	if (thread->prev) {
+		rad_assert(shard->active_head != thread);
+		thread->prev->next = thread->next;
+
+	} else {
+		rad_assert(shard->active_head == thread);
+		shard->active_head = thread->next;
+	}
+
+	if (thread->next) {
+		rad_assert(shard->active_tail != thread);
+		thread->next->prev = thread->prev;
+	} else {
+		rad_assert(shard->active_tail == thread);
+		shard->active_tail = thread->prev;
+	}
+	shard->active_threads--;
+
+	thread->prev = NULL;
+	thread->next = shard->idle_head;
+	if (thread->next) {
+		rad_assert(shard->idle_tail != NULL);
+		thread->next->prev = thread;
+	} else {
+		rad_assert(shard->idle_tail == NULL);
+		shard->idle_tail = thread;
+	}
+	shard->idle_head = thread;
+	shard->idle_threads++;
+}
+
+/*
+ *	Add a new thread to the head of the idle list of its shard.
+ */
+static void thread_idle_insert(THREAD_HANDLE *thread)
+{
+	thread_shard_t *shard = thread->shard;
+
+	pthread_mutex_lock(&shard->mutex);
+	thread->prev = NULL;
+	thread->next = shard->idle_head;
+	if (thread->next) {
+		rad_assert(shard->idle_tail != NULL);
+		thread->next->prev = thread;
+	} else {
+		rad_assert(shard->idle_tail == NULL);
+		shard->idle_tail = thread;
+	}
+	shard->idle_head = thread;
+	shard->idle_threads++;
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ *	Add a thread to the tail of the exited list.
+ *
+ *	Called with the pool mutex held.
+ */
+static void thread_exited_insert(THREAD_HANDLE *thread)
+{
+	if (thread_pool.exited_tail) {
+		thread->prev = thread_pool.exited_tail;
+		thread->prev->next = thread;
+		thread->next = NULL;
+		thread_pool.exited_tail = thread;
+	} else {
+		rad_assert(thread_pool.exited_head == NULL);
+		thread_pool.exited_head = thread;
+		thread_pool.exited_tail = thread;
+		thread->prev = NULL;
+		thread->next = NULL;
+	}
+	thread_pool.total_threads--;
+}
 
 /*
  *	Add a request to the list of waiting requests.
@@ -303,6 +462,9 @@ static REQUEST *request_dequeue(void);
  */
 void request_enqueue(REQUEST *request)
 {
+	uint32_t i, start;
+	uint32_t num_queued;
+	thread_shard_t *shard;
 	THREAD_HANDLE *thread;
 
 	request->component = "<core>";
@@ -330,18 +492,12 @@ void request_enqueue(REQUEST *request)
 	request->child_state = REQUEST_QUEUED;
 	request->module = "<queue>";
 
-	/*
-	 *	Give the request to a thread, doing as little work as
-	 *	possible in the contended region.
-	 */
-	pthread_mutex_lock(&thread_pool.mutex);
+	num_queued = atomic_load_explicit(&thread_pool.num_queued, memory_order_relaxed);
 
 	/*
 	 *	If we're too busy, don't do anything.
 	 */
-	if ((thread_pool.num_queued + 1) >= thread_pool.max_queue_size) {
-		pthread_mutex_unlock(&thread_pool.mutex);
-
+	if ((num_queued + 1) >= thread_pool.max_queue_size) {
 		/*
 		 *	Mark the request as done.
 		 */
@@ -389,7 +545,7 @@ void request_enqueue(REQUEST *request)
 		 *	SOME of the new accounting packets.
 		 */
 		if ((request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
-		    (thread_pool.num_queued > (thread_pool.max_queue_size / 2)) &&
+		    (num_queued > (thread_pool.max_queue_size / 2)) &&
 		    (thread_pool.pps_in.pps_now > thread_pool.pps_out.pps_now)) {
 			uint32_t prob;
 			uint32_t keep;
@@ -410,28 +566,59 @@ void request_enqueue(REQUEST *request)
 			 *	If the queue is larger than our dice
 			 *	roll, we throw the packet away.
 			 */
-			if (thread_pool.num_queued > keep) {
-				pthread_mutex_unlock(&thread_pool.mutex);
-				goto done;
-			}
+			if (num_queued > keep) goto done;
 		}
 
 		gettimeofday(&now, NULL);
 
 		/*
 		 *	Calculate the instantaneous arrival rate into
-		 *	the queue.
+		 *	the queue.  The counters are shared by all of
+		 *	the shards, so they're protected by the pool
+		 *	mutex.
 		 */
+		pthread_mutex_lock(&thread_pool.mutex);
 		thread_pool.pps_in.pps = rad_pps(&thread_pool.pps_in.pps_old,
 						 &thread_pool.pps_in.pps_now,
 						 &thread_pool.pps_in.time_old,
 						 &now);
 
 		thread_pool.pps_in.pps_now++;
+		pthread_mutex_unlock(&thread_pool.mutex);
 	}
 #endif	/* WITH_ACCOUNTING */
 #endif
 
+	/*
+	 *	Find a shard with an idle thread, starting at the next
+	 *	one in round-robin order.  We don't wait for shards
+	 *	which are busy, as they're unlikely to have an idle
+	 *	thread.
+	 *
+	 *	If there are no idle threads, we wait for the first
+	 *	shard, and put the request into its queue.
+	 */
+	start = atomic_fetch_add_explicit(&thread_pool.next_shard, 1, memory_order_relaxed) % thread_pool.num_shards;
+	shard = NULL;
+
+	for (i = 0; i < thread_pool.num_shards; i++) {
+		thread_shard_t *this = &thread_pool.shards[(start + i) % thread_pool.num_shards];
+
+		if (pthread_mutex_trylock(&this->mutex) != 0) continue;
+
+		if (this->idle_head) {
+			shard = this;
+			break;
+		}
+
+		pthread_mutex_unlock(&this->mutex);
+	}
+
+	if (!shard) {
+		shard = &thread_pool.shards[start];
+		pthread_mutex_lock(&shard->mutex);
+	}
+
 	/*
 	 *	If there's a queue, OR no idle threads, put the
 	 *	request into the queue, in priority order.
@@ -439,16 +626,18 @@ void request_enqueue(REQUEST *request)
 	 *	@fixme: warn of blocked threads here, instead of in
 	 *	request_dequeue()
 	 */
-	if (thread_pool.num_queued || !thread_pool.idle_head) {
-		if (!fr_heap_insert(thread_pool.idle_heap, request)) {
-			pthread_mutex_unlock(&thread_pool.mutex);
+	if (shard->num_queued || !shard->idle_head) {
+		if (!fr_heap_insert(shard->heap, request)) {
+			pthread_mutex_unlock(&shard->mutex);
 			goto done;
 		}
 
-		thread_pool.num_queued++;
+		shard->num_queued++;
+		atomic_fetch_add_explicit(&thread_pool.num_queued, 1, memory_order_relaxed);
 
-		if (!thread_pool.idle_head) {
-			pthread_mutex_unlock(&thread_pool.mutex);
+		if (!shard->idle_head) {
+			pthread_mutex_unlock(&shard->mutex);
+			request_wake(shard);
 			return;
 		}
 
@@ -457,10 +646,10 @@ void request_enqueue(REQUEST *request)
 		 *	off of the top of the heap, and pass it to the
 		 *	idle thread.
 		 */
-		thread = thread_pool.idle_head;
-		request = request_dequeue();
+		thread = shard->idle_head;
+		request = request_dequeue(shard);
 		if (!request) {
-			pthread_mutex_unlock(&thread_pool.mutex);
+			pthread_mutex_unlock(&shard->mutex);
 			return;
 		}
 
@@ -468,41 +657,17 @@ void request_enqueue(REQUEST *request)
 		/*
 		 *	Grab the first idle thread.
 		 */
-		thread = thread_pool.idle_head;
+		thread = shard->idle_head;
 		rad_assert(thread->status == THREAD_IDLE);
 	}
 
 	/*
-	 *	Remove the thread from the head of the idle list.
-	 */
-	rad_assert(thread->prev == NULL);
-
-	thread_pool.idle_head = thread->next;
-	if (thread->next) {
-		thread->next->prev = NULL;
-	} else {
-		rad_assert(thread_pool.idle_tail == thread);
-		thread_pool.idle_tail = thread->prev;
-		rad_assert(thread_pool.idle_threads == 1);
-	}
-	thread_pool.idle_threads--;
-
-	/*
-	 *	Move the thread to the head of the active list.
+	 *	Move the thread from the idle list to the active list.
 	 */
-	thread->next = thread_pool.active_head;
-	if (thread->next) {
-		rad_assert(thread_pool.active_tail != NULL);
-		thread->next->prev = thread;
-	} else {
-		rad_assert(thread_pool.active_tail == NULL);
-		thread_pool.active_tail = thread;
-	}
-	thread_pool.active_head = thread;
-	thread_pool.active_threads++;
+	thread_idle_to_active(shard, thread);
 
-	thread_pool.requests++;
-	pthread_mutex_unlock(&thread_pool.mutex);
+	shard->requests++;
+	pthread_mutex_unlock(&shard->mutex);
 
 	thread->status = THREAD_ACTIVE;
 	thread->request = request;
@@ -522,13 +687,11 @@ void request_enqueue(REQUEST *request)
 /*
  *	Remove a request from the queue.
  *
- *	Called with the thread mutex held.
+ *	Called with the shard mutex held.
  */
-static REQUEST *request_dequeue(void)
+static REQUEST *request_dequeue(thread_shard_t *shard)
 {
 	time_t blocked;
-	static time_t last_complained = 0;
-	static time_t total_blocked = 0;
 	int num_blocked = 0;
 	REQUEST *request = NULL;
 
@@ -536,14 +699,15 @@ retry:
 	/*
 	 *	Grab the first entry.
 	 */
-	request = fr_heap_peek(thread_pool.idle_heap);
+	request = fr_heap_peek(shard->heap);
 	if (!request) {
-		rad_assert(thread_pool.num_queued == 0);
+		rad_assert(shard->num_queued == 0);
 		return NULL;
 	}
 
-	(void) fr_heap_extract(thread_pool.idle_heap, request);
-	thread_pool.num_queued--;
+	(void) fr_heap_extract(shard->heap, request);
+	shard->num_queued--;
+	atomic_fetch_sub_explicit(&thread_pool.num_queued, 1, memory_order_relaxed);
 
 	VERIFY_REQUEST(request);
 
@@ -566,16 +730,16 @@ retry:
 
 	blocked = time(NULL);
 	if (!request->proxy && (blocked - request->timestamp.tv_sec) > 5) {
-		total_blocked++;
-		if (last_complained < blocked) {
-			last_complained = blocked;
+		shard->total_blocked++;
+		if (shard->last_complained < blocked) {
+			shard->last_complained = blocked;
 			blocked -= request->timestamp.tv_sec;
-			num_blocked = total_blocked;
+			num_blocked = shard->total_blocked;
 		} else {
 			blocked = 0;
 		}
 	} else {
-		total_blocked = 0;
+		shard->total_blocked = 0;
 		blocked = 0;
 	}
 
@@ -587,6 +751,81 @@ retry:
 	return request;
 }
 
+/*
+ *	Wake up an idle thread in another shard, so that it can
+ *	steal the request we've just queued.
+ *
+ *	Called WITHOUT any mutex held.  Unlike request_enqueue(), we
+ *	wait for each mutex.  A thread only goes idle after checking
+ *	thread_pool.num_queued with its shard mutex held, so it has
+ *	either seen our request, or is on the idle list by the time
+ *	we get the mutex.
+ */
+static void request_wake(thread_shard_t *queued)
+{
+	uint32_t i, start;
+	THREAD_HANDLE *thread;
+
+	if (thread_pool.num_shards == 1) return;
+
+	start = queued - thread_pool.shards;
+
+	for (i = 1; i < thread_pool.num_shards; i++) {
+		thread_shard_t *shard = &thread_pool.shards[(start + i) % thread_pool.num_shards];
+
+		pthread_mutex_lock(&shard->mutex);
+		thread = shard->idle_head;
+		if (!thread) {
+			pthread_mutex_unlock(&shard->mutex);
+			continue;
+		}
+
+		thread_idle_to_active(shard, thread);
+		pthread_mutex_unlock(&shard->mutex);
+
+		/*
+		 *	No request, the thread looks for one.
+		 */
+		thread->status = THREAD_ACTIVE;
+		thread->request = NULL;
+		sem_post(&thread->semaphore);
+		return;
+	}
+}
+
+/*
+ *	Take a request from the queue of another shard.
+ *
+ *	Called WITHOUT any mutex held.  We don't wait for shards
+ *	which are busy.  Whoever holds the mutex will likely empty
+ *	the queue.
+ */
+static REQUEST *request_steal(thread_shard_t *mine)
+{
+	uint32_t i, start;
+	REQUEST *request;
+
+	start = mine - thread_pool.shards;
+
+	for (i = 1; i < thread_pool.num_shards; i++) {
+		thread_shard_t *shard = &thread_pool.shards[(start + i) % thread_pool.num_shards];
+
+		if (pthread_mutex_trylock(&shard->mutex) != 0) continue;
+
+		if (!shard->num_queued) {
+			pthread_mutex_unlock(&shard->mutex);
+			continue;
+		}
+
+		request = request_dequeue(shard);
+		pthread_mutex_unlock(&shard->mutex);
+
+		if (request) return request;
+	}
+
+	return NULL;
+}
+
 
 /*
  *	The main thread handler for requests.
@@ -596,6 +835,7 @@ retry:
 static void *request_handler_thread(void *arg)
 {
 	THREAD_HANDLE *thread = (THREAD_HANDLE *) arg;
+	thread_shard_t *shard = thread->shard;
 
 	/*
 	 *	Loop forever, until told to exit.
@@ -627,6 +867,7 @@ static void *request_handler_thread(void *arg)
 			ERROR("Thread %d failed waiting for semaphore: %s: Exiting\n",
 			      thread->thread_num, fr_syserror(errno));
 
+			pthread_mutex_lock(&shard->mutex);
 			rad_assert(thread->status == THREAD_IDLE);
 
 			thread->status = THREAD_CANCELLED;
@@ -635,38 +876,30 @@ static void *request_handler_thread(void *arg)
 			 *	Remove ourselves from the idle list
 			 */
 			if (thread->prev) {
-				rad_assert(thread_pool.idle_head != thread);
+				rad_assert(shard->idle_head != thread);
 				thread->prev->next = thread->next;
 
 			} else {
-				rad_assert(thread_pool.idle_head == thread);
-				thread_pool.idle_head = thread->next;
+				rad_assert(shard->idle_head == thread);
+				shard->idle_head = thread->next;
 			}
 
 			if (thread->next) {
-				rad_assert(thread_pool.idle_tail != thread);
-				thread->next->prev = NULL;
+				rad_assert(shard->idle_tail != thread);
+				thread->next->prev = thread->prev;
 			} else {
-				rad_assert(thread_pool.idle_tail == thread);
-				thread_pool.idle_tail = thread->prev;
-				rad_assert(thread_pool.idle_threads == 1);
+				rad_assert(shard->idle_tail == thread);
+				shard->idle_tail = thread->prev;
 			}
-			thread_pool.idle_threads--;
+			shard->idle_threads--;
+			pthread_mutex_unlock(&shard->mutex);
 
 			/*
 			 *	Add the thread to the tail of the exited list.
 			 */
-			if (thread_pool.exited_tail) {
-				thread->prev = thread_pool.exited_tail;
-				thread->prev->next = thread;
-				thread_pool.exited_tail = thread;
-			} else {
-				rad_assert(thread_pool.exited_head == NULL);
-				thread_pool.exited_head = thread;
-				thread_pool.exited_tail = thread;
-				thread->prev = NULL;
-			}
-			thread_pool.total_threads--;
+			pthread_mutex_lock(&thread_pool.mutex);
+			thread_exited_insert(thread);
+			pthread_mutex_unlock(&thread_pool.mutex);
 			break;
 		}
 
@@ -682,7 +915,12 @@ static void *request_handler_thread(void *arg)
 		 */
 		if (thread_pool.stop_flag) break;
 
-		rad_assert(thread->request != NULL);
+		/*
+		 *	Woken up by request_wake() to steal a request.
+		 *	Another thread may already have taken it.
+		 */
+		if (!thread->request) goto dequeue;
+
 		request = thread->request;
 
 #ifdef WITH_ACCOUNTING
@@ -701,7 +939,8 @@ static void *request_handler_thread(void *arg)
 			vp = radius_pair_create(request, &request->control,
 					       183, VENDORPEC_FREERADIUS);
 			if (vp) {
-				vp->vp_integer = thread_pool.max_queue_size - thread_pool.num_queued;
+				vp->vp_integer = thread_pool.max_queue_size -
+					atomic_load_explicit(&thread_pool.num_queued, memory_order_relaxed);
 				vp->vp_integer *= 100;
 				vp->vp_integer /= thread_pool.max_queue_size;
 			}
@@ -736,28 +975,33 @@ static void *request_handler_thread(void *arg)
 		ERR_clear_error();
 #  endif
 
-		pthread_mutex_lock(&thread_pool.mutex);
-
 		/*
 		 *	Manage the thread pool once a second.
 		 *
 		 *	This is done in a child thread to ensure that
 		 *	the main socket thread(s) do as little work as
-		 *	possible.
+		 *	possible.  If another thread is already
+		 *	managing the pool, we don't wait for it.
 		 */
 		now = time(NULL);
-		if (thread_pool.managed < now) {
-			thread_pool_manage(now);
+		if ((atomic_load_explicit(&thread_pool.managed, memory_order_relaxed) < (uint64_t) now) &&
+		    (pthread_mutex_trylock(&thread_pool.mutex) == 0)) {
+			if (atomic_load_explicit(&thread_pool.managed, memory_order_relaxed) < (uint64_t) now) {
+				thread_pool_manage(now);
+			}
+			pthread_mutex_unlock(&thread_pool.mutex);
 		}
 
+	dequeue:
 		/*
 		 *	If there are requests waiting on the queue,
 		 *	grab one and process it.
 		 */
-		if (thread_pool.num_queued) {
-			request = request_dequeue();
+		pthread_mutex_lock(&shard->mutex);
+		if (shard->num_queued) {
+			request = request_dequeue(shard);
 			if (request) {
-				pthread_mutex_unlock(&thread_pool.mutex);
+				pthread_mutex_unlock(&shard->mutex);
 				thread->request = request;
 				goto process;
 			}
@@ -766,49 +1010,46 @@ static void *request_handler_thread(void *arg)
 			 *	Else there was an old request which was discard,
 			 *	we're now idle.
 			 */
-			rad_assert(thread_pool.num_queued == 0);
+			rad_assert(shard->num_queued == 0);
 		}
 
 		/*
-		 *	Remove the thread from the active list.
+		 *	Our queue is empty.  Try the other shards
+		 *	before going idle.  Then check our own queue
+		 *	again, as a request may have been added while
+		 *	the mutex was unlocked.
 		 */
-		rad_assert(thread->status == THREAD_ACTIVE);
-
-		if (thread->prev) {
-			rad_assert(thread_pool.active_head != thread);
-			thread->prev->next = thread->next;
+		if ((thread_pool.num_shards > 1) &&
+		    (atomic_load_explicit(&thread_pool.num_queued, memory_order_relaxed) > 0)) {
+			pthread_mutex_unlock(&shard->mutex);
 
-		} else {
-			rad_assert(thread_pool.active_head == thread);
-			thread_pool.active_head = thread->next;
-		}
+			request = request_steal(shard);
+			if (request) {
+				thread->request = request;
+				goto process;
+			}
 
-		if (thread->next) {
-			rad_assert(thread_pool.active_tail != thread);
-			thread->next->prev = thread->prev;
-		} else {
-			rad_assert(thread_pool.active_tail == thread);
-			thread_pool.active_tail = thread->prev;
+			pthread_mutex_lock(&shard->mutex);
+			if (shard->num_queued) {
+				request = request_dequeue(shard);
+				if (request) {
+					pthread_mutex_unlock(&shard->mutex);
+					thread->request = request;
+					goto process;
+				}
+			}
 		}
-		thread_pool.active_threads--;
 
 		/*
-		 *	Insert it into the head of the idle list.
+		 *	Move the thread from the active list to the
+		 *	head of the idle list.
 		 */
-		thread->prev = NULL;
-		thread->next = thread_pool.idle_head;
-		if (thread->next) {
-			rad_assert(thread_pool.idle_tail != NULL);
-			thread->next->prev = thread;
-		} else {
-			rad_assert(thread_pool.idle_tail == NULL);
-			thread_pool.idle_tail = thread;
-		}
-		thread_pool.idle_head = thread;
-		thread_pool.idle_threads++;
+		rad_assert(thread->status == THREAD_ACTIVE);
+
+		thread_active_to_idle(shard, thread);
 
 		thread->status = THREAD_IDLE;
-		pthread_mutex_unlock(&thread_pool.mutex);
+		pthread_mutex_unlock(&shard->mutex);
 	}
 
 	DEBUG2("Thread %d exiting...", thread->thread_num);
@@ -833,7 +1074,8 @@ static void *request_handler_thread(void *arg)
  *	Called with the thread mutex locked...
  *
  *	The thread is started initially in the blocked state, waiting
- *	for the semaphore.
+ *	for the semaphore.  The caller should add it to the idle list
+ *	of its shard.
  */
 static THREAD_HANDLE *spawn_thread(time_t now, int do_trigger)
 {
@@ -849,6 +1091,7 @@ static THREAD_HANDLE *spawn_thread(time_t now, int do_trigger)
 	thread->request_count = 0;
 	thread->status = THREAD_IDLE;
 	thread->timestamp = now;
+	thread->shard = &thread_pool.shards[thread->thread_num % thread_pool.num_shards];
 
 	memset(&thread->semaphore, 0, sizeof(thread->semaphore));
 	rcode = sem_init(&thread->semaphore, 0, SEMAPHORE_LOCKED);
@@ -1000,6 +1243,10 @@ int thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers)
 	FR_INTEGER_BOUND_CHECK("max_servers", thread_pool.max_threads, >=, 1);
 	FR_INTEGER_BOUND_CHECK("start_servers", thread_pool.start_threads, <=, thread_pool.max_threads);
 
+	FR_INTEGER_BOUND_CHECK("queue_shards", thread_pool.num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("queue_shards", thread_pool.num_shards, <=, 64);
+	FR_INTEGER_BOUND_CHECK("queue_shards", thread_pool.num_shards, <=, thread_pool.max_threads);
+
 #ifdef WITH_TLS
 	/*
 	 *	So TLS knows what to do.
@@ -1090,12 +1337,33 @@ int thread_pool_init(void)
 		return -1;
 	}
 
-	thread_pool.idle_heap = fr_heap_create(thread_pool.heap_cmp, offsetof(REQUEST, heap_id));
-	if (!thread_pool.idle_heap) {
+	atomic_init(&thread_pool.num_queued, 0);
+	atomic_init(&thread_pool.next_shard, 0);
+	atomic_init(&thread_pool.managed, 0);
+
+	thread_pool.shards = talloc_zero_array(NULL, thread_shard_t, thread_pool.num_shards);
+	if (!thread_pool.shards) {
 		ERROR("FATAL: Failed to initialize the incoming queue.");
 		return -1;
 	}
 
+	for (i = 0; i < thread_pool.num_shards; i++) {
+		thread_shard_t *shard = &thread_pool.shards[i];
+
+		rcode = pthread_mutex_init(&shard->mutex, NULL);
+		if (rcode != 0) {
+			ERROR("FATAL: Failed to initialize thread pool mutex: %s",
+			       fr_syserror(rcode));
+			return -1;
+		}
+
+		shard->heap = fr_heap_create(thread_pool.heap_cmp, offsetof(REQUEST, heap_id));
+		if (!shard->heap) {
+			ERROR("FATAL: Failed to initialize the incoming queue.");
+			return -1;
+		}
+	}
+
 	/*
 	 *	Create a number of waiting threads.  Note we don't
 	 *	need to lock the mutex, as nothing is sending
@@ -1109,18 +1377,7 @@ int thread_pool_init(void)
 		thread = spawn_thread(now, 0);
 		if (!thread) return -1;
 
-		thread->prev = NULL;
-		thread->next = thread_pool.idle_head;
-		if (thread->next) {
-			rad_assert(thread_pool.idle_tail != NULL);
-			thread->next->prev = thread;
-		} else {
-			rad_assert(thread_pool.idle_tail == NULL);
-			thread_pool.idle_tail = thread;
-		}
-		thread_pool.idle_head = thread;
-		thread_pool.idle_threads++;
-
+		thread_idle_insert(thread);
 		thread_pool.total_threads++;
 	}
 #else
@@ -1143,6 +1400,7 @@ int thread_pool_init(void)
 void thread_pool_stop(void)
 {
 #ifndef WITH_GCD
+	uint32_t i;
 	THREAD_HANDLE *thread;
 	THREAD_HANDLE *next;
 
@@ -1164,27 +1422,33 @@ void thread_pool_stop(void)
 		talloc_free(thread);
 	}
 
-	for (thread = thread_pool.idle_head; thread; thread = next) {
-		next = thread->next;
+	for (i = 0; i < thread_pool.num_shards; i++) {
+		thread_shard_t *shard = &thread_pool.shards[i];
 
-		thread->status = THREAD_CANCELLED;
-		sem_post(&thread->semaphore);
+		for (thread = shard->idle_head; thread; thread = next) {
+			next = thread->next;
 
-		pthread_join(thread->pthread_id, NULL);
-		talloc_free(thread);
-	}
+			thread->status = THREAD_CANCELLED;
+			sem_post(&thread->semaphore);
 
-	for (thread = thread_pool.active_head; thread; thread = next) {
-		next = thread->next;
+			pthread_join(thread->pthread_id, NULL);
+			talloc_free(thread);
+		}
 
-		thread->status = THREAD_CANCELLED;
-		sem_post(&thread->semaphore);
+		for (thread = shard->active_head; thread; thread = next) {
+			next = thread->next;
 
-		pthread_join(thread->pthread_id, NULL);
-		talloc_free(thread);
-	}
+			thread->status = THREAD_CANCELLED;
+			sem_post(&thread->semaphore);
+
+			pthread_join(thread->pthread_id, NULL);
+			talloc_free(thread);
+		}
 
-	fr_heap_delete(thread_pool.idle_heap);
+		fr_heap_delete(shard->heap);
+		pthread_mutex_destroy(&shard->mutex);
+	}
+	TALLOC_FREE(thread_pool.shards);
 
 #  ifdef WNOHANG
 	fr_hash_table_free(thread_pool.waiters);
@@ -1213,14 +1477,33 @@ void request_enqueue(REQUEST *request)
  *	If there are too many or too few threads waiting, then we
  *	either create some more, or delete some.
  *
- *	This is called only from request_enqueue(), with the
- *	mutex held.
+ *	This is called only from request_handler_thread(), with the
+ *	pool mutex held.  The shard mutexes are NOT held.
  */
 static void thread_pool_manage(time_t now)
 {
+	uint32_t i;
+	uint32_t idle_threads;
 	THREAD_HANDLE *thread;
+	thread_shard_t *shard;
 
-	thread_pool.managed = now;
+	atomic_store_explicit(&thread_pool.managed, now, memory_order_relaxed);
+
+	/*
+	 *	Count the idle threads, and find the shard with the
+	 *	most idle threads.  That's where we delete spare
+	 *	threads from.
+	 */
+	idle_threads = 0;
+	shard = NULL;
+	for (i = 0; i < thread_pool.num_shards; i++) {
+		thread_shard_t *this = &thread_pool.shards[i];
+
+		pthread_mutex_lock(&this->mutex);
+		idle_threads += this->idle_threads;
+		if (!shard || (this->idle_threads > shard->idle_threads)) shard = this;
+		pthread_mutex_unlock(&this->mutex);
+	}
 
 	/*
 	 *	Delete one exited thread.
@@ -1258,10 +1541,10 @@ static void thread_pool_manage(time_t now)
 	 */
 	if (!thread_pool.spawning &&
 	    (thread_pool.total_threads < thread_pool.max_threads) &&
-	    (thread_pool.idle_threads < thread_pool.min_spare_threads)) {
-		uint32_t i, total;
+	    (idle_threads < thread_pool.min_spare_threads)) {
+		uint32_t total;
 
-		total = thread_pool.min_spare_threads - thread_pool.idle_threads;
+		total = thread_pool.min_spare_threads - idle_threads;
 
 		if ((total + thread_pool.total_threads) > thread_pool.max_threads) {
 			total = thread_pool.max_threads - thread_pool.total_threads;
@@ -1285,19 +1568,12 @@ static void thread_pool_manage(time_t now)
 
 			thread_pool.spawning = false;
 
+			if (!thread) break;
+
 			/*
 			 *	Insert it into the head of the idle list.
 			 */
-			thread->prev = NULL;
-			thread->next = thread_pool.idle_head;
-			if (thread->next) {
-				thread->next->prev = thread;
-			} else {
-				rad_assert(thread_pool.idle_tail == NULL);
-				thread_pool.idle_tail = thread;
-			}
-			thread_pool.idle_head = thread;
-			thread_pool.idle_threads++;
+			thread_idle_insert(thread);
 			thread_pool.total_threads++;
 		}
 
@@ -1321,44 +1597,41 @@ static void thread_pool_manage(time_t now)
 	 *	slowly reaped, which is better than suddenly nuking a
 	 *	bunch of them.
 	 */
-	if (thread_pool.idle_threads > thread_pool.max_spare_threads) {
+	if (idle_threads > thread_pool.max_spare_threads) {
 		DEBUG2("Threads: deleting 1 spare out of %d spares",
-		       thread_pool.idle_threads - thread_pool.max_spare_threads);
-
-		rad_assert(thread_pool.idle_tail != NULL);
+		       idle_threads - thread_pool.max_spare_threads);
 
 		/*
 		 *	Remove the thread from the tail of the idle list.
+		 *
+		 *	The shard may have changed since we counted
+		 *	the idle threads.
 		 */
-		thread = thread_pool.idle_tail;
+		pthread_mutex_lock(&shard->mutex);
+		thread = shard->idle_tail;
+		if (!thread) {
+			pthread_mutex_unlock(&shard->mutex);
+			return;
+		}
 		rad_assert(thread->next == NULL);
 
-		thread_pool.idle_tail = thread->prev;
+		shard->idle_tail = thread->prev;
 		if (thread->prev) {
 			thread->prev->next = NULL;
 		} else {
-			thread_pool.idle_head = NULL;
-			rad_assert(thread_pool.idle_threads == 1);
+			shard->idle_head = NULL;
+			rad_assert(shard->idle_threads == 1);
 		}
-		thread_pool.idle_threads--;
+		shard->idle_threads--;
+
+		rad_assert(thread->status == THREAD_IDLE);
+		thread->status = THREAD_CANCELLED;
+		pthread_mutex_unlock(&shard->mutex);
 
 		/*
 		 *	Add the thread to the tail of the exited list.
 		 */
-		if (thread_pool.exited_tail) {
-			thread->prev = thread_pool.exited_tail;
-			thread->prev->next = thread;
-			thread_pool.exited_tail = thread;
-		} else {
-			thread->prev = NULL;
-			rad_assert(thread_pool.exited_head == NULL);
-			thread_pool.exited_head = thread;
-			thread_pool.exited_tail = thread;
-		}
-		thread_pool.total_threads--;
-
-		rad_assert(thread->status == THREAD_IDLE);
-		thread->status = THREAD_CANCELLED;
+		thread_exited_insert(thread);
 
 		/*
 		 *	Post an extra semaphore, as a
@@ -1482,7 +1755,7 @@ void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
 		 *	fixed in size.
 		 */
 		memset(array, 0, sizeof(array[0]) * RAD_LISTEN_MAX);
-		array[0] = fr_heap_num_elements(thread_pool.idle_heap);
+		array[0] = atomic_load_explicit(&thread_pool.num_queued, memory_order_relaxed);
 
 		gettimeofday(&now, NULL);
 
@@ -1518,7 +1518,7 @@ void fr_stats_bins(fr_stats_t *stats, struct timeval *start, struct timeval *end
 	fr_timeval_subtract(&diff, end, start);
 
 	if (diff.tv_sec >= 10) {
-		stats->elapsed[7]++;
+		FR_STATS_ADD(stats->elapsed[7], 1);
 	} else {
 		int i;
 		uint32_t cmp;
@@ -1528,7 +1528,7 @@ void fr_stats_bins(fr_stats_t *stats, struct timeval *start, struct timeval *end
 		cmp = 10;
 		for (i = 0; i < 7; i++) {
 			if (delay < cmp) {
-				stats->elapsed[i]++;
+				FR_STATS_ADD(stats->elapsed[i], 1);
 				break;
 			}
 			cmp *= 10;
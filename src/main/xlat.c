@@ -33,6 +33,12 @@ RCSID("$Id$")
 
 #include <ctype.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 typedef struct xlat_t {
 	char			name[FR_MAX_STRING_LEN];	//!< Name of the xlat expansion.
 	int			length;			//!< Length of name.
@@ -78,6 +84,75 @@ typedef struct xlat_out {
 
 static rbtree_t *xlat_root = NULL;
 
+/*
+ *	Parsed expansions of format strings passed to radius_xlat()
+ *	and friends, so that they are only tokenized once.
+ *
+ *	Each thread has its own cache, so lookups don't take any
+ *	locks.  Runtime format strings may be built from request
+ *	data, so each cache holds at most XLAT_CACHE_MAX entries,
+ *	and entries which haven't been used recently are evicted
+ *	using the CLOCK algorithm.
+ */
+#define XLAT_CACHE_MAX	(1024)
+
+typedef struct xlat_cache_entry_t {
+	char const	*fmt;		//!< Format string, used as the key.
+	xlat_exp_t	*head;		//!< Parsed expansion.
+	bool		referenced;	//!< Set on lookup, cleared by the CLOCK hand.
+} xlat_cache_entry_t;
+
+typedef struct xlat_cache_t {
+	TALLOC_CTX		*entries;	//!< Parent of the tree, and all entries in it.
+	rbtree_t		*tree;		//!< Entries, by format string.
+	xlat_cache_entry_t	*clock[XLAT_CACHE_MAX];
+	uint32_t		num;		//!< Entries in the clock.
+	uint32_t		hand;		//!< CLOCK hand.
+
+	uint64_t		generation;	//!< Value of xlat_cache_generation when the entries
+						//!< were parsed.
+	uint32_t		depth;		//!< Expansions in progress in this thread.
+	TALLOC_CTX		*retired;	//!< Entries removed while an expansion was in progress.
+						//!< They may be in use further up the stack.
+} xlat_cache_t;
+
+fr_thread_local_setup(xlat_cache_t *, xlat_cache)	/* macro */
+
+/*
+ *	Incremented when xlat functions are registered or unregistered,
+ *	as parsed expansions may refer to them, or may have been parsed
+ *	before they existed.  Each thread empties its cache when it next
+ *	sees the new value.
+ */
+static atomic_uint_fast64_t xlat_cache_generation;
+
+/** Invalidate the cache of every thread
+ *
+ */
+static void xlat_cache_flush(void)
+{
+	atomic_fetch_add_explicit(&xlat_cache_generation, 1, memory_order_release);
+}
+
+/** Free an entry, or keep it until the current expansions have finished
+ *
+ */
+static void xlat_cache_release(xlat_cache_t *cache, TALLOC_CTX *ctx)
+{
+	if (!cache->depth) {
+		talloc_free(ctx);
+		return;
+	}
+
+	if (!cache->retired) MEM(cache->retired = talloc_init("xlat_cache_retired"));
+	(void) talloc_steal(cache->retired, ctx);
+}
+
+static void _xlat_cache_free(void *cache)
+{
+	talloc_free(cache);
+}
+
 #ifdef WITH_UNLANG
 static char const * const xlat_foreach_names[] = {"Foreach-Variable-0",
 						  "Foreach-Variable-1",
@@ -822,6 +897,8 @@ int xlat_register(void *mod_inst, char const *name,
 		c->mod_inst = mod_inst;
 		c->instantiate = instantiate;
 		c->inst_size = inst_size;
+
+		xlat_cache_flush();
 		return 0;
 	}
 
@@ -846,6 +923,7 @@ int xlat_register(void *mod_inst, char const *name,
 		return -1;
 	}
 
+	xlat_cache_flush();
 	return 0;
 }
 
@@ -873,6 +951,7 @@ void xlat_unregister(void *mod_inst, char const *name, UNUSED xlat_func_t func)
 
 	if (c->mod_inst != mod_inst) return;
 
+	xlat_cache_flush();
 	rbtree_deletebydata(xlat_root, c);
 }
 
@@ -889,6 +968,7 @@ void xlat_unregister_module(void *instance)
 {
 	if (!xlat_root) return;	/* All xlats have already been freed */
 
+	xlat_cache_flush();
 	rbtree_walk(xlat_root, RBTREE_DELETE_ORDER, xlat_unregister_callback, instance);
 }
 
@@ -1159,6 +1239,14 @@ ssize_t xlat_fmt_to_ref(uint8_t const **out, REQUEST *request, char const *fmt)
  */
 void xlat_free(void)
 {
+	xlat_cache_t *cache;
+
+	cache = fr_thread_local_init(xlat_cache, _xlat_cache_free);
+	if (cache) {
+		talloc_free(cache);
+		fr_thread_local_set(xlat_cache, NULL);
+	}
+
 	TALLOC_FREE(xlat_root);
 }
 
@@ -1862,6 +1950,141 @@ static ssize_t xlat_tokenize_request(REQUEST *request, char const *fmt, xlat_exp
 	return slen;
 }
 
+static int xlat_cache_cmp(void const *one, void const *two)
+{
+	xlat_cache_entry_t const *a = one;
+	xlat_cache_entry_t const *b = two;
+
+	return strcmp(a->fmt, b->fmt);
+}
+
+/** Get the cache for this thread, emptying it if it's out of date
+ *
+ * @return
+ *	- The cache.
+ *	- NULL on error.
+ */
+static xlat_cache_t *xlat_cache_get(void)
+{
+	xlat_cache_t	*cache;
+	uint64_t	generation;
+
+	generation = atomic_load_explicit(&xlat_cache_generation, memory_order_acquire);
+
+	cache = fr_thread_local_init(xlat_cache, _xlat_cache_free);
+	if (!cache) {
+		cache = talloc_zero(NULL, xlat_cache_t);
+		if (!cache) return NULL;
+
+		if (fr_thread_local_set(xlat_cache, cache) != 0) {
+			talloc_free(cache);
+			return NULL;
+		}
+		cache->generation = generation;
+	}
+
+	if (cache->generation != generation) {
+		if (cache->entries) xlat_cache_release(cache, cache->entries);
+		cache->entries = NULL;
+		cache->tree = NULL;
+		memset(cache->clock, 0, sizeof(cache->clock));
+		cache->num = 0;
+		cache->hand = 0;
+		cache->generation = generation;
+	}
+
+	if (!cache->entries) {
+		cache->entries = talloc_init("xlat_cache_entries");
+		if (!cache->entries) return NULL;
+
+		cache->tree = rbtree_create(cache->entries, xlat_cache_cmp, NULL, 0);
+		if (!cache->tree) {
+			TALLOC_FREE(cache->entries);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+/** Find a previously parsed expansion for a format string
+ *
+ * @param[in] cache for this thread.
+ * @param[in] fmt the format string.
+ * @return
+ *	- The parsed expansion.  Must not be modified or freed.
+ *	- NULL if the format string is not in the cache.
+ */
+static xlat_exp_t const *xlat_cache_find(xlat_cache_t *cache, char const *fmt)
+{
+	xlat_cache_entry_t	my_entry, *entry;
+
+	my_entry.fmt = fmt;
+
+	entry = rbtree_finddata(cache->tree, &my_entry);
+	if (!entry) return NULL;
+
+	entry->referenced = true;
+
+	return entry->head;
+}
+
+/** Add a parsed expansion to the cache
+ *
+ * If the cache is full, the first entry which hasn't been used since
+ * the CLOCK hand last passed it is evicted.
+ *
+ * @param[in] cache for this thread.
+ * @param[in] fmt the format string.
+ * @param[in] head the parsed expansion.  Reparented to the cache on success.
+ * @return
+ *	- true if the cache now owns head.
+ *	- false if it was not added, and the caller must free it.
+ */
+static bool xlat_cache_add(xlat_cache_t *cache, char const *fmt, xlat_exp_t *head)
+{
+	xlat_cache_entry_t	*entry;
+
+	/*
+	 *	Advance the hand to a free slot.  If the cache is full,
+	 *	make one by evicting the first entry which hasn't been
+	 *	used since the hand last passed it.
+	 */
+	for (;;) {
+		entry = cache->clock[cache->hand];
+		if (!entry) break;
+
+		if (!entry->referenced && (cache->num == XLAT_CACHE_MAX)) {
+			rbtree_deletebydata(cache->tree, entry);
+			xlat_cache_release(cache, entry);
+			cache->clock[cache->hand] = NULL;
+			cache->num--;
+			break;
+		}
+
+		entry->referenced = false;
+		cache->hand = (cache->hand + 1) % XLAT_CACHE_MAX;
+	}
+
+	entry = talloc_zero(cache->entries, xlat_cache_entry_t);
+	if (!entry) return false;
+
+	entry->fmt = talloc_typed_strdup(entry, fmt);
+	entry->head = talloc_steal(entry, head);
+
+	if (!entry->fmt || !rbtree_insert(cache->tree, entry)) {
+		(void) talloc_steal(NULL, head);
+		talloc_free(entry);
+		return false;
+	}
+
+	cache->clock[cache->hand] = entry;
+	cache->hand = (cache->hand + 1) % XLAT_CACHE_MAX;
+	cache->num++;
+
+	return true;
+}
+
 
 static char *xlat_getvp(TALLOC_CTX *ctx, REQUEST *request, vp_tmpl_t const *vpt,
 			bool escape, bool return_null)
@@ -2590,11 +2813,21 @@ static ssize_t xlat_expand(char **out, size_t outlen, REQUEST *request, char con
 			   xlat_escape_t escape, void *escape_ctx)
 {
 	ssize_t len;
-	xlat_exp_t *node;
+	xlat_exp_t *node = NULL;
+	xlat_exp_t const *cached = NULL;
+	xlat_cache_t *cache;
 
 	RDEBUG2("EXPAND %s", fmt);
 	RINDENT();
 
+	/*
+	 *	Most format strings come from the configuration, and
+	 *	are the same for every request.
+	 */
+	cache = xlat_cache_get();
+	if (cache) cached = xlat_cache_find(cache, fmt);
+	if (cached) goto expand;
+
 	/*
 	 *	Give better errors than the old code.
 	 */
@@ -2615,7 +2848,17 @@ static ssize_t xlat_expand(char **out, size_t outlen, REQUEST *request, char con
 		return -1;
 	}
 
-	len = xlat_expand_struct(out, outlen, request, node, escape, escape_ctx);
+	cached = node;
+	if (cache && xlat_cache_add(cache, fmt, node)) node = NULL;
+
+expand:
+	/*
+	 *	Expansions may recurse, and cache entries removed in
+	 *	the meantime mustn't be freed until we're done.
+	 */
+	if (cache) cache->depth++;
+	len = xlat_expand_struct(out, outlen, request, cached, escape, escape_ctx);
+	if (cache && (--cache->depth == 0)) TALLOC_FREE(cache->retired);
 	talloc_free(node);
 
 	REXDENT();
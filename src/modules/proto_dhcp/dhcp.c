@@ -1637,6 +1637,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 {
 	uint8_t		*p;
 	vp_cursor_t	cursor;
+	vp_list_t	list;
 	VALUE_PAIR	*vp;
 	uint32_t	lvalue;
 	uint16_t	svalue;
@@ -1651,8 +1652,14 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	/* XXX Ugly ... should be set by the caller */
 	if (packet->code == 0) packet->code = PW_DHCP_NAK;
 
+	/*
+	 *	Index the list, as we look up most of the header
+	 *	fields in it.
+	 */
+	fr_pair_head_init(&list, packet->vps);
+
 	/* store xid */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 260, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 260, TAG_ANY))) {
 		packet->id = vp->vp_integer;
 	} else {
 		packet->id = fr_rand();
@@ -1681,7 +1688,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	}
 #endif
 
-	vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 256, TAG_ANY);
+	vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 256, TAG_ANY);
 	if (vp) {
 		*p++ = vp->vp_integer & 0xff;
 	} else {
@@ -1689,21 +1696,21 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	}
 
 	/* DHCP-Hardware-Type */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 257, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 257, TAG_ANY))) {
 		*p++ = vp->vp_byte;
 	} else {
 		*p++ = 1;		/* hardware type = ethernet */
 	}
 
 	/* DHCP-Hardware-Address-len */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 258, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 258, TAG_ANY))) {
 		*p++ = vp->vp_byte;
 	} else {
 		*p++ = 6;		/* 6 bytes of ethernet */
 	}
 
 	/* DHCP-Hop-Count */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 259, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 259, TAG_ANY))) {
 		*p = vp->vp_byte;
 	}
 	p++;
@@ -1714,27 +1721,27 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	p += 4;
 
 	/* DHCP-Number-of-Seconds */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 261, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 261, TAG_ANY))) {
 		svalue = htons(vp->vp_short);
 		memcpy(p, &svalue, 2);
 	}
 	p += 2;
 
 	/* DHCP-Flags */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 262, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 262, TAG_ANY))) {
 		svalue = htons(vp->vp_short);
 		memcpy(p, &svalue, 2);
 	}
 	p += 2;
 
 	/* DHCP-Client-IP-Address */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 263, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 263, TAG_ANY))) {
 		memcpy(p, &vp->vp_ipaddr, 4);
 	}
 	p += 4;
 
 	/* DHCP-Your-IP-address */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 264, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 264, TAG_ANY))) {
 		lvalue = vp->vp_ipaddr;
 	} else {
 		lvalue = htonl(INADDR_ANY);
@@ -1743,7 +1750,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	p += 4;
 
 	/* DHCP-Server-IP-Address */
-	vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 265, TAG_ANY);
+	vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 265, TAG_ANY);
 	if (vp) {
 		lvalue = vp->vp_ipaddr;
 	} else {
@@ -1755,7 +1762,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	/*
 	 *	DHCP-Gateway-IP-Address
 	 */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 266, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 266, TAG_ANY))) {
 		lvalue = vp->vp_ipaddr;
 	} else {
 		lvalue = htonl(INADDR_ANY);
@@ -1764,7 +1771,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	p += 4;
 
 	/* DHCP-Client-Hardware-Address */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 267, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 267, TAG_ANY))) {
 		if (vp->vp_length == sizeof(vp->vp_ether)) {
 			/*
 			 *	Ensure that we mark the packet as being Ethernet.
@@ -1779,7 +1786,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	p += DHCP_CHADDR_LEN;
 
 	/* DHCP-Server-Host-Name */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 268, TAG_ANY))) {
+	if ((vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 268, TAG_ANY))) {
 		if (vp->vp_length > DHCP_SNAME_LEN) {
 			memcpy(p, vp->vp_strvalue, DHCP_SNAME_LEN);
 		} else {
@@ -1799,7 +1806,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	 */
 
 	/* DHCP-Boot-Filename */
-	vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 269, TAG_ANY);
+	vp = fr_pair_head_find_by_num(&list, DHCP_MAGIC_VENDOR, 269, TAG_ANY);
 	if (vp) {
 		if (vp->vp_length > DHCP_FILE_LEN) {
 			memcpy(p, vp->vp_strvalue, DHCP_FILE_LEN);
@@ -1819,6 +1826,8 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	p[2] = packet->code - PW_DHCP_OFFSET;
 	p += 3;
 
+	fr_pair_head_reset(&list);
+
 	/*
 	 *  Pre-sort attributes into contiguous blocks so that fr_dhcp_encode_option
 	 *  operates correctly. This changes the order of the list, but never mind...
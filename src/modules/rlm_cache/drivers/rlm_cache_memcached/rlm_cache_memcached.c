@@ -181,7 +181,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_ERROR;
 	}
 	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
+	if (!cache_serialized_is_binary((uint8_t const *)from_store, len)) RDEBUG2("%s", from_store);
 
 	c = talloc_zero(NULL,  rlm_cache_entry_t);
 	ret = cache_deserialize(c, from_store, len);
@@ -201,7 +201,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, UNUSED void *driver_inst,
 					 REQUEST *request, void *handle, const rlm_cache_entry_t *c)
 {
 	rlm_cache_memcached_handle_t *mandle = handle;
@@ -210,19 +210,26 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 
 	TALLOC_CTX *pool;
 	char *to_store;
+	size_t len;
 
 	pool = talloc_pool(NULL, 1024);
 	if (!pool) return CACHE_ERROR;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
-		talloc_free(pool);
-
-		return CACHE_ERROR;
+	if (config->serialize == CACHE_SERIALIZE_TEXT) {
+		if (cache_serialize(pool, &to_store, c) < 0) {
+		error:
+			RERROR("Failed serializing entry: %s", fr_strerror());
+			talloc_free(pool);
+
+			return CACHE_ERROR;
+		}
+		len = to_store ? talloc_array_length(to_store) - 1 : 0;
+	} else {
+		if (cache_serialize_binary(pool, (uint8_t **)&to_store, &len, c) < 0) goto error;
 	}
 
 	ret = memcached_set(mandle->handle, (char const *)c->key, c->key_len,
-		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, c->expires, 0);
+		            to_store ? to_store : "", len, c->expires, 0);
 	talloc_free(pool);
 	if (ret != MEMCACHED_SUCCESS) {
 		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
@@ -27,6 +27,7 @@
 #include <freeradius-devel/rad_assert.h>
 
 #include "../../rlm_cache.h"
+#include "../../serialize.h"
 #include "../../../rlm_redis/redis.h"
 #include "../../../rlm_redis/cluster.h"
 
@@ -159,6 +160,27 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_MISS;
 	}
 
+	/*
+	 *	Binary entries are stored as a single element.
+	 */
+	if ((reply->elements == 1) && (reply->element[0]->type == REDIS_REPLY_STRING) &&
+	    cache_serialized_is_binary((uint8_t const *)reply->element[0]->str, reply->element[0]->len)) {
+		c = talloc_zero(NULL, rlm_cache_entry_t);
+		if (cache_deserialize_binary(c, (uint8_t const *)reply->element[0]->str,
+					     reply->element[0]->len) < 0) {
+			REDEBUG("%s", fr_strerror());
+			talloc_free(c);
+			goto error;
+		}
+		fr_redis_reply_free(reply);
+
+		c->key = talloc_memdup(c, key, key_len);
+		c->key_len = key_len;
+		*out = c;
+
+		return CACHE_OK;
+	}
+
 	if (reply->elements % 3) {
 		REDEBUG("Invalid number of reply elements (%zu).  "
 			"Reply must contain triplets of keys operators and values",
@@ -238,7 +260,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *driver_inst,
 					 REQUEST *request, UNUSED void *handle, const rlm_cache_entry_t *c)
 {
 	rlm_cache_redis_t	*driver = driver_inst;
@@ -300,8 +322,6 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	expires_value.tmpl_data_value.date = c->expires;
 	expires.next = c->maps;	/* Head of the list */
 
-	for (cnt = 0, map = &created; map; cnt++, map = map->next);
-
 	/*
 	 *	The majority of serialized entries should be under 1k.
 	 *
@@ -310,6 +330,34 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	pool = talloc_pool(request, 1024);
 	if (!pool) return CACHE_ERROR;
 
+	/*
+	 *	Binary entries are pushed as a single element,
+	 *	which includes the created and expires times.
+	 */
+	if (config->serialize == CACHE_SERIALIZE_BINARY) {
+		uint8_t *to_store;
+
+		argv_p = argv = talloc_array(pool, char const *, 3);		/* cmd + key + entry */
+		argv_len_p = argv_len = talloc_array(pool, size_t, 3);		/* cmd + key + entry */
+
+		*argv_p++ = command;
+		*argv_len_p++ = sizeof(command) - 1;
+
+		*argv_p++ = (char const *)c->key;
+		*argv_len_p++ = c->key_len;
+
+		if (cache_serialize_binary(pool, &to_store, argv_len_p, c) < 0) {
+			REDEBUG("Failed serializing entry: %s", fr_strerror());
+			talloc_free(pool);
+			return CACHE_ERROR;
+		}
+		*argv_p = (char const *)to_store;
+
+		goto pipeline;
+	}
+
+	for (cnt = 0, map = &created; map; cnt++, map = map->next);
+
 	argv_p = argv = talloc_array(pool, char const *, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 	argv_len_p = argv_len = talloc_array(pool, size_t, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 
@@ -332,6 +380,8 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 		argv_len_p += 3;
 	}
 
+pipeline:
+
 	RDEBUG3("Pipelining commands");
 	RINDENT();
 
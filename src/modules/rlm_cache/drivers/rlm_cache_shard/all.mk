@@ -0,0 +1,3 @@
+TARGET		:= rlm_cache_shard.a
+SOURCES		:= rlm_cache_shard.c
+TGT_LDLIBS	:= $(LIBS)
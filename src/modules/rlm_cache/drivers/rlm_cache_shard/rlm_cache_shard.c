@@ -0,0 +1,564 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_shard.c
+ * @brief Sharded in memory cache, with CLOCK eviction.
+ *
+ * Entries are spread over a number of shards by the hash of their key.  Each shard
+ * is an open addressing hash table with its own mutex, so threads looking up
+ * different keys rarely contend.  When a shard uses more than its share of max_size,
+ * entries are evicted using the CLOCK algorithm.
+ *
+ * Shard mutexes are only held for the duration of a single driver call.  Entries
+ * returned by find are reference counted, so they stay valid after the mutex is
+ * released, even if they're expired or evicted by another thread.  This allows
+ * the caller to expand xlats (which may themselves use the cache) whilst holding
+ * an entry.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include "../../rlm_cache.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#define SHARD_MIN_SLOTS	(16)
+
+typedef struct rlm_cache_shard_entry {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+	uint32_t		hash;		//!< Of the key.
+	size_t			size;		//!< Memory used by the entry when it was inserted.
+	bool			referenced;	//!< Cleared by the CLOCK hand, set on lookup.
+	atomic_uint_fast32_t	refs;		//!< One for the shard, and one for each caller
+						//!< holding the entry.
+} rlm_cache_shard_entry_t;
+
+typedef struct cache_shard {
+	pthread_mutex_t		mutex;		//!< Protects everything in the shard.
+
+	rlm_cache_shard_entry_t	**slots;	//!< Open addressing table, with linear probing.
+	uint32_t		num_slots;	//!< Always a power of 2.
+	uint32_t		used;		//!< Slots containing entries.
+	uint32_t		deleted;	//!< Slots containing tombstones.
+	uint32_t		hand;		//!< CLOCK hand.
+	size_t			size;		//!< Memory used by entries in this shard.
+
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;
+} cache_shard_t;
+
+typedef struct rlm_cache_shard {
+	uint32_t		num_shards;	//!< Always a power of 2.
+	uint64_t		max_size;	//!< Maximum memory used by entries, 0 for no limit.
+
+	cache_shard_t		*shards;
+	atomic_uint_fast32_t	count;		//!< Entries in all shards.
+} rlm_cache_shard_t;
+
+/** Handle for a single cache operation
+ *
+ */
+typedef struct rlm_cache_shard_handle {
+	rlm_cache_shard_t	*driver;
+} rlm_cache_shard_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", PW_TYPE_INTEGER, rlm_cache_shard_t, num_shards), .dflt = "16" },
+	{ FR_CONF_OFFSET("max_size", PW_TYPE_INTEGER64, rlm_cache_shard_t, max_size), .dflt = "67108864" },
+	CONF_PARSER_TERMINATOR
+};
+
+/*
+ *	Marks slots which used to contain an entry, so that probing
+ *	carries on past them.
+ */
+static rlm_cache_shard_entry_t shard_tombstone;
+#define TOMBSTONE (&shard_tombstone)
+
+/** Lock the shard for a key
+ *
+ */
+static cache_shard_t *shard_lock(rlm_cache_shard_t *driver, uint32_t hash)
+{
+	cache_shard_t *shard = &driver->shards[hash & (driver->num_shards - 1)];
+
+	pthread_mutex_lock(&shard->mutex);
+
+	return shard;
+}
+
+/** Drop a reference to an entry, freeing it if it was the last one
+ *
+ */
+static void shard_entry_unref(rlm_cache_shard_entry_t *e)
+{
+	if (atomic_fetch_sub_explicit(&e->refs, 1, memory_order_acq_rel) == 1) talloc_free(e);
+}
+
+/*
+ *	The low bits of the hash select the shard, so use the high
+ *	bits to select the slot.
+ */
+static inline uint32_t shard_slot(cache_shard_t *shard, uint32_t hash)
+{
+	return ((hash >> 16) | (hash << 16)) & (shard->num_slots - 1);
+}
+
+/** Find the slot containing an entry
+ *
+ * @return
+ *	- The slot number.
+ *	- -1 if there is no entry for the key.
+ */
+static int shard_find_slot(cache_shard_t *shard, uint32_t hash, uint8_t const *key, size_t key_len)
+{
+	uint32_t i, slot;
+	rlm_cache_shard_entry_t *e;
+
+	if (!shard->slots) return -1;
+
+	slot = shard_slot(shard, hash);
+	for (i = 0; i < shard->num_slots; i++, slot = (slot + 1) & (shard->num_slots - 1)) {
+		e = shard->slots[slot];
+		if (!e) return -1;
+		if (e == TOMBSTONE) continue;
+
+		if ((e->hash == hash) && (e->fields.key_len == key_len) &&
+		    (memcmp(e->fields.key, key, key_len) == 0)) return slot;
+	}
+
+	return -1;
+}
+
+/** Remove the entry in a slot, and drop the shard's reference to it
+ *
+ */
+static void shard_remove_slot(rlm_cache_shard_t *driver, cache_shard_t *shard, uint32_t slot)
+{
+	rlm_cache_shard_entry_t *e = shard->slots[slot];
+
+	rad_assert(e && (e != TOMBSTONE));
+
+	shard->slots[slot] = TOMBSTONE;
+	shard->used--;
+	shard->deleted++;
+	shard->size -= e->size;
+	atomic_fetch_sub_explicit(&driver->count, 1, memory_order_relaxed);
+
+	shard_entry_unref(e);
+}
+
+/** Resize the table, dropping tombstones
+ *
+ */
+static int shard_resize(cache_shard_t *shard, uint32_t num_slots)
+{
+	rlm_cache_shard_entry_t **old = shard->slots, *e;
+	uint32_t old_num = shard->num_slots, i, slot;
+
+	shard->slots = talloc_zero_array(NULL, rlm_cache_shard_entry_t *, num_slots);
+	if (!shard->slots) {
+		shard->slots = old;
+		return -1;
+	}
+	shard->num_slots = num_slots;
+	shard->deleted = 0;
+	shard->hand = 0;
+
+	for (i = 0; i < old_num; i++) {
+		e = old[i];
+		if (!e || (e == TOMBSTONE)) continue;
+
+		for (slot = shard_slot(shard, e->hash); shard->slots[slot]; slot = (slot + 1) & (num_slots - 1));
+		shard->slots[slot] = e;
+	}
+
+	talloc_free(old);
+
+	return 0;
+}
+
+/** Evict entries until there's room for size more bytes
+ *
+ * Expired entries, and entries which haven't been looked up since the
+ * hand last passed them, are evicted.
+ */
+static void shard_evict(rlm_cache_shard_t *driver, cache_shard_t *shard, size_t size, time_t now)
+{
+	uint64_t max = driver->max_size / driver->num_shards;
+	rlm_cache_shard_entry_t *e;
+
+	if (!driver->max_size) return;
+
+	while (shard->used && ((shard->size + size) > max)) {
+		shard->hand = (shard->hand + 1) & (shard->num_slots - 1);
+
+		e = shard->slots[shard->hand];
+		if (!e || (e == TOMBSTONE)) continue;
+
+		if (e->referenced && (e->fields.expires >= now)) {
+			e->referenced = false;
+			continue;
+		}
+
+		shard_remove_slot(driver, shard, shard->hand);
+		shard->evictions++;
+	}
+}
+
+/** Free the tables, and any entries left in them
+ *
+ */
+static int _mod_detach(rlm_cache_shard_t *driver)
+{
+	uint32_t i, j;
+
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		cache_shard_t *shard = &driver->shards[i];
+
+		for (j = 0; j < shard->num_slots; j++) {
+			if (shard->slots[j] && (shard->slots[j] != TOMBSTONE)) talloc_free(shard->slots[j]);
+		}
+		talloc_free(shard->slots);
+
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+/** Create a new cache_shard instance
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(CONF_SECTION *conf, UNUSED rlm_cache_config_t const *config, void *driver_inst)
+{
+	rlm_cache_shard_t	*driver = driver_inst;
+	uint32_t		i;
+
+	if (cf_section_parse(conf, driver, driver_config) < 0) return -1;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 1024);
+
+	/*
+	 *	Round up to a power of 2, so we can mask the hash.
+	 */
+	for (i = 1; i < driver->num_shards; i <<= 1);
+	driver->num_shards = i;
+
+	driver->shards = talloc_zero_array(driver, cache_shard_t, driver->num_shards);
+	if (!driver->shards) {
+		ERROR("Failed allocating cache shards");
+		return -1;
+	}
+	atomic_init(&driver->count, 0);
+
+	for (i = 0; i < driver->num_shards; i++) {
+		if (pthread_mutex_init(&driver->shards[i].mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			driver->num_shards = i;
+			talloc_set_destructor(driver, _mod_detach);
+			return -1;
+		}
+	}
+
+	talloc_set_destructor(driver, _mod_detach);
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+					    REQUEST *request)
+{
+	rlm_cache_shard_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_shard_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+	atomic_init(&c->refs, 1);
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Free a cache entry
+ *
+ * Drops the caller's reference.  The entry is only freed once it has also
+ * been removed from its shard.
+ *
+ * @copydetails cache_entry_free_t
+ */
+static void cache_entry_free(rlm_cache_entry_t *c)
+{
+	rlm_cache_shard_entry_t *e;
+
+	memcpy(&e, &c, sizeof(e));
+	shard_entry_unref(e);
+}
+
+/** Locate a cache entry
+ *
+ * The entry is returned with an additional reference, which is dropped by
+ * #cache_entry_free.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *driver_inst,
+				       UNUSED REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+{
+	cache_shard_t *shard;
+	rlm_cache_shard_entry_t *e;
+	uint32_t hash;
+	int slot;
+
+	hash = fr_hash(key, key_len);
+	shard = shard_lock(driver_inst, hash);
+
+	slot = shard_find_slot(shard, hash, key, key_len);
+	if (slot < 0) {
+		shard->misses++;
+		pthread_mutex_unlock(&shard->mutex);
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	e = shard->slots[slot];
+	e->referenced = true;
+	atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+	shard->hits++;
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	*out = &e->fields;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+					 REQUEST *request, UNUSED void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_shard_t *driver = driver_inst;
+	cache_shard_t *shard;
+	uint32_t hash;
+	int slot;
+
+	if (!request) return CACHE_ERROR;
+
+	hash = fr_hash(key, key_len);
+	shard = shard_lock(driver, hash);
+
+	slot = shard_find_slot(shard, hash, key, key_len);
+	if (slot < 0) {
+		pthread_mutex_unlock(&shard->mutex);
+		return CACHE_MISS;
+	}
+
+	shard_remove_slot(driver, shard, slot);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * The shard takes its own reference to the entry, the caller's reference
+ * is dropped by #cache_entry_free.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+					 REQUEST *request, UNUSED void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_shard_t *driver = driver_inst;
+	rlm_cache_shard_entry_t *e;
+	cache_shard_t *shard;
+	uint32_t slot;
+	int old;
+
+	if (!request) return CACHE_ERROR;
+
+	memcpy(&e, &c, sizeof(e));
+
+	e->hash = fr_hash(c->key, c->key_len);
+	e->size = talloc_total_size(e);
+	e->referenced = true;
+
+	shard = shard_lock(driver, e->hash);
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = shard_find_slot(shard, e->hash, c->key, c->key_len);
+	if (old >= 0) shard_remove_slot(driver, shard, old);
+
+	shard_evict(driver, shard, e->size, request->timestamp.tv_sec);
+
+	/*
+	 *	Keep the table at most 3/4 full, counting tombstones.
+	 */
+	if (((shard->used + shard->deleted + 1) * 4) > (shard->num_slots * 3)) {
+		uint32_t num_slots = shard->num_slots ? shard->num_slots : SHARD_MIN_SLOTS;
+
+		if (((shard->used + 1) * 2) > num_slots) num_slots <<= 1;
+
+		if (shard_resize(shard, num_slots) < 0) {
+			pthread_mutex_unlock(&shard->mutex);
+			RERROR("Failed resizing cache shard");
+			return CACHE_ERROR;
+		}
+	}
+
+	for (slot = shard_slot(shard, e->hash);
+	     shard->slots[slot] && (shard->slots[slot] != TOMBSTONE);
+	     slot = (slot + 1) & (shard->num_slots - 1));
+
+	if (shard->slots[slot] == TOMBSTONE) shard->deleted--;
+	shard->slots[slot] = e;
+	shard->used++;
+	shard->size += e->size;
+	atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&driver->count, 1, memory_order_relaxed);
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * Entries are expired lazily, so there's nothing to re-order.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+					  UNUSED REQUEST *request, UNUSED void *handle,
+					  UNUSED rlm_cache_entry_t *c)
+{
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+				  UNUSED REQUEST *request, UNUSED void *handle)
+{
+	rlm_cache_shard_t *driver = driver_inst;
+
+	return atomic_load_explicit(&driver->count, memory_order_relaxed);
+}
+
+/** Allocate a handle
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *driver_inst,
+			 REQUEST *request)
+{
+	rlm_cache_shard_handle_t *h;
+
+	h = talloc_zero(request, rlm_cache_shard_handle_t);
+	if (!h) return -1;
+
+	h->driver = driver_inst;
+	*handle = h;
+
+	return 0;
+}
+
+/** Free a handle
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+			  UNUSED REQUEST *request, rlm_cache_handle_t *handle)
+{
+	talloc_free(handle);
+}
+
+/** Sum the statistics from each shard
+ *
+ * Each shard is locked while it's read, so its counters are consistent
+ * with each other, but the shards aren't all read at the same time.
+ *
+ * @copydetails cache_stats_t
+ */
+static int cache_stats(rlm_cache_stats_t *out, UNUSED rlm_cache_config_t const *config, void *driver_inst)
+{
+	rlm_cache_shard_t *driver = driver_inst;
+	uint32_t i;
+
+	memset(out, 0, sizeof(*out));
+
+	for (i = 0; i < driver->num_shards; i++) {
+		cache_shard_t *shard = &driver->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		out->hits += shard->hits;
+		out->misses += shard->misses;
+		out->evictions += shard->evictions;
+		out->entries += shard->used;
+		out->size += shard->size;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	return 0;
+}
+
+extern cache_driver_t rlm_cache_shard;
+cache_driver_t rlm_cache_shard = {
+	.name		= "rlm_cache_shard",
+	.instantiate	= mod_instantiate,
+	.inst_size	= sizeof(rlm_cache_shard_t),
+	.alloc		= cache_entry_alloc,
+	.free		= cache_entry_free,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+	.stats		= cache_stats,
+};
@@ -34,6 +34,12 @@ RCSID("$Id$")
 
 #include "rlm_cache.h"
 
+static const FR_NAME_NUMBER cache_serialize_table[] = {
+	{ "text",	CACHE_SERIALIZE_TEXT },
+	{ "binary",	CACHE_SERIALIZE_BINARY },
+	{ NULL,		-1 }
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", PW_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_cache_config_t, key) },
@@ -43,6 +49,7 @@ static const CONF_PARSER module_config[] = {
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", PW_TYPE_SIGNED, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", PW_TYPE_BOOLEAN, rlm_cache_config_t, stats), .dflt = "no" },
+	{ FR_CONF_OFFSET("serialize", PW_TYPE_STRING, rlm_cache_config_t, serialize_str), .dflt = "text" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -226,7 +233,7 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 			talloc_free(p);
 		}
 
-		inst->driver->expire(&inst->config, inst->driver_inst, request, handle, c->key, c->key_len);
+		inst->driver->expire(&inst->config, inst->driver_inst, request, *handle, c->key, c->key_len);
 		cache_free(inst, &c);
 		return RLM_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
@@ -294,7 +301,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		return RLM_MODULE_FAIL;
 	}
@@ -792,6 +799,36 @@ static ssize_t cache_xlat(char **out, UNUSED size_t freespace,
 	vp_tmpl_t		target;
 	vp_map_t		*map = NULL;
 
+	/*
+	 *	%{cache:stats.<counter>} returns statistics from
+	 *	the driver, if it keeps any.
+	 */
+	if (inst->driver->stats && (strncmp(fmt, "stats.", 6) == 0)) {
+		rlm_cache_stats_t	stats;
+		uint64_t		value;
+		char const		*counter = fmt + 6;
+
+		if (inst->driver->stats(&stats, &inst->config, inst->driver_inst) < 0) return -1;
+
+		if (strcmp(counter, "hits") == 0) {
+			value = stats.hits;
+		} else if (strcmp(counter, "misses") == 0) {
+			value = stats.misses;
+		} else if (strcmp(counter, "evictions") == 0) {
+			value = stats.evictions;
+		} else if (strcmp(counter, "entries") == 0) {
+			value = stats.entries;
+		} else if (strcmp(counter, "size") == 0) {
+			value = stats.size;
+		} else {
+			REDEBUG("Unknown cache statistic \"%s\"", counter);
+			return -1;
+		}
+
+		*out = talloc_asprintf(request, "%" PRIu64, value);
+		return talloc_array_length(*out) - 1;
+	}
+
 	key_len = tmpl_expand((char const **)&key, (char *)buffer, sizeof(buffer),
 			      request, inst->config.key, NULL, NULL);
 	if (key_len < 0) return -1;
@@ -804,14 +841,16 @@ static ssize_t cache_xlat(char **out, UNUSED size_t freespace,
 
 	if (cache_acquire(&handle, mod_inst, request) < 0) return -1;
 
-	switch (cache_find(&c, mod_inst, request, handle, key, key_len)) {
+	switch (cache_find(&c, mod_inst, request, &handle, key, key_len)) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
+		cache_release(mod_inst, request, &handle);
 		return 0;
 
 	default:
+		cache_release(mod_inst, request, &handle);
 		return -1;
 	}
 
@@ -829,7 +868,7 @@ static ssize_t cache_xlat(char **out, UNUSED size_t freespace,
 	/*
 	 *	Check if we found a matching map
 	 */
-	if (!map) return 0;
+	if (!map) ret = 0;
 
 	cache_free(mod_inst, &c);
 	cache_release(mod_inst, request, &handle);
@@ -892,6 +931,7 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_cache_t	*inst = instance;
 	CONF_SECTION	*update;
+	int		serialize;
 
 	inst->cs = conf;
 
@@ -905,6 +945,14 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	serialize = fr_str2int(cache_serialize_table, inst->config.serialize_str, -1);
+	if (serialize < 0) {
+		cf_log_err_cs(conf, "Invalid 'serialize' value \"%s\", expected 'binary' or 'text'",
+			      inst->config.serialize_str);
+		return -1;
+	}
+	inst->config.serialize = serialize;
+
 	/*
 	 *	Load the appropriate driver for our database
 	 */
@@ -39,6 +39,14 @@ typedef enum {
 	CACHE_MISS	= 1				//!< Cache entry notfound
 } cache_status_t;
 
+/** Format used by drivers which serialize cache entries
+ *
+ */
+typedef enum {
+	CACHE_SERIALIZE_TEXT = 0,			//!< Human readable maps, one per line.
+	CACHE_SERIALIZE_BINARY				//!< Compact binary encoding, keyed by attribute number.
+} cache_serialize_t;
+
 /** Configuration for the rlm_cache module
  *
  * This is separate from the #rlm_cache_t struct, to limit driver's visibility of
@@ -52,6 +60,8 @@ typedef struct rlm_cache_config_t {
 	uint32_t		max_entries;		//!< Maximum entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
+	char const		*serialize_str;		//!< Format to serialize entries in.
+	cache_serialize_t	serialize;		//!< Parsed version of serialize_str.
 } rlm_cache_config_t;
 
 /*
@@ -83,6 +93,17 @@ typedef struct rlm_cache_entry_t {
 	vp_map_t		*maps;			//!< Head of the maps list.
 } rlm_cache_entry_t;
 
+/** Statistics for a cache instance
+ *
+ */
+typedef struct rlm_cache_stats_t {
+	uint64_t		hits;			//!< Lookups which found an entry.
+	uint64_t		misses;			//!< Lookups which didn't find an entry.
+	uint64_t		evictions;		//!< Entries removed to make room for new ones.
+	uint64_t		entries;		//!< Entries currently in the cache.
+	uint64_t		size;			//!< Memory used by entries, in bytes.
+} rlm_cache_stats_t;
+
 /** Instantiate a driver
  *
  * Function to handle any driver specific instantiation.
@@ -275,6 +296,20 @@ typedef void		(*cache_release_t)(rlm_cache_config_t const *config, void *driver_
 typedef int		(*cache_reconnect_t)(rlm_cache_handle_t **handle, rlm_cache_config_t const *config,
 					     void *driver_inst, REQUEST *request);
 
+/** Get statistics for the cache
+ *
+ * @note This callback is optional.  If it's provided, the statistics may be retrieved
+ *	with %{<instance>:stats.<counter>}.
+ *
+ * @param[out] out Where to write the statistics.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] driver_inst Driver specific instance data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+typedef int		(*cache_stats_t)(rlm_cache_stats_t *out, rlm_cache_config_t const *config, void *driver_inst);
+
 struct cache_driver {
 	char const			*name;			//!< Driver name.
 
@@ -294,6 +329,7 @@ struct cache_driver {
 	cache_release_t			release;		//!< (optional) Release access to resource acquired
 								//!< with acquire callback.
 	cache_reconnect_t		reconnect;		//!< (optional) Re-initialise resource.
+	cache_stats_t			stats;			//!< (optional) Retrieve statistics.
 
 	size_t				inst_size;		//!< How many bytes should be allocated for the driver's
 								//!< instance data.
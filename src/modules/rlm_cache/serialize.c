@@ -28,6 +28,30 @@ RCSID("$Id$")
 #include "rlm_cache.h"
 #include "serialize.h"
 
+#include <freeradius-devel/rad_assert.h>
+
+/*
+ *	Binary entries start with a magic number, so they can't be
+ *	confused with text entries, which always start with '&'.
+ *
+ *	The header is followed by one record per map.  Records are
+ *
+ *	flags (1) op (1) list (1) tag (1) type (1)
+ *	vendor (4) attr (4)		- or name length (2) name, with CACHE_BINARY_ATTR_NAME
+ *	value length (4) value
+ *
+ *	All integers are in network byte order, and values use the same
+ *	encoding as they would in a RADIUS attribute.
+ */
+#define CACHE_BINARY_MAGIC_LEN	3
+#define CACHE_BINARY_VERSION	1
+#define CACHE_BINARY_HDR_LEN	(CACHE_BINARY_MAGIC_LEN + 1 + 8 + 8)	//!< magic, version, created, expires.
+
+#define CACHE_BINARY_ATTR_NAME	0x01	//!< Attribute is identified by name, not by number.
+#define CACHE_BINARY_VALUE_TEXT	0x02	//!< Value has no binary encoding, and was printed as text.
+
+static uint8_t const cache_binary_magic[CACHE_BINARY_MAGIC_LEN] = { 0xfe, 'R', 'C' };
+
 /** Serialize a cache entry as a humanly readable string
  *
  * @param ctx to alloc new string in. Should be a talloc pool a little bigger
@@ -90,12 +114,450 @@ finish:
 	return 0;
 }
 
+/** Make room for more data in a binary cache entry
+ *
+ * @param buff to grow.
+ * @param used Bytes already written to buff.  Is advanced by need.
+ * @param need How many more bytes are needed.
+ * @return
+ *	- Where to write the new data.
+ *	- NULL on error.
+ */
+static uint8_t *cache_binary_reserve(uint8_t **buff, size_t *used, size_t need)
+{
+	size_t	size = talloc_array_length(*buff);
+	uint8_t	*p;
+
+	if ((*used + need) > size) {
+		while ((*used + need) > size) size *= 2;
+
+		p = talloc_realloc(talloc_parent(*buff), *buff, uint8_t, size);
+		if (!p) {
+			fr_strerror_printf("Out of memory");
+			return NULL;
+		}
+		*buff = p;
+	}
+
+	p = *buff + *used;
+	*used += need;
+
+	return p;
+}
+
+/** Whether the LHS of a map can be identified by its attribute number alone
+ *
+ */
+static bool cache_binary_attr_by_num(vp_tmpl_t const *vpt)
+{
+	fr_dict_attr_t const *da = vpt->tmpl_da;
+
+	if ((vpt->tmpl_request != REQUEST_CURRENT) || (vpt->tmpl_num != NUM_ANY)) return false;
+
+	if (da->flags.is_unknown) return false;
+
+	return (fr_dict_attr_by_num(NULL, da->vendor, da->attr) == da);
+}
+
+/** Serialize a cache entry in a compact binary format
+ *
+ * Attributes are identified by their vendor and attribute numbers, and values
+ * are written in network byte order, so entries can be decoded without going
+ * through the map parser.
+ *
+ * @param ctx to alloc new buffer in.
+ * @param out Where to write pointer to serialized cache entry.
+ * @param outlen Where to write the length of the serialized cache entry.
+ * @param c Cache entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c)
+{
+	uint8_t		*buff, *p;
+	size_t		used = 0;
+	uint64_t	date;
+	vp_map_t	*map;
+
+	buff = talloc_array(ctx, uint8_t, 256);
+	if (!buff) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	p = cache_binary_reserve(&buff, &used, CACHE_BINARY_HDR_LEN);
+	memcpy(p, cache_binary_magic, CACHE_BINARY_MAGIC_LEN);
+	p[CACHE_BINARY_MAGIC_LEN] = CACHE_BINARY_VERSION;
+	date = htonll((uint64_t)c->created);
+	memcpy(p + CACHE_BINARY_MAGIC_LEN + 1, &date, sizeof(date));
+	date = htonll((uint64_t)c->expires);
+	memcpy(p + CACHE_BINARY_MAGIC_LEN + 1 + 8, &date, sizeof(date));
+
+	for (map = c->maps; map; map = map->next) {
+		value_data_t const	*data = &map->rhs->tmpl_data_value;
+		PW_TYPE			type = map->rhs->tmpl_data_type;
+		uint8_t			flags = 0;
+		uint8_t			buffer[8];
+		uint8_t const		*value = buffer;
+		char			*text = NULL;
+		char			attr[256];
+		size_t			attr_len = 0, value_len;
+		uint16_t		len16;
+		uint32_t		len32;
+
+		rad_assert(map->lhs->type == TMPL_TYPE_ATTR);
+		rad_assert(map->rhs->type == TMPL_TYPE_DATA);
+
+		if (!cache_binary_attr_by_num(map->lhs)) {
+			flags |= CACHE_BINARY_ATTR_NAME;
+
+			attr_len = tmpl_snprint(attr, sizeof(attr), map->lhs, map->lhs->tmpl_da);
+			if (is_truncated(attr_len, sizeof(attr))) {
+				fr_strerror_printf("Serialized attribute too long.  Must be < " STRINGIFY(sizeof(attr)) " "
+						   "bytes, got %zu bytes", attr_len);
+			error:
+				talloc_free(buff);
+				return -1;
+			}
+		}
+
+		switch (type) {
+		case PW_TYPE_STRING:
+		case PW_TYPE_OCTETS:
+			value = data->octets;
+			value_len = data->length;
+			break;
+
+		/*
+		 *	All of these values are at the same location,
+		 *	and are already in network byte order.
+		 */
+		case PW_TYPE_IFID:
+		case PW_TYPE_IPV4_ADDR:
+		case PW_TYPE_IPV6_ADDR:
+		case PW_TYPE_IPV6_PREFIX:
+		case PW_TYPE_IPV4_PREFIX:
+		case PW_TYPE_ABINARY:
+		case PW_TYPE_ETHERNET:
+		case PW_TYPE_COMBO_IP_ADDR:
+			value = (uint8_t const *)data;
+			value_len = data->length;
+			break;
+
+		case PW_TYPE_BOOLEAN:
+			buffer[0] = data->boolean ? 1 : 0;
+			value_len = 1;
+			break;
+
+		case PW_TYPE_BYTE:
+			buffer[0] = data->byte;
+			value_len = 1;
+			break;
+
+		case PW_TYPE_SHORT:
+			buffer[0] = (data->ushort >> 8) & 0xff;
+			buffer[1] = data->ushort & 0xff;
+			value_len = 2;
+			break;
+
+		case PW_TYPE_INTEGER:
+		case PW_TYPE_DATE:
+		case PW_TYPE_SIGNED:
+			len32 = htonl(data->integer);
+			memcpy(buffer, &len32, sizeof(len32));
+			value_len = 4;
+			break;
+
+		case PW_TYPE_INTEGER64:
+		{
+			uint64_t value64 = htonll(data->integer64);
+
+			memcpy(buffer, &value64, sizeof(value64));
+			value_len = 8;
+		}
+			break;
+
+		/*
+		 *	Anything else is rare enough that it's not
+		 *	worth a binary encoding.
+		 */
+		default:
+			flags |= CACHE_BINARY_VALUE_TEXT;
+			text = value_data_asprint(buff, type, map->lhs->tmpl_da, data, '\0');
+			if (!text) goto error;
+			value = (uint8_t const *)text;
+			value_len = talloc_array_length(text) - 1;
+			break;
+		}
+
+		if (value_len > UINT32_MAX) {
+			fr_strerror_printf("Serialized value too long");
+			goto error;
+		}
+
+		p = cache_binary_reserve(&buff, &used, 5 + ((flags & CACHE_BINARY_ATTR_NAME) ? 2 + attr_len : 8) +
+					 4 + value_len);
+		if (!p) goto error;
+
+		*p++ = flags;
+		*p++ = map->op;
+		*p++ = map->lhs->tmpl_list;
+		*p++ = (uint8_t)map->lhs->tmpl_tag;
+		*p++ = type;
+
+		if (flags & CACHE_BINARY_ATTR_NAME) {
+			len16 = htons(attr_len);
+			memcpy(p, &len16, sizeof(len16));
+			memcpy(p + 2, attr, attr_len);
+			p += 2 + attr_len;
+		} else {
+			len32 = htonl(map->lhs->tmpl_da->vendor);
+			memcpy(p, &len32, sizeof(len32));
+			len32 = htonl(map->lhs->tmpl_da->attr);
+			memcpy(p + 4, &len32, sizeof(len32));
+			p += 8;
+		}
+
+		len32 = htonl(value_len);
+		memcpy(p, &len32, sizeof(len32));
+		if (value_len) memcpy(p + 4, value, value_len);
+
+		talloc_free(text);
+	}
+
+	*out = buff;
+	*outlen = used;
+
+	return 0;
+}
+
+/** Converts a binary serialized cache entry back into a structure
+ *
+ * @param c Cache entry to populate (should already be allocated).
+ * @param in Binary representation of cache entry.
+ * @param inlen Length of in.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	vp_map_t	**last = &c->maps;
+	uint8_t const	*p = in, *end = in + inlen;
+	uint64_t	date;
+	uint32_t	len32;
+	uint16_t	len16;
+
+	if (!cache_serialized_is_binary(in, inlen)) {
+		fr_strerror_printf("Not a binary cache entry");
+		return -1;
+	}
+
+	if (in[CACHE_BINARY_MAGIC_LEN] != CACHE_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported binary cache entry version %u", in[CACHE_BINARY_MAGIC_LEN]);
+		return -1;
+	}
+
+	memcpy(&date, in + CACHE_BINARY_MAGIC_LEN + 1, sizeof(date));
+	c->created = ntohll(date);
+	memcpy(&date, in + CACHE_BINARY_MAGIC_LEN + 1 + 8, sizeof(date));
+	c->expires = ntohll(date);
+
+	p += CACHE_BINARY_HDR_LEN;
+
+	while (p < end) {
+		vp_map_t		*map;
+		fr_dict_attr_t const	*da;
+		value_data_t		*data;
+		uint8_t			flags, list, tag;
+		PW_TYPE			type;
+		size_t			value_len;
+
+		if ((end - p) < 5) {
+		truncated:
+			fr_strerror_printf("Binary cache entry truncated");
+			return -1;
+		}
+
+		MEM(map = talloc_zero(c, vp_map_t));
+
+		flags = p[0];
+		map->op = p[1];
+		list = p[2];
+		tag = p[3];
+		type = p[4];
+		p += 5;
+
+		if (flags & CACHE_BINARY_ATTR_NAME) {
+			char attr[256];
+
+			if ((end - p) < 2) {
+			map_truncated:
+				talloc_free(map);
+				goto truncated;
+			}
+			memcpy(&len16, p, sizeof(len16));
+			len16 = ntohs(len16);
+			p += 2;
+
+			if ((size_t)(end - p) < len16) goto map_truncated;
+			if (len16 >= sizeof(attr)) {
+				fr_strerror_printf("Serialized attribute too long");
+			error:
+				talloc_free(map);
+				return -1;
+			}
+			memcpy(attr, p, len16);
+			attr[len16] = '\0';
+			p += len16;
+
+			if (tmpl_afrom_attr_str(map, &map->lhs, attr, REQUEST_CURRENT, PAIR_LIST_REQUEST,
+						true, false) <= 0) goto error;
+
+			if (map->lhs->type != TMPL_TYPE_ATTR) {
+				fr_strerror_printf("Pair left hand side \"%s\" parsed as %s, needed attribute.  "
+						   "Check local dictionaries", map->lhs->name,
+						   fr_int2str(tmpl_names, map->lhs->type, "<INVALID>"));
+				goto error;
+			}
+			da = map->lhs->tmpl_da;
+		} else {
+			uint32_t vendor, attr;
+
+			if ((end - p) < 8) goto map_truncated;
+			memcpy(&vendor, p, sizeof(vendor));
+			memcpy(&attr, p + 4, sizeof(attr));
+			p += 8;
+
+			da = fr_dict_attr_by_num(NULL, ntohl(vendor), ntohl(attr));
+			if (!da) {
+				fr_strerror_printf("Unknown attribute %u.%u.  Check local dictionaries",
+						   ntohl(vendor), ntohl(attr));
+				goto error;
+			}
+
+			MEM(map->lhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_ATTR, da->name, -1, T_BARE_WORD));
+			map->lhs->tmpl_da = da;
+			map->lhs->tmpl_tag = (int8_t)tag;
+			map->lhs->tmpl_list = list;
+			map->lhs->tmpl_num = NUM_ANY;
+			map->lhs->tmpl_request = REQUEST_CURRENT;
+		}
+
+		if (da->type != type) {
+			fr_strerror_printf("Serialized type of %s (%s) doesn't match dictionary type (%s).  "
+					   "Check local dictionaries", da->name,
+					   fr_int2str(dict_attr_types, type, "<INVALID>"),
+					   fr_int2str(dict_attr_types, da->type, "<INVALID>"));
+			goto error;
+		}
+
+		if ((end - p) < 4) goto map_truncated;
+		memcpy(&len32, p, sizeof(len32));
+		value_len = ntohl(len32);
+		p += 4;
+		if ((size_t)(end - p) < value_len) goto map_truncated;
+
+		MEM(map->rhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_DATA, "<BINARY>", -1,
+					 (type == PW_TYPE_STRING) ? T_SINGLE_QUOTED_STRING : T_BARE_WORD));
+		map->rhs->tmpl_data_type = type;
+		data = &map->rhs->tmpl_data_value;
+
+		if (flags & CACHE_BINARY_VALUE_TEXT) {
+			if (value_data_from_str(map->rhs, data, &type, da, (char const *)p, value_len, '\0') < 0) {
+				goto error;
+			}
+			goto next;
+		}
+
+		/*
+		 *	Check fixed length types against the dictionary
+		 *	sizes, and make sure they fit in the value.
+		 */
+		if ((type != PW_TYPE_STRING) && (type != PW_TYPE_OCTETS)) {
+			size_t min = dict_attr_sizes[type][0], max = dict_attr_sizes[type][1];
+
+			if (type == PW_TYPE_BOOLEAN) min = max = 1;
+
+			if ((value_len < min) || (value_len > max) || (value_len > offsetof(value_data_t, length))) {
+				fr_strerror_printf("Invalid length %zu for %s value", value_len, da->name);
+				goto error;
+			}
+		}
+
+		switch (type) {
+		case PW_TYPE_STRING:
+			data->strvalue = talloc_bstrndup(map->rhs, (char const *)p, value_len);
+			if (!data->strvalue) goto error;
+			break;
+
+		case PW_TYPE_OCTETS:
+			data->octets = talloc_memdup(map->rhs, p, value_len);
+			if (!data->octets) goto error;
+			break;
+
+		case PW_TYPE_BOOLEAN:
+			data->boolean = (p[0] != 0);
+			break;
+
+		case PW_TYPE_BYTE:
+			data->byte = p[0];
+			break;
+
+		case PW_TYPE_SHORT:
+			data->ushort = (p[0] << 8) | p[1];
+			break;
+
+		case PW_TYPE_INTEGER:
+		case PW_TYPE_DATE:
+		case PW_TYPE_SIGNED:
+			memcpy(&len32, p, sizeof(len32));
+			data->integer = ntohl(len32);
+			break;
+
+		case PW_TYPE_INTEGER64:
+			memcpy(&data->integer64, p, sizeof(data->integer64));
+			data->integer64 = ntohll(data->integer64);
+			break;
+
+		default:
+			memcpy(data, p, value_len);
+			break;
+		}
+		data->length = value_len;
+
+	next:
+		p += value_len;
+
+		*last = map;
+		last = &(*last)->next;
+	}
+
+	return 0;
+}
+
+/** Whether a serialized cache entry is in the binary format
+ *
+ * @param in Serialized cache entry.
+ * @param inlen Length of in.
+ * @return true if the entry is in the binary format, else false.
+ */
+bool cache_serialized_is_binary(uint8_t const *in, size_t inlen)
+{
+	return (inlen >= CACHE_BINARY_HDR_LEN) && (memcmp(in, cache_binary_magic, CACHE_BINARY_MAGIC_LEN) == 0);
+}
+
 /** Converts a serialized cache entry back into a structure
+ *
+ * Entries in the binary format are passed to #cache_deserialize_binary, so
+ * entries written with either format can be read back.
  *
  * @param c Cache entry to populate (should already be allocated)
  * @param in String representation of cache entry.
  * @param inlen Length of string. May be < 0 in which case strlen will be
- *	used to calculate the length of the string.
+ *	used to calculate the length of the string.  Must be >= 0 for
+ *	binary entries.
  * @return
  *	- 0 on success.
  *	- -1 on failure.
@@ -105,7 +567,11 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 	vp_map_t	**last = &c->maps;
 	char		*p, *q;
 
-	if (inlen < 0) inlen = strlen(in);
+	if (inlen < 0) {
+		inlen = strlen(in);
+	} else if (cache_serialized_is_binary((uint8_t const *)in, inlen)) {
+		return cache_deserialize_binary(c, (uint8_t const *)in, inlen);
+	}
 
 	p = in;
 
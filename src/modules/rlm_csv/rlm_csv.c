@@ -29,6 +29,9 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 
 #include <freeradius-devel/map_proc.h>
+#include <freeradius-devel/reload.h>
+
+#include <sys/stat.h>
 
 static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST *request,
 				char const *key, vp_map_t const *maps);
@@ -46,6 +49,10 @@ typedef struct rlm_csv_t {
 	char const	*delimiter;
 	char const	*header;
 	char const	*key;
+	char const	*index_file;
+	uint32_t	reload_interval;
+
+	CONF_SECTION	*cs;
 
 	int		num_fields;
 	int		used_fields;
@@ -53,7 +60,8 @@ typedef struct rlm_csv_t {
 
 	char const     	**field_names;
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
-	rbtree_t	*tree;
+	reload_t	*tree;		//!< Entries, in an rbtree.
+	reload_t	*index;		//!< Or a mapped fr_file_index_t, if index_file is set.
 } rlm_csv_t;
 
 typedef struct rlm_csv_entry_t {
@@ -70,6 +78,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("delimiter", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY, rlm_csv_t, delimiter), .dflt = "," },
 	{ FR_CONF_OFFSET("header", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY, rlm_csv_t, header) },
 	{ FR_CONF_OFFSET("key_field", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY, rlm_csv_t, key) },
+	{ FR_CONF_OFFSET("index", PW_TYPE_FILE_INPUT, rlm_csv_t, index_file) },
+	{ FR_CONF_OFFSET("reload_interval", PW_TYPE_INTEGER, rlm_csv_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -155,29 +165,31 @@ static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
 /*
  *	Convert a buffer to a CSV entry
  */
-static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static rlm_csv_entry_t *csv_entry_parse(TALLOC_CTX *ctx, rlm_csv_t *inst, char *buffer)
 {
 	rlm_csv_entry_t *e;
 	int i;
 	char *p, *q;
 
-	e = (rlm_csv_entry_t *) talloc_zero_array(inst->tree, uint8_t, sizeof(*e) + inst->used_fields + sizeof(e->data[0]));
+	e = (rlm_csv_entry_t *) talloc_zero_array(ctx, uint8_t, sizeof(*e) + inst->used_fields + sizeof(e->data[0]));
 	if (!e) {
-		cf_log_err_cs(conf, "Out of memory");
+		fr_strerror_printf("Out of memory");
 		return NULL;
 	}
 
 	for (p = buffer, i = 0; p != NULL; p = q, i++) {
 		if (!buf2entry(inst, p, &q)) {
-			cf_log_err_cs(conf, "Malformed entry in file %s line %d", inst->filename, lineno);
+			fr_strerror_printf("Malformed entry");
+		error:
+			talloc_free(e);
 			return NULL;
 		}
 
 		if (q) *(q++) = '\0';
 
 		if (i >= inst->num_fields) {
-			cf_log_err_cs(conf, "Too many fields at file %s line %d", inst->filename, lineno);
-			return NULL;
+			fr_strerror_printf("Too many fields");
+			goto error;
 		}
 
 		/*
@@ -197,14 +209,30 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 	}
 
 	if (i < inst->num_fields) {
-		cf_log_err_cs(conf, "Too few fields at file %s line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
+		fr_strerror_printf("Too few fields (%d < %d)", i, inst->num_fields);
+		goto error;
+	}
+
+	return e;
+}
+
+/*
+ *	Convert a line of the file to a CSV entry, and add it to the tree
+ */
+static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, rbtree_t *tree, int lineno, char *buffer)
+{
+	rlm_csv_entry_t *e;
+
+	e = csv_entry_parse(tree, inst, buffer);
+	if (!e) {
+		cf_log_err_cs(conf, "%s in file %s line %d", fr_strerror(), inst->filename, lineno);
 		return NULL;
 	}
 
 	/*
 	 *	FIXME: Allow duplicate keys later.
 	 */
-	if (!rbtree_insert(inst->tree, e)) {
+	if (!rbtree_insert(tree, e)) {
 		cf_log_err_cs(conf, "Failed inserting entry for filename %s line %d: duplicate entry",
 			      inst->filename, lineno);
 		return NULL;
@@ -257,6 +285,94 @@ static int csv_map_verify(UNUSED void *proc_inst, void *mod_inst, UNUSED vp_tmpl
 }
 
 
+/*
+ *	Read the CSV file into a new tree, for reload_init().  The
+ *	tree is allocated in the NULL ctx, as it may be read by the
+ *	reload thread.
+ */
+static void *csv_load(char const *filename, void *uctx)
+{
+	rlm_csv_t	*inst = uctx;
+	rbtree_t	*tree;
+	FILE		*fp;
+	int		lineno;
+	char		buffer[8192];
+
+	tree = rbtree_create(NULL, csv_entry_cmp, NULL, 0);
+	if (!tree) {
+		cf_log_err_cs(inst->cs, "Out of memory");
+		return NULL;
+	}
+
+	/*
+	 *	Read the file line by line.
+	 */
+	fp = fopen(filename, "r");
+	if (!fp) {
+		cf_log_err_cs(inst->cs, "Error opening filename %s: %s", filename, strerror(errno));
+		talloc_free(tree);
+		return NULL;
+	}
+
+	lineno = 1;
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		rlm_csv_entry_t *e;
+
+		e = file2csv(inst->cs, inst, tree, lineno, buffer);
+		if (!e) {
+			fclose(fp);
+			talloc_free(tree);
+			return NULL;
+		}
+
+		lineno++;
+	}
+
+	fclose(fp);
+
+	return tree;
+}
+
+static void csv_free(void *data, UNUSED void *uctx)
+{
+	talloc_free(data);
+}
+
+/*
+ *	Map an index built by radindex, for reload_init().
+ */
+static void *csv_index_load(char const *filename, void *uctx)
+{
+	rlm_csv_t		*inst = uctx;
+	fr_file_index_t		*idx;
+	fr_file_index_info_t	info;
+	struct stat		st;
+
+	idx = fr_file_index_open(NULL, filename);
+	if (!idx) {
+		cf_log_err_cs(inst->cs, "%s", fr_strerror());
+		return NULL;
+	}
+
+	fr_file_index_info(idx, &info);
+	if ((info.key_field != (uint32_t) inst->key_field) || (info.delimiter != *inst->delimiter) ||
+	    !(info.flags & FR_FILE_INDEX_QUOTED) || (info.flags & FR_FILE_INDEX_LIST_KEYS)) {
+		cf_log_err_cs(inst->cs, "Index %s does not match the configuration.  Rebuild it with "
+			      "'radindex -d %c -q -k %d %s'", filename, *inst->delimiter, inst->key_field + 1,
+			      inst->filename);
+		talloc_free(idx);
+		return NULL;
+	}
+
+	if ((stat(inst->filename, &st) == 0) &&
+	    ((st.st_mtime != info.source_mtime) || ((uint64_t) st.st_size != info.source_size))) {
+		WARN("rlm_csv (%s) - Index %s is out of date with respect to %s", inst->name,
+		     filename, inst->filename);
+	}
+
+	return idx;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -274,10 +390,8 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	char const *p;
 	char *q;
 	char *header;
-	FILE *fp;
-	int lineno;
-	char buffer[8192];
 
+	inst->cs = conf;
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
@@ -363,33 +477,20 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
-	inst->tree = rbtree_create(inst, csv_entry_cmp, NULL, 0);
-	if (!inst->tree) goto oom;
-
 	/*
-	 *	Read the file line by line.
+	 *	Use the pre-built index if there is one, and
+	 *	otherwise read the whole file.
 	 */
-	fp = fopen(inst->filename, "r");
-	if (!fp) {
-		cf_log_err_cs(conf, "Error opening filename %s: %s", inst->filename, strerror(errno));
-		return -1;
-	}
-
-	lineno = 1;
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		rlm_csv_entry_t *e;
-
-		e = file2csv(conf, inst, lineno, buffer);
-		if (!e) {
-			fclose(fp);
-			return -1;
-		}
-
-		lineno++;
+	if (inst->index_file) {
+		inst->index = reload_init(inst, inst->name, inst->index_file, inst->reload_interval,
+					  csv_index_load, csv_free, inst);
+		if (!inst->index) return -1;
+	} else {
+		inst->tree = reload_init(inst, inst->name, inst->filename, inst->reload_interval,
+					 csv_load, csv_free, inst);
+		if (!inst->tree) return -1;
 	}
 
-	fclose(fp);
-
 	/*
 	 *	And register the map function.
 	 */
@@ -398,6 +499,19 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+/*
+ *	Stop the reload thread before the config it uses is freed.
+ */
+static int mod_detach(void *instance)
+{
+	rlm_csv_t *inst = instance;
+
+	TALLOC_FREE(inst->tree);
+	TALLOC_FREE(inst->index);
+
+	return 0;
+}
+
 /*
  *	Convert field X to a VP.
  */
@@ -473,13 +587,57 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 				char const *key, vp_map_t const *maps)
 {
 	rlm_csv_t		*inst = mod_inst;
-	rlm_csv_entry_t		*e, my_entry;
+	rlm_csv_entry_t		*e = NULL, my_entry;
 	vp_map_t const		*map;
+	reload_t		*rl;
+	unsigned int		ref;
+	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
+
+	/*
+	 *	The entry stays valid until we release the tree or
+	 *	index, even if the file is reloaded.
+	 */
+	if (inst->index) {
+		fr_file_index_t	*idx;
+		uint64_t	iter = 0;
+		char const	*line;
+		char		buffer[8192];
+
+		rl = inst->index;
+		idx = reload_acquire(rl, &ref);
+
+		line = fr_file_index_find(idx, &iter, key, strlen(key), NULL);
+		if (!line) {
+			rcode = RLM_MODULE_NOOP;
+			goto finish;
+		}
 
-	my_entry.key = key;
+		/*
+		 *	The line is in read-only memory, so it has to be
+		 *	copied before it can be split into fields.
+		 */
+		if (strlcpy(buffer, line, sizeof(buffer)) >= sizeof(buffer)) {
+			REDEBUG("Entry for key '%s' is too long", key);
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
 
-	e = rbtree_finddata(inst->tree, &my_entry);
-	if (!e) return RLM_MODULE_NOOP;
+		e = csv_entry_parse(request, inst, buffer);
+		if (!e) {
+			REDEBUG("%s in entry for key '%s'", fr_strerror(), key);
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	} else {
+		rl = inst->tree;
+		my_entry.key = key;
+
+		e = rbtree_finddata(reload_acquire(rl, &ref), &my_entry);
+		if (!e) {
+			rcode = RLM_MODULE_NOOP;
+			goto finish;
+		}
+	}
 
 	RINDENT();
 	for (map = maps;
@@ -494,7 +652,8 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 		if (map->rhs->type != TMPL_TYPE_UNPARSED) {
 			if (tmpl_aexpand(request, &field_name, request, map->rhs, NULL, NULL) < 0) {
 				RDEBUG("Failed expanding RHS at %s", map->lhs->name);
-				return RLM_MODULE_FAIL;
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
 			}
 		} else {
 			memcpy(&field_name, &map->rhs->name, sizeof(field_name)); /* const */
@@ -506,7 +665,8 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 
 		if (field < 0) {
 			RDEBUG("No such field name %s", map->rhs->name);
-			return RLM_MODULE_FAIL;
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
 		}
 
 		/*
@@ -514,11 +674,16 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 		 *	create the VP and add it to the map.
 		 */
 		if (map_to_request(request, map, csv_map_getvalue, e->data[field]) < 0) {
-			return RLM_MODULE_FAIL;
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
 		}
 	}
 
-	return RLM_MODULE_UPDATED;
+finish:
+	if (inst->index) talloc_free(e);
+	reload_release(rl, ref);
+
+	return rcode;
 }
 
 extern module_t rlm_csv;
@@ -529,4 +694,5 @@ module_t rlm_csv = {
 	.inst_size	= sizeof(rlm_csv_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.detach		= mod_detach,
 };
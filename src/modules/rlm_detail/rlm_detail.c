@@ -34,7 +34,16 @@ RCSID("$Id$")
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
 
 #ifdef HAVE_FNMATCH_H
 #  include <fnmatch.h>
@@ -50,6 +59,69 @@ RCSID("$Id$")
 
 #define DIRLEN	8192		//!< Maximum path length.
 
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+/** When the writer thread should fsync detail files
+ *
+ */
+typedef enum {
+	DETAIL_FSYNC_NONE = 0,		//!< Leave flushing to the OS.
+	DETAIL_FSYNC_BATCH,		//!< After every batch of entries.
+	DETAIL_FSYNC_INTERVAL		//!< After a batch, at most once per interval.
+} detail_fsync_t;
+
+static const FR_NAME_NUMBER detail_fsync_table[] = {
+	{ "none",	DETAIL_FSYNC_NONE },
+	{ "batch",	DETAIL_FSYNC_BATCH },
+	{ "interval",	DETAIL_FSYNC_INTERVAL },
+
+	{  NULL , -1 }
+};
+
+/** A formatted entry waiting for the writer thread
+ *
+ * Allocated with malloc() as a single block, as entries are freed
+ * by a different thread to the one which allocated them.
+ */
+typedef struct detail_record {
+	char		*filename;	//!< Expanded filename.
+	char		*data;		//!< Formatted entry.
+	size_t		len;		//!< Length of the formatted entry.
+} detail_record_t;
+
+/** State for writing entries from a separate thread
+ *
+ */
+typedef struct detail_async {
+	bool			enabled;	//!< Whether entries are written asynchronously.
+	uint32_t		queue_size;	//!< Maximum number of entries waiting to be written.
+	uint32_t		max_batch;	//!< Maximum number of entries written in one go.
+	char const		*fsync_str;	//!< When to fsync files.
+	detail_fsync_t		fsync;		//!< Parsed version of fsync_str.
+	struct timeval		fsync_interval;	//!< Minimum time between fsyncs.
+
+	bool			have_gid;	//!< Whether gid should be set on files.
+	gid_t			gid;		//!< Resolved version of group.
+
+	fr_atomic_queue_t	*queue;		//!< Entries waiting to be written.
+	detail_record_t		**batch;	//!< Entries being written.
+	struct timeval		last_sync;	//!< When we last called fsync.
+
+	pthread_t		thread;		//!< Writer thread.
+	bool			running;	//!< Whether the writer thread was started.
+	pthread_mutex_t		mutex;		//!< Protects cond.
+	pthread_cond_t		cond;		//!< Signalled when entries are queued.
+	atomic_bool		sleeping;	//!< Whether the writer is waiting on cond.
+	atomic_bool		stop;		//!< Tells the writer to drain the queue and exit.
+
+	atomic_uint_fast64_t	queued;		//!< Entries accepted.
+	atomic_uint_fast64_t	dropped;	//!< Entries discarded because the queue was full.
+	atomic_uint_fast64_t	written;	//!< Entries written to disk.
+	atomic_uint_fast64_t	failed;		//!< Entries lost to open or write errors.
+} detail_async_t;
+
 /** Instance configuration for rlm_detail
  *
  * Holds the configuration and preparsed data for a instance of rlm_detail.
@@ -72,8 +144,19 @@ typedef struct detail_instance {
 	exfile_t    	*ef;		//!< Log file handler
 
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
+
+	detail_async_t	async;		//!< Asynchronous writer.
 } rlm_detail_t;
 
+static const CONF_PARSER async_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, rlm_detail_t, async.enabled), .dflt = "no" },
+	{ FR_CONF_OFFSET("queue_size", PW_TYPE_INTEGER, rlm_detail_t, async.queue_size), .dflt = "65536" },
+	{ FR_CONF_OFFSET("max_batch", PW_TYPE_INTEGER, rlm_detail_t, async.max_batch), .dflt = "256" },
+	{ FR_CONF_OFFSET("fsync", PW_TYPE_STRING, rlm_detail_t, async.fsync_str), .dflt = "none" },
+	{ FR_CONF_OFFSET("fsync_interval", PW_TYPE_TIMEVAL, rlm_detail_t, async.fsync_interval), .dflt = "1.0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", PW_TYPE_FILE_OUTPUT | PW_TYPE_REQUIRED | PW_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Client-IP-Address}/detail" },
 	{ FR_CONF_OFFSET("header", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_detail_t, header), .dflt = "%t" },
@@ -82,9 +165,246 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("locking", PW_TYPE_BOOLEAN, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", PW_TYPE_BOOLEAN, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", PW_TYPE_BOOLEAN, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_POINTER("async", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) async_config },
 	CONF_PARSER_TERMINATOR
 };
 
+/** Write all entries in a batch which are destined for the same file as batch[start]
+ *
+ * Entries are written with a single writev, in the order they were queued,
+ * then freed, and their slots in the batch set to NULL.
+ *
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] batch of entries.
+ * @param[in] start Index of the first entry for the file.
+ * @param[in] num Number of entries in the batch.
+ * @param[in] sync Whether the file should be fsynced after writing.
+ */
+static void detail_write_file(rlm_detail_t *inst, detail_record_t **batch, uint32_t start, uint32_t num, bool sync)
+{
+	struct iovec	vector[IOV_MAX];
+	int		vector_len = 0;
+	int		fd;
+	uint32_t	i;
+	char const	*filename = batch[start]->filename;
+
+	for (i = start; i < num; i++) {
+		if (!batch[i] || (strcmp(batch[i]->filename, filename) != 0)) continue;
+
+		vector[vector_len].iov_base = batch[i]->data;
+		vector[vector_len].iov_len = batch[i]->len;
+		vector_len++;
+	}
+
+	fd = exfile_open(inst->ef, NULL, filename, inst->perm, true);
+	if (fd < 0) {
+		ERROR("Couldn't open file %s: %s", filename, fr_strerror());
+		atomic_fetch_add_explicit(&inst->async.failed, vector_len, memory_order_relaxed);
+		goto finish;
+	}
+
+	if (inst->async.have_gid && (chown(filename, -1, inst->async.gid) == -1)) {
+		DEBUG2("Unable to change system group of '%s'", filename);
+	}
+
+	if (fr_writev(fd, vector, vector_len, NULL) < 0) {
+		ERROR("Failed writing to detail file %s: %s", filename, fr_syserror(errno));
+		exfile_close(inst->ef, NULL, fd);
+		atomic_fetch_add_explicit(&inst->async.failed, vector_len, memory_order_relaxed);
+		goto finish;
+	}
+
+	if (sync && (fsync(fd) < 0)) {
+		ERROR("Failed syncing detail file %s: %s", filename, fr_syserror(errno));
+	}
+
+	exfile_close(inst->ef, NULL, fd);
+	atomic_fetch_add_explicit(&inst->async.written, vector_len, memory_order_relaxed);
+
+finish:
+	for (i = start + 1; i < num; i++) {
+		if (!batch[i] || (strcmp(batch[i]->filename, filename) != 0)) continue;
+
+		free(batch[i]);
+		batch[i] = NULL;
+	}
+	free(batch[start]);
+	batch[start] = NULL;
+}
+
+/** Write a batch of entries, coalescing entries for the same file
+ *
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] num Number of entries in inst->async.batch.
+ */
+static void detail_write_batch(rlm_detail_t *inst, uint32_t num)
+{
+	uint32_t	i;
+	bool		sync = false;
+	struct timeval	now, when;
+
+	switch (inst->async.fsync) {
+	case DETAIL_FSYNC_NONE:
+		break;
+
+	case DETAIL_FSYNC_BATCH:
+		sync = true;
+		break;
+
+	case DETAIL_FSYNC_INTERVAL:
+		gettimeofday(&now, NULL);
+		fr_timeval_add(&when, &inst->async.last_sync, &inst->async.fsync_interval);
+		if (fr_timeval_cmp(&now, &when) >= 0) {
+			inst->async.last_sync = now;
+			sync = true;
+		}
+		break;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (!inst->async.batch[i]) continue;
+
+		detail_write_file(inst, inst->async.batch, i, num, sync);
+	}
+}
+
+/** Wait for entries to be queued
+ *
+ * Workers only signal the condition if the writer says it's sleeping,
+ * so that queueing an entry doesn't usually need the mutex.  The
+ * timeout limits the delay if a wakeup is missed.
+ */
+static void detail_writer_wait(rlm_detail_t *inst)
+{
+	struct timeval	now;
+	struct timespec	when;
+
+	gettimeofday(&now, NULL);
+	when.tv_sec = now.tv_sec + 1;
+	when.tv_nsec = now.tv_usec * 1000;
+
+	pthread_mutex_lock(&inst->async.mutex);
+	atomic_store(&inst->async.sleeping, true);
+
+	if ((fr_atomic_queue_num_elements(inst->async.queue) == 0) && !atomic_load(&inst->async.stop)) {
+		pthread_cond_timedwait(&inst->async.cond, &inst->async.mutex, &when);
+	}
+
+	atomic_store(&inst->async.sleeping, false);
+	pthread_mutex_unlock(&inst->async.mutex);
+}
+
+/** Write queued entries to disk until told to stop
+ *
+ * Whatever is in the queue when the thread is told to stop is still
+ * written out.
+ */
+static void *detail_writer(void *arg)
+{
+	rlm_detail_t	*inst = arg;
+	uint32_t	num;
+
+	for (;;) {
+		for (num = 0; num < inst->async.max_batch; num++) {
+			if (!fr_atomic_queue_pop(inst->async.queue, (void **) &inst->async.batch[num])) break;
+		}
+
+		if (num > 0) {
+			detail_write_batch(inst, num);
+			continue;
+		}
+
+		if (atomic_load(&inst->async.stop)) break;
+
+		detail_writer_wait(inst);
+	}
+
+	return NULL;
+}
+
+/** Queue a formatted entry for the writer thread
+ *
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] filename The expanded filename.
+ * @param[in] data The formatted entry.
+ * @param[in] len Length of the formatted entry.
+ * @return
+ *	- #RLM_MODULE_OK if the entry was queued.
+ *	- #RLM_MODULE_FAIL if the queue was full.
+ */
+static rlm_rcode_t detail_enqueue(rlm_detail_t *inst, REQUEST *request, char const *filename,
+				  char const *data, size_t len)
+{
+	detail_record_t	*rec;
+	size_t		filename_len = strlen(filename);
+
+	rec = malloc(sizeof(*rec) + filename_len + 1 + len);
+	if (!rec) {
+		RERROR("Out of memory");
+		return RLM_MODULE_FAIL;
+	}
+
+	rec->filename = (char *) (rec + 1);
+	memcpy(rec->filename, filename, filename_len + 1);
+	rec->data = rec->filename + filename_len + 1;
+	memcpy(rec->data, data, len);
+	rec->len = len;
+
+	if (!fr_atomic_queue_push(inst->async.queue, rec)) {
+		free(rec);
+		atomic_fetch_add_explicit(&inst->async.dropped, 1, memory_order_relaxed);
+		RERROR("Dropping entry for %s, writer queue is full", filename);
+		return RLM_MODULE_FAIL;
+	}
+	atomic_fetch_add_explicit(&inst->async.queued, 1, memory_order_relaxed);
+
+	if (atomic_load(&inst->async.sleeping)) {
+		pthread_mutex_lock(&inst->async.mutex);
+		pthread_cond_signal(&inst->async.cond);
+		pthread_mutex_unlock(&inst->async.mutex);
+	}
+
+	return RLM_MODULE_OK;
+}
+
+/** Return statistics for the asynchronous writer
+ *
+ * @verbatim %{<inst>:stats.<counter>} @endverbatim where counter is one
+ * of queue_depth, queued, dropped, written or failed.
+ */
+static ssize_t detail_xlat(char **out, UNUSED size_t freespace,
+			   void const *mod_inst, UNUSED void const *xlat_inst,
+			   REQUEST *request, char const *fmt)
+{
+	rlm_detail_t const	*inst = mod_inst;
+	uint64_t		value;
+	char const		*counter;
+
+	if (strncmp(fmt, "stats.", 6) != 0) {
+		REDEBUG("Unknown detail expansion \"%s\"", fmt);
+		return -1;
+	}
+	counter = fmt + 6;
+
+	if (strcmp(counter, "queue_depth") == 0) {
+		value = fr_atomic_queue_num_elements(inst->async.queue);
+	} else if (strcmp(counter, "queued") == 0) {
+		value = atomic_load(&inst->async.queued);
+	} else if (strcmp(counter, "dropped") == 0) {
+		value = atomic_load(&inst->async.dropped);
+	} else if (strcmp(counter, "written") == 0) {
+		value = atomic_load(&inst->async.written);
+	} else if (strcmp(counter, "failed") == 0) {
+		value = atomic_load(&inst->async.failed);
+	} else {
+		REDEBUG("Unknown detail statistic \"%s\"", counter);
+		return -1;
+	}
+
+	*out = talloc_asprintf(request, "%" PRIu64, value);
+	return talloc_array_length(*out) - 1;
+}
 
 /*
  *	Clean up.
@@ -92,6 +412,24 @@ static const CONF_PARSER module_config[] = {
 static int mod_detach(void *instance)
 {
 	rlm_detail_t *inst = instance;
+
+	/*
+	 *	Let the writer flush whatever is still queued.
+	 */
+	if (inst->async.running) {
+		atomic_store(&inst->async.stop, true);
+
+		pthread_mutex_lock(&inst->async.mutex);
+		pthread_cond_signal(&inst->async.cond);
+		pthread_mutex_unlock(&inst->async.mutex);
+
+		pthread_join(inst->async.thread, NULL);
+
+		pthread_cond_destroy(&inst->async.cond);
+		pthread_mutex_destroy(&inst->async.mutex);
+		inst->async.running = false;
+	}
+
 	if (inst->ht) fr_hash_table_free(inst->ht);
 	return 0;
 }
@@ -189,13 +527,96 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		}
 	}
 
+	/*
+	 *	Start the writer thread.  Workers format entries
+	 *	and queue them, and the writer coalesces them into
+	 *	as few writes as possible.
+	 */
+	if (inst->async.enabled) {
+		int fsync_type;
+
+		fsync_type = fr_str2int(detail_fsync_table, inst->async.fsync_str, -1);
+		if (fsync_type < 0) {
+			cf_log_err_cs(conf, "Invalid 'async.fsync' value \"%s\", expected 'none', 'batch' "
+				      "or 'interval'", inst->async.fsync_str);
+			return -1;
+		}
+		inst->async.fsync = fsync_type;
+
+		FR_INTEGER_BOUND_CHECK("queue_size", inst->async.queue_size, >=, 16);
+		FR_INTEGER_BOUND_CHECK("queue_size", inst->async.queue_size, <=, 1048576);
+		FR_INTEGER_BOUND_CHECK("max_batch", inst->async.max_batch, >=, 1);
+		FR_INTEGER_BOUND_CHECK("max_batch", inst->async.max_batch, <=, IOV_MAX);
+
+#ifdef HAVE_GRP_H
+		if (inst->group) {
+			char *endptr;
+
+			inst->async.gid = strtol(inst->group, &endptr, 10);
+			if (*endptr != '\0') {
+				if (rad_getgid(inst, &inst->async.gid, inst->group) < 0) {
+					cf_log_err_cs(conf, "Unable to find system group '%s'", inst->group);
+					return -1;
+				}
+			}
+			inst->async.have_gid = true;
+		}
+#endif
+
+		inst->async.queue = fr_atomic_queue_create(inst, inst->async.queue_size);
+		if (!inst->async.queue) {
+			cf_log_err_cs(conf, "Failed creating writer queue: %s", fr_strerror());
+			return -1;
+		}
+		MEM(inst->async.batch = talloc_zero_array(inst, detail_record_t *, inst->async.max_batch));
+
+		pthread_mutex_init(&inst->async.mutex, NULL);
+		pthread_cond_init(&inst->async.cond, NULL);
+
+		if (pthread_create(&inst->async.thread, NULL, detail_writer, inst) != 0) {
+			cf_log_err_cs(conf, "Failed creating writer thread: %s", fr_syserror(errno));
+			pthread_cond_destroy(&inst->async.cond);
+			pthread_mutex_destroy(&inst->async.mutex);
+			return -1;
+		}
+		inst->async.running = true;
+
+		xlat_register(inst, inst->name, detail_xlat, NULL, NULL, 0, 0);
+	}
+
 	return 0;
 }
 
+/** Append a single attribute to a detail entry
+ *
+ * Output is the same as fr_pair_fprint(), the attribute indented with a tab,
+ * and followed by a newline.
+ */
+static void detail_pair_append(char **out, VALUE_PAIR const *vp)
+{
+	char	buf[1024];
+	size_t	len;
+
+	buf[0] = '\t';
+	len = fr_pair_snprint(buf + 1, sizeof(buf) - 1, vp);
+	if (!len) return;
+	len++;
+
+	/*
+	 *	Deal with truncation gracefully
+	 */
+	if (len >= (sizeof(buf) - 2)) len = sizeof(buf) - 2;
+
+	buf[len++] = '\n';
+	buf[len] = '\0';
+
+	MEM(*out = talloc_strdup_append_buffer(*out, buf));
+}
+
 /*
  *	Wrapper for VPs allocated on the stack.
  */
-static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, VALUE_PAIR const *stacked)
+static void detail_fr_pair_append(TALLOC_CTX *ctx, char **out, VALUE_PAIR const *stacked)
 {
 	VALUE_PAIR *vp;
 
@@ -204,36 +625,36 @@ static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, VALUE_PAIR const *
 
 	memcpy(vp, stacked, sizeof(*vp));
 	vp->op = T_OP_EQ;
-	fr_pair_fprint(out, vp);
+	detail_pair_append(out, vp);
 	talloc_free(vp);
 }
 
 
-/** Write a single detail entry to file pointer
+/** Format a single detail entry
  *
- * @param[in] out Where to write entry.
+ * @param[in] ctx to allocate the entry in.
  * @param[in] inst Instance of rlm_detail.
  * @param[in] request The current request.
  * @param[in] packet associated with the request (request, reply, proxy-request, proxy-reply...).
  * @param[in] compat Write out entry in compatibility mode.
+ * @return
+ *	- The formatted entry.
+ *	- NULL on error.
  */
-static int detail_write(FILE *out, rlm_detail_t *inst, REQUEST *request, RADIUS_PACKET *packet, bool compat)
+static char *detail_format(TALLOC_CTX *ctx, rlm_detail_t const *inst, REQUEST *request,
+			   RADIUS_PACKET *packet, bool compat)
 {
 	VALUE_PAIR *vp;
 	char timestamp[256];
+	char *out;
 
 	if (radius_xlat(timestamp, sizeof(timestamp), request, inst->header, NULL, NULL) < 0) {
-		return -1;
+		return NULL;
 	}
 
-#define WRITE(fmt, ...) do {\
-	if (fprintf(out, fmt, ## __VA_ARGS__) < 0) {\
-		RERROR("Failed writing to detail file: %s", fr_syserror(errno));\
-		return -1;\
-	}\
-} while(0)
+#define WRITE(fmt, ...) MEM(out = talloc_asprintf_append_buffer(out, fmt, ## __VA_ARGS__))
 
-	WRITE("%s\n", timestamp);
+	MEM(out = talloc_asprintf(ctx, "%s\n", timestamp));
 
 	/*
 	 *	Write the information to the file.
@@ -278,16 +699,16 @@ static int detail_write(FILE *out, rlm_detail_t *inst, REQUEST *request, RADIUS_
 			break;
 		}
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		detail_fr_pair_append(request, &out, &src_vp);
+		detail_fr_pair_append(request, &out, &dst_vp);
 
 		src_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_SRC_PORT);
 		src_vp.vp_integer = packet->src_port;
 		dst_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_DST_PORT);
 		dst_vp.vp_integer = packet->dst_port;
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		detail_fr_pair_append(request, &out, &src_vp);
+		detail_fr_pair_append(request, &out, &dst_vp);
 	}
 
 	{
@@ -310,7 +731,7 @@ static int detail_write(FILE *out, rlm_detail_t *inst, REQUEST *request, RADIUS_
 			 */
 			op = vp->op;
 			vp->op = T_OP_EQ;
-			fr_pair_fprint(out, vp);
+			detail_pair_append(&out, vp);
 			vp->op = op;
 		}
 	}
@@ -333,7 +754,7 @@ static int detail_write(FILE *out, rlm_detail_t *inst, REQUEST *request, RADIUS_
 
 	WRITE("\n");
 
-	return 0;
+	return out;
 }
 
 /*
@@ -344,7 +765,8 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void *instance, REQUEST *request,
 	int		outfd;
 	char		buffer[DIRLEN];
 
-	FILE		*outfp;
+	char		*entry;
+	struct iovec	vector;
 
 #ifdef HAVE_GRP_H
 	gid_t		gid;
@@ -381,9 +803,22 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void *instance, REQUEST *request,
 #endif
 #endif
 
+	entry = detail_format(request, inst, request, packet, compat);
+	if (!entry) return RLM_MODULE_FAIL;
+
+	if (inst->async.enabled) {
+		rlm_rcode_t rcode;
+
+		rcode = detail_enqueue(inst, request, buffer, entry, talloc_array_length(entry) - 1);
+		talloc_free(entry);
+
+		return rcode;
+	}
+
 	outfd = exfile_open(inst->ef, request, buffer, inst->perm, true);
 	if (outfd < 0) {
 		RERROR("Couldn't open file %s: %s", buffer, fr_strerror());
+		talloc_free(entry);
 		return RLM_MODULE_FAIL;
 	}
 
@@ -402,24 +837,18 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void *instance, REQUEST *request,
 	}
 
 skip_group:
-	/*
-	 *	Open the output fp for buffering.
-	 */
-	if ((outfp = fdopen(outfd, "a")) == NULL) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_syserror(errno));
-	fail:
-		if (outfp) fclose(outfp);
-		exfile_unlock(inst->ef, request, outfd);
+	vector.iov_base = entry;
+	vector.iov_len = talloc_array_length(entry) - 1;
+
+	if (fr_writev(outfd, &vector, 1, NULL) < 0) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+		exfile_close(inst->ef, request, outfd);
+		talloc_free(entry);
 		return RLM_MODULE_FAIL;
 	}
 
-	if (detail_write(outfp, inst, request, packet, compat) < 0) goto fail;
-
-	/*
-	 *	Flush everything
-	 */
-	fclose(outfp);
-	exfile_unlock(inst->ef, request, outfd); /* do NOT close outfp */
+	exfile_close(inst->ef, request, outfd);
+	talloc_free(entry);
 
 	/*
 	 *	And everything is fine.
@@ -26,44 +26,80 @@ RCSID("$Id$")
 
 #include	<freeradius-devel/radiusd.h>
 #include	<freeradius-devel/modules.h>
+#include	<freeradius-devel/reload.h>
 
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/** A DEFAULT index key, and the entries which have it
+ *
+ */
+typedef struct files_index_entry {
+	VALUE_PAIR const	*vp;		//!< Check item the entries were indexed by.
+	uint32_t		*defaults;	//!< Positions of the entries in the DEFAULT array.
+	uint32_t		num_defaults;	//!< Number of entries with this key.
+} files_index_entry_t;
+
+/** The entries from one "users" file
+ *
+ * Most DEFAULT entries compare a request attribute with a fixed value,
+ * e.g. NAS-IP-Address == 192.0.2.1.  Those entries are indexed by
+ * attribute and value.  For a given request, only the entries matching
+ * its attributes, and the entries which couldn't be indexed, are
+ * evaluated with paircompare().
+ */
+typedef struct rlm_files_table {
+	rbtree_t		*users;		//!< Non-DEFAULT entries, keyed by name.
+
+	PAIR_LIST		**defaults;	//!< DEFAULT entries, in file order.
+	uint32_t		num_defaults;	//!< Number of DEFAULT entries.
+
+	fr_hash_table_t		*index;		//!< files_index_entry_t, keyed by check item.
+	fr_dict_attr_t const	**index_da;	//!< Attributes used as index keys.
+	uint32_t		num_index_da;	//!< Number of attributes used as index keys.
+
+	uint64_t		*unindexed;	//!< Bitmap of DEFAULT entries which are always evaluated.
+	uint32_t		bitmap_len;	//!< Number of words in a DEFAULT bitmap.
+} rlm_files_table_t;
+
 typedef struct rlm_files_t {
+	char const *name;
+
 	char const *compat_mode;
 
 	char const *key;
 
+	uint32_t reload_interval;
+
 	char const *filename;
-	rbtree_t *common;
+	reload_t *common;
 
 	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
+	reload_t *users;
 
 
 	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
+	reload_t *auth_users;
 
 	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
+	reload_t *acct_users;
 
 #ifdef WITH_PROXY
 	/* pre-proxy */
 	char const *preproxy_usersfile;
-	rbtree_t *preproxy_users;
+	reload_t *preproxy_users;
 
 	/* post-proxy */
 	char const *postproxy_usersfile;
-	rbtree_t *postproxy_users;
+	reload_t *postproxy_users;
 #endif
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+	reload_t *postauth_users;
 } rlm_files_t;
 
 
@@ -90,6 +126,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("postauth_usersfile", PW_TYPE_FILE_INPUT, rlm_files_t, postauth_usersfile) },
 	{ FR_CONF_OFFSET("compat", PW_TYPE_STRING | PW_TYPE_DEPRECATED, rlm_files_t, compat_mode) },
 	{ FR_CONF_OFFSET("key", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_files_t, key) },
+	{ FR_CONF_OFFSET("reload_interval", PW_TYPE_INTEGER, rlm_files_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -100,21 +137,188 @@ static int pairlist_cmp(void const *a, void const *b)
 		      ((PAIR_LIST const *)b)->name);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree, char const *compat_mode_str)
+/** Get the bytes of a check item value, as compared by radius_compare_vps()
+ *
+ * @return false if the type can't be used as an index key.
+ */
+static bool files_index_value(VALUE_PAIR const *vp, void const **value, size_t *len)
+{
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+		*value = vp->vp_strvalue;
+		*len = strlen(vp->vp_strvalue);	/* compared with strcmp() */
+		return true;
+
+	case PW_TYPE_OCTETS:
+		*value = vp->vp_octets;
+		*len = vp->vp_length;
+		return true;
+
+	case PW_TYPE_INTEGER:
+		*value = &vp->vp_integer;
+		*len = sizeof(vp->vp_integer);
+		return true;
+
+	case PW_TYPE_IPV4_ADDR:
+		*value = &vp->vp_ipaddr;
+		*len = sizeof(vp->vp_ipaddr);
+		return true;
+
+	case PW_TYPE_IPV6_ADDR:
+		*value = &vp->vp_ipv6addr;
+		*len = sizeof(vp->vp_ipv6addr);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static uint32_t files_index_hash(void const *data)
+{
+	files_index_entry_t const *ie = data;
+	void const *value;
+	size_t len;
+	uint32_t hash;
+
+	hash = fr_hash(&ie->vp->da, sizeof(ie->vp->da));
+	if (!files_index_value(ie->vp, &value, &len)) return hash;
+
+	return fr_hash_update(value, len, hash);
+}
+
+static int files_index_cmp(void const *one, void const *two)
+{
+	files_index_entry_t const *a = one;
+	files_index_entry_t const *b = two;
+	void const *a_value, *b_value;
+	size_t a_len, b_len;
+
+	if (a->vp->da != b->vp->da) return (a->vp->da < b->vp->da) ? -1 : +1;
+
+	(void) files_index_value(a->vp, &a_value, &a_len);
+	(void) files_index_value(b->vp, &b_value, &b_len);
+
+	if (a_len != b_len) return (a_len < b_len) ? -1 : +1;
+
+	return memcmp(a_value, b_value, a_len);
+}
+
+/** Find a check item which a DEFAULT entry can be indexed by
+ *
+ * The check item must be an equality comparison of a RADIUS attribute
+ * with a fixed value, so that the entry can only match requests which
+ * contain that attribute with that value.  Attributes with comparison
+ * functions registered, such as Huntgroup-Name, can't be indexed.
+ *
+ * @param entry to find a key for.
+ * @return
+ *	- The check item to index by.
+ *	- NULL if the entry can't be indexed.
+ */
+static VALUE_PAIR const *files_index_key(PAIR_LIST const *entry)
+{
+	VALUE_PAIR	*vp;
+	void const	*value;
+	size_t		len;
+
+	for (vp = entry->check; vp; vp = vp->next) {
+		if ((vp->op != T_OP_CMP_EQ) && (vp->op != T_OP_EQ)) continue;
+
+		if (vp->type == VT_XLAT) continue;
+
+		if (vp->da->flags.virtual || vp->da->flags.has_tag) continue;
+
+		if (!vp->da->vendor && ((vp->da->attr >= 256) || (vp->da->attr == PW_USER_PASSWORD))) continue;
+
+		if (radius_find_compare(vp->da)) continue;
+
+		if (!files_index_value(vp, &value, &len)) continue;
+
+		return vp;
+	}
+
+	return NULL;
+}
+
+/** Build the index of DEFAULT entries
+ *
+ * @param table to index.  table->defaults must be populated.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int files_index_build(rlm_files_table_t *table)
+{
+	uint32_t		i, j, indexed = 0;
+	VALUE_PAIR const	*key;
+	files_index_entry_t	my_ie, *ie;
+
+	table->bitmap_len = (table->num_defaults + 63) / 64;
+	if (!table->bitmap_len) return 0;
+
+	MEM(table->unindexed = talloc_zero_array(table, uint64_t, table->bitmap_len));
+
+	table->index = fr_hash_table_create(table, files_index_hash, files_index_cmp, NULL);
+	if (!table->index) return -1;
+
+	for (i = 0; i < table->num_defaults; i++) {
+		key = files_index_key(table->defaults[i]);
+		if (!key) {
+			table->unindexed[i / 64] |= ((uint64_t) 1) << (i % 64);
+			continue;
+		}
+
+		my_ie.vp = key;
+		ie = fr_hash_table_finddata(table->index, &my_ie);
+		if (!ie) {
+			MEM(ie = talloc_zero(table, files_index_entry_t));
+			ie->vp = key;
+			if (!fr_hash_table_insert(table->index, ie)) return -1;
+
+			/*
+			 *	Remember which attributes we need to
+			 *	look for in the request.
+			 */
+			for (j = 0; j < table->num_index_da; j++) {
+				if (table->index_da[j] == key->da) break;
+			}
+			if (j == table->num_index_da) {
+				MEM(table->index_da = talloc_realloc(table, table->index_da, fr_dict_attr_t const *,
+								     table->num_index_da + 1));
+				table->index_da[table->num_index_da++] = key->da;
+			}
+		}
+
+		MEM(ie->defaults = talloc_realloc(ie, ie->defaults, uint32_t, ie->num_defaults + 1));
+		ie->defaults[ie->num_defaults++] = i;
+		indexed++;
+	}
+
+	DEBUG2("Indexed %u of %u DEFAULT entries by %u attribute(s)",
+	       indexed, table->num_defaults, table->num_index_da);
+
+	return 0;
+}
+
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, rlm_files_table_t **ptable, char const *compat_mode_str)
 {
 	int rcode;
 	PAIR_LIST *users = NULL;
 	PAIR_LIST *entry, *next;
-	PAIR_LIST *user_list, *default_list, **default_tail;
-	rbtree_t *tree;
+	PAIR_LIST *user_list;
+	rlm_files_table_t *table;
 
 	if (!filename) {
-		*ptree = NULL;
+		*ptable = NULL;
 		return 0;
 	}
 
-	rcode = pairlist_read(ctx, filename, &users, 1);
+	MEM(table = talloc_zero(ctx, rlm_files_table_t));
+
+	rcode = pairlist_read(table, filename, &users, 1);
 	if (rcode < 0) {
+		talloc_free(table);
 		return -1;
 	}
 
@@ -235,15 +439,13 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		}
 	}
 
-	tree = rbtree_create(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
-	if (!tree) {
-		pairlist_free(&users);
+	table->users = rbtree_create(table, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!table->users) {
+	error:
+		talloc_free(table);
 		return -1;
 	}
 
-	default_list = NULL;
-	default_tail = &default_list;
-
 	/*
 	 *	We've read the entries in linearly, but putting them
 	 *	into an indexed data structure would be much faster.
@@ -255,47 +457,27 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		 */
 		next = entry->next;
 		entry->next = NULL;
-		(void) talloc_steal(tree, entry);
 
 		/*
-		 *	DEFAULT entries get their own list.
+		 *	DEFAULT entries go into an array, which is
+		 *	indexed below.
 		 */
 		if (strcmp(entry->name, "DEFAULT") == 0) {
-			if (!default_list) {
-				default_list = entry;
-
-				/*
-				 *	Insert the first DEFAULT into the tree.
-				 */
-				if (!rbtree_insert(tree, entry)) {
-				error:
-					pairlist_free(&entry);
-					pairlist_free(&next);
-					rbtree_free(tree);
-					return -1;
-				}
-
-			} else {
-				/*
-				 *	Tack this entry onto the tail
-				 *	of the DEFAULT list.
-				 */
-				*default_tail = entry;
-			}
-
-			default_tail = &entry->next;
+			MEM(table->defaults = talloc_realloc(table, table->defaults, PAIR_LIST *,
+							     table->num_defaults + 1));
+			table->defaults[table->num_defaults++] = entry;
 			continue;
 		}
 
 		/*
 		 *	Not DEFAULT, must be a normal user.
 		 */
-		user_list = rbtree_finddata(tree, entry);
+		user_list = rbtree_finddata(table->users, entry);
 		if (!user_list) {
 			/*
 			 *	Insert the first one.
 			 */
-			if (!rbtree_insert(tree, entry)) goto error;
+			if (!rbtree_insert(table->users, entry)) goto error;
 		} else {
 			/*
 			 *	Find the tail of this list, and add it
@@ -307,22 +489,146 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		}
 	}
 
-	*ptree = tree;
+	if (files_index_build(table) < 0) {
+		ERROR("Failed indexing DEFAULT entries in %s", filename);
+		goto error;
+	}
+
+	*ptable = table;
 
 	return 0;
 }
 
+/** Mark the DEFAULT entries which may match a request
+ *
+ * @param[in] ctx to allocate the bitmap in.
+ * @param[in] table of entries.
+ * @param[in] vps from the request.
+ * @return A bitmap of the positions of the DEFAULT entries to evaluate.
+ */
+static uint64_t *files_default_candidates(TALLOC_CTX *ctx, rlm_files_table_t const *table, VALUE_PAIR *vps)
+{
+	uint64_t		*bitmap;
+	uint32_t		i, j;
+	VALUE_PAIR		*vp;
+	files_index_entry_t	my_ie, *ie;
+
+	if (!table->bitmap_len) return NULL;
+
+	MEM(bitmap = talloc_memdup(ctx, table->unindexed, table->bitmap_len * sizeof(table->unindexed[0])));
+
+	for (vp = vps; vp; vp = vp->next) {
+		for (i = 0; i < table->num_index_da; i++) {
+			if (vp->da == table->index_da[i]) break;
+		}
+		if (i == table->num_index_da) continue;
+
+		my_ie.vp = vp;
+		ie = fr_hash_table_finddata(table->index, &my_ie);
+		if (!ie) continue;
+
+		for (j = 0; j < ie->num_defaults; j++) {
+			bitmap[ie->defaults[j] / 64] |= ((uint64_t) 1) << (ie->defaults[j] % 64);
+		}
+	}
+
+	return bitmap;
+}
+
+/** Return the next DEFAULT entry to evaluate
+ *
+ * @param[in] table of entries.
+ * @param[in] bitmap from files_default_candidates().
+ * @param[in,out] pos the position to search from.  Updated to the position
+ *	after the returned entry.
+ * @return
+ *	- The next DEFAULT entry.
+ *	- NULL if there are no more candidates.
+ */
+static PAIR_LIST const *files_default_next(rlm_files_table_t const *table, uint64_t const *bitmap, uint32_t *pos)
+{
+	uint32_t i;
+
+	for (i = *pos; i < table->num_defaults; i++) {
+		/*
+		 *	Skip words with no candidates.
+		 */
+		if (((i % 64) == 0) && !bitmap[i / 64]) {
+			i += 63;
+			continue;
+		}
+
+		if (bitmap[i / 64] & (((uint64_t) 1) << (i % 64))) {
+			*pos = i + 1;
+			return table->defaults[i];
+		}
+	}
+
+	*pos = table->num_defaults;
+	return NULL;
+}
+
+
+
+/*
+ *	Read a "users" file, for reload_init().  Tables are allocated
+ *	in the NULL ctx, as they may be read by the reload thread.
+ */
+static void *files_load(char const *filename, void *uctx)
+{
+	rlm_files_t		*inst = uctx;
+	rlm_files_table_t	*table;
+
+	if (getusersfile(NULL, filename, &table, inst->compat_mode) != 0) return NULL;
+
+	return table;
+}
+
+static void files_free(void *data, UNUSED void *uctx)
+{
+	talloc_free(data);
+}
+
+/*
+ *	Stop the reload threads before the config they use is freed.
+ */
+static int mod_detach(void *instance)
+{
+	rlm_files_t *inst = instance;
 
+	TALLOC_FREE(inst->common);
+	TALLOC_FREE(inst->users);
+	TALLOC_FREE(inst->acct_users);
+#ifdef WITH_PROXY
+	TALLOC_FREE(inst->preproxy_users);
+	TALLOC_FREE(inst->postproxy_users);
+#endif
+	TALLOC_FREE(inst->auth_users);
+	TALLOC_FREE(inst->postauth_users);
+
+	return 0;
+}
 
 /*
  *	(Re-)read the "users" file into memory.
  */
-static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_files_t *inst = instance;
 
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
 #undef READFILE
-#define READFILE(_x, _y) do { if (getusersfile(inst, inst->_x, &inst->_y, inst->compat_mode) != 0) { ERROR("Failed reading %s", inst->_x); return -1;} } while (0)
+#define READFILE(_x, _y) do { \
+	if (inst->_x) { \
+		inst->_y = reload_init(inst, inst->name, inst->_x, inst->reload_interval, files_load, files_free, inst); \
+		if (!inst->_y) { \
+			ERROR("Failed reading %s", inst->_x); \
+			return -1; \
+		} \
+	} \
+} while (0)
 
 	READFILE(filename, common);
 	READFILE(usersfile, users);
@@ -342,9 +648,11 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *filename, rbtree_t *tree,
+static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *filename, reload_t *rl,
 			       RADIUS_PACKET *request_packet, RADIUS_PACKET *reply_packet)
 {
+	rlm_files_table_t *table;
+	unsigned int	ref;
 	char const	*name, *match;
 	VALUE_PAIR	*check_tmp;
 	VALUE_PAIR	*reply_tmp;
@@ -352,6 +660,8 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 	bool		found = false;
 	PAIR_LIST	my_pl;
 	char		buffer[256];
+	uint64_t	*candidates;
+	uint32_t	default_pos = 0;
 
 	if (!inst->key) {
 		VALUE_PAIR	*namepair;
@@ -369,12 +679,23 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		name = len ? buffer : "NONE";
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
+	if (!rl) return RLM_MODULE_NOOP;
+
+	/*
+	 *	The table may be swapped by the reload thread, but
+	 *	it won't be freed until we release it.
+	 */
+	table = reload_acquire(rl, &ref);
 
 	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
-	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	user_pl = rbtree_finddata(table->users, &my_pl);
+
+	/*
+	 *	Only evaluate the DEFAULT entries which could
+	 *	match the request.
+	 */
+	candidates = files_default_candidates(request, table, request_packet->vps);
+	default_pl = candidates ? files_default_next(table, candidates, &default_pos) : NULL;
 
 	/*
 	 *	Find the entry for the user.
@@ -396,7 +717,7 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		} else if (!user_pl && default_pl) {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_pl = files_default_next(table, candidates, &default_pos);
 
 		} else if (user_pl->lineno < default_pl->lineno) {
 			pl = user_pl;
@@ -406,7 +727,7 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		} else {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_pl = files_default_next(table, candidates, &default_pos);
 		}
 
 		check_tmp = fr_pair_list_copy(request, pl->check);
@@ -438,6 +759,9 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		}
 	}
 
+	talloc_free(candidates);
+	reload_release(rl, ref);
+
 	/*
 	 *	Remove server internal parameters.
 	 */
@@ -532,6 +856,7 @@ module_t rlm_files = {
 	.inst_size	= sizeof(rlm_files_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -0,0 +1,4 @@
+TARGETNAME	:= rlm_ippool
+
+TARGET		:= $(TARGETNAME).a
+SOURCES		:= $(TARGETNAME).c pool.c journal.c
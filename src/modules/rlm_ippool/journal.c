@@ -0,0 +1,502 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file journal.c
+ * @brief Persist in-memory IP pool leases to disk.
+ *
+ * Every change to a lease is appended to a journal, as a record holding
+ * the complete new state of the address.  Replaying records in order
+ * therefore always gives the latest state, no matter where replay starts.
+ *
+ * The journal is periodically compacted into a snapshot:
+ *
+ * - The journal is renamed to <journal>.prev, and a new journal is started.
+ * - Every lease is written to <journal>.snapshot.tmp, which is then renamed
+ *   to <journal>.snapshot.
+ * - <journal>.prev is removed.
+ *
+ * On start up the snapshot, <journal>.prev and the journal are replayed in
+ * that order, so a crash at any point loses nothing which was written to
+ * the journal.
+ *
+ * Records are:
+ * @verbatim
++---------+---------+----------+------------+-----------+--------------+
+| address | expires | pool len | device len | pool name | device       |
+| 4 bytes | 4 bytes | 1 byte   | 1 byte     | pool len  | device len   |
++---------+---------+----------+------------+-----------+--------------+
+@endverbatim
+ * with integers in network byte order.  A device length of zero means the
+ * address was released.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_ippool (%s) - "
+#define LOG_PREFIX_ARGS journal->name
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "rlm_ippool.h"
+
+#define IPPOOL_JOURNAL_MAGIC		"FRIPJRN1"
+#define IPPOOL_JOURNAL_MAGIC_LEN	(sizeof(IPPOOL_JOURNAL_MAGIC) - 1)
+#define IPPOOL_RECORD_HDR_LEN		10
+#define IPPOOL_RECORD_MAX_LEN		(IPPOOL_RECORD_HDR_LEN + (IPPOOL_MAX_NAME_LEN * 2))
+
+struct ippool_journal {
+	char const		*name;		//!< Instance name, for log messages.
+	char const		*filename;	//!< Changes since the last snapshot.
+	char			*prev;		//!< Changes being compacted into a snapshot.
+	char			*snapshot;	//!< Last complete snapshot.
+	char			*snapshot_tmp;	//!< Snapshot being written.
+
+	rbtree_t		*pools;		//!< Pools to snapshot and restore.
+	bool			sync;		//!< Flush every record to disk.
+	uint32_t		interval;	//!< Seconds between snapshots.  0 means only
+						//!< on start up.
+
+	int			fd;		//!< Current journal.
+	off_t			offset;		//!< End of the last complete record.
+	pthread_mutex_t		mutex;		//!< Serialises writes to fd, and rotation.
+
+	pthread_mutex_t		snapshot_mutex;	//!< Held by the thread writing a snapshot.
+	time_t			next_snapshot;	//!< When the next snapshot is due.
+	bool			prev_pending;	//!< prev hasn't been compacted yet.
+};
+
+/*
+ *	Encode the state of an address.
+ */
+static size_t journal_record(uint8_t *out, ippool_pool_t const *pool, ippool_lease_t const *lease)
+{
+	uint8_t		*p = out;
+	size_t		pool_len = strlen(pool->name);
+	size_t		device_len = lease->device ? strlen(lease->device) : 0;
+	uint32_t	address = htonl(ippool_pool_address(pool, lease->index));
+	uint32_t	expires = htonl((uint32_t) lease->expires);
+
+	rad_assert(pool_len <= IPPOOL_MAX_NAME_LEN);
+	rad_assert(device_len <= IPPOOL_MAX_NAME_LEN);
+
+	memcpy(p, &address, sizeof(address));
+	p += sizeof(address);
+	memcpy(p, &expires, sizeof(expires));
+	p += sizeof(expires);
+	*p++ = pool_len;
+	*p++ = device_len;
+	memcpy(p, pool->name, pool_len);
+	p += pool_len;
+	if (device_len) memcpy(p, lease->device, device_len);
+	p += device_len;
+
+	return p - out;
+}
+
+/*
+ *	Restore leases from a journal or snapshot.  Missing
+ *	files are fine, they just have nothing to restore.
+ */
+static int journal_replay(ippool_journal_t *journal, char const *filename, time_t now)
+{
+	int		fd;
+	struct stat	st;
+	uint8_t		*buff, *p, *end;
+	ssize_t		slen;
+	size_t		num = 0, skipped = 0;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+
+		ERROR("Failed opening \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ERROR("Failed reading \"%s\": %s", filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	MEM(buff = talloc_array(NULL, uint8_t, st.st_size));
+	for (p = buff, end = buff + st.st_size; p < end; p += slen) {
+		slen = read(fd, p, end - p);
+		if (slen <= 0) {
+			ERROR("Failed reading \"%s\": %s", filename, slen < 0 ? fr_syserror(errno) : "Unexpected EOF");
+			close(fd);
+			talloc_free(buff);
+			return -1;
+		}
+	}
+	close(fd);
+
+	if (((size_t) st.st_size < IPPOOL_JOURNAL_MAGIC_LEN) ||
+	    (memcmp(buff, IPPOOL_JOURNAL_MAGIC, IPPOOL_JOURNAL_MAGIC_LEN) != 0)) {
+		ERROR("\"%s\" is not an ippool journal", filename);
+		talloc_free(buff);
+		return -1;
+	}
+
+	for (p = buff + IPPOOL_JOURNAL_MAGIC_LEN; (end - p) >= IPPOOL_RECORD_HDR_LEN; ) {
+		ippool_pool_t	find, *pool;
+		uint32_t	address, expires;
+		size_t		pool_len = p[8], device_len = p[9];
+		char		name[IPPOOL_MAX_NAME_LEN + 1], device[IPPOOL_MAX_NAME_LEN + 1];
+		int		offset;
+
+		if ((size_t) (end - p) < (IPPOOL_RECORD_HDR_LEN + pool_len + device_len)) break;
+
+		memcpy(&address, p, sizeof(address));
+		memcpy(&expires, p + 4, sizeof(expires));
+		p += IPPOOL_RECORD_HDR_LEN;
+
+		memcpy(name, p, pool_len);
+		name[pool_len] = '\0';
+		p += pool_len;
+
+		memcpy(device, p, device_len);
+		device[device_len] = '\0';
+		p += device_len;
+
+		/*
+		 *	Pools and ranges may have been removed
+		 *	from the configuration.
+		 */
+		memset(&find, 0, sizeof(find));
+		find.name = name;
+		pool = rbtree_finddata(journal->pools, &find);
+		if (!pool) {
+			skipped++;
+			continue;
+		}
+
+		offset = ippool_pool_offset(pool, ntohl(address));
+		if (offset < 0) {
+			skipped++;
+			continue;
+		}
+
+		ippool_lease_set(pool, offset, device_len ? device : NULL, ntohl(expires), now);
+		num++;
+	}
+
+	/*
+	 *	The server stopped while writing the record.
+	 */
+	if (p < end) WARN("Ignoring truncated record at the end of \"%s\"", filename);
+
+	if (skipped) WARN("Ignored %zu records in \"%s\" for addresses which are no longer in a pool",
+			  skipped, filename);
+
+	DEBUG("Restored %zu records from \"%s\"", num, filename);
+	talloc_free(buff);
+
+	return 0;
+}
+
+/*
+ *	Start a new, empty, journal.
+ */
+static int journal_open(ippool_journal_t *journal, int *fd)
+{
+	*fd = open(journal->filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (*fd < 0) {
+		ERROR("Failed opening \"%s\": %s", journal->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fcntl(*fd, F_SETFD, FD_CLOEXEC) < 0) ||
+	    (write(*fd, IPPOOL_JOURNAL_MAGIC, IPPOOL_JOURNAL_MAGIC_LEN) != (ssize_t) IPPOOL_JOURNAL_MAGIC_LEN)) {
+		ERROR("Failed writing \"%s\": %s", journal->filename, fr_syserror(errno));
+		close(*fd);
+		*fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _journal_snapshot_pool(void *ctx, void *data)
+{
+	FILE		*fp = ctx;
+	ippool_pool_t	*pool = data;
+	uint8_t		buff[IPPOOL_RECORD_MAX_LEN];
+	uint32_t	i;
+	int		ret = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (i = 0; i < pool->size; i++) {
+		ippool_lease_t const *lease = pool->leases[i];
+
+		/*
+		 *	Free addresses with no device have nothing
+		 *	worth restoring.
+		 */
+		if (!lease || (!lease->device && (lease->heap_id < 0))) continue;
+
+		if (fwrite(buff, journal_record(buff, pool, lease), 1, fp) != 1) {
+			ret = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return ret;
+}
+
+/*
+ *	Write every lease to a new snapshot.
+ */
+static int journal_snapshot_write(ippool_journal_t *journal)
+{
+	FILE *fp;
+
+	fp = fopen(journal->snapshot_tmp, "w");
+	if (!fp) {
+		ERROR("Failed opening \"%s\": %s", journal->snapshot_tmp, fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fwrite(IPPOOL_JOURNAL_MAGIC, IPPOOL_JOURNAL_MAGIC_LEN, 1, fp) != 1) ||
+	    (rbtree_walk(journal->pools, RBTREE_IN_ORDER, _journal_snapshot_pool, fp) != 0) ||
+	    (fflush(fp) != 0) || (fsync(fileno(fp)) < 0)) {
+		ERROR("Failed writing \"%s\": %s", journal->snapshot_tmp, fr_syserror(errno));
+		fclose(fp);
+	error:
+		unlink(journal->snapshot_tmp);
+		return -1;
+	}
+
+	if (fclose(fp) != 0) {
+		ERROR("Failed writing \"%s\": %s", journal->snapshot_tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	if (rename(journal->snapshot_tmp, journal->snapshot) < 0) {
+		ERROR("Failed renaming \"%s\" to \"%s\": %s", journal->snapshot_tmp, journal->snapshot,
+		      fr_syserror(errno));
+		goto error;
+	}
+
+	return 0;
+}
+
+/*
+ *	Move the journal out of the way, so it can be compacted,
+ *	and start a new one.
+ */
+static int journal_rotate(ippool_journal_t *journal)
+{
+	int fd;
+
+	pthread_mutex_lock(&journal->mutex);
+
+	if (rename(journal->filename, journal->prev) < 0) {
+		ERROR("Failed renaming \"%s\" to \"%s\": %s", journal->filename, journal->prev, fr_syserror(errno));
+	error:
+		pthread_mutex_unlock(&journal->mutex);
+		return -1;
+	}
+
+	if (journal_open(journal, &fd) < 0) {
+		/*
+		 *	Keep writing to the old journal.
+		 */
+		if (rename(journal->prev, journal->filename) < 0) {
+			ERROR("Failed renaming \"%s\" to \"%s\": %s", journal->prev, journal->filename,
+			      fr_syserror(errno));
+		}
+		goto error;
+	}
+
+	close(journal->fd);
+	journal->fd = fd;
+	journal->offset = IPPOOL_JOURNAL_MAGIC_LEN;
+	journal->prev_pending = true;
+
+	pthread_mutex_unlock(&journal->mutex);
+
+	return 0;
+}
+
+static int _journal_free(ippool_journal_t *journal)
+{
+	if (journal->fd >= 0) close(journal->fd);
+
+	pthread_mutex_destroy(&journal->mutex);
+	pthread_mutex_destroy(&journal->snapshot_mutex);
+
+	return 0;
+}
+
+/** Restore leases from disk, and start a new journal
+ *
+ * The restored leases are compacted into a new snapshot before any new
+ * leases are written.
+ *
+ * @param[in] inst rlm_ippool configuration.  The pools must already exist.
+ * @return
+ *	- New journal.
+ *	- NULL on error.
+ */
+ippool_journal_t *ippool_journal_init(rlm_ippool_t *inst)
+{
+	ippool_journal_t	*journal;
+	time_t			now = time(NULL);
+
+	MEM(journal = talloc_zero(inst, ippool_journal_t));
+	journal->name = inst->name;
+	journal->filename = inst->journal_file;
+	journal->pools = inst->pools;
+	journal->sync = inst->journal_sync;
+	journal->interval = inst->snapshot_interval;
+	journal->fd = -1;
+
+	MEM(journal->prev = talloc_asprintf(journal, "%s.prev", journal->filename));
+	MEM(journal->snapshot = talloc_asprintf(journal, "%s.snapshot", journal->filename));
+	MEM(journal->snapshot_tmp = talloc_asprintf(journal, "%s.snapshot.tmp", journal->filename));
+
+	pthread_mutex_init(&journal->mutex, NULL);
+	pthread_mutex_init(&journal->snapshot_mutex, NULL);
+	talloc_set_destructor(journal, _journal_free);
+
+	if ((journal_replay(journal, journal->snapshot, now) < 0) ||
+	    (journal_replay(journal, journal->prev, now) < 0) ||
+	    (journal_replay(journal, journal->filename, now) < 0)) {
+	error:
+		talloc_free(journal);
+		return NULL;
+	}
+
+	/*
+	 *	Everything is in memory now, so once it's in a
+	 *	snapshot, the old journals aren't needed.
+	 */
+	if (journal_snapshot_write(journal) < 0) goto error;
+
+	if ((unlink(journal->prev) < 0) && (errno != ENOENT)) {
+		ERROR("Failed removing \"%s\": %s", journal->prev, fr_syserror(errno));
+		goto error;
+	}
+
+	if (journal_open(journal, &journal->fd) < 0) goto error;
+	journal->offset = IPPOOL_JOURNAL_MAGIC_LEN;
+	journal->next_snapshot = now + journal->interval;
+
+	return journal;
+}
+
+/** Append the state of an address to the journal
+ *
+ * Must be called with the pool's mutex held, so records for an address
+ * are written in the order its state changed.
+ *
+ * @param[in] journal to write to.
+ * @param[in] pool containing the address.
+ * @param[in] lease for the address.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The journal is left as it was.
+ */
+int ippool_journal_write(ippool_journal_t *journal, ippool_pool_t const *pool, ippool_lease_t const *lease)
+{
+	uint8_t		buff[IPPOOL_RECORD_MAX_LEN];
+	size_t		len;
+	ssize_t		slen;
+
+	len = journal_record(buff, pool, lease);
+
+	pthread_mutex_lock(&journal->mutex);
+
+	slen = write(journal->fd, buff, len);
+	if ((slen == (ssize_t) len) && journal->sync && (fsync(journal->fd) < 0)) slen = -1;
+
+	if (slen != (ssize_t) len) {
+		ERROR("Failed writing \"%s\": %s", journal->filename,
+		      slen < 0 ? fr_syserror(errno) : "Short write");
+
+		/*
+		 *	Don't leave part of a record behind, or
+		 *	every record after it will be misread.
+		 */
+		if ((ftruncate(journal->fd, journal->offset) < 0) ||
+		    (lseek(journal->fd, journal->offset, SEEK_SET) < 0)) {
+			ERROR("Failed truncating \"%s\": %s", journal->filename, fr_syserror(errno));
+		}
+
+		pthread_mutex_unlock(&journal->mutex);
+		return -1;
+	}
+	journal->offset += len;
+
+	pthread_mutex_unlock(&journal->mutex);
+
+	return 0;
+}
+
+/** Compact the journal into a snapshot, if one is due
+ *
+ * Must be called without any pool mutexes held.  Only one thread writes a
+ * snapshot at a time, the others carry on without waiting.
+ *
+ * @param[in] journal to compact.
+ * @param[in] now Current time.
+ */
+void ippool_journal_snapshot_check(ippool_journal_t *journal, time_t now)
+{
+	if (!journal->interval) return;
+
+	if (pthread_mutex_trylock(&journal->snapshot_mutex) != 0) return;
+
+	if (now < journal->next_snapshot) {
+		pthread_mutex_unlock(&journal->snapshot_mutex);
+		return;
+	}
+	journal->next_snapshot = now + journal->interval;
+
+	/*
+	 *	If the last snapshot failed, prev still holds
+	 *	changes which are in no snapshot, so it has to
+	 *	be compacted before it can be replaced.
+	 */
+	if (!journal->prev_pending && (journal_rotate(journal) < 0)) {
+		pthread_mutex_unlock(&journal->snapshot_mutex);
+		return;
+	}
+
+	if (journal_snapshot_write(journal) == 0) {
+		if ((unlink(journal->prev) < 0) && (errno != ENOENT)) {
+			ERROR("Failed removing \"%s\": %s", journal->prev, fr_syserror(errno));
+		} else {
+			journal->prev_pending = false;
+		}
+	}
+
+	pthread_mutex_unlock(&journal->snapshot_mutex);
+}
@@ -0,0 +1,590 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file pool.c
+ * @brief Allocate addresses from in-memory pools.
+ *
+ * Each pool keeps a bitmap of its free addresses, a heap of active leases
+ * ordered by expiry time, and a hash table of leases by device.
+ *
+ * Allocation first looks for the device's previous lease, then takes the
+ * lowest free address.  Expired leases are freed lazily, before each
+ * operation, by popping them off the heap.  All of these are O(1), or
+ * O(log n) for the heap, apart from the bitmap search, which skips 64
+ * addresses at a time, and remembers where it last found a free address.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_ippool.h"
+
+#define FREE_WORD(_offset)	((_offset) / 64)
+#define FREE_BIT(_offset)	((uint64_t) 1 << ((_offset) % 64))
+
+static uint32_t lease_device_hash(void const *data)
+{
+	ippool_lease_t const *lease = data;
+
+	return fr_hash_string(lease->device);
+}
+
+static int lease_device_cmp(void const *one, void const *two)
+{
+	ippool_lease_t const *a = one;
+	ippool_lease_t const *b = two;
+
+	return strcmp(a->device, b->device);
+}
+
+static int lease_expiry_cmp(void const *one, void const *two)
+{
+	ippool_lease_t const *a = one;
+	ippool_lease_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+static inline void pool_set_free(ippool_pool_t *pool, uint32_t offset)
+{
+	if (pool->free[FREE_WORD(offset)] & FREE_BIT(offset)) return;
+
+	pool->free[FREE_WORD(offset)] |= FREE_BIT(offset);
+	pool->num_free++;
+
+	if (FREE_WORD(offset) < pool->hint) pool->hint = FREE_WORD(offset);
+}
+
+static inline void pool_set_used(ippool_pool_t *pool, uint32_t offset)
+{
+	if (!(pool->free[FREE_WORD(offset)] & FREE_BIT(offset))) return;
+
+	pool->free[FREE_WORD(offset)] &= ~FREE_BIT(offset);
+	pool->num_free--;
+}
+
+/*
+ *	Find the lowest free address.
+ */
+static int pool_find_free(ippool_pool_t *pool)
+{
+	uint32_t i, num_words = talloc_array_length(pool->free);
+
+	if (!pool->num_free) return -1;
+
+	for (i = pool->hint; i < num_words; i++) {
+		if (!pool->free[i]) continue;
+
+		pool->hint = i;
+		return (i * 64) + fr_low_bit(pool->free[i]);
+	}
+
+	pool->hint = num_words;
+	return -1;
+}
+
+/*
+ *	Get the lease for an address, creating it if the
+ *	address has never been leased.
+ */
+static ippool_lease_t *pool_lease(ippool_pool_t *pool, uint32_t offset)
+{
+	ippool_lease_t *lease;
+
+	lease = pool->leases[offset];
+	if (lease) return lease;
+
+	MEM(lease = talloc_zero(pool->leases, ippool_lease_t));
+	lease->pool = pool;
+	lease->index = offset;
+	lease->heap_id = -1;
+	pool->leases[offset] = lease;
+
+	return lease;
+}
+
+/*
+ *	Change the device a lease belongs to.  A device only
+ *	has one lease in a pool, so any other lease it had
+ *	loses its device.
+ */
+static void lease_device_set(ippool_pool_t *pool, ippool_lease_t *lease, char const *device)
+{
+	ippool_lease_t find, *old;
+
+	if (lease->device) {
+		if (device && (strcmp(lease->device, device) == 0)) return;
+
+		fr_hash_table_delete(pool->devices, lease);
+		TALLOC_FREE(lease->device);
+	}
+
+	if (!device) return;
+
+	find.device = UNCONST(char *, device);
+	old = fr_hash_table_finddata(pool->devices, &find);
+	if (old) {
+		fr_hash_table_delete(pool->devices, old);
+		TALLOC_FREE(old->device);
+	}
+
+	MEM(lease->device = talloc_typed_strdup(lease, device));
+	fr_hash_table_insert(pool->devices, lease);
+}
+
+/*
+ *	Change when a lease expires, marking its address as
+ *	used or free.
+ */
+static void lease_expires_set(ippool_pool_t *pool, ippool_lease_t *lease, time_t expires, time_t now)
+{
+	if (lease->heap_id >= 0) fr_heap_extract(pool->expiry, lease);
+
+	lease->expires = expires;
+
+	if (expires <= now) {
+		pool_set_free(pool, lease->index);
+		return;
+	}
+
+	pool_set_used(pool, lease->index);
+	fr_heap_insert(pool->expiry, lease);
+}
+
+/*
+ *	Free the addresses of leases which have expired.  They
+ *	keep their device, so it can be given the same address
+ *	again.
+ */
+static void pool_expire(ippool_pool_t *pool, time_t now)
+{
+	ippool_lease_t *lease;
+
+	while ((lease = fr_heap_peek(pool->expiry)) && (lease->expires <= now)) {
+		fr_heap_extract(pool->expiry, lease);
+		pool_set_free(pool, lease->index);
+	}
+}
+
+/*
+ *	Parse "a.b.c.d/prefix" or "a.b.c.d-e.f.g.h"
+ */
+static int pool_range_parse(ippool_range_t *range, CONF_PAIR *cp)
+{
+	char const	*value = cf_pair_value(cp);
+	char const	*p;
+	fr_ipaddr_t	start, end;
+	uint32_t	first, last;
+
+	if (!value || !*value) {
+		cf_log_err_cp(cp, "Range must not be empty");
+		return -1;
+	}
+
+	p = strchr(value, '-');
+	if (p) {
+		if ((fr_inet_pton4(&start, value, p - value, false, false, false) < 0) ||
+		    (fr_inet_pton4(&end, p + 1, -1, false, false, false) < 0)) {
+		error:
+			cf_log_err_cp(cp, "Invalid range \"%s\": %s", value, fr_strerror());
+			return -1;
+		}
+
+		first = ntohl(start.ipaddr.ip4addr.s_addr);
+		last = ntohl(end.ipaddr.ip4addr.s_addr);
+		if (last < first) {
+			cf_log_err_cp(cp, "Invalid range \"%s\": Last address is lower than first address", value);
+			return -1;
+		}
+	} else {
+		if (fr_inet_pton4(&start, value, -1, false, false, true) < 0) goto error;
+
+		first = ntohl(start.ipaddr.ip4addr.s_addr);
+		last = first | ((start.prefix < 32) ? (0xffffffff >> start.prefix) : 0);
+
+		/*
+		 *	Skip the network and broadcast addresses.
+		 */
+		if (start.prefix < 31) {
+			first++;
+			last--;
+		}
+	}
+
+	if (((uint64_t) last - first) >= IPPOOL_MAX_POOL_SIZE) {
+		cf_log_err_cp(cp, "Range \"%s\" contains too many addresses, maximum is %u",
+			      value, IPPOOL_MAX_POOL_SIZE);
+		return -1;
+	}
+
+	range->start = first;
+	range->num = (last - first) + 1;
+
+	return 0;
+}
+
+static int _pool_free(ippool_pool_t *pool)
+{
+	fr_heap_delete(pool->expiry);
+	pthread_mutex_destroy(&pool->mutex);
+
+	return 0;
+}
+
+/** Create a pool from its configuration
+ *
+ * @verbatim
+pool <name> {
+	range = <address>/<prefix>
+	range = <first address>-<last address>
+	...
+}
+@endverbatim
+ *
+ * @param[in] ctx to allocate the pool in.
+ * @param[in] cs pool section.
+ * @return
+ *	- New pool, with every address free.
+ *	- NULL on error.
+ */
+ippool_pool_t *ippool_pool_alloc(TALLOC_CTX *ctx, CONF_SECTION *cs)
+{
+	ippool_pool_t	*pool;
+	CONF_PAIR	*cp;
+	char const	*name = cf_section_name2(cs);
+	uint32_t	i, j, num_words;
+
+	if (!name) {
+		cf_log_err_cs(cs, "Pools must have a name, e.g. \"pool main { ... }\"");
+		return NULL;
+	}
+
+	if (strlen(name) > IPPOOL_MAX_NAME_LEN) {
+		cf_log_err_cs(cs, "Pool name must be no longer than %u characters", IPPOOL_MAX_NAME_LEN);
+		return NULL;
+	}
+
+	MEM(pool = talloc_zero(ctx, ippool_pool_t));
+	pool->name = name;
+
+	for (cp = cf_pair_find(cs, "range"); cp; cp = cf_pair_find_next(cs, cp, "range")) pool->num_ranges++;
+	if (!pool->num_ranges) {
+		cf_log_err_cs(cs, "Pool \"%s\" must contain at least one range", name);
+	error:
+		talloc_free(pool);
+		return NULL;
+	}
+
+	MEM(pool->ranges = talloc_array(pool, ippool_range_t, pool->num_ranges));
+	for (cp = cf_pair_find(cs, "range"), i = 0; cp; cp = cf_pair_find_next(cs, cp, "range"), i++) {
+		ippool_range_t *range = &pool->ranges[i];
+
+		if (pool_range_parse(range, cp) < 0) goto error;
+
+		for (j = 0; j < i; j++) {
+			ippool_range_t *other = &pool->ranges[j];
+
+			if ((range->start <= (other->start + (other->num - 1))) &&
+			    (other->start <= (range->start + (range->num - 1)))) {
+				cf_log_err_cp(cp, "Range \"%s\" overlaps with another range in pool \"%s\"",
+					      cf_pair_value(cp), name);
+				goto error;
+			}
+		}
+
+		if ((pool->size + range->num) > IPPOOL_MAX_POOL_SIZE) {
+			cf_log_err_cs(cs, "Pool \"%s\" contains too many addresses, maximum is %u",
+				      name, IPPOOL_MAX_POOL_SIZE);
+			goto error;
+		}
+
+		range->offset = pool->size;
+		pool->size += range->num;
+	}
+
+	/*
+	 *	Every address starts off free.
+	 */
+	num_words = (pool->size + 63) / 64;
+	MEM(pool->free = talloc_array(pool, uint64_t, num_words));
+	memset(pool->free, 0xff, num_words * sizeof(uint64_t));
+	if (pool->size % 64) pool->free[num_words - 1] = FREE_BIT(pool->size) - 1;
+	pool->num_free = pool->size;
+
+	MEM(pool->leases = talloc_zero_array(pool, ippool_lease_t *, pool->size));
+	MEM(pool->devices = fr_hash_table_create(pool, lease_device_hash, lease_device_cmp, NULL));
+
+	pool->expiry = fr_heap_create(lease_expiry_cmp, offsetof(ippool_lease_t, heap_id));
+	if (!pool->expiry) {
+		cf_log_err_cs(cs, "Failed creating expiry heap for pool \"%s\"", name);
+		goto error;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	talloc_set_destructor(pool, _pool_free);
+
+	return pool;
+}
+
+/** Find the offset of an address in a pool
+ *
+ * @param[in] pool to search.
+ * @param[in] address in host byte order.
+ * @return
+ *	- The offset of the address.
+ *	- -1 if the address isn't in the pool.
+ */
+int ippool_pool_offset(ippool_pool_t const *pool, uint32_t address)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->num_ranges; i++) {
+		ippool_range_t const *range = &pool->ranges[i];
+
+		if ((address - range->start) < range->num) return range->offset + (address - range->start);
+	}
+
+	return -1;
+}
+
+/** Find the address at an offset in a pool
+ *
+ * @param[in] pool to search.
+ * @param[in] offset of the address, must be less than the pool size.
+ * @return the address, in host byte order.
+ */
+uint32_t ippool_pool_address(ippool_pool_t const *pool, uint32_t offset)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->num_ranges; i++) {
+		ippool_range_t const *range = &pool->ranges[i];
+
+		if ((offset - range->offset) < range->num) return range->start + (offset - range->offset);
+	}
+
+	rad_assert(0);
+	return 0;
+}
+
+/** Set the state of an address, when restoring leases from the journal
+ *
+ * Must not be called once the pool is in use.
+ *
+ * @param[in] pool containing the address.
+ * @param[in] offset of the address.
+ * @param[in] device the address was leased to, or NULL if it was released.
+ * @param[in] expires When the lease expires.
+ * @param[in] now Current time.
+ */
+void ippool_lease_set(ippool_pool_t *pool, uint32_t offset, char const *device, time_t expires, time_t now)
+{
+	ippool_lease_t *lease;
+
+	rad_assert(offset < pool->size);
+
+	lease = pool_lease(pool, offset);
+	lease_device_set(pool, lease, device);
+	lease_expires_set(pool, lease, expires, now);
+}
+
+/*
+ *	Record the new state of an address before changing it, so
+ *	that if the write fails, the pool can be left as it was.
+ */
+static int pool_journal_write(ippool_journal_t *journal, ippool_pool_t const *pool, uint32_t offset,
+			      char const *device, time_t expires)
+{
+	ippool_lease_t lease;
+
+	if (!journal) return 0;
+
+	memset(&lease, 0, sizeof(lease));
+	lease.index = offset;
+	lease.device = UNCONST(char *, device);
+	lease.expires = expires;
+
+	return ippool_journal_write(journal, pool, &lease);
+}
+
+/** Allocate an address to a device
+ *
+ * The device is given the address it had last, if no other device has
+ * been given it since.  Otherwise it's given the lowest free address.
+ *
+ * @param[in] pool to allocate from.
+ * @param[in] journal to record the lease in.  May be NULL.
+ * @param[in] device to allocate the address to.
+ * @param[in] now Current time.
+ * @param[in] lease_time How long to allocate the address for.
+ * @param[out] address Allocated address, in host byte order.
+ * @param[out] expires When the lease expires.
+ * @return
+ *	- #IPPOOL_RCODE_SUCCESS if an address was allocated.
+ *	- #IPPOOL_RCODE_POOL_EMPTY if there are no free addresses.
+ *	- #IPPOOL_RCODE_FAIL if the lease couldn't be written to the journal.  No
+ *	  address is allocated.
+ */
+ippool_rcode_t ippool_allocate(ippool_pool_t *pool, ippool_journal_t *journal, char const *device,
+			       time_t now, uint32_t lease_time, uint32_t *address, time_t *expires)
+{
+	ippool_lease_t	find, *lease;
+	ippool_rcode_t	ret = IPPOOL_RCODE_SUCCESS;
+	int		offset;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool_expire(pool, now);
+
+	find.device = UNCONST(char *, device);
+	lease = fr_hash_table_finddata(pool->devices, &find);
+	if (lease) {
+		offset = lease->index;
+	} else {
+		offset = pool_find_free(pool);
+		if (offset < 0) {
+			ret = IPPOOL_RCODE_POOL_EMPTY;
+			goto finish;
+		}
+	}
+
+	/*
+	 *	Don't take the address from the free bitmap unless
+	 *	the lease will survive a restart.
+	 */
+	if (pool_journal_write(journal, pool, offset, device, now + lease_time) < 0) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	if (!lease) {
+		lease = pool_lease(pool, offset);
+		lease_device_set(pool, lease, device);
+	}
+	lease_expires_set(pool, lease, now + lease_time, now);
+
+	*address = ippool_pool_address(pool, lease->index);
+	*expires = lease->expires;
+
+finish:
+	pthread_mutex_unlock(&pool->mutex);
+
+	return ret;
+}
+
+/** Extend the lease of an address
+ *
+ * @param[in] pool containing the address.
+ * @param[in] journal to record the lease in.  May be NULL.
+ * @param[in] address to update, in host byte order.
+ * @param[in] device the address must be leased to.
+ * @param[in] now Current time.
+ * @param[in] lease_time How long to extend the lease for.
+ * @param[out] expires When the lease expires.
+ * @return
+ *	- #IPPOOL_RCODE_SUCCESS if the lease was extended.
+ *	- #IPPOOL_RCODE_NOT_FOUND if the address isn't in the pool.
+ *	- #IPPOOL_RCODE_EXPIRED if the address isn't leased.
+ *	- #IPPOOL_RCODE_DEVICE_MISMATCH if the address is leased to another device.
+ *	- #IPPOOL_RCODE_FAIL if the lease couldn't be written to the journal.  The
+ *	  lease isn't extended.
+ */
+ippool_rcode_t ippool_update(ippool_pool_t *pool, ippool_journal_t *journal, uint32_t address,
+			     char const *device, time_t now, uint32_t lease_time, time_t *expires)
+{
+	ippool_lease_t	*lease;
+	ippool_rcode_t	ret = IPPOOL_RCODE_SUCCESS;
+	int		offset;
+
+	offset = ippool_pool_offset(pool, address);
+	if (offset < 0) return IPPOOL_RCODE_NOT_FOUND;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool_expire(pool, now);
+
+	lease = pool->leases[offset];
+	if (!lease || (lease->heap_id < 0)) {
+		ret = IPPOOL_RCODE_EXPIRED;
+
+	} else if (!lease->device || (strcmp(lease->device, device) != 0)) {
+		ret = IPPOOL_RCODE_DEVICE_MISMATCH;
+
+	} else if (pool_journal_write(journal, pool, offset, device, now + lease_time) < 0) {
+		ret = IPPOOL_RCODE_FAIL;
+
+	} else {
+		lease_expires_set(pool, lease, now + lease_time, now);
+		*expires = lease->expires;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return ret;
+}
+
+/** Release an address
+ *
+ * Releasing an address which isn't leased succeeds, and does nothing.
+ *
+ * @param[in] pool containing the address.
+ * @param[in] journal to record the release in.  May be NULL.
+ * @param[in] address to release, in host byte order.
+ * @param[in] device the address must be leased to.
+ * @param[in] now Current time.
+ * @return
+ *	- #IPPOOL_RCODE_SUCCESS if the address was released.
+ *	- #IPPOOL_RCODE_NOT_FOUND if the address isn't in the pool.
+ *	- #IPPOOL_RCODE_DEVICE_MISMATCH if the address is leased to another device.
+ *	- #IPPOOL_RCODE_FAIL if the release couldn't be written to the journal.  The
+ *	  address stays leased.
+ */
+ippool_rcode_t ippool_release(ippool_pool_t *pool, ippool_journal_t *journal, uint32_t address,
+			      char const *device, time_t now)
+{
+	ippool_lease_t	*lease;
+	ippool_rcode_t	ret = IPPOOL_RCODE_SUCCESS;
+	int		offset;
+
+	offset = ippool_pool_offset(pool, address);
+	if (offset < 0) return IPPOOL_RCODE_NOT_FOUND;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	lease = pool->leases[offset];
+	if (lease && lease->device) {
+		if (strcmp(lease->device, device) != 0) {
+			ret = IPPOOL_RCODE_DEVICE_MISMATCH;
+
+		} else if (pool_journal_write(journal, pool, offset, NULL, now) < 0) {
+			ret = IPPOOL_RCODE_FAIL;
+
+		} else {
+			lease_device_set(pool, lease, NULL);
+			lease_expires_set(pool, lease, now, now);
+		}
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return ret;
+}
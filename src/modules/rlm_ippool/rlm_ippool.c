@@ -0,0 +1,450 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_ippool.c
+ * @brief IPv4 address allocation from pools held in memory.
+ *
+ * An alternative to rlm_sqlippool and rlm_redis_ippool for single servers,
+ * which needs no external database.  Leases are held in memory, and are
+ * made durable with an append-only journal, which is periodically compacted
+ * into a snapshot.
+ *
+ * Pool-Action and Acct-Status-Type select the action, as they do for
+ * rlm_redis_ippool.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_ippool (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_ippool.h"
+
+static CONF_PARSER journal_config[] = {
+	{ FR_CONF_OFFSET("filename", PW_TYPE_FILE_OUTPUT, rlm_ippool_t, journal_file) },
+	{ FR_CONF_OFFSET("snapshot_interval", PW_TYPE_INTEGER, rlm_ippool_t, snapshot_interval), .dflt = "300" },
+	{ FR_CONF_OFFSET("sync", PW_TYPE_BOOLEAN, rlm_ippool_t, journal_sync), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("pool_name", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_ippool_t, pool_name) },
+	{ FR_CONF_OFFSET("device", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_ippool_t, device_id) },
+
+	{ FR_CONF_OFFSET("offer_time", PW_TYPE_INTEGER, rlm_ippool_t, offer_time) },
+	{ FR_CONF_OFFSET("lease_time", PW_TYPE_INTEGER | PW_TYPE_REQUIRED, rlm_ippool_t, lease_time) },
+
+	{ FR_CONF_OFFSET("requested_address", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_ippool_t, requested_address), .dflt = "%{%{DHCP-Requested-IP-Address}:-%{DHCP-Client-IP-Address}}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("allocated_address_attr", PW_TYPE_TMPL | PW_TYPE_ATTRIBUTE | PW_TYPE_REQUIRED, rlm_ippool_t, allocated_address_attr), .dflt = "&reply:DHCP-Your-IP-Address", .quote = T_BARE_WORD },
+	{ FR_CONF_OFFSET("expiry_attr", PW_TYPE_TMPL | PW_TYPE_ATTRIBUTE, rlm_ippool_t, expiry_attr) },
+	{ FR_CONF_OFFSET("copy_on_update", PW_TYPE_BOOLEAN, rlm_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
+
+	{ FR_CONF_POINTER("journal", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) journal_config },
+	CONF_PARSER_TERMINATOR
+};
+
+static int ippool_pool_cmp(void const *one, void const *two)
+{
+	ippool_pool_t const *a = one;
+	ippool_pool_t const *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+/*
+ *	Write an address to the allocated_address_attr.
+ */
+static int ippool_address_to_request(rlm_ippool_t const *inst, REQUEST *request, uint32_t address)
+{
+	vp_tmpl_t ip_rhs = {
+		.name = "",
+		.type = TMPL_TYPE_DATA,
+		.quote = T_BARE_WORD,
+	};
+	vp_map_t ip_map = {
+		.lhs = inst->allocated_address_attr,
+		.op = T_OP_SET,
+		.rhs = &ip_rhs
+	};
+
+	ip_rhs.tmpl_data_type = PW_TYPE_IPV4_ADDR;
+	ip_rhs.tmpl_data_value.ipaddr.s_addr = htonl(address);
+	ip_rhs.tmpl_data_length = sizeof(ip_rhs.tmpl_data_value.ipaddr);
+
+	return map_to_request(request, &ip_map, map_to_vp, NULL);
+}
+
+/*
+ *	Write the remaining lease time to the expiry_attr.
+ */
+static int ippool_expiry_to_request(rlm_ippool_t const *inst, REQUEST *request, time_t expires, time_t now)
+{
+	vp_tmpl_t expiry_rhs = {
+		.name = "",
+		.type = TMPL_TYPE_DATA,
+		.quote = T_BARE_WORD,
+	};
+	vp_map_t expiry_map = {
+		.lhs = inst->expiry_attr,
+		.op = T_OP_SET,
+		.rhs = &expiry_rhs
+	};
+
+	if (!inst->expiry_attr) return 0;
+
+	expiry_rhs.tmpl_data_type = PW_TYPE_INTEGER;
+	expiry_rhs.tmpl_data_value.integer = (expires > now) ? (uint32_t) (expires - now) : 0;
+	expiry_rhs.tmpl_data_length = sizeof(expiry_rhs.tmpl_data_value.integer);
+
+	return map_to_request(request, &expiry_map, map_to_vp, NULL);
+}
+
+/*
+ *	Expand requested_address.
+ */
+static int ippool_requested_address(rlm_ippool_t const *inst, REQUEST *request, uint32_t *address,
+				    char *buff, size_t bufflen)
+{
+	char const	*ip_str;
+	fr_ipaddr_t	ip;
+
+	if (tmpl_expand(&ip_str, buff, bufflen, request, inst->requested_address, NULL, NULL) < 0) {
+		REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
+		return -1;
+	}
+
+	if (fr_inet_pton4(&ip, ip_str, -1, false, false, false) < 0) {
+		REDEBUG("%s", fr_strerror());
+		return -1;
+	}
+
+	/*
+	 *	So the caller can print it.
+	 */
+	if (ip_str != buff) strlcpy(buff, ip_str, bufflen);
+
+	*address = ntohl(ip.ipaddr.ip4addr.s_addr);
+
+	return 0;
+}
+
+static rlm_rcode_t mod_action(rlm_ippool_t const *inst, REQUEST *request, ippool_action_t action)
+{
+	char		name_buff[IPPOOL_MAX_NAME_LEN + 1], device_buff[IPPOOL_MAX_NAME_LEN + 1];
+	char		ip_buff[INET_ADDRSTRLEN + 4];
+	char const	*device;
+	ippool_pool_t	find, *pool;
+	uint32_t	address;
+	time_t		now, expires;
+	ssize_t		slen;
+	rlm_rcode_t	rcode;
+
+	slen = tmpl_expand(NULL, name_buff, sizeof(name_buff), request, inst->pool_name, NULL, NULL);
+	if (slen < 0) {
+		if (inst->pool_name->type == TMPL_TYPE_ATTR) {
+			RDEBUG2("Pool attribute not present in request.  Doing nothing");
+			return RLM_MODULE_NOOP;
+		}
+		REDEBUG("Failed expanding pool name");
+		return RLM_MODULE_FAIL;
+	}
+	if (slen == 0) {
+		RDEBUG2("Empty pool name.  Doing nothing");
+		return RLM_MODULE_NOOP;
+	}
+	if (is_truncated((size_t) slen, sizeof(name_buff))) {
+		REDEBUG("Pool name too long.  Expected %zu bytes, got %zu bytes", sizeof(name_buff) - 1, (size_t) slen);
+		return RLM_MODULE_FAIL;
+	}
+
+	memset(&find, 0, sizeof(find));
+	find.name = name_buff;
+	pool = rbtree_finddata(inst->pools, &find);
+	if (!pool) {
+		REDEBUG("No such pool \"%s\"", name_buff);
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	slen = tmpl_expand(&device, device_buff, sizeof(device_buff), request, inst->device_id, NULL, NULL);
+	if (slen < 0) {
+		REDEBUG("Failed expanding device (%s)", inst->device_id->name);
+		return RLM_MODULE_FAIL;
+	}
+	if (slen == 0) {
+		REDEBUG("Device identifier is empty");
+		return RLM_MODULE_FAIL;
+	}
+	if (is_truncated((size_t) slen, sizeof(device_buff))) {
+		REDEBUG("Device identifier too long.  Expected %zu bytes, got %zu bytes",
+			sizeof(device_buff) - 1, (size_t) slen);
+		return RLM_MODULE_FAIL;
+	}
+
+	now = time(NULL);
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		RDEBUG2("Allocating lease from pool \"%s\", to \"%s\", expires in %us",
+			pool->name, device, inst->offer_time);
+
+		switch (ippool_allocate(pool, inst->journal, device, now, inst->offer_time, &address, &expires)) {
+		case IPPOOL_RCODE_SUCCESS:
+			if ((ippool_address_to_request(inst, request, address) < 0) ||
+			    (ippool_expiry_to_request(inst, request, expires, now) < 0)) {
+				rcode = RLM_MODULE_FAIL;
+				break;
+			}
+			RDEBUG2("IP address lease allocated");
+			rcode = RLM_MODULE_UPDATED;
+			break;
+
+		case IPPOOL_RCODE_POOL_EMPTY:
+			RWDEBUG("Pool contains no free addresses");
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		break;
+
+	case POOL_ACTION_UPDATE:
+		if (ippool_requested_address(inst, request, &address, ip_buff, sizeof(ip_buff)) < 0) {
+			return RLM_MODULE_FAIL;
+		}
+
+		RDEBUG2("Updating %s in pool \"%s\", device \"%s\", expires in %us",
+			ip_buff, pool->name, device, inst->lease_time);
+
+		switch (ippool_update(pool, inst->journal, address, device, now, inst->lease_time, &expires)) {
+		case IPPOOL_RCODE_SUCCESS:
+			if ((inst->copy_on_update && (ippool_address_to_request(inst, request, address) < 0)) ||
+			    (ippool_expiry_to_request(inst, request, expires, now) < 0)) {
+				rcode = RLM_MODULE_FAIL;
+				break;
+			}
+			RDEBUG2("IP address lease updated");
+			rcode = RLM_MODULE_UPDATED;
+			break;
+
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("IP address is not a member of the specified pool");
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		case IPPOOL_RCODE_EXPIRED:
+			REDEBUG("IP address lease already expired at time of renewal");
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("IP address lease allocated to another device");
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		break;
+
+	case POOL_ACTION_RELEASE:
+		if (ippool_requested_address(inst, request, &address, ip_buff, sizeof(ip_buff)) < 0) {
+			return RLM_MODULE_FAIL;
+		}
+
+		RDEBUG2("Releasing %s leased by \"%s\" to pool \"%s\"", ip_buff, device, pool->name);
+
+		switch (ippool_release(pool, inst->journal, address, device, now)) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address released");
+			rcode = RLM_MODULE_UPDATED;
+			break;
+
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("IP address is not a member of the specified pool");
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("IP address lease allocated to another device");
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		break;
+
+	case POOL_ACTION_BULK_RELEASE:
+		RDEBUG2("Bulk release not yet implemented");
+		return RLM_MODULE_NOOP;
+
+	default:
+		rad_assert(0);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (inst->journal) ippool_journal_snapshot_check(inst->journal, now);
+
+	return rcode;
+}
+
+static rlm_rcode_t mod_accounting(void *instance, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
+{
+	rlm_ippool_t	*inst = instance;
+	VALUE_PAIR	*vp;
+
+	/*
+	 *	Pool-Action override
+	 */
+	vp = fr_pair_find_by_num(request->control, 0, PW_POOL_ACTION, TAG_ANY);
+	if (vp) return mod_action(inst, request, vp->vp_integer);
+
+	/*
+	 *	Otherwise, guess the action by Acct-Status-Type
+	 */
+	vp = fr_pair_find_by_num(request->packet->vps, 0, PW_ACCT_STATUS_TYPE, TAG_ANY);
+	if (!vp) {
+		RDEBUG2("Couldn't find &request:Acct-Status-Type or &control:Pool-Action, doing nothing...");
+		return RLM_MODULE_NOOP;
+	}
+
+	switch (vp->vp_integer) {
+	case PW_STATUS_START:
+	case PW_STATUS_ALIVE:
+		return mod_action(inst, request, POOL_ACTION_UPDATE);
+
+	case PW_STATUS_STOP:
+		return mod_action(inst, request, POOL_ACTION_RELEASE);
+
+	case PW_STATUS_ACCOUNTING_OFF:
+	case PW_STATUS_ACCOUNTING_ON:
+		return mod_action(inst, request, POOL_ACTION_BULK_RELEASE);
+
+	default:
+		return RLM_MODULE_NOOP;
+	}
+}
+
+static rlm_rcode_t mod_authorize(void *instance, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
+{
+	rlm_ippool_t	*inst = instance;
+	VALUE_PAIR	*vp;
+
+	/*
+	 *	Unless it's overridden the default action is to allocate
+	 *	when called in Authorize.
+	 */
+	vp = fr_pair_find_by_num(request->control, 0, PW_POOL_ACTION, TAG_ANY);
+	return mod_action(inst, request, vp ? vp->vp_integer : POOL_ACTION_ALLOCATE);
+}
+
+static rlm_rcode_t mod_post_auth(void *instance, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_post_auth(void *instance, REQUEST *request)
+{
+	rlm_ippool_t	*inst = instance;
+	VALUE_PAIR	*vp;
+
+	/*
+	 *	Unless it's overridden the default action is to allocate
+	 *	when called in Post-Auth.
+	 */
+	vp = fr_pair_find_by_num(request->control, 0, PW_POOL_ACTION, TAG_ANY);
+	return mod_action(inst, request, vp ? vp->vp_integer : POOL_ACTION_ALLOCATE);
+}
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_ippool_t	*inst = instance;
+	CONF_SECTION	*cs;
+	ippool_pool_t	*pool;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	rad_assert(inst->allocated_address_attr->type == TMPL_TYPE_ATTR);
+
+	FR_INTEGER_BOUND_CHECK("lease_time", inst->lease_time, >=, 1);
+
+	/*
+	 *	If we don't have a separate time specifically for offers
+	 *	just use the lease time.
+	 */
+	if (!inst->offer_time) inst->offer_time = inst->lease_time;
+
+	inst->pools = rbtree_create(inst, ippool_pool_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!inst->pools) {
+		ERROR("Failed creating pool tree");
+		return -1;
+	}
+
+	for (cs = cf_subsection_find_next(conf, NULL, "pool");
+	     cs;
+	     cs = cf_subsection_find_next(conf, cs, "pool")) {
+		pool = ippool_pool_alloc(inst, cs);
+		if (!pool) return -1;
+
+		if (!rbtree_insert(inst->pools, pool)) {
+			cf_log_err_cs(cs, "Duplicate pool \"%s\"", pool->name);
+			talloc_free(pool);
+			return -1;
+		}
+
+		DEBUG2("Pool \"%s\" contains %u addresses", pool->name, pool->size);
+	}
+
+	if (!rbtree_num_elements(inst->pools)) {
+		cf_log_err_cs(conf, "At least one pool must be configured");
+		return -1;
+	}
+
+	if (!inst->journal_file) {
+		WARN("No journal configured, leases will be lost when the server restarts");
+		return 0;
+	}
+
+	inst->journal = ippool_journal_init(inst);
+	if (!inst->journal) return -1;
+
+	return 0;
+}
+
+extern module_t rlm_ippool;
+module_t rlm_ippool = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "ippool",
+	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_ippool_t),
+	.config		= module_config,
+	.instantiate	= mod_instantiate,
+	.methods = {
+		[MOD_ACCOUNTING]	= mod_accounting,
+		[MOD_AUTHORIZE]		= mod_authorize,
+		[MOD_POST_AUTH]		= mod_post_auth,
+	},
+};
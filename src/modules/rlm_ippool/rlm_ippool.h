@@ -0,0 +1,144 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_ippool.h
+ * @brief Structures and prototypes for the in-memory IP pool module.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+#ifndef _RLM_IPPOOL_H
+#define _RLM_IPPOOL_H
+
+RCSIDH(rlm_ippool_h, "$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/heap.h>
+
+#define IPPOOL_MAX_POOL_SIZE	(1 << 20)	//!< Maximum number of addresses in a pool.
+#define IPPOOL_MAX_NAME_LEN	255		//!< Maximum length of pool names and device identifiers.
+
+typedef enum {
+	IPPOOL_RCODE_SUCCESS = 0,
+	IPPOOL_RCODE_NOT_FOUND = -1,
+	IPPOOL_RCODE_EXPIRED = -2,
+	IPPOOL_RCODE_DEVICE_MISMATCH = -3,
+	IPPOOL_RCODE_POOL_EMPTY = -4,
+	IPPOOL_RCODE_FAIL = -5
+} ippool_rcode_t;
+
+typedef enum {
+	POOL_ACTION_ALLOCATE = 1,
+	POOL_ACTION_UPDATE = 2,
+	POOL_ACTION_RELEASE = 3,
+	POOL_ACTION_BULK_RELEASE = 4,
+} ippool_action_t;
+
+typedef struct ippool_pool ippool_pool_t;
+typedef struct ippool_journal ippool_journal_t;
+
+/** The state of one address in a pool
+ *
+ * Only allocated once an address has been leased, and kept afterwards, so
+ * the device which last used the address can be given it again.
+ */
+typedef struct ippool_lease {
+	ippool_pool_t		*pool;		//!< Pool the address belongs to.
+	uint32_t		index;		//!< Offset of the address in the pool.
+	char			*device;	//!< Device the address was last leased to.
+						//!< NULL if the address was released.
+	time_t			expires;	//!< When the lease expires.
+	int			heap_id;	//!< Position in the expiry heap, -1 if the
+						//!< address is free.
+} ippool_lease_t;
+
+/** A contiguous block of addresses in a pool
+ *
+ */
+typedef struct ippool_range {
+	uint32_t		start;		//!< First address, in host byte order.
+	uint32_t		num;		//!< Number of addresses.
+	uint32_t		offset;		//!< Offset of the first address in the pool.
+} ippool_range_t;
+
+struct ippool_pool {
+	char const		*name;		//!< Name of the pool.
+
+	ippool_range_t		*ranges;	//!< Addresses in the pool.
+	uint32_t		num_ranges;	//!< Number of ranges.
+	uint32_t		size;		//!< Total number of addresses.
+
+	uint64_t		*free;		//!< Bitmap of free addresses, indexed by offset.
+	uint32_t		num_free;	//!< Number of bits set in free.
+	uint32_t		hint;		//!< Lowest word of free which may have a bit set.
+
+	ippool_lease_t		**leases;	//!< Leases, indexed by offset.  NULL if the address
+						//!< has never been leased.
+	fr_hash_table_t		*devices;	//!< Leases, indexed by device.
+	fr_heap_t		*expiry;	//!< Active leases, ordered by expiry time.
+
+	pthread_mutex_t		mutex;		//!< Protects everything above, once the
+						//!< module has been instantiated.
+};
+
+/** rlm_ippool module instance
+ *
+ */
+typedef struct rlm_ippool {
+	char const		*name;		//!< Instance name.
+
+	vp_tmpl_t		*pool_name;	//!< Name of the pool to allocate addresses from.
+	vp_tmpl_t		*device_id;	//!< Unique device identifier.  Devices are given
+						//!< the address they last had, if it's free.
+
+	uint32_t		offer_time;	//!< How long to reserve an address for when it's
+						//!< allocated.
+	uint32_t		lease_time;	//!< How long to extend a lease for when it's updated.
+
+	vp_tmpl_t		*requested_address;		//!< Address to update or release.
+	vp_tmpl_t		*allocated_address_attr;	//!< Attribute to write allocated addresses to.
+	vp_tmpl_t		*expiry_attr;	//!< Attribute to write the lease time to.
+	bool			copy_on_update;	//!< Copy the requested address to the
+						//!< allocated_address_attr if an update succeeds.
+
+	char const		*journal_file;	//!< Where to record changes to leases.
+	uint32_t		snapshot_interval;	//!< How often to compact the journal.
+	bool			journal_sync;	//!< Whether to flush every journal record to disk.
+
+	rbtree_t		*pools;		//!< Pools, by name.
+	ippool_journal_t	*journal;	//!< Journal of lease changes, NULL if leases are
+						//!< only kept in memory.
+} rlm_ippool_t;
+
+/* pool.c */
+ippool_pool_t	*ippool_pool_alloc(TALLOC_CTX *ctx, CONF_SECTION *cs);
+int		ippool_pool_offset(ippool_pool_t const *pool, uint32_t address);
+uint32_t	ippool_pool_address(ippool_pool_t const *pool, uint32_t offset);
+void		ippool_lease_set(ippool_pool_t *pool, uint32_t offset, char const *device, time_t expires, time_t now);
+ippool_rcode_t	ippool_allocate(ippool_pool_t *pool, ippool_journal_t *journal, char const *device,
+				time_t now, uint32_t lease_time, uint32_t *address, time_t *expires);
+ippool_rcode_t	ippool_update(ippool_pool_t *pool, ippool_journal_t *journal, uint32_t address,
+			      char const *device, time_t now, uint32_t lease_time, time_t *expires);
+ippool_rcode_t	ippool_release(ippool_pool_t *pool, ippool_journal_t *journal, uint32_t address,
+			       char const *device, time_t now);
+
+/* journal.c */
+ippool_journal_t *ippool_journal_init(rlm_ippool_t *inst);
+int		ippool_journal_write(ippool_journal_t *journal, ippool_pool_t const *pool,
+				     ippool_lease_t const *lease);
+void		ippool_journal_snapshot_check(ippool_journal_t *journal, time_t now);
+#endif
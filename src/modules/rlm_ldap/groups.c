@@ -25,6 +25,7 @@
  * @copyright 2013-2015 The FreeRADIUS Server Project.
  */
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/heap.h>
 #include <ctype.h>
 
 #include "rlm_ldap.h"
@@ -836,3 +837,461 @@ rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALU
 	RDEBUG2("Cached membership not found");
 	return RLM_MODULE_NOTFOUND;
 }
+
+/*
+ *	Group memberships are cached across requests, by user DN.
+ */
+typedef struct rlm_ldap_group_cache_group {
+	char			*value;		//!< Group name or DN.
+	size_t			len;		//!< Length of the value.
+	bool			is_dn;		//!< Whether the value is a DN.
+	bool			member;		//!< Whether the user is a member of the group.
+	time_t			expires;	//!< When the result should no longer be used.
+} rlm_ldap_group_cache_group_t;
+
+typedef struct rlm_ldap_group_cache_entry {
+	char			*user_dn;	//!< Key.
+	time_t			expires;	//!< When the entry is removed.
+	bool			complete;	//!< groups contains every group the user is a member of,
+						//!< as determined by rlm_ldap_cacheable_userobj() and
+						//!< rlm_ldap_cacheable_groupobj().
+	rlm_ldap_group_cache_group_t *groups;	//!< Results for individual groups.
+	uint32_t		num_groups;	//!< Number of results.
+	size_t			heap_id;	//!< Offset used for heap.
+} rlm_ldap_group_cache_entry_t;
+
+struct rlm_ldap_group_cache {
+	rbtree_t		*tree;		//!< Entries, by user DN.
+	fr_heap_t		*heap;		//!< Entries, by expiry.
+	pthread_mutex_t		mutex;		//!< Protects the tree, the heap, and the entries.
+};
+
+static int group_cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_ldap_group_cache_entry_t const *a = one;
+	rlm_ldap_group_cache_entry_t const *b = two;
+
+	return strcasecmp(a->user_dn, b->user_dn);
+}
+
+static int group_cache_heap_cmp(void const *one, void const *two)
+{
+	rlm_ldap_group_cache_entry_t const *a = one;
+	rlm_ldap_group_cache_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+static int _group_cache_entry_free(void *ctx, void *data)
+{
+	rlm_ldap_group_cache_t *cache = ctx;
+
+	fr_heap_extract(cache->heap, data);
+	talloc_free(data);
+
+	return 2;
+}
+
+static int _group_cache_free(rlm_ldap_group_cache_t *cache)
+{
+	rbtree_walk(cache->tree, RBTREE_DELETE_ORDER, _group_cache_entry_free, cache);
+	rbtree_free(cache->tree);
+	fr_heap_delete(cache->heap);
+
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+static void group_cache_entry_remove(rlm_ldap_group_cache_t *cache, rlm_ldap_group_cache_entry_t *entry)
+{
+	fr_heap_extract(cache->heap, entry);
+	rbtree_deletebydata(cache->tree, entry);
+	talloc_free(entry);
+}
+
+/*
+ *	Find the entry for a user.  Must be called with the mutex held.
+ */
+static rlm_ldap_group_cache_entry_t *group_cache_entry_find(rlm_ldap_group_cache_t *cache, char const *user_dn,
+							    time_t now)
+{
+	rlm_ldap_group_cache_entry_t	find, *entry;
+
+	memcpy(&find.user_dn, &user_dn, sizeof(find.user_dn));	/* const work-arounds */
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry) return NULL;
+
+	if (entry->expires <= now) {
+		group_cache_entry_remove(cache, entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/*
+ *	Find or create the entry for a user, making space for it if
+ *	necessary.  Must be called with the mutex held.
+ */
+static rlm_ldap_group_cache_entry_t *group_cache_entry_alloc(rlm_ldap_t const *inst, char const *user_dn,
+							     time_t now)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	rlm_ldap_group_cache_entry_t	*entry;
+
+	entry = group_cache_entry_find(cache, user_dn, now);
+	if (entry) return entry;
+
+	/*
+	 *	Remove expired entries, then the entry closest to
+	 *	expiring if we're still full.
+	 */
+	while ((entry = fr_heap_peek(cache->heap)) && (entry->expires <= now)) {
+		group_cache_entry_remove(cache, entry);
+	}
+	if (rbtree_num_elements(cache->tree) >= inst->group_cache_max_entries) {
+		entry = fr_heap_peek(cache->heap);
+		if (entry) group_cache_entry_remove(cache, entry);
+	}
+
+	entry = talloc_zero(NULL, rlm_ldap_group_cache_entry_t);
+	if (!entry) return NULL;
+
+	entry->user_dn = talloc_typed_strdup(entry, user_dn);
+	entry->expires = now + inst->group_cache_lifetime;
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+		return NULL;
+	}
+	fr_heap_insert(cache->heap, entry);
+
+	return entry;
+}
+
+static rlm_ldap_group_cache_group_t *group_cache_group_find(rlm_ldap_group_cache_entry_t *entry,
+							    char const *value, size_t len, bool is_dn)
+{
+	uint32_t i;
+
+	for (i = 0; i < entry->num_groups; i++) {
+		rlm_ldap_group_cache_group_t *group = &entry->groups[i];
+
+		if ((group->is_dn != is_dn) || (group->len != len)) continue;
+
+		/*
+		 *	DNs are case insensitive, group names aren't.
+		 */
+		if (is_dn ? (strncasecmp(group->value, value, len) == 0) : (memcmp(group->value, value, len) == 0)) {
+			return group;
+		}
+	}
+
+	return NULL;
+}
+
+static rlm_ldap_group_cache_group_t *group_cache_group_add(rlm_ldap_group_cache_entry_t *entry,
+							   char const *value, size_t len, bool is_dn)
+{
+	rlm_ldap_group_cache_group_t	*group;
+
+	if (entry->num_groups >= (LDAP_MAX_CACHEABLE * 2)) return NULL;
+
+	if (entry->num_groups == talloc_array_length(entry->groups)) {
+		group = talloc_realloc(entry, entry->groups, rlm_ldap_group_cache_group_t,
+				       entry->num_groups ? entry->num_groups * 2 : 8);
+		if (!group) return NULL;
+		entry->groups = group;
+	}
+
+	group = &entry->groups[entry->num_groups++];
+	memset(group, 0, sizeof(*group));
+	group->value = talloc_bstrndup(entry->groups, value, len);
+	group->len = len;
+	group->is_dn = is_dn;
+
+	return group;
+}
+
+/** Create the group membership cache
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rlm_ldap_group_cache_init(rlm_ldap_t *inst)
+{
+	rlm_ldap_group_cache_t *cache;
+
+	MEM(cache = talloc_zero(inst, rlm_ldap_group_cache_t));
+
+	cache->tree = rbtree_create(NULL, group_cache_entry_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!cache->tree) {
+		ERROR("Failed creating group cache");
+	error:
+		talloc_free(cache);
+		return -1;
+	}
+
+	cache->heap = fr_heap_create(group_cache_heap_cmp, offsetof(rlm_ldap_group_cache_entry_t, heap_id));
+	if (!cache->heap) {
+		ERROR("Failed creating group cache heap");
+		rbtree_free(cache->tree);
+		goto error;
+	}
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _group_cache_free);
+
+	inst->group_cache = cache;
+
+	return 0;
+}
+
+/** Check the group membership cache to see if a user is a member
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] user_dn of the user.
+ * @param[in] check vp containing the group value (name or dn).
+ * @return
+ *	- #RLM_MODULE_OK if the user is a member.
+ *	- #RLM_MODULE_NOTFOUND if the user is not a member.
+ *	- #RLM_MODULE_INVALID if the membership is not cached.
+ */
+rlm_rcode_t rlm_ldap_group_cache_check(rlm_ldap_t const *inst, REQUEST *request, char const *user_dn,
+				       VALUE_PAIR const *check)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	rlm_ldap_group_cache_entry_t	*entry;
+	rlm_ldap_group_cache_group_t	*group;
+	rlm_rcode_t			rcode = RLM_MODULE_INVALID;
+	bool				is_dn;
+	time_t				now;
+
+	if (!cache) return RLM_MODULE_INVALID;
+
+	is_dn = rlm_ldap_is_dn(check->vp_strvalue, check->vp_length);
+	now = time(NULL);
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = group_cache_entry_find(cache, user_dn, now);
+	if (!entry) goto finish;
+
+	group = group_cache_group_find(entry, check->vp_strvalue, check->vp_length, is_dn);
+	if (group && (group->expires > now)) {
+		rcode = group->member ? RLM_MODULE_OK : RLM_MODULE_NOTFOUND;
+		goto finish;
+	}
+
+	/*
+	 *	We know all the groups the user is a member of,
+	 *	so if this isn't one of them, they're not a member.
+	 */
+	if (entry->complete && ((is_dn && inst->cacheable_group_dn) || (!is_dn && inst->cacheable_group_name))) {
+		rcode = RLM_MODULE_NOTFOUND;
+	}
+
+finish:
+	pthread_mutex_unlock(&cache->mutex);
+
+	switch (rcode) {
+	case RLM_MODULE_OK:
+		RDEBUG2("User found. Matched membership in group cache");
+		break;
+
+	case RLM_MODULE_NOTFOUND:
+		RDEBUG2("User not found. Matched non-membership in group cache");
+		break;
+
+	default:
+		break;
+	}
+
+	return rcode;
+}
+
+/** Add the result of a group membership check to the group membership cache
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] user_dn of the user.
+ * @param[in] check vp containing the group value (name or dn).
+ * @param[in] member Whether the user is a member of the group.
+ */
+void rlm_ldap_group_cache_add(rlm_ldap_t const *inst, REQUEST *request, char const *user_dn,
+			      VALUE_PAIR const *check, bool member)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	rlm_ldap_group_cache_entry_t	*entry;
+	rlm_ldap_group_cache_group_t	*group;
+	bool				is_dn;
+	time_t				now;
+
+	if (!cache) return;
+
+	is_dn = rlm_ldap_is_dn(check->vp_strvalue, check->vp_length);
+	now = time(NULL);
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = group_cache_entry_alloc(inst, user_dn, now);
+	if (!entry) goto finish;
+
+	group = group_cache_group_find(entry, check->vp_strvalue, check->vp_length, is_dn);
+	if (!group) group = group_cache_group_add(entry, check->vp_strvalue, check->vp_length, is_dn);
+	if (!group) goto finish;
+
+	group->member = member;
+	group->expires = now + (member ? inst->group_cache_lifetime : inst->group_cache_negative_lifetime);
+
+	RDEBUG3("Cached %s of \"%s\"", member ? "membership" : "non-membership", check->vp_strvalue);
+
+finish:
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Add all of a user's group memberships to the group membership cache
+ *
+ * Should be called after rlm_ldap_cacheable_userobj() and rlm_ldap_cacheable_groupobj()
+ * have added the user's memberships to the control list.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] user_dn of the user.
+ */
+void rlm_ldap_group_cache_add_complete(rlm_ldap_t const *inst, REQUEST *request, char const *user_dn)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	rlm_ldap_group_cache_entry_t	*entry;
+	rlm_ldap_group_cache_group_t	*group;
+	VALUE_PAIR			*vp;
+	vp_cursor_t			cursor;
+	time_t				now;
+
+	if (!cache) return;
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&cache->mutex);
+
+	/*
+	 *	Start again, so results for individual groups
+	 *	don't outlive the complete set.
+	 */
+	entry = group_cache_entry_find(cache, user_dn, now);
+	if (entry) group_cache_entry_remove(cache, entry);
+
+	entry = group_cache_entry_alloc(inst, user_dn, now);
+	if (!entry) goto finish;
+
+	for (vp = fr_cursor_init(&cursor, &request->control);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		bool is_dn;
+
+		if (vp->da != inst->cache_da) continue;
+
+		is_dn = rlm_ldap_is_dn(vp->vp_strvalue, vp->vp_length);
+		if (group_cache_group_find(entry, vp->vp_strvalue, vp->vp_length, is_dn)) continue;
+
+		group = group_cache_group_add(entry, vp->vp_strvalue, vp->vp_length, is_dn);
+		if (!group) {
+			/*
+			 *	Better to not cache the user at all,
+			 *	than to cache an incomplete set.
+			 */
+			group_cache_entry_remove(cache, entry);
+			goto finish;
+		}
+		group->member = true;
+		group->expires = entry->expires;
+	}
+	entry->complete = true;
+
+	RDEBUG2("Cached %u group memberships", entry->num_groups);
+
+finish:
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Add a user's cached group memberships to the control list
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] user_dn of the user.
+ * @return
+ *	- #RLM_MODULE_OK if the memberships were added.
+ *	- #RLM_MODULE_INVALID if the complete set of memberships isn't cached.
+ */
+rlm_rcode_t rlm_ldap_group_cache_expand(rlm_ldap_t const *inst, REQUEST *request, char const *user_dn)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	rlm_ldap_group_cache_entry_t	*entry;
+	VALUE_PAIR			*vp;
+	uint32_t			i;
+	time_t				now;
+
+	if (!cache) return RLM_MODULE_INVALID;
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = group_cache_entry_find(cache, user_dn, now);
+	if (!entry || !entry->complete) {
+		pthread_mutex_unlock(&cache->mutex);
+		return RLM_MODULE_INVALID;
+	}
+
+	RDEBUG("Adding cached group memberships");
+	RINDENT();
+	for (i = 0; i < entry->num_groups; i++) {
+		rlm_ldap_group_cache_group_t *group = &entry->groups[i];
+
+		if (!group->member || (group->expires <= now)) continue;
+
+		MEM(vp = pair_make_config(inst->cache_da->name, NULL, T_OP_ADD));
+		fr_pair_value_bstrncpy(vp, group->value, group->len);
+
+		RDEBUG("&control:%s += \"%s\"", inst->cache_da->name, vp->vp_strvalue);
+	}
+	REXDENT();
+	pthread_mutex_unlock(&cache->mutex);
+
+	return RLM_MODULE_OK;
+}
+
+/** Remove users from the group membership cache
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] user_dn of the user to remove.  If NULL, all users are removed.
+ * @return the number of users removed.
+ */
+uint32_t rlm_ldap_group_cache_flush(rlm_ldap_t const *inst, char const *user_dn)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	rlm_ldap_group_cache_entry_t	*entry;
+	uint32_t			count = 0;
+
+	if (!cache) return 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (!user_dn) {
+		count = rbtree_num_elements(cache->tree);
+		rbtree_walk(cache->tree, RBTREE_DELETE_ORDER, _group_cache_entry_free, cache);
+	} else {
+		entry = group_cache_entry_find(cache, user_dn, time(NULL));
+		if (entry) {
+			group_cache_entry_remove(cache, entry);
+			count = 1;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return count;
+}
@@ -487,38 +487,35 @@ char const *rlm_ldap_error_str(ldap_handle_t const *conn)
 	return ldap_err2string(lib_errno);
 }
 
-/** Parse response from LDAP server dealing with any errors
+/** Parse a result received from the LDAP server, dealing with any errors
  *
- * Should be called after an LDAP operation. Will check result of operation
- * and if it was successful, then attempt to retrieve and parse the result.
- *
- * Will also produce extended error output including any messages the server
+ * Will produce extended error output including any messages the server
  * sent, and information about partial DN matches.
  *
  * @param[in] inst	of LDAP module.
  * @param[in] conn	Current connection.
- * @param[in] msgid	returned from last operation. May be -1 if no result
- *			processing is required.
+ * @param[in] lib_errno	returned by the library when sending the operation or
+ *			retrieving the result.  If this is not LDAP_SUCCESS,
+ *			*result must be NULL.
  * @param[in] dn	Last search or bind DN.
- * @param[in] timeout	Override the default result timeout.
- * @param[out] result	Where to write result, if NULL result will be freed.
+ * @param[in,out] result to parse.  Will be set to NULL if it's freed.
+ * @param[in] freeit	Whether the result should be freed after being parsed.
  * @param[out] error	Where to write the error string, may be NULL, must
  *			not be freed.
  * @param[out] extra	Where to write additional error string to, may be NULL
  *			(faster) or must be freed (with talloc_free).
  * @return One of the LDAP_PROC_* (#ldap_rcode_t) values.
  */
-ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst,
-			     ldap_handle_t const *conn,
-			     int msgid,
-			     char const *dn,
-			     struct timeval const *timeout,
-			     LDAPMessage **result,
-			     char const **error, char **extra)
+ldap_rcode_t rlm_ldap_result_parse(rlm_ldap_t const *inst,
+				   ldap_handle_t const *conn,
+				   int lib_errno,
+				   char const *dn,
+				   LDAPMessage **result,
+				   bool freeit,
+				   char const **error, char **extra)
 {
 	ldap_rcode_t status = LDAP_PROC_SUCCESS;
 
-	int lib_errno = LDAP_SUCCESS;	// errno returned by the library.
 	int srv_errno = LDAP_SUCCESS;	// errno in the result message.
 
 	char *part_dn = NULL;		// Partial DN match.
@@ -526,59 +523,16 @@ ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst,
 	char *srv_err = NULL;		// Server's extended error message.
 	char *p, *a;
 
-	bool freeit = false;		// Whether the message should be freed after being processed.
 	int len;
 
-	struct timeval tv;		// Holds timeout values.
-
-	LDAPMessage *tmp_msg = NULL;	// Temporary message pointer storage if we weren't provided with one.
-
 	char const *tmp_err;		// Temporary error pointer storage if we weren't provided with one.
 
 	if (!error) error = &tmp_err;
 	*error = NULL;
 
 	if (extra) *extra = NULL;
-	if (result) *result = NULL;
-
-	/*
-	 *	We always need the result, but our caller may not
-	 */
-	if (!result) {
-		result = &tmp_msg;
-		freeit = true;
-	}
 
-	/*
-	 *	Check if there was an error sending the request
-	 */
-	ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
 	if (lib_errno != LDAP_SUCCESS) goto process_error;
-	if (msgid < 0) return LDAP_SUCCESS;	/* No msgid and no error, return now */
-
-	if (!timeout) {
-		tv.tv_sec = inst->res_timeout;
-		tv.tv_usec = 0;
-	} else {
-		tv = *timeout;
-	}
-
-	/*
-	 *	Now retrieve the result and check for errors
-	 *	ldap_result returns -1 on failure, and 0 on timeout
-	 */
-	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
-	if (lib_errno == 0) {
-		lib_errno = LDAP_TIMEOUT;
-
-		goto process_error;
-	}
-
-	if (lib_errno == -1) {
-		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
-
-		goto process_error;
-	}
 
 	/*
 	 *	Parse the result and check for errors sent by the server
@@ -735,6 +689,83 @@ process_error:
 	return status;
 }
 
+/** Parse response from LDAP server dealing with any errors
+ *
+ * Should be called after an LDAP operation. Will check result of operation
+ * and if it was successful, then attempt to retrieve and parse the result.
+ *
+ * @param[in] inst	of LDAP module.
+ * @param[in] conn	Current connection.
+ * @param[in] msgid	returned from last operation. May be -1 if no result
+ *			processing is required.
+ * @param[in] dn	Last search or bind DN.
+ * @param[in] timeout	Override the default result timeout.
+ * @param[out] result	Where to write result, if NULL result will be freed.
+ * @param[out] error	Where to write the error string, may be NULL, must
+ *			not be freed.
+ * @param[out] extra	Where to write additional error string to, may be NULL
+ *			(faster) or must be freed (with talloc_free).
+ * @return One of the LDAP_PROC_* (#ldap_rcode_t) values.
+ */
+ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst,
+			     ldap_handle_t const *conn,
+			     int msgid,
+			     char const *dn,
+			     struct timeval const *timeout,
+			     LDAPMessage **result,
+			     char const **error, char **extra)
+{
+	int lib_errno = LDAP_SUCCESS;	// errno returned by the library.
+
+	bool freeit = false;		// Whether the message should be freed after being processed.
+
+	struct timeval tv;		// Holds timeout values.
+
+	LDAPMessage *tmp_msg = NULL;	// Temporary message pointer storage if we weren't provided with one.
+
+	if (error) *error = NULL;
+	if (extra) *extra = NULL;
+
+	/*
+	 *	We always need the result, but our caller may not
+	 */
+	if (!result) {
+		result = &tmp_msg;
+		freeit = true;
+	}
+	*result = NULL;
+
+	/*
+	 *	Check if there was an error sending the request
+	 */
+	ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
+	if (lib_errno != LDAP_SUCCESS) goto process_error;
+	if (msgid < 0) return LDAP_SUCCESS;	/* No msgid and no error, return now */
+
+	if (!timeout) {
+		tv.tv_sec = inst->res_timeout;
+		tv.tv_usec = 0;
+	} else {
+		tv = *timeout;
+	}
+
+	/*
+	 *	Now retrieve the result and check for errors
+	 *	ldap_result returns -1 on failure, and 0 on timeout
+	 */
+	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
+	if (lib_errno == 0) {
+		lib_errno = LDAP_TIMEOUT;
+	} else if (lib_errno == -1) {
+		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
+	} else {
+		lib_errno = LDAP_SUCCESS;
+	}
+
+process_error:
+	return rlm_ldap_result_parse(inst, conn, lib_errno, dn, result, freeit, error, extra);
+}
+
 /** Bind to the LDAP directory as a user
  *
  * Performs a simple bind to the LDAP directory, and handles any errors that occur.
@@ -936,9 +967,10 @@ ldap_rcode_t rlm_ldap_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUE
 	memcpy(&search_attrs, &attrs, sizeof(attrs));
 
 	/*
-	 *	Do all searches as the admin user.
+	 *	Do all searches as the admin user.  Multiplexed
+	 *	connections are always bound as the admin user.
 	 */
-	if ((*pconn)->rebound) {
+	if ((*pconn)->rebound && !inst->mux) {
 		status = rlm_ldap_bind(inst, request, pconn, (*pconn)->inst->admin_identity,
 				       (*pconn)->inst->admin_password, &(*pconn)->inst->admin_sasl, true,
 				       NULL, NULL, NULL);
@@ -976,11 +1008,18 @@ ldap_rcode_t rlm_ldap_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUE
 	 *	and we can't make a new one.
 	 */
 	for (i = conn_available; i >= 0; i--) {
-		(void) ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs,
-				       0, our_serverctrls, our_clientctrls, &tv, 0, &msgid);
+		if (inst->mux) {
+			ROPTIONAL(RDEBUG, DEBUG, "Waiting for multiplexed search result...");
+			status = rlm_ldap_mux_search(inst->mux, *pconn, dn, scope, filter, search_attrs,
+						     our_serverctrls, our_clientctrls, &tv,
+						     &our_result, &error, &extra);
+		} else {
+			(void) ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs,
+					       0, our_serverctrls, our_clientctrls, &tv, 0, &msgid);
 
-		ROPTIONAL(RDEBUG, DEBUG, "Waiting for search result...");
-		status = rlm_ldap_result(inst, *pconn, msgid, dn, NULL, &our_result, &error, &extra);
+			ROPTIONAL(RDEBUG, DEBUG, "Waiting for search result...");
+			status = rlm_ldap_result(inst, *pconn, msgid, dn, NULL, &our_result, &error, &extra);
+		}
 		switch (status) {
 		case LDAP_PROC_SUCCESS:
 			break;
@@ -997,7 +1036,11 @@ ldap_rcode_t rlm_ldap_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUE
 			break;
 
 		case LDAP_PROC_RETRY:
-			*pconn = fr_connection_reconnect(inst->pool, request, *pconn);
+			/*
+			 *	Failed multiplexed connections are
+			 *	replaced by the next search.
+			 */
+			if (!inst->mux) *pconn = fr_connection_reconnect(inst->pool, request, *pconn);
 			if (*pconn) {
 				ROPTIONAL(RWDEBUG, WARN, "Search failed: %s. Got new socket, retrying...", error);
 
@@ -1229,7 +1272,7 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 	/*
 	 *	Perform all searches as the admin user.
 	 */
-	if ((*pconn)->rebound) {
+	if ((*pconn)->rebound && !inst->mux) {
 		status = rlm_ldap_bind(inst, request, pconn, (*pconn)->inst->admin_identity,
 				       (*pconn)->inst->admin_password, &(*pconn)->inst->admin_sasl, true,
 				       NULL, NULL, NULL);
@@ -1656,14 +1699,24 @@ static int _mod_conn_free(ldap_handle_t *conn)
 /** Create and return a new connection
  *
  * Create a new ldap connection and allocate memory for a new rlm_handle_t
+ *
+ * @param[in] ctx	to allocate the connection in.
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] timeout	to use when connecting.
+ * @param[in] bind	If true, bind as the admin user.  If false, the connection
+ *			is not opened until it's first used, and is marked as
+ *			rebound, so that it binds as the admin user before any
+ *			search or modification.
+ * @return
+ *	- A new connection.
+ *	- NULL on error.
  */
-void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout)
+ldap_handle_t *rlm_ldap_conn_create(TALLOC_CTX *ctx, rlm_ldap_t *inst, struct timeval const *timeout, bool bind)
 {
 	ldap_rcode_t status;
 
 	int ldap_errno, ldap_version;
 
-	rlm_ldap_t *inst = instance;
 	ldap_handle_t *conn;
 	LDAP *handle = NULL;
 
@@ -1808,6 +1861,11 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	}
 #endif /* HAVE_LDAP_START_TLS_S */
 
+	if (!bind) {
+		conn->rebound = true;
+		return conn;
+	}
+
 	status = rlm_ldap_bind(inst, NULL, &conn, conn->inst->admin_identity, conn->inst->admin_password,
 			       &(conn->inst->admin_sasl), false, timeout, NULL, NULL);
 	if (status != LDAP_PROC_SUCCESS) goto error;
@@ -1836,6 +1894,18 @@ error:
 	return NULL;
 }
 
+/** Create a new connection for the connection pool
+ *
+ * If searches are multiplexed, pooled connections are only used for binds
+ * and modifications, so they're not opened until they're needed.
+ */
+void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout)
+{
+	rlm_ldap_t *inst = instance;
+
+	return rlm_ldap_conn_create(ctx, inst, timeout, !inst->multiplex);
+}
+
 /** Gets an LDAP socket from the connection pool
  *
  * Retrieve a socket from the connection pool, or NULL on error (of if no sockets are available).
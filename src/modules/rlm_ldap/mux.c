@@ -0,0 +1,509 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file mux.c
+ * @brief Multiplex searches from many worker threads over a few connections.
+ *
+ * Workers send searches on a shared connection, and wait for the result.
+ * A single reader thread watches the sockets of all shared connections with
+ * an event list, and hands each complete result to the worker waiting for
+ * its msgid.  Any number of searches may be outstanding on a connection,
+ * so the directory's concurrency is used without a socket per search.
+ *
+ * @copyright 2016 The FreeRADIUS Server Project.
+ */
+#include "rlm_ldap.h"
+
+#include <fcntl.h>
+
+/** A worker waiting for the result of a search
+ *
+ */
+typedef struct rlm_ldap_mux_wait {
+	int			msgid;		//!< Of the search.
+	LDAPMessage		*result;	//!< Complete result chain, written by the reader.
+	int			lib_errno;	//!< Set by the reader if the connection failed.
+	bool			done;		//!< Whether the reader has finished with this search.
+	pthread_cond_t		cond;		//!< Signalled when done is set.
+} rlm_ldap_mux_wait_t;
+
+/** A connection shared by many searches
+ *
+ */
+typedef struct rlm_ldap_mux_conn {
+	rlm_ldap_mux_t		*mux;		//!< Multiplexer this connection belongs to.
+	pthread_mutex_t		mutex;		//!< Held by the reader while calling ldap_result(),
+						//!< and by workers while sending or abandoning
+						//!< searches, so libldap never sees concurrent calls
+						//!< on one handle.  Must be taken before the
+						//!< multiplexer's mutex.
+	ldap_handle_t		*conn;		//!< Bound as the admin user.  NULL if the connection
+						//!< failed and hasn't been replaced yet.  Allocated in
+						//!< the NULL ctx, as workers open connections in parallel.
+	int			fd;		//!< Socket being watched by the reader, or -1.
+	bool			connecting;	//!< A worker is replacing the connection.
+	rbtree_t		*waiting;	//!< Searches waiting for results, by msgid.
+} rlm_ldap_mux_conn_t;
+
+struct rlm_ldap_mux {
+	rlm_ldap_t		*inst;		//!< rlm_ldap configuration.
+
+	pthread_mutex_t		mutex;		//!< Protects everything below, and the connections'
+						//!< state.  Not held while calling libldap, so a
+						//!< slow read or send doesn't stop results being
+						//!< handed to workers.
+
+	rlm_ldap_mux_conn_t	*conns;		//!< Shared connections.
+	uint32_t		num_conns;	//!< Number of shared connections.
+
+	fr_event_list_t		*el;		//!< Only used by the reader thread.
+	int			wake[2];	//!< Pipe used to tell the reader about new connections.
+	pthread_t		thread;		//!< Reader thread.
+	bool			running;	//!< Whether the reader thread was started.
+	bool			stop;		//!< Tells the reader thread to exit.
+};
+
+static int mux_wait_cmp(void const *one, void const *two)
+{
+	rlm_ldap_mux_wait_t const *a = one;
+	rlm_ldap_mux_wait_t const *b = two;
+
+	return (a->msgid > b->msgid) - (a->msgid < b->msgid);
+}
+
+static int _mux_wait_fail(void *ctx, void *data)
+{
+	rlm_ldap_mux_wait_t	*wait = data;
+
+	wait->lib_errno = *(int *) ctx;
+	wait->done = true;
+	pthread_cond_signal(&wait->cond);
+
+	return 2;	/* delete and continue */
+}
+
+/*
+ *	Fail every search outstanding on a connection, and close it.
+ *	The next search to pick it opens a new one.
+ *
+ *	Called by the reader with the connection's mutex and the
+ *	multiplexer's mutex held.
+ */
+static void mux_conn_fail(rlm_ldap_mux_conn_t *mconn)
+{
+	rlm_ldap_mux_t	*mux = mconn->mux;
+	rlm_ldap_t	*inst = mux->inst;
+	int		lib_errno = LDAP_SUCCESS;
+
+	ldap_get_option(mconn->conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
+	if (lib_errno == LDAP_SUCCESS) lib_errno = LDAP_SERVER_DOWN;
+
+	ERROR("Multiplexed connection failed: %s.  Failing %u outstanding searches", ldap_err2string(lib_errno),
+	      rbtree_num_elements(mconn->waiting));
+
+	rbtree_walk(mconn->waiting, RBTREE_DELETE_ORDER, _mux_wait_fail, &lib_errno);
+
+	fr_event_fd_delete(mux->el, 0, mconn->fd);
+	mconn->fd = -1;
+	TALLOC_FREE(mconn->conn);
+}
+
+/*
+ *	Read every complete result available on a connection,
+ *	and hand each one to the worker waiting for it.
+ *
+ *	Only the connection's mutex is held while reading, so workers
+ *	can use the other connections, and collect their results.
+ *	Only the reader frees connections, so mconn->conn can't change
+ *	while its fd is being watched.
+ */
+static void mux_conn_read(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	rlm_ldap_mux_conn_t	*mconn = ctx;
+	rlm_ldap_mux_t		*mux = mconn->mux;
+	rlm_ldap_mux_wait_t	find, *wait;
+	LDAPMessage		*msg;
+	struct timeval		tv = { 0, 0 };
+	int			ret;
+
+	pthread_mutex_lock(&mconn->mutex);
+	for (;;) {
+		ret = ldap_result(mconn->conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &tv, &msg);
+		if (ret == 0) break;
+
+		pthread_mutex_lock(&mux->mutex);
+		if (ret < 0) {
+			mux_conn_fail(mconn);
+			pthread_mutex_unlock(&mux->mutex);
+			break;
+		}
+
+		/*
+		 *	Results of searches which timed out, and
+		 *	unsolicited notifications.
+		 */
+		find.msgid = ldap_msgid(msg);
+		wait = rbtree_finddata(mconn->waiting, &find);
+		if (!wait) {
+			pthread_mutex_unlock(&mux->mutex);
+			ldap_msgfree(msg);
+			continue;
+		}
+
+		rbtree_deletebydata(mconn->waiting, wait);
+		wait->result = msg;
+		wait->done = true;
+		pthread_cond_signal(&wait->cond);
+		pthread_mutex_unlock(&mux->mutex);
+	}
+	pthread_mutex_unlock(&mconn->mutex);
+}
+
+/*
+ *	Start watching connections which were opened by workers,
+ *	or exit if the module is being detached.
+ */
+static void mux_wake_read(fr_event_list_t *el, int fd, void *ctx)
+{
+	rlm_ldap_mux_t	*mux = ctx;
+	rlm_ldap_t	*inst = mux->inst;
+	uint8_t		buffer[64];
+	uint32_t	i;
+	bool		stop;
+
+	while (read(fd, buffer, sizeof(buffer)) > 0);
+
+	pthread_mutex_lock(&mux->mutex);
+	stop = mux->stop;
+	pthread_mutex_unlock(&mux->mutex);
+
+	if (stop) {
+		fr_event_loop_exit(el, 1);
+		return;
+	}
+
+	for (i = 0; i < mux->num_conns; i++) {
+		rlm_ldap_mux_conn_t *mconn = &mux->conns[i];
+
+		pthread_mutex_lock(&mconn->mutex);
+		pthread_mutex_lock(&mux->mutex);
+		if (mconn->conn && (mconn->fd < 0) &&
+		    ((ldap_get_option(mconn->conn->handle, LDAP_OPT_DESC, &mconn->fd) != LDAP_OPT_SUCCESS) ||
+		     (mconn->fd < 0) || !fr_event_fd_insert(el, 0, mconn->fd, mux_conn_read, mconn))) {
+			ERROR("Failed watching multiplexed connection");
+			mconn->fd = -1;
+			mux_conn_fail(mconn);
+		}
+		pthread_mutex_unlock(&mux->mutex);
+		pthread_mutex_unlock(&mconn->mutex);
+	}
+}
+
+static void mux_wake(rlm_ldap_mux_t *mux)
+{
+	if ((write(mux->wake[1], "", 1) < 0) && (errno != EAGAIN)) {
+		rlm_ldap_t *inst = mux->inst;
+
+		ERROR("Failed waking multiplexer: %s", fr_syserror(errno));
+	}
+}
+
+static void *mux_thread(void *arg)
+{
+	rlm_ldap_mux_t *mux = arg;
+
+	fr_event_loop(mux->el);
+
+	return NULL;
+}
+
+/*
+ *	Pick the connection with the fewest outstanding searches,
+ *	replacing a failed connection first if there is one.
+ *
+ *	Called with the mutex held, which is released while connecting.
+ */
+static rlm_ldap_mux_conn_t *mux_conn_get(rlm_ldap_mux_t *mux)
+{
+	rlm_ldap_t		*inst = mux->inst;
+	rlm_ldap_mux_conn_t	*best = NULL, *dead = NULL;
+	ldap_handle_t		*conn;
+	struct timeval		timeout;
+	uint32_t		i;
+
+	for (i = 0; i < mux->num_conns; i++) {
+		rlm_ldap_mux_conn_t *mconn = &mux->conns[i];
+
+		if (!mconn->conn) {
+			if (!mconn->connecting && !dead) dead = mconn;
+			continue;
+		}
+
+		if (!best || (rbtree_num_elements(mconn->waiting) < rbtree_num_elements(best->waiting))) {
+			best = mconn;
+		}
+	}
+
+	if (!dead) return best;
+
+	dead->connecting = true;
+	pthread_mutex_unlock(&mux->mutex);
+
+	timeout.tv_sec = inst->res_timeout;
+	timeout.tv_usec = 0;
+	conn = rlm_ldap_conn_create(NULL, inst, &timeout, true);
+
+	pthread_mutex_lock(&mux->mutex);
+	dead->connecting = false;
+	if (!conn) return best;
+
+	dead->conn = conn;
+	mux_wake(mux);
+
+	return dead;
+}
+
+/** Perform a search on a shared connection
+ *
+ * Sends the search, then waits for the reader thread to receive the complete
+ * result, or for the result timeout to expire.
+ *
+ * The connection's mutex is held from sending the search until it's been
+ * added to the searches waiting for results, so the reader can't receive
+ * the result before anyone is waiting for it.
+ *
+ * @param[in] mux		to send the search on.
+ * @param[in] conn		pooled connection of the caller.  Only used to parse the result.
+ * @param[in] dn		to use as base for the search.
+ * @param[in] scope		to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter		to use, should be pre-escaped.
+ * @param[in] attrs		to retrieve.
+ * @param[in] serverctrls	Search controls to pass to the server.  May be NULL.
+ * @param[in] clientctrls	Search controls for ldap_search.  May be NULL.
+ * @param[in] timelimit		for the server to spend on the search.
+ * @param[out] result		Where to write the result.
+ * @param[out] error		Where to write the error string.
+ * @param[out] extra		Where to write additional error string to, must be freed
+ *				(with talloc_free).
+ * @return One of the LDAP_PROC_* (#ldap_rcode_t) values.
+ */
+ldap_rcode_t rlm_ldap_mux_search(rlm_ldap_mux_t *mux, ldap_handle_t const *conn,
+				 char const *dn, int scope, char const *filter, char **attrs,
+				 LDAPControl **serverctrls, LDAPControl **clientctrls, struct timeval *timelimit,
+				 LDAPMessage **result, char const **error, char **extra)
+{
+	rlm_ldap_t const	*inst = mux->inst;
+	rlm_ldap_mux_conn_t	*mconn;
+	rlm_ldap_mux_wait_t	wait;
+	LDAP			*handle;
+	struct timeval		now;
+	struct timespec		when;
+
+	memset(&wait, 0, sizeof(wait));
+	pthread_cond_init(&wait.cond, NULL);
+
+	pthread_mutex_lock(&mux->mutex);
+	mconn = mux_conn_get(mux);
+	pthread_mutex_unlock(&mux->mutex);
+	if (!mconn) {
+		wait.lib_errno = LDAP_SERVER_DOWN;
+		goto finish;
+	}
+
+	/*
+	 *	The connection may have failed while we weren't
+	 *	holding any locks.  Once we hold its mutex, the
+	 *	reader can't free it.
+	 */
+	pthread_mutex_lock(&mconn->mutex);
+	pthread_mutex_lock(&mux->mutex);
+	handle = mconn->conn ? mconn->conn->handle : NULL;
+	pthread_mutex_unlock(&mux->mutex);
+	if (!handle) {
+		pthread_mutex_unlock(&mconn->mutex);
+		wait.lib_errno = LDAP_SERVER_DOWN;
+		goto finish;
+	}
+
+	wait.lib_errno = ldap_search_ext(handle, dn, scope, filter, attrs,
+					 0, serverctrls, clientctrls, timelimit, 0, &wait.msgid);
+	if (wait.lib_errno != LDAP_SUCCESS) {
+		pthread_mutex_unlock(&mconn->mutex);
+		goto finish;
+	}
+
+	pthread_mutex_lock(&mux->mutex);
+	if (!rbtree_insert(mconn->waiting, &wait)) {
+		pthread_mutex_unlock(&mux->mutex);
+		ldap_abandon_ext(handle, wait.msgid, NULL, NULL);
+		pthread_mutex_unlock(&mconn->mutex);
+		wait.lib_errno = LDAP_NO_MEMORY;
+		goto finish;
+	}
+	pthread_mutex_unlock(&mconn->mutex);
+
+	gettimeofday(&now, NULL);
+	when.tv_sec = now.tv_sec + inst->res_timeout;
+	when.tv_nsec = now.tv_usec * 1000;
+
+	while (!wait.done) {
+		if (pthread_cond_timedwait(&wait.cond, &mux->mutex, &when) == ETIMEDOUT) break;
+	}
+
+	/*
+	 *	The reader hasn't finished with the search, so the
+	 *	connection is still open.  Stop waiting for it.
+	 *
+	 *	The connection's mutex has to be taken first, and
+	 *	the reader may finish while we're waiting for it.
+	 */
+	if (!wait.done) {
+		pthread_mutex_unlock(&mux->mutex);
+		pthread_mutex_lock(&mconn->mutex);
+		pthread_mutex_lock(&mux->mutex);
+
+		if (!wait.done) {
+			rbtree_deletebydata(mconn->waiting, &wait);
+			pthread_mutex_unlock(&mux->mutex);
+			ldap_abandon_ext(handle, wait.msgid, NULL, NULL);
+			pthread_mutex_unlock(&mconn->mutex);
+			wait.lib_errno = LDAP_TIMEOUT;
+			goto finish;
+		}
+		pthread_mutex_unlock(&mconn->mutex);
+	}
+	pthread_mutex_unlock(&mux->mutex);
+
+finish:
+	pthread_cond_destroy(&wait.cond);
+
+	*result = wait.result;
+
+	return rlm_ldap_result_parse(inst, conn, wait.lib_errno, dn, result, false, error, extra);
+}
+
+static int _mux_free(rlm_ldap_mux_t *mux)
+{
+	uint32_t i;
+
+	if (mux->running) {
+		pthread_mutex_lock(&mux->mutex);
+		mux->stop = true;
+		pthread_mutex_unlock(&mux->mutex);
+
+		mux_wake(mux);
+		pthread_join(mux->thread, NULL);
+	}
+
+	for (i = 0; i < mux->num_conns; i++) {
+		if (mux->conns[i].fd >= 0) fr_event_fd_delete(mux->el, 0, mux->conns[i].fd);
+		TALLOC_FREE(mux->conns[i].conn);
+		pthread_mutex_destroy(&mux->conns[i].mutex);
+	}
+
+	if (mux->wake[0] >= 0) close(mux->wake[0]);
+	if (mux->wake[1] >= 0) close(mux->wake[1]);
+
+	pthread_mutex_destroy(&mux->mutex);
+
+	return 0;
+}
+
+/** Open the shared connections, and start the reader thread
+ *
+ * Connections which can't be opened now are opened by the first search
+ * which needs them.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @return
+ *	- New multiplexer, to be freed when the instance is detached.
+ *	- NULL on error.
+ */
+rlm_ldap_mux_t *rlm_ldap_mux_init(rlm_ldap_t *inst)
+{
+	rlm_ldap_mux_t	*mux;
+	struct timeval	timeout;
+	uint32_t	i;
+
+	MEM(mux = talloc_zero(inst, rlm_ldap_mux_t));
+	mux->inst = inst;
+	mux->wake[0] = mux->wake[1] = -1;
+	pthread_mutex_init(&mux->mutex, NULL);
+	talloc_set_destructor(mux, _mux_free);
+
+	mux->num_conns = inst->multiplex_connections;
+	MEM(mux->conns = talloc_zero_array(mux, rlm_ldap_mux_conn_t, mux->num_conns));
+	for (i = 0; i < mux->num_conns; i++) {
+		mux->conns[i].mux = mux;
+		mux->conns[i].fd = -1;
+		pthread_mutex_init(&mux->conns[i].mutex, NULL);
+	}
+
+	mux->el = fr_event_list_create(mux, NULL);
+	if (!mux->el) {
+		ERROR("Failed creating event list: %s", fr_strerror());
+	error:
+		talloc_free(mux);
+		return NULL;
+	}
+
+	if (pipe(mux->wake) < 0) {
+		ERROR("Failed creating pipe: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if ((fr_nonblock(mux->wake[0]) < 0) || (fr_nonblock(mux->wake[1]) < 0) ||
+	    (fcntl(mux->wake[0], F_SETFD, FD_CLOEXEC) < 0) || (fcntl(mux->wake[1], F_SETFD, FD_CLOEXEC) < 0)) {
+		ERROR("Failed configuring pipe: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (!fr_event_fd_insert(mux->el, 0, mux->wake[0], mux_wake_read, mux)) {
+		ERROR("Failed watching pipe: %s", fr_strerror());
+		goto error;
+	}
+
+	timeout.tv_sec = inst->res_timeout;
+	timeout.tv_usec = 0;
+
+	for (i = 0; i < mux->num_conns; i++) {
+		rlm_ldap_mux_conn_t *mconn = &mux->conns[i];
+
+		MEM(mconn->waiting = rbtree_create(mux, mux_wait_cmp, NULL, RBTREE_FLAG_NONE));
+
+		mconn->conn = rlm_ldap_conn_create(NULL, inst, &timeout, true);
+		if (!mconn->conn) {
+			WARN("Failed opening multiplexed connection %u, will retry when it's needed", i);
+			continue;
+		}
+
+		if ((ldap_get_option(mconn->conn->handle, LDAP_OPT_DESC, &mconn->fd) != LDAP_OPT_SUCCESS) ||
+		    (mconn->fd < 0) || !fr_event_fd_insert(mux->el, 0, mconn->fd, mux_conn_read, mconn)) {
+			ERROR("Failed watching multiplexed connection");
+			goto error;
+		}
+	}
+
+	if (pthread_create(&mux->thread, NULL, mux_thread, mux) != 0) {
+		ERROR("Failed creating multiplexer thread: %s", fr_syserror(errno));
+		goto error;
+	}
+	mux->running = true;
+
+	return mux;
+}
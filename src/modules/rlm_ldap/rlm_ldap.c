@@ -136,6 +136,16 @@ static CONF_PARSER user_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Group membership cache configuration
+ */
+static CONF_PARSER group_cache_config[] = {
+	{ FR_CONF_OFFSET("lifetime", PW_TYPE_INTEGER, rlm_ldap_t, group_cache_lifetime), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_lifetime", PW_TYPE_INTEGER, rlm_ldap_t, group_cache_negative_lifetime), .dflt = "60" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_ldap_t, group_cache_max_entries), .dflt = "16384" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	Group configuration
  */
@@ -151,6 +161,8 @@ static CONF_PARSER group_config[] = {
 	{ FR_CONF_OFFSET("cacheable_dn", PW_TYPE_BOOLEAN, rlm_ldap_t, cacheable_group_dn), .dflt = "no" },
 	{ FR_CONF_OFFSET("cache_attribute", PW_TYPE_STRING, rlm_ldap_t, cache_attribute) },
 	{ FR_CONF_OFFSET("group_attribute", PW_TYPE_STRING, rlm_ldap_t, group_attribute) },
+
+	{ FR_CONF_POINTER("cache", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) group_cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -215,6 +227,14 @@ static CONF_PARSER option_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Searches sent over shared connections.
+ */
+static CONF_PARSER multiplex_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, rlm_ldap_t, multiplex), .dflt = "no" },
+	{ FR_CONF_OFFSET("connections", PW_TYPE_INTEGER, rlm_ldap_t, multiplex_connections), .dflt = "2" },
+	CONF_PARSER_TERMINATOR
+};
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("server", PW_TYPE_STRING | PW_TYPE_MULTI, rlm_ldap_t, config_server) },	/* Do not set to required */
@@ -250,6 +270,8 @@ static const CONF_PARSER module_config[] = {
 
 	{ FR_CONF_POINTER("options", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) option_config },
 
+	{ FR_CONF_POINTER("multiplex", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) multiplex_config },
+
 	{ FR_CONF_POINTER("tls", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) tls_config },
 	CONF_PARSER_TERMINATOR
 };
@@ -268,6 +290,29 @@ static ssize_t ldap_unescape_xlat(char **out, size_t outlen,
 	return rlm_ldap_unescape_func(request, *out, outlen, fmt, NULL);
 }
 
+/** Remove a user's group memberships from the group membership cache
+ *
+ * An empty string removes every user.  Returns the number of users removed.
+ *
+@verbatim
+%{<inst>_group_flush:<user dn>}
+@endverbatim
+ */
+static ssize_t ldap_group_flush_xlat(char **out, size_t outlen,
+				     void const *mod_inst, UNUSED void const *xlat_inst,
+				     REQUEST *request, char const *fmt)
+{
+	rlm_ldap_t const	*inst = mod_inst;
+	uint32_t		count;
+
+	while (isspace((int) *fmt)) fmt++;
+
+	count = rlm_ldap_group_cache_flush(inst, *fmt ? fmt : NULL);
+	RDEBUG2("Removed %u user(s) from the group cache", count);
+
+	return snprintf(*out, outlen, "%u", count);
+}
+
 /** Expand an LDAP URL into a query, and return a string result from that query.
  *
  */
@@ -531,9 +576,11 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	bool		found = false;
 	bool		check_is_dn;
+	bool		definitive = false;
 
 	ldap_handle_t	*conn = NULL;
-	char const	*user_dn;
+	char const	*user_dn = NULL;
+	VALUE_PAIR	*vp;
 
 	rad_assert(inst->groupobj_base_dn);
 
@@ -574,6 +621,25 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 		}
 	}
 
+	/*
+	 *	Check if a previous request found the answer.
+	 */
+	vp = fr_pair_find_by_num(request->control, 0, PW_LDAP_USERDN, TAG_ANY);
+	if (vp) {
+		switch (rlm_ldap_group_cache_check(inst, request, vp->vp_strvalue, check)) {
+		case RLM_MODULE_NOTFOUND:
+			found = false;
+			goto finish;
+
+		case RLM_MODULE_OK:
+			found = true;
+			goto finish;
+
+		default:
+			break;
+		}
+	}
+
 	conn = mod_conn_get(inst, request);
 	if (!conn) return 1;
 
@@ -588,6 +654,21 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	rad_assert(conn);
 
+	if (!vp) {
+		switch (rlm_ldap_group_cache_check(inst, request, user_dn, check)) {
+		case RLM_MODULE_NOTFOUND:
+			found = false;
+			goto finish;
+
+		case RLM_MODULE_OK:
+			found = true;
+			goto finish;
+
+		default:
+			break;
+		}
+	}
+
 	/*
 	 *	Check groupobj user membership
 	 */
@@ -598,6 +679,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
+			definitive = true;
 
 		default:
 			goto finish;
@@ -616,6 +698,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
+			definitive = true;
 
 		default:
 			goto finish;
@@ -624,9 +707,16 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	rad_assert(conn);
 
+	/*
+	 *	Every configured method said the user isn't a member.
+	 */
+	definitive = true;
+
 finish:
 	if (conn) mod_conn_release(inst, request, conn);
 
+	if (definitive) rlm_ldap_group_cache_add(inst, request, user_dn, check, found);
+
 	if (!found) {
 		RDEBUG("User is not a member of \"%s\"", check->vp_strvalue);
 
@@ -660,6 +750,13 @@ static int mod_detach(void *instance)
 	if (inst->userobj_sort_ctrl) ldap_control_free(inst->userobj_sort_ctrl);
 #endif
 
+	/*
+	 *	Stop the reader thread before the connections
+	 *	are closed.
+	 */
+	TALLOC_FREE(inst->mux);
+	TALLOC_FREE(inst->group_cache);
+
 	pthread_mutex_destroy(&inst->directory_mutex);
 
 	fr_connection_pool_free(inst->pool);
@@ -768,6 +865,9 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 
 	xlat_register(inst, "ldap_escape", ldap_escape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register(inst, "ldap_unescape", ldap_unescape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+
+	snprintf(buffer, sizeof(buffer), "%s_group_flush", inst->name);
+	xlat_register(inst, buffer, ldap_group_flush_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	map_proc_register(inst, inst->name, mod_map_proc, NULL, NULL, 0);
 
 	return 0;
@@ -875,6 +975,18 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		}
 	}
 
+	/*
+	 *	Group membership cache.
+	 */
+	if (inst->group_cache_lifetime) {
+		FR_INTEGER_BOUND_CHECK("group.cache.max_entries", inst->group_cache_max_entries, >=, 1);
+		if (inst->group_cache_negative_lifetime > inst->group_cache_lifetime) {
+			inst->group_cache_negative_lifetime = inst->group_cache_lifetime;
+		}
+
+		if (rlm_ldap_group_cache_init(inst) < 0) goto error;
+	}
+
 	/*
 	 *	If we have a *pair* as opposed to a *section*
 	 *	then the module is referencing another ldap module's
@@ -1273,6 +1385,18 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	if (rlm_ldap_global_init(inst) < 0) goto error;
 
+	/*
+	 *	Open the shared connections before the pool, so
+	 *	the pool doesn't need connections for searches.
+	 */
+	if (inst->multiplex) {
+		FR_INTEGER_BOUND_CHECK("multiplex.connections", inst->multiplex_connections, >=, 1);
+		FR_INTEGER_BOUND_CHECK("multiplex.connections", inst->multiplex_connections, <=, 64);
+
+		inst->mux = rlm_ldap_mux_init(inst);
+		if (!inst->mux) goto error;
+	}
+
 	/*
 	 *	Initialize the socket pool.
 	 */
@@ -1585,7 +1709,8 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 	/*
 	 *	Check if we need to cache group memberships
 	 */
-	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
+	if ((inst->cacheable_group_dn || inst->cacheable_group_name) &&
+	    (rlm_ldap_group_cache_expand(inst, request, dn) != RLM_MODULE_OK)) {
 		if (inst->userobj_membership_attr) {
 			rcode = rlm_ldap_cacheable_userobj(inst, request, &conn, entry, inst->userobj_membership_attr);
 			if (rcode != RLM_MODULE_OK) {
@@ -1597,6 +1722,8 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		if (rcode != RLM_MODULE_OK) {
 			goto finish;
 		}
+
+		rlm_ldap_group_cache_add_complete(inst, request, dn);
 	}
 
 #ifdef WITH_EDIR
@@ -1615,6 +1742,21 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		char password[256];
 		size_t pass_size = sizeof(password);
 
+		/*
+		 *	The user object may have been found using a
+		 *	multiplexed connection, in which case this one
+		 *	may not be bound as the admin user yet.
+		 */
+		if (conn->rebound) {
+			status = rlm_ldap_bind(inst, request, &conn, inst->admin_identity, inst->admin_password,
+					       &inst->admin_sasl, true, NULL, NULL, NULL);
+			if (status != LDAP_PROC_SUCCESS) {
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
+			}
+			conn->rebound = false;
+		}
+
 		/*
 		 *	Retrive universal password
 		 */
@@ -138,6 +138,10 @@ extern FR_NAME_NUMBER const ldap_supported_extensions[];
 
 typedef struct ldap_instance rlm_ldap_t;
 
+typedef struct rlm_ldap_mux rlm_ldap_mux_t;
+
+typedef struct rlm_ldap_group_cache rlm_ldap_group_cache_t;
+
 typedef struct ldap_acct_section {
 	CONF_SECTION	*cs;				//!< Section configuration.
 
@@ -309,6 +313,13 @@ struct ldap_instance {
 	fr_dict_attr_t const	*group_da;		//!< The DA associated with this specific instance of the
 							//!< rlm_ldap module.
 
+	uint32_t	group_cache_lifetime;		//!< How long group memberships are cached for, across
+							//!< requests.  0 disables the cache.
+	uint32_t	group_cache_negative_lifetime;	//!< How long to remember that a user is not a member of
+							//!< a group.
+	uint32_t	group_cache_max_entries;	//!< Maximum number of users to cache memberships for.
+	rlm_ldap_group_cache_t *group_cache;		//!< Memberships of recently seen users.
+
 	/*
 	 *	Dynamic clients
 	 */
@@ -400,6 +411,14 @@ struct ldap_instance {
 	uint32_t	keepalive_interval;		//!< Interval between keepalive probes.
 #endif
 
+	/*
+	 *	Multiplexed searches
+	 */
+	bool		multiplex;			//!< If true, searches are sent over a small set of shared
+							//!< connections, with many searches outstanding on each.
+	uint32_t	multiplex_connections;		//!< Number of shared connections to open.
+	rlm_ldap_mux_t	*mux;				//!< Shared connections and the thread reading from them.
+
 	LDAP		*handle;			//!< Hack for OpenLDAP libldap global initialisation.
 };
 
@@ -497,6 +516,9 @@ void rlm_ldap_check_reply(rlm_ldap_t const *inst, REQUEST *request);
 /*
  *	ldap.c - Callbacks for the connection pool API.
  */
+ldap_rcode_t rlm_ldap_result_parse(rlm_ldap_t const *inst, ldap_handle_t const *conn, int lib_errno, char const *dn,
+				   LDAPMessage **result, bool freeit, char const **error, char **extra);
+
 ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst, ldap_handle_t const *conn, int msgid, char const *dn,
 			     struct timeval const *timeout,
 			     LDAPMessage **result, char const **error, char **extra);
@@ -505,6 +527,8 @@ char *rlm_ldap_berval_to_string(TALLOC_CTX *ctx, struct berval const *in);
 
 int rlm_ldap_global_init(rlm_ldap_t *inst) CC_HINT(nonnull);
 
+ldap_handle_t *rlm_ldap_conn_create(TALLOC_CTX *ctx, rlm_ldap_t *inst, struct timeval const *timeout, bool bind);
+
 void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
 
 ldap_handle_t *mod_conn_get(rlm_ldap_t const *inst, REQUEST *request);
@@ -527,6 +551,20 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 
 rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALUE_PAIR *check);
 
+int rlm_ldap_group_cache_init(rlm_ldap_t *inst);
+
+rlm_rcode_t rlm_ldap_group_cache_check(rlm_ldap_t const *inst, REQUEST *request, char const *user_dn,
+				       VALUE_PAIR const *check);
+
+void rlm_ldap_group_cache_add(rlm_ldap_t const *inst, REQUEST *request, char const *user_dn,
+			      VALUE_PAIR const *check, bool member);
+
+void rlm_ldap_group_cache_add_complete(rlm_ldap_t const *inst, REQUEST *request, char const *user_dn);
+
+rlm_rcode_t rlm_ldap_group_cache_expand(rlm_ldap_t const *inst, REQUEST *request, char const *user_dn);
+
+uint32_t rlm_ldap_group_cache_flush(rlm_ldap_t const *inst, char const *user_dn);
+
 /*
  *	attrmap.c - Attribute mapping code.
  */
@@ -568,6 +606,16 @@ int rlm_ldap_control_add_session_tracking(ldap_handle_t *conn, REQUEST *request)
  */
 int rlm_ldap_directory_alloc(TALLOC_CTX *ctx, ldap_directory_t **out, rlm_ldap_t *inst, ldap_handle_t **pconn);
 
+/*
+ *	mux.c - Multiplexed searches
+ */
+rlm_ldap_mux_t *rlm_ldap_mux_init(rlm_ldap_t *inst);
+
+ldap_rcode_t rlm_ldap_mux_search(rlm_ldap_mux_t *mux, ldap_handle_t const *conn,
+				 char const *dn, int scope, char const *filter, char **attrs,
+				 LDAPControl **serverctrls, LDAPControl **clientctrls, struct timeval *timelimit,
+				 LDAPMessage **result, char const **error, char **extra);
+
 /*
  *	edir.c - Magic extensions for Novell
  */
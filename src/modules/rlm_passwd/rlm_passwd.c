@@ -28,6 +28,9 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/reload.h>
+
+#include <sys/stat.h>
 
 struct mypasswd {
 	struct mypasswd *next;
@@ -348,9 +351,12 @@ int main(void){
 
 #else  /* TEST */
 typedef struct rlm_passwd_t {
-	struct hashtable	*ht;
+	char const		*name;
+	reload_t		*ht;
+	reload_t		*index;		//!< Mapped fr_file_index_t, used instead of ht if index_file is set.
 	struct mypasswd		*pwdfmt;
 	char const		*filename;
+	char const		*index_file;
 	char const		*format;
 	char const		*delimiter;
 	bool			allow_multiple;
@@ -361,10 +367,12 @@ typedef struct rlm_passwd_t {
 	uint32_t		listable;
 	fr_dict_attr_t const		*keyattr;
 	bool			ignore_empty;
+	uint32_t		reload_interval;
 } rlm_passwd_t;
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", PW_TYPE_FILE_INPUT | PW_TYPE_REQUIRED, rlm_passwd_t, filename) },
+	{ FR_CONF_OFFSET("index", PW_TYPE_FILE_INPUT, rlm_passwd_t, index_file) },
 	{ FR_CONF_OFFSET("format", PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_passwd_t, format) },
 	{ FR_CONF_OFFSET("delimiter", PW_TYPE_STRING, rlm_passwd_t, delimiter), .dflt = ":" },
 
@@ -375,9 +383,68 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", PW_TYPE_BOOLEAN, rlm_passwd_t, allow_multiple), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("hash_size", PW_TYPE_INTEGER, rlm_passwd_t, hash_size), .dflt = "100" },
+
+	{ FR_CONF_OFFSET("reload_interval", PW_TYPE_INTEGER, rlm_passwd_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Build the hash table, for reload_init().
+ */
+static void *passwd_load(char const *filename, void *uctx)
+{
+	rlm_passwd_t *inst = uctx;
+
+	return build_hash_table(filename, inst->nfields, inst->keyfield, inst->listable,
+				inst->hash_size, inst->ignore_nislike, *inst->delimiter);
+}
+
+static void passwd_free(void *data, UNUSED void *uctx)
+{
+	release_ht(data);
+}
+
+/*
+ *	Map an index built by radindex, for reload_init().
+ */
+static void *passwd_index_load(char const *filename, void *uctx)
+{
+	rlm_passwd_t		*inst = uctx;
+	fr_file_index_t		*idx;
+	fr_file_index_info_t	info;
+	struct stat		st;
+
+	idx = fr_file_index_open(NULL, filename);
+	if (!idx) {
+		ERROR("%s", fr_strerror());
+		return NULL;
+	}
+
+	fr_file_index_info(idx, &info);
+	if ((info.key_field != inst->keyfield) || (info.delimiter != *inst->delimiter) ||
+	    (info.flags & FR_FILE_INDEX_QUOTED) ||
+	    (!(info.flags & FR_FILE_INDEX_LIST_KEYS) != !inst->listable) ||
+	    (!(info.flags & FR_FILE_INDEX_IGNORE_NIS) != !inst->ignore_nislike)) {
+		ERROR("Index %s does not match the configuration.  Rebuild it with "
+		      "'radindex -d %c -k %u%s%s %s'", filename, *inst->delimiter, inst->keyfield + 1,
+		      inst->listable ? " -l" : "", inst->ignore_nislike ? " -n" : "", inst->filename);
+		talloc_free(idx);
+		return NULL;
+	}
+
+	if ((stat(inst->filename, &st) == 0) &&
+	    ((st.st_mtime != info.source_mtime) || ((uint64_t) st.st_size != info.source_size))) {
+		WARN("Index %s is out of date with respect to %s", filename, inst->filename);
+	}
+
+	return idx;
+}
+
+static void passwd_index_free(void *data, UNUSED void *uctx)
+{
+	talloc_free(data);
+}
+
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	int nfields=0, keyfield=-1, listable=0;
@@ -391,6 +458,9 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	rad_assert(inst->filename && *inst->filename);
 	rad_assert(inst->format && *inst->format);
 
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
 	if (inst->hash_size == 0) {
 		cf_log_err_cs(conf, "Invalid value '0' for hash_size");
 		return -1;
@@ -431,20 +501,12 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 			      inst->format);
 		return -1;
 	}
-	if (! (inst->ht = build_hash_table (inst->filename, nfields, keyfield, listable, inst->hash_size, inst->ignore_nislike, *inst->delimiter)) ){
-		ERROR("Can't build hashtable from passwd file");
-		return -1;
-	}
 	if (! (inst->pwdfmt = mypasswd_alloc(inst->format, nfields, &len)) ){
 		ERROR("Memory allocation failed");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 	if (!string_to_entry(inst->format, nfields, ':', inst->pwdfmt , len)) {
 		ERROR("Unable to convert format entry");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -459,14 +521,10 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	}
 	if (!*inst->pwdfmt->field[keyfield]) {
 		cf_log_err_cs(conf, "key field is empty");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 	if (!(da = fr_dict_attr_by_name(NULL, inst->pwdfmt->field[keyfield]))) {
 		ERROR("Unable to resolve attribute: %s", inst->pwdfmt->field[keyfield]);
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -475,6 +533,26 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->keyfield = keyfield;
 	inst->listable = listable;
 
+	/*
+	 *	Use the pre-built index if there is one, and
+	 *	otherwise read the whole file.
+	 */
+	if (inst->index_file) {
+		inst->index = reload_init(inst, inst->name, inst->index_file, inst->reload_interval,
+					  passwd_index_load, passwd_index_free, inst);
+		if (!inst->index) {
+			ERROR("Can't load index %s", inst->index_file);
+			return -1;
+		}
+	} else {
+		inst->ht = reload_init(inst, inst->name, inst->filename, inst->reload_interval,
+				       passwd_load, passwd_free, inst);
+		if (!inst->ht) {
+			ERROR("Can't build hashtable from passwd file");
+			return -1;
+		}
+	}
+
 	DEBUG3("nfields: %d keyfield %d(%s) listable: %s", nfields, keyfield,
 	       inst->pwdfmt->field[keyfield], listable ? "yes" : "no");
 
@@ -485,10 +563,11 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 static int mod_detach (void *instance) {
 #define inst ((rlm_passwd_t *)instance)
-	if(inst->ht) {
-		release_ht(inst->ht);
-		inst->ht = NULL;
-	}
+	/*
+	 *	Stop the reload thread before the config it uses is freed.
+	 */
+	TALLOC_FREE(inst->ht);
+	TALLOC_FREE(inst->index);
 	talloc_free(inst->pwdfmt);
 	return 0;
 #undef inst
@@ -513,6 +592,39 @@ static void addresult (TALLOC_CTX *ctx, rlm_passwd_t *inst, REQUEST *request,
 	}
 }
 
+/*
+ *	Add the results for every line in the index with the given key.
+ */
+static bool passwd_index_map(rlm_passwd_t *inst, REQUEST *request, fr_file_index_t const *idx, char const *name)
+{
+	uint64_t	iter = 0;
+	char const	*line;
+	size_t		len;
+	struct mypasswd	*pw;
+	bool		found = false;
+
+	while ((line = fr_file_index_find(idx, &iter, name, strlen(name), NULL))) {
+		/*
+		 *	The line is in read-only memory, so it's
+		 *	copied when it's split into fields.
+		 */
+		pw = mypasswd_alloc(line, inst->nfields, &len);
+		if (!string_to_entry(line, inst->nfields, *inst->delimiter, pw, len)) {
+			talloc_free(pw);
+			continue;
+		}
+
+		addresult(request, inst, request, &request->control, pw, 0, "config");
+		addresult(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
+		addresult(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
+		talloc_free(pw);
+
+		found = true;
+	}
+
+	return found;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, REQUEST *request)
 {
 #define inst ((rlm_passwd_t *)instance)
@@ -520,12 +632,24 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, REQUEST *requ
 	VALUE_PAIR *key, *i;
 	struct mypasswd * pw, *last_found;
 	vp_cursor_t cursor;
+	struct hashtable *ht = NULL;
+	fr_file_index_t *idx = NULL;
+	reload_t *rl;
+	unsigned int ref;
 
 	key = fr_pair_find_by_da(request->packet->vps, inst->keyattr, TAG_ANY);
 	if (!key) {
 		return RLM_MODULE_NOTFOUND;
 	}
 
+	if (inst->index) {
+		rl = inst->index;
+		idx = reload_acquire(rl, &ref);
+	} else {
+		rl = inst->ht;
+		ht = reload_acquire(rl, &ref);
+	}
+
 	for (i = fr_cursor_init(&cursor, &key);
 	     i;
 	     i = fr_cursor_next_by_num(&cursor, inst->keyattr->vendor, inst->keyattr->attr, TAG_ANY)) {
@@ -533,20 +657,26 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, REQUEST *requ
 		 *	Ensure we have the string form of the attribute
 		 */
 		fr_pair_value_snprint(buffer, sizeof(buffer), i, 0);
-		if (!(pw = get_pw_nam(buffer, inst->ht, &last_found)) ) {
-			continue;
+		if (idx) {
+			if (!passwd_index_map(inst, request, idx, buffer)) continue;
+		} else {
+			if (!(pw = get_pw_nam(buffer, ht, &last_found)) ) {
+				continue;
+			}
+			do {
+				addresult(request, inst, request, &request->control, pw, 0, "config");
+				addresult(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
+				addresult(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
+			} while ((pw = get_next(buffer, ht, &last_found)));
 		}
-		do {
-			addresult(request, inst, request, &request->control, pw, 0, "config");
-			addresult(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
-			addresult(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
-		} while ((pw = get_next(buffer, inst->ht, &last_found)));
 
 		if (!inst->allow_multiple) {
 			break;
 		}
 	}
 
+	reload_release(rl, ref);
+
 	return RLM_MODULE_OK;
 
 #undef inst
@@ -1587,6 +1587,27 @@ static cluster_key_slot_t *cluster_slot_by_key(fr_redis_cluster_t *cluster, REQU
 	return &cluster->key_slot[0];
 }
 
+/** Resolve a key to the ID of the node which currently serves it
+ *
+ * Used to group commands which will be sent to the same node.  The mapping may
+ * change at any time, so callers must still follow redirects.
+ *
+ * @param[in] cluster to resolve key in.
+ * @param[in] request The current request.
+ * @param[in] key to resolve.  If NULL or key_len is 0 a random slot will be chosen.
+ * @param[in] key_len Length of the key.
+ * @return
+ *	- The ID of the master node for the key's slot.
+ *	- -1 if there are no nodes in the cluster.
+ */
+int fr_redis_cluster_node_id_by_key(fr_redis_cluster_t *cluster, REQUEST *request,
+				    uint8_t const *key, size_t key_len)
+{
+	if (rbtree_num_elements(cluster->used_nodes) == 0) return -1;
+
+	return cluster_slot_by_key(cluster, request, key, key_len)->master;
+}
+
 /** Resolve a key to a pool, and reserve a connection in that pool
  *
  * This should be used with #fr_redis_cluster_state_next, and #fr_redis_command_status, to
@@ -75,6 +75,12 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 					     fr_redis_cluster_t *cluster, REQUEST *request,
 					     fr_redis_rcode_t status, redisReply **reply);
 
+/*
+ *	Group commands by the node they'll be sent to.
+ */
+int fr_redis_cluster_node_id_by_key(fr_redis_cluster_t *cluster, REQUEST *request,
+				    uint8_t const *key, size_t key_len);
+
 /*
  *	Useful for running commands over every node, such as PING
  *	or KEYS.
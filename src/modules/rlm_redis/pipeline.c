@@ -0,0 +1,297 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file pipeline.c
+ * @brief Send commands from concurrent requests to a Redis cluster node in one pipeline.
+ *
+ * Commands for each node are grouped by a shared batch queue (see
+ * main/batch.c), and each group is sent using one connection, and one
+ * round trip.
+ *
+ * Each waiting request is given the reply to its own command.  Commands which
+ * are redirected, or which need a script loaded, aren't retried in the
+ * pipeline.  The requests which issued them are told to send them on their
+ * own, so the normal cluster code can deal with them.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/batch.h>
+
+#include "pipeline.h"
+
+/*
+ *	A command waiting to be sent.  Lives on the stack of the
+ *	request waiting for it.
+ */
+typedef struct redis_pipeline_entry {
+	uint8_t const		*key;		//!< Key the command operates on.
+	size_t			key_len;	//!< Length of the key.
+	char const		*cmd;		//!< Command in the redis protocol format.
+	size_t			cmd_len;	//!< Length of the command.
+
+	redisReply		*reply;		//!< Reply to the command.
+	fr_redis_rcode_t	status;		//!< Result of the command, or #REDIS_RCODE_TRY_AGAIN
+						//!< if it should be sent on its own.
+	bool			sent;		//!< Sent on the current connection.
+	bool			answered;	//!< A reply to the command has been received.
+} redis_pipeline_entry_t;
+
+struct fr_redis_pipeline {
+	fr_redis_cluster_t	*cluster;	//!< Cluster the commands are sent to.
+
+	uint32_t		wait_num;	//!< How many slaves must acknowledge the commands.
+	uint32_t		wait_timeout;	//!< How long to wait for slaves to acknowledge (ms).
+
+	fr_batch_t		**node;		//!< Pipelines, indexed by node ID.
+};
+
+static void redis_pipeline_run(REQUEST *request, fr_batch_entry_t *list, uint32_t num, void *uctx);
+
+/** Allocate pipelines for a cluster
+ *
+ * @param[in] ctx to allocate the pipelines in.
+ * @param[in] cluster to send commands to.
+ * @param[in] max_size Maximum number of commands per pipeline.
+ * @param[in] max_latency Maximum time a command waits for a running pipeline to finish.
+ * @param[in] wait_num If non-zero, a WAIT is sent after each pipeline, and the commands
+ *	in it fail if fewer than this many slaves acknowledge them.
+ * @param[in] wait_timeout How long the WAIT blocks for, in milliseconds.
+ * @return new pipelines.
+ */
+fr_redis_pipeline_t *fr_redis_pipeline_alloc(TALLOC_CTX *ctx, fr_redis_cluster_t *cluster,
+					     uint32_t max_size, struct timeval const *max_latency,
+					     uint32_t wait_num, uint32_t wait_timeout)
+{
+	fr_redis_pipeline_t	*pipeline;
+	int			i;
+
+	MEM(pipeline = talloc_zero(ctx, fr_redis_pipeline_t));
+	pipeline->cluster = cluster;
+	pipeline->wait_num = wait_num;
+	pipeline->wait_timeout = wait_timeout;
+
+	/*
+	 *	Node IDs are 8 bit, so there's a fixed maximum.
+	 */
+	MEM(pipeline->node = talloc_zero_array(pipeline, fr_batch_t *, UINT8_MAX + 1));
+	for (i = 0; i <= UINT8_MAX; i++) {
+		pipeline->node[i] = fr_batch_alloc(pipeline->node, max_size, max_latency,
+						   redis_pipeline_run, pipeline);
+	}
+
+	return pipeline;
+}
+
+/*
+ *	Commands which succeeded in the last round can't be
+ *	trusted to have been replicated.
+ */
+static void redis_pipeline_unreplicated(fr_batch_entry_t *list)
+{
+	fr_batch_entry_t	*item;
+	redis_pipeline_entry_t	*entry;
+
+	for (item = list; item; item = item->next) {
+		entry = item->data;
+		if (!entry->sent || !entry->answered || (entry->status != REDIS_RCODE_SUCCESS)) continue;
+
+		fr_redis_reply_free(entry->reply);
+		entry->reply = NULL;
+		entry->status = REDIS_RCODE_ERROR;
+	}
+}
+
+/*
+ *	Send every command which hasn't been answered yet, and
+ *	read the replies.
+ *
+ *	Returns REDIS_RCODE_RECONNECT if the connection failed,
+ *	in which case the commands which weren't answered are
+ *	sent again on a new connection.
+ */
+static fr_redis_rcode_t redis_pipeline_send(fr_redis_pipeline_t *pipeline, REQUEST *request,
+					    fr_redis_conn_t *conn, fr_batch_entry_t *list)
+{
+	fr_batch_entry_t	*item;
+	redis_pipeline_entry_t	*entry;
+	redisReply		*reply;
+	fr_redis_rcode_t	status, ret = REDIS_RCODE_SUCCESS;
+	int			pipelined = 0;
+
+	for (item = list; item; item = item->next) {
+		entry = item->data;
+		entry->sent = false;
+		if (entry->answered) continue;
+
+		redisAppendFormattedCommand(conn->handle, entry->cmd, entry->cmd_len);
+		entry->sent = true;
+		pipelined++;
+	}
+	if (pipeline->wait_num) {
+		redisAppendCommand(conn->handle, "WAIT %i %i", pipeline->wait_num, pipeline->wait_timeout);
+	}
+
+	RDEBUG3("Sending %i pipelined commands", pipelined);
+
+	for (item = list; item; item = item->next) {
+		entry = item->data;
+		if (!entry->sent) continue;
+
+		reply = NULL;	/* redisGetReply doesn't NULLify reply on error */
+		(void) redisGetReply(conn->handle, (void **)&reply);
+		status = fr_redis_command_status(conn, reply);
+
+		/*
+		 *	The connection's unusable, and we don't
+		 *	know what happened to the rest.
+		 */
+		if (!reply) {
+			if (pipeline->wait_num) redis_pipeline_unreplicated(list);
+			return REDIS_RCODE_RECONNECT;
+		}
+
+		entry->answered = true;
+
+		switch (status) {
+		case REDIS_RCODE_SUCCESS:
+		case REDIS_RCODE_ERROR:
+			entry->status = status;
+			entry->reply = reply;
+			break;
+
+		/*
+		 *	Redirects and missing scripts are dealt
+		 *	with by the request that sent the command.
+		 */
+		default:
+			RDEBUG3("Pipelined command returned %s, it will be sent on its own",
+				fr_int2str(redis_rcodes, status, "<UNKNOWN>"));
+			fr_redis_reply_free(reply);
+			break;
+		}
+	}
+
+	if (!pipeline->wait_num) return REDIS_RCODE_SUCCESS;
+
+	reply = NULL;
+	(void) redisGetReply(conn->handle, (void **)&reply);
+	status = fr_redis_command_status(conn, reply);
+	if (!reply) {
+		ret = REDIS_RCODE_RECONNECT;
+		goto unreplicated;
+	}
+
+	if (status != REDIS_RCODE_SUCCESS) {
+		REDEBUG("WAIT failed: %s", fr_strerror());
+		goto unreplicated;
+	}
+	if (reply->type != REDIS_REPLY_INTEGER) {
+		REDEBUG("WAIT result is wrong type, expected integer got %s",
+			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+		goto unreplicated;
+	}
+	if (reply->integer < pipeline->wait_num) {
+		REDEBUG("Too few slaves acknowledged pipelined commands, needed %i, got %lli",
+			pipeline->wait_num, reply->integer);
+		goto unreplicated;
+	}
+	fr_redis_reply_free(reply);
+
+	return REDIS_RCODE_SUCCESS;
+
+unreplicated:
+	fr_redis_reply_free(reply);
+	redis_pipeline_unreplicated(list);
+
+	return ret;
+}
+
+/*
+ *	Send every command in a pipeline.
+ */
+static void redis_pipeline_run(REQUEST *request, fr_batch_entry_t *list, uint32_t num, void *uctx)
+{
+	fr_redis_pipeline_t		*pipeline = uctx;
+	redis_pipeline_entry_t		*first = list->data;
+	fr_redis_cluster_state_t	state;
+	fr_redis_conn_t			*conn;
+	fr_redis_rcode_t		s_ret, status;
+	redisReply			*reply = NULL;
+
+	RDEBUG2("Sending pipeline of %u commands", num);
+
+	/*
+	 *	Every key mapped to the same node when it was added,
+	 *	so the first one is as good as any.
+	 */
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, pipeline->cluster, request,
+						 first->key, first->key_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, pipeline->cluster, request, status, &reply)) {
+		status = redis_pipeline_send(pipeline, request, conn, list);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) RWDEBUG("Pipeline failed, unanswered commands will be sent on their own");
+}
+
+/** Send a command as part of a pipeline
+ *
+ * Blocks until the pipeline containing the command has been sent.
+ *
+ * @param[out] out Where to write the reply.  Must be freed by the caller.
+ * @param[in] pipeline to add the command to.
+ * @param[in] request The current request.
+ * @param[in] key the command operates on, used to find the node to send it to.
+ * @param[in] key_len Length of the key.
+ * @param[in] cmd Command, as formatted by redisFormatCommand.
+ * @param[in] cmd_len Length of the command.
+ * @return
+ *	- #REDIS_RCODE_SUCCESS - on success, the reply is written to out.
+ *	- #REDIS_RCODE_ERROR - if the command failed.  The error reply (if any) is
+ *	  written to out.
+ *	- #REDIS_RCODE_TRY_AGAIN - if the command should be sent on its own, using
+ *	  #fr_redis_cluster_state_init and #fr_redis_cluster_state_next.
+ */
+fr_redis_rcode_t fr_redis_pipeline_command(redisReply **out, fr_redis_pipeline_t *pipeline, REQUEST *request,
+					   uint8_t const *key, size_t key_len,
+					   char const *cmd, size_t cmd_len)
+{
+	fr_batch_entry_t	item;
+	redis_pipeline_entry_t	entry;
+	int			node_id;
+
+	*out = NULL;
+
+	node_id = fr_redis_cluster_node_id_by_key(pipeline->cluster, request, key, key_len);
+	if (node_id < 0) return REDIS_RCODE_TRY_AGAIN;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.key = key;
+	entry.key_len = key_len;
+	entry.cmd = cmd;
+	entry.cmd_len = cmd_len;
+	entry.status = REDIS_RCODE_TRY_AGAIN;
+
+	fr_batch_add(pipeline->node[node_id], request, &item, &entry);
+
+	*out = entry.reply;
+	return entry.status;
+}
@@ -0,0 +1,42 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file pipeline.h
+ * @brief Send commands from concurrent requests to a Redis cluster node in one pipeline.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+
+#ifndef LIBFREERADIUS_REDIS_PIPELINE_H
+#define	LIBFREERADIUS_REDIS_PIPELINE_H
+
+RCSIDH(pipeline_h, "$Id$")
+
+#include "redis.h"
+#include "cluster.h"
+
+typedef struct fr_redis_pipeline fr_redis_pipeline_t;
+
+fr_redis_pipeline_t	*fr_redis_pipeline_alloc(TALLOC_CTX *ctx, fr_redis_cluster_t *cluster,
+						 uint32_t max_size, struct timeval const *max_latency,
+						 uint32_t wait_num, uint32_t wait_timeout);
+
+fr_redis_rcode_t	fr_redis_pipeline_command(redisReply **out, fr_redis_pipeline_t *pipeline, REQUEST *request,
+						  uint8_t const *key, size_t key_len,
+						  char const *cmd, size_t cmd_len);
+#endif	/* LIBFREERADIUS_REDIS_PIPELINE_H */
@@ -48,6 +48,7 @@ RCSID("$Id$")
 
 #include "redis.h"
 #include "cluster.h"
+#include "pipeline.h"
 #include "redis_ippool.h"
 
 /** rlm_redis module instance
@@ -94,6 +95,13 @@ typedef struct rlm_redis_ippool {
 						//!< allocated_address_attr if updates are successful.
 
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
+
+	uint32_t		pipeline_size;	//!< Maximum number of commands per pipeline.
+						//!< 0 disables pipelining.
+	struct timeval		pipeline_latency;	//!< Maximum time a command waits for a
+							//!< running pipeline to finish.
+	fr_redis_pipeline_t	*pipeline;	//!< Commands from concurrent requests, waiting to
+						//!< be sent to the same node.
 } rlm_redis_ippool_t;
 
 static CONF_PARSER redis_config[] = {
@@ -101,6 +109,12 @@ static CONF_PARSER redis_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER pipeline_config[] = {
+	{ FR_CONF_OFFSET("max_size", PW_TYPE_INTEGER, rlm_redis_ippool_t, pipeline_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_latency", PW_TYPE_TIMEVAL, rlm_redis_ippool_t, pipeline_latency), .dflt = "0.001" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("pool_name", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_redis_ippool_t, pool_name) },
 
@@ -125,6 +139,8 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ipv4_integer", PW_TYPE_BOOLEAN, rlm_redis_ippool_t, ipv4_integer) },
 	{ FR_CONF_OFFSET("copy_on_update", PW_TYPE_BOOLEAN, rlm_redis_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
 
+	{ FR_CONF_POINTER("pipeline", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) pipeline_config },
+
 	/*
 	 *	Split out to allow conversion to universal ippool module with
 	 *	minimum of config changes.
@@ -411,6 +427,8 @@ static void ippool_action_print(REQUEST *request, ippool_action_t action,
  * @param[out] out Where to write Redis reply object resulting from the command.
  * @param[in] request The current request.
  * @param[in] cluster configuration.
+ * @param[in] pipeline to send the command in, may be NULL.  If the pipeline
+ *	can't deal with the command, it's sent on its own.
  * @param[in] key to use to determine the cluster node.
  * @param[in] key_len length of the key.
  * @param[in] wait_num If > 0 wait until this many slaves have replicated the data
@@ -423,6 +441,7 @@ static void ippool_action_print(REQUEST *request, ippool_action_t action,
  * @return status of the command.
  */
 static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
+				      fr_redis_pipeline_t *pipeline,
 				      uint8_t const *key, size_t key_len,
 				      uint32_t wait_num, uint32_t wait_timeout,
 				      char const digest[], char const *script,
@@ -442,6 +461,48 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 
 	va_start(ap, cmd);
 
+	/*
+	 *	Try sending the command in a pipeline with commands
+	 *	from other requests.  Redirects and script loads are
+	 *	dealt with below, by sending the command on its own.
+	 */
+	if (pipeline) {
+		char		*formatted;
+		int		len;
+		va_list		copy;
+
+		va_copy(copy, ap);	/* copy or segv */
+		len = redisvFormatCommand(&formatted, cmd, copy);
+		va_end(copy);
+
+		if (len > 0) {
+			RDEBUG3("Calling script 0x%s (pipelined)", digest);
+			status = fr_redis_pipeline_command(&replies[0], pipeline, request, key, key_len,
+							   formatted, (size_t)len);
+			free(formatted);
+
+			switch (status) {
+			case REDIS_RCODE_SUCCESS:
+				*out = replies[0];
+				va_end(ap);
+				return REDIS_RCODE_SUCCESS;
+
+			case REDIS_RCODE_ERROR:
+				if (replies[0] && (replies[0]->type == REDIS_REPLY_ERROR)) {
+					REDEBUG("Pipelined command failed: %s", replies[0]->str);
+				} else {
+					REDEBUG("Pipelined command failed");
+				}
+				fr_redis_reply_free(replies[0]);
+				va_end(ap);
+				return REDIS_RCODE_ERROR;
+
+			default:
+				break;
+			}
+		}
+	}
+
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &replies[0])) {
@@ -570,7 +631,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t *inst, REQUEST *r
 	 */
 	if (!gateway_id) gateway_id = (uint8_t const *)"";
 
-	status = ippool_script(&reply, request, inst->cluster,
+	status = ippool_script(&reply, request, inst->cluster, inst->pipeline,
 			       key_prefix, key_prefix_len,
 			       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
 			       lua_alloc_digest, lua_alloc_cmd,
@@ -783,7 +844,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t *inst, REQUEST *req
 	if (!gateway_id) gateway_id = (uint8_t const *)"";
 
 	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
+		status = ippool_script(&reply, request, inst->cluster, inst->pipeline,
 				       key_prefix, key_prefix_len,
 				       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
 				       lua_update_digest, lua_update_cmd,
@@ -798,7 +859,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t *inst, REQUEST *req
 		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
 
 		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
+		status = ippool_script(&reply, request, inst->cluster, inst->pipeline,
 				       key_prefix, key_prefix_len,
 				       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
 				       lua_update_digest, lua_update_cmd,
@@ -922,7 +983,7 @@ static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t *inst, REQUEST *re
 	if (!device_id) device_id = (uint8_t const *)"";
 
 	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
+		status = ippool_script(&reply, request, inst->cluster, inst->pipeline,
 				       key_prefix, key_prefix_len,
 				       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
 				       lua_release_digest, lua_release_cmd,
@@ -936,7 +997,7 @@ static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t *inst, REQUEST *re
 		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
 
 		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
+		status = ippool_script(&reply, request, inst->cluster, inst->pipeline,
 				       key_prefix, key_prefix_len,
 				       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
 				       lua_release_digest, lua_release_cmd,
@@ -1345,6 +1406,19 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	if (!inst->offer_time) inst->offer_time = inst->lease_time;
 
+	/*
+	 *	Send commands from concurrent requests to the
+	 *	same node in a single pipeline.
+	 */
+	if (inst->pipeline_size > 0) {
+		FR_INTEGER_BOUND_CHECK("pipeline.max_size", inst->pipeline_size, <=, 1000);
+		FR_TIMEVAL_BOUND_CHECK("pipeline.max_latency", &inst->pipeline_latency, <=, 1, 0);
+
+		inst->pipeline = fr_redis_pipeline_alloc(inst, inst->cluster, inst->pipeline_size,
+							 &inst->pipeline_latency,
+							 inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout));
+	}
+
 	return 0;
 }
 
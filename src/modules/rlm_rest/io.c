@@ -0,0 +1,419 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file io.c
+ * @brief Perform HTTP transfers for all worker threads from one I/O thread.
+ *
+ * Worker threads configure a curl easy handle as usual, and pass it to
+ * the I/O thread, which runs every transfer through a single curl multi
+ * handle.  The I/O thread sleeps in an event loop, watching the sockets
+ * curl asks for, and calls curl_multi_socket_action() when one is ready
+ * or curl's timer fires.  All transfers share the connection cache of the multi handle,
+ * so keep-alive connections are re-used no matter which worker or pooled
+ * handle the request came from, and one thread services every socket.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <fcntl.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#include "rest.h"
+
+/*
+ *	CURLMOPT_TIMERFUNCTION was added in 7.16.0.
+ */
+#if LIBCURL_VERSION_NUM >= 0x071000
+#  define HAVE_CURL_MULTI_SOCKET 1
+#endif
+
+#define REST_IO_QUEUE_SIZE	4096	//!< Maximum number of handles waiting to be added.
+
+struct rest_io_t {
+	char const		*name;		//!< Instance name, for log messages.
+
+	CURLM			*mandle;	//!< Multi handle all transfers are run through.
+	fr_atomic_queue_t	*queue;		//!< Handles waiting to be added to mandle.
+	rlm_rest_handle_t	*active;	//!< Handles added to mandle.  Only used by
+						//!< the I/O thread.
+
+	fr_event_list_t		*el;		//!< Watches the sockets of every transfer, and the
+						//!< wake pipe.  Only used by the I/O thread.
+	fr_event_t		*timer;		//!< When curl next wants to be called, if it
+						//!< isn't woken up by a socket.
+
+	int			wake[2];	//!< Pipe used to wake the I/O thread.
+	pthread_t		thread;		//!< I/O thread.
+	bool			running;	//!< Whether the I/O thread was started.
+	atomic_bool		stop;		//!< Tells the I/O thread to exit.
+};
+
+#ifdef HAVE_CURL_MULTI_SOCKET
+/*
+ *	Tell the worker waiting on a handle that its transfer has finished.
+ */
+static void rest_io_complete(rest_io_t *io, rlm_rest_handle_t *randle, CURLcode result)
+{
+	curl_multi_remove_handle(io->mandle, randle->handle);
+
+	if (randle->prev) randle->prev->next = randle->next;
+	if (randle->next) randle->next->prev = randle->prev;
+	if (io->active == randle) io->active = randle->next;
+	randle->prev = randle->next = NULL;
+
+	pthread_mutex_lock(&randle->mutex);
+	randle->result = result;
+	randle->done = true;
+	pthread_cond_signal(&randle->cond);
+	pthread_mutex_unlock(&randle->mutex);
+}
+
+/*
+ *	Add handles submitted by workers to the multi handle.
+ *
+ *	Adding a handle sets curl's timer, which starts the transfer.
+ */
+static void rest_io_add(rest_io_t *io)
+{
+	rlm_rest_handle_t	*randle;
+	CURLMcode		ret;
+
+	while (fr_atomic_queue_pop(io->queue, (void **) &randle)) {
+		curl_easy_setopt(randle->handle, CURLOPT_PRIVATE, randle);
+
+		randle->prev = NULL;
+		randle->next = io->active;
+		if (io->active) io->active->prev = randle;
+		io->active = randle;
+
+		ret = curl_multi_add_handle(io->mandle, randle->handle);
+		if (ret != CURLM_OK) {
+			ERROR("rlm_rest (%s): Failed adding transfer: %s", io->name, curl_multi_strerror(ret));
+			rest_io_complete(io, randle, CURLE_FAILED_INIT);
+		}
+	}
+}
+
+/*
+ *	Hand finished transfers back to their workers.
+ */
+static void rest_io_done(rest_io_t *io)
+{
+	CURLMsg			*msg;
+	int			left;
+	rlm_rest_handle_t	*randle;
+
+	while ((msg = curl_multi_info_read(io->mandle, &left))) {
+		if (msg->msg != CURLMSG_DONE) continue;
+
+		if (curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &randle) != CURLE_OK) {
+			rad_assert(0);
+			continue;
+		}
+
+		rest_io_complete(io, randle, msg->data.result);
+	}
+}
+
+/*
+ *	Let curl service a socket (or its timers), then hand back
+ *	any transfers which have finished.
+ */
+static void rest_io_socket_action(rest_io_t *io, curl_socket_t fd)
+{
+	CURLMcode	ret;
+	int		running;
+
+	/*
+	 *	The event list doesn't say whether the socket is
+	 *	readable or writable, so let curl work it out.
+	 */
+	ret = curl_multi_socket_action(io->mandle, fd, 0, &running);
+	if (ret != CURLM_OK) ERROR("rlm_rest (%s): Failed servicing transfers: %s", io->name, curl_multi_strerror(ret));
+
+	rest_io_done(io);
+}
+
+static void _rest_io_fd_ready(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	rest_io_socket_action(ctx, fd);
+}
+
+static void _rest_io_timer_fired(void *ctx, UNUSED struct timeval *now)
+{
+	rest_io_socket_action(ctx, CURL_SOCKET_TIMEOUT);
+}
+
+/*
+ *	Called by curl to tell us which events it wants for a socket.
+ */
+static int _rest_io_socket(UNUSED CURL *candle, curl_socket_t fd, int what, void *userp, UNUSED void *socketp)
+{
+	rest_io_t	*io = userp;
+	int		type;
+
+	/*
+	 *	The events wanted may have changed, so always
+	 *	start again.
+	 */
+	fr_event_fd_delete(io->el, 0, fd);
+
+	switch (what) {
+	case CURL_POLL_REMOVE:
+		return 0;
+
+	case CURL_POLL_OUT:
+		type = FR_EVENT_FD_WRITE;
+		break;
+
+	case CURL_POLL_INOUT:
+		type = FR_EVENT_FD_READ | FR_EVENT_FD_WRITE;
+		break;
+
+	default:
+		type = FR_EVENT_FD_READ;
+		break;
+	}
+
+	if (!fr_event_fd_insert(io->el, type, fd, _rest_io_fd_ready, io)) {
+		ERROR("rlm_rest (%s): Failed watching socket: %s", io->name, fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Called by curl to tell us when it next wants to be called,
+ *	if nothing happens on its sockets.
+ */
+static int _rest_io_timer(UNUSED CURLM *mandle, long timeout_ms, void *userp)
+{
+	rest_io_t	*io = userp;
+	struct timeval	now, when, timeout;
+
+	if (timeout_ms < 0) {
+		fr_event_delete(io->el, &io->timer);
+		return 0;
+	}
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+	gettimeofday(&now, NULL);
+	fr_timeval_add(&when, &now, &timeout);
+
+	if (!fr_event_insert(io->el, _rest_io_timer_fired, io, &when, &io->timer)) {
+		ERROR("rlm_rest (%s): Failed setting timer: %s", io->name, fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	A worker has submitted a transfer, or we've been told to exit.
+ */
+static void _rest_io_wake(fr_event_list_t *el, int fd, void *ctx)
+{
+	rest_io_t	*io = ctx;
+	uint8_t		buffer[64];
+
+	while (read(fd, buffer, sizeof(buffer)) > 0);
+
+	if (atomic_load(&io->stop)) {
+		fr_event_loop_exit(el, 1);
+		return;
+	}
+
+	rest_io_add(io);
+}
+
+static void *rest_io_thread(void *arg)
+{
+	rest_io_t		*io = arg;
+
+	/*
+	 *	Sleep until a socket is ready, a curl timer
+	 *	fires, or a worker submits a new transfer.
+	 */
+	if (fr_event_loop(io->el) < 0) {
+		ERROR("rlm_rest (%s): I/O thread exiting: %s", io->name, fr_strerror());
+	}
+
+	/*
+	 *	Fail anything still in progress, so no worker is
+	 *	left waiting.
+	 */
+	rest_io_add(io);
+	while (io->active) rest_io_complete(io, io->active, CURLE_ABORTED_BY_CALLBACK);
+
+	return NULL;
+}
+#endif
+
+static int _rest_io_free(rest_io_t *io)
+{
+	if (io->running) {
+		atomic_store(&io->stop, true);
+		if (write(io->wake[1], "", 1) < 0) {
+			/* nothing we can do */
+		}
+		pthread_join(io->thread, NULL);
+	}
+
+	if (io->wake[0] >= 0) close(io->wake[0]);
+	if (io->wake[1] >= 0) close(io->wake[1]);
+	if (io->mandle) curl_multi_cleanup(io->mandle);
+
+	return 0;
+}
+
+/** Start the I/O thread
+ *
+ * @param[in] inst to start the I/O thread for.
+ * @return
+ *	- New I/O thread state, to be freed when the instance is detached.
+ *	- NULL on error.
+ */
+rest_io_t *rest_io_init(rlm_rest_t *inst)
+{
+#ifndef HAVE_CURL_MULTI_SOCKET
+	ERROR("rlm_rest (%s): async requires libcurl >= 7.16.0", inst->xlat_name);
+	return NULL;
+#else
+	rest_io_t	*io;
+
+	MEM(io = talloc_zero(inst, rest_io_t));
+	io->name = inst->xlat_name;
+	io->wake[0] = io->wake[1] = -1;
+	atomic_init(&io->stop, false);
+	talloc_set_destructor(io, _rest_io_free);
+
+	io->mandle = curl_multi_init();
+	if (!io->mandle) {
+		ERROR("rlm_rest (%s): Failed to create CURL multi handle", io->name);
+	error:
+		talloc_free(io);
+		return NULL;
+	}
+
+#if LIBCURL_VERSION_NUM >= 0x071e00
+	if (inst->async.max_connections) {
+		curl_multi_setopt(io->mandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) inst->async.max_connections);
+	}
+	if (inst->async.max_host_connections) {
+		curl_multi_setopt(io->mandle, CURLMOPT_MAX_HOST_CONNECTIONS, (long) inst->async.max_host_connections);
+	}
+#endif
+#ifdef CURLPIPE_MULTIPLEX
+	/*
+	 *	Run concurrent transfers over one connection, if the
+	 *	server speaks HTTP/2.
+	 */
+	curl_multi_setopt(io->mandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+	curl_multi_setopt(io->mandle, CURLMOPT_SOCKETFUNCTION, _rest_io_socket);
+	curl_multi_setopt(io->mandle, CURLMOPT_SOCKETDATA, io);
+	curl_multi_setopt(io->mandle, CURLMOPT_TIMERFUNCTION, _rest_io_timer);
+	curl_multi_setopt(io->mandle, CURLMOPT_TIMERDATA, io);
+
+	io->queue = fr_atomic_queue_create(io, REST_IO_QUEUE_SIZE);
+	if (!io->queue) {
+		ERROR("rlm_rest (%s): Failed creating queue: %s", io->name, fr_strerror());
+		goto error;
+	}
+
+	if (pipe(io->wake) < 0) {
+		ERROR("rlm_rest (%s): Failed creating pipe: %s", io->name, fr_syserror(errno));
+		goto error;
+	}
+
+	if ((fr_nonblock(io->wake[0]) < 0) || (fr_nonblock(io->wake[1]) < 0) ||
+	    (fcntl(io->wake[0], F_SETFD, FD_CLOEXEC) < 0) || (fcntl(io->wake[1], F_SETFD, FD_CLOEXEC) < 0)) {
+		ERROR("rlm_rest (%s): Failed configuring pipe: %s", io->name, fr_syserror(errno));
+		goto error;
+	}
+
+	io->el = fr_event_list_create(io, NULL);
+	if (!io->el) {
+		ERROR("rlm_rest (%s): Failed creating event list", io->name);
+		goto error;
+	}
+
+	if (!fr_event_fd_insert(io->el, 0, io->wake[0], _rest_io_wake, io)) {
+		ERROR("rlm_rest (%s): Failed watching pipe: %s", io->name, fr_strerror());
+		goto error;
+	}
+
+	if (pthread_create(&io->thread, NULL, rest_io_thread, io) != 0) {
+		ERROR("rlm_rest (%s): Failed creating I/O thread: %s", io->name, fr_syserror(errno));
+		goto error;
+	}
+	io->running = true;
+
+	return io;
+#endif
+}
+
+/** Perform a transfer from the I/O thread, and wait for it to complete
+ *
+ * The handle must have been configured with rest_request_config().
+ *
+ * @param[in] io thread to perform the transfer.
+ * @param[in] request Current request.
+ * @param[in] randle to perform.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rest_io_perform(rest_io_t *io, REQUEST *request, rlm_rest_handle_t *randle)
+{
+	randle->done = false;
+
+	if (!fr_atomic_queue_push(io->queue, randle)) {
+		REDEBUG("Request failed: Too many requests waiting for the I/O thread");
+		return -1;
+	}
+
+	if ((write(io->wake[1], "", 1) < 0) && (errno != EAGAIN)) {
+		RWDEBUG("Failed waking I/O thread: %s", fr_syserror(errno));
+	}
+
+	pthread_mutex_lock(&randle->mutex);
+	while (!randle->done) pthread_cond_wait(&randle->cond, &randle->mutex);
+	pthread_mutex_unlock(&randle->mutex);
+
+	if (randle->result != CURLE_OK) {
+		REDEBUG("Request failed: %i - %s", randle->result, curl_easy_strerror(randle->result));
+
+		return -1;
+	}
+
+	return 0;
+}
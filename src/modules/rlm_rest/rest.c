@@ -310,6 +310,9 @@ static int _mod_conn_free(rlm_rest_handle_t *randle)
 {
 	curl_easy_cleanup(randle->handle);
 
+	pthread_cond_destroy(&randle->cond);
+	pthread_mutex_destroy(&randle->mutex);
+
 	return 0;
 }
 
@@ -387,6 +390,8 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 
 	randle->ctx = curl_ctx;
 	randle->handle = candle;
+	pthread_mutex_init(&randle->mutex, NULL);
+	pthread_cond_init(&randle->cond, NULL);
 	talloc_set_destructor(randle, _mod_conn_free);
 
 	/*
@@ -432,6 +437,12 @@ int mod_conn_alive(void *instance, void *handle)
 	long last_socket;
 	CURLcode ret;
 
+	/*
+	 *	Connections belong to the I/O thread's multi handle,
+	 *	which checks and re-opens them itself.
+	 */
+	if (inst->async.enable) return true;
+
 	ret = curl_easy_getinfo(candle, CURLINFO_LASTSOCKET, &last_socket);
 	if (ret != CURLE_OK) {
 		ERROR("Couldn't determine socket state: %i - %s", ret, curl_easy_strerror(ret));
@@ -2329,13 +2340,15 @@ error_header:
  *	- 0 on success.
  *	- -1 on failure.
  */
-int rest_request_perform(UNUSED rlm_rest_t const *instance, UNUSED rlm_rest_section_t *section,
+int rest_request_perform(rlm_rest_t const *instance, UNUSED rlm_rest_section_t *section,
 			 REQUEST *request, void *handle)
 {
 	rlm_rest_handle_t	*randle = handle;
 	CURL			*candle = randle->handle;
 	CURLcode		ret;
 
+	if (instance->async.enable) return rest_io_perform(instance->async.io, request, randle);
+
 	ret = curl_easy_perform(candle);
 	if (ret != CURLE_OK) {
 		REDEBUG("Request failed: %i - %s", ret, curl_easy_strerror(ret));
@@ -140,6 +140,24 @@ typedef struct rlm_rest_section_t {
 	uint32_t		chunk;		//!< Max chunk-size (mainly for testing the encoders)
 } rlm_rest_section_t;
 
+/*
+ *	State for the I/O thread (io.c)
+ */
+typedef struct rest_io_t rest_io_t;
+
+/*
+ *	Configuration for performing transfers from a single I/O thread
+ */
+typedef struct rlm_rest_async_t {
+	bool			enable;		//!< Whether transfers are performed by the I/O thread.
+	uint32_t		max_connections;	//!< Maximum connections the I/O thread
+							//!< will open, 0 for no limit.
+	uint32_t		max_host_connections;	//!< Maximum connections to any one host,
+							//!< 0 for no limit.
+
+	rest_io_t		*io;		//!< I/O thread state.
+} rlm_rest_async_t;
+
 /*
  *	Structure for module configuration
  */
@@ -153,6 +171,8 @@ typedef struct rlm_rest_t {
 
 	fr_connection_pool_t	*pool;		//!< Pointer to the connection pool.
 
+	rlm_rest_async_t	async;		//!< I/O thread configuration.
+
 	rlm_rest_section_t	xlat;		//!< Configuration specific to xlat.
 	rlm_rest_section_t	authorize;	//!< Configuration specific to authorisation.
 	rlm_rest_section_t	authenticate;	//!< Configuration specific to authentication.
@@ -238,6 +258,16 @@ typedef struct rlm_rest_curl_context_t {
 typedef struct rlm_rest_handle_t {
 	void			*handle;	//!< Real Handle.
 	rlm_rest_curl_context_t	*ctx;		//!< Context.
+
+	/*
+	 *	Only used when transfers are performed by the I/O thread.
+	 */
+	pthread_mutex_t		mutex;		//!< Protects done and result.
+	pthread_cond_t		cond;		//!< Signalled when the transfer completes.
+	bool			done;		//!< Whether the transfer has completed.
+	CURLcode		result;		//!< Result of the transfer.
+	struct rlm_rest_handle_t *prev;		//!< Previous handle being transferred.
+	struct rlm_rest_handle_t *next;		//!< Next handle being transferred.
 } rlm_rest_handle_t;
 
 /*
@@ -258,6 +288,13 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 
 int mod_conn_alive(void *instance, void *handle);
 
+/*
+ *	I/O thread API
+ */
+rest_io_t *rest_io_init(rlm_rest_t *inst);
+
+int rest_io_perform(rest_io_t *io, REQUEST *request, rlm_rest_handle_t *randle);
+
 /*
  *	Request processing API
  */
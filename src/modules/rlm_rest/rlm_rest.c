@@ -88,10 +88,18 @@ static const CONF_PARSER xlat_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER async_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, rlm_rest_t, async.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_connections", PW_TYPE_INTEGER, rlm_rest_t, async.max_connections), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_host_connections", PW_TYPE_INTEGER, rlm_rest_t, async.max_host_connections), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("connect_uri", PW_TYPE_STRING, rlm_rest_t, connect_uri) },
 	{ FR_CONF_DEPRECATED("connect_timeout", PW_TYPE_TIMEVAL, rlm_rest_t, connect_timeout) },
 	{ FR_CONF_OFFSET("connect_proxy", PW_TYPE_STRING, rlm_rest_t, connect_proxy) },
+	{ FR_CONF_POINTER("async", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) async_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -881,6 +889,11 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->pool = module_connection_pool_init(conf, inst, mod_conn_create, mod_conn_alive, NULL, NULL, NULL);
 	if (!inst->pool) return -1;
 
+	if (inst->async.enable) {
+		inst->async.io = rest_io_init(inst);
+		if (!inst->async.io) return -1;
+	}
+
 	return 0;
 }
 
@@ -892,6 +905,12 @@ static int mod_detach(void *instance)
 {
 	rlm_rest_t *inst = instance;
 
+	/*
+	 *	Stop the I/O thread before freeing the handles
+	 *	it may be using.
+	 */
+	TALLOC_FREE(inst->async.io);
+
 	fr_connection_pool_free(inst->pool);
 
 	/* Free any memory used by libcurl */
@@ -0,0 +1,186 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file batch.c
+ * @brief Run accounting queries from many requests in one transaction.
+ *
+ * Queries are grouped by the shared batch queue (see main/batch.c).  Each
+ * batch of queries is run using one connection and one transaction.
+ *
+ * Each waiting request is told how many rows its own query affected, or that
+ * the batch failed, in which case nothing in the batch was committed.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <freeradius-devel/batch.h>
+
+#include "rlm_sql.h"
+
+/*
+ *	A query waiting to be run.  Lives on the stack of the
+ *	request waiting for it.
+ */
+typedef struct sql_batch_query {
+	rlm_sql_params_t const	*params;	//!< Expanded query.
+	int			numaffected;	//!< Rows affected by the query, or -1
+						//!< if the batch failed.
+} sql_batch_query_t;
+
+/*
+ *	Run one query without reconnecting, as a new connection
+ *	wouldn't be part of the transaction.
+ */
+static sql_rcode_t sql_batch_exec(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle,
+				  rlm_sql_params_t const *params, char const *query, int *numaffected)
+{
+	sql_rcode_t ret;
+
+	if (params) {
+		RDEBUG2("Executing batched query: %s", params->escaped);
+
+		if (params->query && inst->module->sql_query_params) {
+			ret = (inst->module->sql_query_params)(handle, inst->config, params->query,
+							       params->value, params->num);
+		} else {
+			ret = (inst->module->sql_query)(handle, inst->config, params->escaped);
+		}
+	} else {
+		RDEBUG2("Executing query: %s", query);
+
+		ret = (inst->module->sql_query)(handle, inst->config, query);
+	}
+
+	if (ret != RLM_SQL_OK) {
+		if (ret != RLM_SQL_RECONNECT) {
+			rlm_sql_print_error(inst, request, handle, false);
+			(inst->module->sql_finish_query)(handle, inst->config);
+		}
+		return ret;
+	}
+
+	if (numaffected) *numaffected = (inst->module->sql_affected_rows)(handle, inst->config);
+	(inst->module->sql_finish_query)(handle, inst->config);
+
+	return RLM_SQL_OK;
+}
+
+/*
+ *	Run every query in a batch in one transaction.
+ */
+static void sql_batch_run(REQUEST *request, fr_batch_entry_t *list, uint32_t num, void *uctx)
+{
+	rlm_sql_t const		*inst = uctx;
+	rlm_sql_handle_t	*handle;
+	fr_batch_entry_t	*entry;
+	sql_batch_query_t	*query;
+	sql_rcode_t		ret;
+	bool			failed = true;
+
+	handle = fr_connection_get(inst->pool, request);
+	if (!handle) goto done;
+
+	RDEBUG2("Running batch of %u queries", num);
+
+	ret = sql_batch_exec(inst, request, handle, NULL, "BEGIN", NULL);
+	if (ret != RLM_SQL_OK) goto error;
+
+	for (entry = list; entry; entry = entry->next) {
+		query = entry->data;
+
+		ret = sql_batch_exec(inst, request, handle, query->params, NULL, &query->numaffected);
+		if (ret != RLM_SQL_OK) goto rollback;
+	}
+
+	ret = sql_batch_exec(inst, request, handle, NULL, "COMMIT", NULL);
+	if (ret == RLM_SQL_OK) {
+		failed = false;
+		goto release;
+	}
+
+rollback:
+	if (ret != RLM_SQL_RECONNECT) {
+		(void) sql_batch_exec(inst, request, handle, NULL, "ROLLBACK", NULL);
+		goto release;
+	}
+
+error:
+	/*
+	 *	The connection is unusable, and whatever was
+	 *	sent on it is lost.
+	 */
+	if (ret == RLM_SQL_RECONNECT) {
+		fr_connection_close(inst->pool, request, handle);
+		goto done;
+	}
+
+release:
+	fr_connection_release(inst->pool, request, handle);
+
+done:
+	if (!failed) return;
+
+	RWDEBUG("Batch failed, queries will be run individually");
+	for (entry = list; entry; entry = entry->next) {
+		query = entry->data;
+		query->numaffected = -1;
+	}
+}
+
+/** Allocate the batch queue for a section
+ *
+ * @param[in] ctx to allocate the queue in.
+ * @param[in] inst #rlm_sql_t instance data.
+ * @param[in] max_size Maximum number of queries per batch.
+ * @param[in] max_latency Maximum time a query waits for a running batch to finish.
+ * @return new batch queue.
+ */
+fr_batch_t *sql_batch_alloc(TALLOC_CTX *ctx, rlm_sql_t *inst, uint32_t max_size,
+			    struct timeval const *max_latency)
+{
+	return fr_batch_alloc(ctx, max_size, max_latency, sql_batch_run, inst);
+}
+
+/** Run a query as part of a batch
+ *
+ * Blocks until the batch containing the query has been run.
+ *
+ * @param[in] batch queue to add the query to.
+ * @param[in] request Current request.
+ * @param[in] params Expanded query.
+ * @return
+ *	- The number of rows affected by the query.
+ *	- -1 if the batch failed.  Nothing in the batch was committed,
+ *	  and the query should be run on its own.
+ */
+int sql_batch_query(fr_batch_t *batch, REQUEST *request, rlm_sql_params_t const *params)
+{
+	fr_batch_entry_t	entry;
+	sql_batch_query_t	query = { .params = params, .numaffected = -1 };
+
+	fr_batch_add(batch, request, &entry, &query);
+
+	return query.numaffected;
+}
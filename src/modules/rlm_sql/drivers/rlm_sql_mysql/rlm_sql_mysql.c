@@ -69,8 +69,16 @@ typedef struct rlm_sql_mysql_conn {
 	MYSQL		*sock;
 	MYSQL_RES	*result;
 	rlm_sql_row_t	row;
+	MYSQL_STMT	*stmt;		//!< Prepared statement executed by the last query, if any.
 } rlm_sql_mysql_conn_t;
 
+typedef struct rlm_sql_mysql_stmt {
+	MYSQL_STMT	*stmt;
+	MYSQL_BIND	*bind;		//!< One per parameter.
+	unsigned long	*length;	//!< Lengths of the bound values.
+	unsigned int	num;		//!< Number of parameters.
+} rlm_sql_mysql_stmt_t;
+
 typedef struct rlm_sql_mysql_config {
 	char const *tls_ca_file;		//!< Path to the CA used to validate the server's certificate.
 	char const *tls_ca_path;		//!< Directory containing CAs that may be used to validate the
@@ -360,6 +368,95 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return RLM_SQL_OK;
 }
 
+static int _sql_stmt_free(rlm_sql_mysql_stmt_t *stmt)
+{
+	if (stmt->stmt) mysql_stmt_close(stmt->stmt);
+
+	return 0;
+}
+
+/*
+ *	Only used for queries which don't return rows.  Binding
+ *	results isn't worth it for the few selects we run.
+ */
+static sql_rcode_t sql_query_params(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query,
+				    char const * const *value, int num)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	rlm_sql_mysql_stmt_t	*stmt;
+	sql_rcode_t		rcode;
+	int			i;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	stmt = rlm_sql_stmt_find(handle, query);
+	if (!stmt) {
+		MEM(stmt = talloc_zero(handle, rlm_sql_mysql_stmt_t));
+		talloc_set_destructor(stmt, _sql_stmt_free);
+
+		stmt->stmt = mysql_stmt_init(conn->sock);
+		if (!stmt->stmt) {
+			talloc_free(stmt);
+			return sql_check_error(conn->sock, CR_OUT_OF_MEMORY);
+		}
+
+		if (mysql_stmt_prepare(stmt->stmt, query, strlen(query)) != 0) {
+			rcode = sql_check_error(conn->sock, mysql_stmt_errno(stmt->stmt));
+			talloc_free(stmt);
+			return (rcode == RLM_SQL_OK) ? RLM_SQL_ERROR : rcode;
+		}
+
+		stmt->num = mysql_stmt_param_count(stmt->stmt);
+		if (stmt->num > 0) {
+			MEM(stmt->bind = talloc_zero_array(stmt, MYSQL_BIND, stmt->num));
+			MEM(stmt->length = talloc_zero_array(stmt, unsigned long, stmt->num));
+		}
+
+		rlm_sql_stmt_add(handle, query, stmt);
+	}
+
+	if (stmt->num != (unsigned int) num) {
+		ERROR("Statement has %u parameters, but %i values were provided", stmt->num, num);
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	/*
+	 *	Values are sent as strings, the server converts
+	 *	them to the column types.  NULL values are sent
+	 *	as SQL NULL.
+	 */
+	for (i = 0; i < num; i++) {
+		memset(&stmt->bind[i], 0, sizeof(stmt->bind[i]));
+		if (!value[i]) {
+			stmt->length[i] = 0;
+			stmt->bind[i].buffer_type = MYSQL_TYPE_NULL;
+			continue;
+		}
+
+		stmt->length[i] = strlen(value[i]);
+		stmt->bind[i].buffer_type = MYSQL_TYPE_STRING;
+		memcpy(&stmt->bind[i].buffer, &value[i], sizeof(stmt->bind[i].buffer));
+		stmt->bind[i].buffer_length = stmt->length[i];
+		stmt->bind[i].length = &stmt->length[i];
+	}
+
+	if ((num > 0) && mysql_stmt_bind_param(stmt->stmt, stmt->bind)) {
+		return sql_check_error(conn->sock, mysql_stmt_errno(stmt->stmt));
+	}
+
+	conn->stmt = stmt->stmt;
+
+	if (mysql_stmt_execute(stmt->stmt) != 0) {
+		rcode = sql_check_error(conn->sock, mysql_stmt_errno(stmt->stmt));
+		return (rcode == RLM_SQL_OK) ? RLM_SQL_ERROR : rcode;
+	}
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
@@ -671,10 +768,23 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
  */
 static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
-#if (MYSQL_VERSION_ID >= 40100)
 	rlm_sql_mysql_conn_t	*conn = handle->conn;
+#if (MYSQL_VERSION_ID >= 40100)
 	int			ret;
 	MYSQL_RES		*result;
+#endif
+
+	/*
+	 *	Prepared statements don't leave results on the
+	 *	connection handle.
+	 */
+	if (conn->stmt) {
+		mysql_stmt_free_result(conn->stmt);
+		conn->stmt = NULL;
+		return RLM_SQL_OK;
+	}
+
+#if (MYSQL_VERSION_ID >= 40100)
 
 	/*
 	 *	If there's no result associated with the
@@ -719,6 +829,8 @@ static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_affected_rows(conn->stmt);
+
 	return mysql_affected_rows(conn->sock);
 }
 
@@ -747,6 +859,7 @@ rlm_sql_module_t rlm_sql_mysql = {
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
 	.sql_select_query		= sql_select_query,
+	.sql_query_params		= sql_query_params,
 	.sql_store_result		= sql_store_result,
 	.sql_num_fields			= sql_num_fields,
 	.sql_num_rows			= sql_num_rows,
@@ -69,8 +69,14 @@ typedef struct rlm_sql_postgres_conn {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	uint32_t	stmt_id;	//!< Used to generate prepared statement names.
 } rlm_sql_postgres_conn_t;
 
+typedef struct rlm_sql_postgres_stmt {
+	rlm_sql_postgres_conn_t	*conn;
+	char			name[NAMEDATALEN];
+} rlm_sql_postgres_stmt_t;
+
 static CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("send_application_name", PW_TYPE_BOOLEAN, rlm_sql_postgres_config_t, send_application_name), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
@@ -295,28 +301,14 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
-					      char const *query)
+/** Determine the outcome of the last query from its result
+ *
+ */
+static sql_rcode_t sql_result_status(rlm_sql_postgres_conn_t *conn)
 {
-	rlm_sql_postgres_conn_t *conn = handle->conn;
 	ExecStatusType status;
 	int numfields = 0;
 
-	if (!conn->db) {
-		ERROR("Socket not connected");
-		return RLM_SQL_RECONNECT;
-	}
-
-	/*
-	 *  Returns a PGresult pointer or possibly a null pointer.
-	 *  A non-null pointer will generally be returned except in
-	 *  out-of-memory conditions or serious errors such as inability
-	 *  to send the command to the server. If a null pointer is
-	 *  returned, it should be treated like a PGRES_FATAL_ERROR
-	 *  result.
-	 */
-	conn->result = PQexec(conn->db, query);
-
 	/*
 	 *  As this error COULD be a connection error OR an out-of-memory
 	 *  condition return value WILL be wrong SOME of the time
@@ -386,11 +378,98 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED r
 	return RLM_SQL_ERROR;
 }
 
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					      char const *query)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  Returns a PGresult pointer or possibly a null pointer.
+	 *  A non-null pointer will generally be returned except in
+	 *  out-of-memory conditions or serious errors such as inability
+	 *  to send the command to the server. If a null pointer is
+	 *  returned, it should be treated like a PGRES_FATAL_ERROR
+	 *  result.
+	 */
+	conn->result = PQexec(conn->db, query);
+
+	return sql_result_status(conn);
+}
+
+static int _sql_stmt_free(rlm_sql_postgres_stmt_t *stmt)
+{
+	char buffer[NAMEDATALEN + 16];
+
+	/*
+	 *  Statements are dropped by the server when the
+	 *  connection closes, this is only needed when the
+	 *  statement cache is flushed.
+	 */
+	if (!stmt->conn->db || (PQstatus(stmt->conn->db) != CONNECTION_OK)) return 0;
+
+	snprintf(buffer, sizeof(buffer), "DEALLOCATE %s", stmt->name);
+	PQclear(PQexec(stmt->conn->db, buffer));
+
+	return 0;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_params(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						     char const *query, char const * const *value, int num)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	rlm_sql_postgres_stmt_t *stmt;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	stmt = rlm_sql_stmt_find(handle, query);
+	if (!stmt) {
+		sql_rcode_t rcode;
+
+		MEM(stmt = talloc_zero(handle, rlm_sql_postgres_stmt_t));
+		stmt->conn = conn;
+		snprintf(stmt->name, sizeof(stmt->name), "fr_stmt_%u", conn->stmt_id++);
+
+		/*
+		 *  Leave parameter types unspecified, so the
+		 *  server infers them from the query.
+		 */
+		conn->result = PQprepare(conn->db, stmt->name, query, 0, NULL);
+		rcode = sql_result_status(conn);
+		if (rcode != RLM_SQL_OK) {
+			talloc_free(stmt);
+			return rcode;
+		}
+		PQclear(conn->result);
+		conn->result = NULL;
+
+		talloc_set_destructor(stmt, _sql_stmt_free);
+		rlm_sql_stmt_add(handle, query, stmt);
+	}
+
+	conn->result = PQexecPrepared(conn->db, stmt->name, num, value, NULL, NULL, 0);
+
+	return sql_result_status(conn);
+}
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
 {
 	return sql_query(handle, config, query);
 }
 
+static sql_rcode_t sql_select_query_params(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					   char const *query, char const * const *value, int num)
+{
+	return sql_query_params(handle, config, query, value, num);
+}
+
 static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_postgres_conn_t *conn = handle->conn;
@@ -533,10 +612,13 @@ extern rlm_sql_module_t rlm_sql_postgresql;
 rlm_sql_module_t rlm_sql_postgresql = {
 	.name				= "rlm_sql_postgresql",
 //	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,	/* Needs more testing */
+	.flags				= RLM_SQL_FLAGS_PARAMS_NUMBERED,
 	.mod_instantiate		= mod_instantiate,
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
 	.sql_select_query		= sql_select_query,
+	.sql_query_params		= sql_query_params,
+	.sql_select_query_params	= sql_select_query_params,
 	.sql_num_fields			= sql_num_fields,
 	.sql_fields			= sql_fields,
 	.sql_fetch_row			= sql_fetch_row,
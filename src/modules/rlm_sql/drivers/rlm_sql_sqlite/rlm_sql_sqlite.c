@@ -52,9 +52,14 @@ typedef sqlite_int64 sqlite3_int64;
 typedef struct rlm_sql_sqlite_conn {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
+	bool statement_cached;		//!< statement is owned by the handle's statement cache.
 	int col_count;
 } rlm_sql_sqlite_conn_t;
 
+typedef struct rlm_sql_sqlite_stmt {
+	sqlite3_stmt *statement;
+} rlm_sql_sqlite_stmt_t;
+
 typedef struct rlm_sql_sqlite_config {
 	char const	*filename;
 	uint32_t	busy_timeout;
@@ -616,6 +621,78 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return sql_check_error(conn->db, status);
 }
 
+static int _sql_stmt_free(rlm_sql_sqlite_stmt_t *stmt)
+{
+	(void) sqlite3_finalize(stmt->statement);
+
+	return 0;
+}
+
+/*
+ *	Find or prepare the statement for the query, and bind the values.
+ */
+static sql_rcode_t sql_prepare_params(rlm_sql_handle_t *handle, char const *query,
+				      char const * const *value, int num)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	rlm_sql_sqlite_stmt_t	*stmt;
+	sql_rcode_t		rcode;
+	char const		*z_tail;
+	int			status, i;
+
+	stmt = rlm_sql_stmt_find(handle, query);
+	if (!stmt) {
+		MEM(stmt = talloc_zero(handle, rlm_sql_sqlite_stmt_t));
+
+#ifdef HAVE_SQLITE3_PREPARE_V2
+		status = sqlite3_prepare_v2(conn->db, query, strlen(query), &stmt->statement, &z_tail);
+#else
+		status = sqlite3_prepare(conn->db, query, strlen(query), &stmt->statement, &z_tail);
+#endif
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) {
+			(void) sqlite3_finalize(stmt->statement);
+			talloc_free(stmt);
+			return rcode;
+		}
+		talloc_set_destructor(stmt, _sql_stmt_free);
+
+		rlm_sql_stmt_add(handle, query, stmt);
+	}
+
+	conn->statement = stmt->statement;
+	conn->statement_cached = true;
+	conn->col_count = 0;
+
+	for (i = 0; i < num; i++) {
+		status = sqlite3_bind_text(conn->statement, i + 1, value[i], -1, SQLITE_TRANSIENT);
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_select_query_params(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					   char const *query, char const * const *value, int num)
+{
+	return sql_prepare_params(handle, query, value, num);
+}
+
+static sql_rcode_t sql_query_params(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				    char const *query, char const * const *value, int num)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+	int			status;
+
+	rcode = sql_prepare_params(handle, query, value, num);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	status = sqlite3_step(conn->statement);
+	return sql_check_error(conn->db, status);
+}
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -736,8 +813,18 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		/*
+		 *	Cached statements are only reset, so they
+		 *	can be executed again.
+		 */
+		if (conn->statement_cached) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
+		conn->statement_cached = false;
 		conn->col_count = 0;
 	}
 
@@ -804,6 +891,8 @@ rlm_sql_module_t rlm_sql_sqlite = {
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
 	.sql_select_query		= sql_select_query,
+	.sql_query_params		= sql_query_params,
+	.sql_select_query_params	= sql_select_query_params,
 	.sql_num_fields			= sql_num_fields,
 	.sql_affected_rows		= sql_affected_rows,
 	.sql_fetch_row			= sql_fetch_row,
@@ -63,10 +63,18 @@ static const CONF_PARSER type_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER batch_config[] = {
+	{ FR_CONF_OFFSET("max_size", PW_TYPE_INTEGER, rlm_sql_config_t, accounting.batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_latency", PW_TYPE_TIMEVAL, rlm_sql_config_t, accounting.batch_latency), .dflt = "0.1" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER acct_config[] = {
 	{ FR_CONF_OFFSET("reference", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, accounting.reference), .dflt = ".query" },
 	{ FR_CONF_OFFSET("logfile", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, accounting.logfile) },
 
+	{ FR_CONF_POINTER("batch", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) batch_config },
+
 	{ FR_CONF_POINTER("type", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) type_config },
 	CONF_PARSER_TERMINATOR
 };
@@ -113,6 +121,7 @@ static const CONF_PARSER module_config[] = {
 	 *	This only works for a few drivers.
 	 */
 	{ FR_CONF_OFFSET("query_timeout", PW_TYPE_INTEGER, rlm_sql_config_t, query_timeout) },
+	{ FR_CONF_OFFSET("prepared_statements", PW_TYPE_BOOLEAN, rlm_sql_config_t, prepared_statements), .dflt = "no" },
 
 	{ FR_CONF_POINTER("accounting", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) acct_config },
 
@@ -833,7 +842,7 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 	VALUE_PAIR		*check_tmp = NULL, *reply_tmp = NULL, *sql_group = NULL;
 	rlm_sql_grouplist_t	*head = NULL, *entry = NULL;
 
-	char			*expanded = NULL;
+	rlm_sql_params_t	*params = NULL;
 	int			rows;
 
 	rad_assert(request->packet != NULL);
@@ -892,15 +901,15 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 			/*
 			 *	Expand the group query
 			 */
-			if (radius_axlat(&expanded, request, inst->config->authorize_group_check_query,
-					 inst->sql_escape_func, *handle) < 0) {
+			if (rlm_sql_xlat_params(request, &params, inst, request, *handle,
+						inst->config->authorize_group_check_query) < 0) {
 				REDEBUG("Error generating query");
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
 
-			rows = sql_getvpdata(request, inst, request, handle, &check_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata(request, inst, request, handle, &check_tmp, params);
+			TALLOC_FREE(params);
 			if (rows < 0) {
 				REDEBUG("Error retrieving check pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -942,15 +951,15 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 			/*
 			 *	Now get the reply pairs since the paircompare matched
 			 */
-			if (radius_axlat(&expanded, request, inst->config->authorize_group_reply_query,
-					 inst->sql_escape_func, *handle) < 0) {
+			if (rlm_sql_xlat_params(request, &params, inst, request, *handle,
+						inst->config->authorize_group_reply_query) < 0) {
 				REDEBUG("Error generating query");
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
 
-			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp, params);
+			TALLOC_FREE(params);
 			if (rows < 0) {
 				REDEBUG("Error retrieving reply pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -1090,6 +1099,160 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 }
 
 
+/*
+ *	Queries opt in to batching with "batch = yes" in the
+ *	section containing them.
+ */
+static bool acct_batch_enabled(CONF_PAIR *pair)
+{
+	CONF_PAIR	*cp;
+	char const	*value;
+
+	cp = cf_pair_find(cf_item_parent(cf_pair_to_item(pair)), "batch");
+	if (!cp) return false;
+
+	value = cf_pair_value(cp);
+
+	return (value && (strcmp(value, "yes") == 0));
+}
+
+/*
+ *	A group of alternative queries, found by expanding
+ *	a section's "reference".
+ */
+typedef struct sql_acct_query {
+	char const		*path;		//!< Expanded reference which finds the queries.
+	char const		*attr;		//!< Name of the config items holding the queries.
+	bool			batch;		//!< Whether the first query may be batched.
+	int			num;		//!< Number of alternative queries.
+	CONF_PAIR		**cp;		//!< Config items holding the queries.
+	xlat_exp_t		**xlat;		//!< Pre-compiled queries.  NULL for null queries.
+} sql_acct_query_t;
+
+static int acct_query_cmp(void const *one, void const *two)
+{
+	sql_acct_query_t const *a = one;
+	sql_acct_query_t const *b = two;
+
+	return strcmp(a->path, b->path);
+}
+
+/*
+ *	Pre-compile a config item, and the items after it with the
+ *	same name, which are the alternatives tried if it fails.
+ *
+ *	Items which aren't valid expansions are skipped, and looked
+ *	up at run time as before, so any error is only reported if
+ *	they are ever used.
+ */
+static void acct_query_add(sql_acct_section_t *section, CONF_SECTION *cs, CONF_PAIR *first, char const *prefix)
+{
+	sql_acct_query_t	*query;
+	CONF_PAIR		*cp;
+	char const		*attr = cf_pair_attr(first);
+	char const		*error;
+	char			*fmt;
+	int			i;
+
+	MEM(query = talloc_zero(section->queries, sql_acct_query_t));
+	MEM(query->path = talloc_asprintf(query, "%s%s", prefix, attr));
+	query->attr = attr;
+	query->batch = acct_batch_enabled(first);
+
+	for (cp = first; cp; cp = cf_pair_find_next(cs, cp, attr)) query->num++;
+
+	MEM(query->cp = talloc_array(query, CONF_PAIR *, query->num));
+	MEM(query->xlat = talloc_zero_array(query, xlat_exp_t *, query->num));
+
+	for (cp = first, i = 0; cp; cp = cf_pair_find_next(cs, cp, attr), i++) {
+		query->cp[i] = cp;
+		if (!cf_pair_value(cp)) continue;
+
+		MEM(fmt = talloc_typed_strdup(query, cf_pair_value(cp)));	/* modified by xlat_tokenize */
+		if (xlat_tokenize(query, fmt, &query->xlat[i], &error) < 0) {
+			DEBUG3("Not pre-compiling %s: %s", query->path, error);
+			talloc_free(query);
+			return;
+		}
+	}
+
+	if (!rbtree_insert(section->queries, query)) talloc_free(query);
+}
+
+/*
+ *	Find every group of queries in a section, under the
+ *	paths cf_reference_item() would use to find them.
+ */
+static void acct_queries_index(sql_acct_section_t *section, CONF_SECTION *cs, char const *prefix)
+{
+	CONF_ITEM	*ci;
+	CONF_SECTION	*subcs;
+	CONF_PAIR	*cp;
+	char		*path;
+
+	for (ci = cf_item_find_next(cs, NULL); ci; ci = cf_item_find_next(cs, ci)) {
+		if (cf_item_is_section(ci)) {
+			subcs = cf_item_to_section(ci);
+
+			/*
+			 *	"foo." only finds the first "foo" section,
+			 *	"foo[bar]." finds any of them.
+			 */
+			if (cf_section_sub_find(cs, cf_section_name1(subcs)) == subcs) {
+				MEM(path = talloc_asprintf(NULL, "%s%s.", prefix, cf_section_name1(subcs)));
+				acct_queries_index(section, subcs, path);
+				talloc_free(path);
+			}
+
+			if (cf_section_name2(subcs)) {
+				MEM(path = talloc_asprintf(NULL, "%s%s[%s].", prefix,
+							   cf_section_name1(subcs), cf_section_name2(subcs)));
+				acct_queries_index(section, subcs, path);
+				talloc_free(path);
+			}
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		/*
+		 *	Only the first item with a name can be
+		 *	referenced, the others are its alternatives.
+		 */
+		cp = cf_item_to_pair(ci);
+		if (cf_pair_find(cs, cf_pair_attr(cp)) != cp) continue;
+
+		acct_query_add(section, cs, cp, prefix);
+	}
+}
+
+/*
+ *	Pre-compile the reference of an accounting or post-auth
+ *	section, and every group of queries it could refer to.
+ */
+static int acct_section_init(rlm_sql_t *inst, sql_acct_section_t *section)
+{
+	char const	*error;
+	char		*fmt;
+
+	if (!section->reference_cp) return 0;
+
+	MEM(fmt = talloc_typed_strdup(inst, section->reference));	/* modified by xlat_tokenize */
+	if (xlat_tokenize(inst, fmt, &section->reference_xlat, &error) < 0) {
+		cf_log_err_cs(section->cs, "Failed parsing reference: %s", error);
+		talloc_free(fmt);
+		return -1;
+	}
+
+	MEM(section->queries = rbtree_create(inst, acct_query_cmp, NULL, RBTREE_FLAG_NONE));
+	acct_queries_index(section, section->cs, ".");
+
+	DEBUG2("Pre-compiled %u query groups in %s", rbtree_num_elements(section->queries),
+	       cf_section_name1(section->cs));
+
+	return 0;
+}
+
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_sql_t *inst = instance;
@@ -1137,6 +1300,18 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->config->postauth.cs = cf_section_sub_find(conf, "post-auth");
 	inst->config->postauth.reference_cp = (cf_pair_find(inst->config->postauth.cs, "reference") != NULL);
 
+	if ((acct_section_init(inst, &inst->config->accounting) < 0) ||
+	    (acct_section_init(inst, &inst->config->postauth) < 0)) return -1;
+
+	if (inst->config->accounting.batch_size > 0) {
+		FR_INTEGER_BOUND_CHECK("batch.max_size", inst->config->accounting.batch_size, <=, 10000);
+		FR_TIMEVAL_BOUND_CHECK("batch.max_latency", &inst->config->accounting.batch_latency, >=, 0, 1000);
+		FR_TIMEVAL_BOUND_CHECK("batch.max_latency", &inst->config->accounting.batch_latency, <=, 5, 0);
+
+		inst->config->accounting.batch = sql_batch_alloc(inst, inst, inst->config->accounting.batch_size,
+								 &inst->config->accounting.batch_latency);
+	}
+
 	/*
 	 *	Cache the SQL-User-Name fr_dict_attr_t, so we can be slightly
 	 *	more efficient about creating SQL-User-Name attributes.
@@ -1189,6 +1364,12 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 				inst->module->sql_escape_func :
 				sql_escape_func;
 
+	if (inst->config->prepared_statements && !inst->module->sql_query_params) {
+		WARN("Driver %s does not support prepared statements, ignoring 'prepared_statements'",
+		     inst->config->sql_driver_name);
+		inst->config->prepared_statements = false;
+	}
+
 	inst->ef = module_exfile_init(inst, conf, 256, 30, true, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err_cs(conf, "Failed creating log file context");
@@ -1231,7 +1412,7 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 
 	int	rows;
 
-	char	*expanded = NULL;
+	rlm_sql_params_t	*params = NULL;
 
 	rad_assert(request->packet != NULL);
 	rad_assert(request->reply != NULL);
@@ -1269,15 +1450,15 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		vp_cursor_t cursor;
 		VALUE_PAIR *vp;
 
-		if (radius_axlat(&expanded, request, inst->config->authorize_check_query,
-				 inst->sql_escape_func, handle) < 0) {
+		if (rlm_sql_xlat_params(request, &params, inst, request, handle,
+					inst->config->authorize_check_query) < 0) {
 			REDEBUG("Failed generating query");
 			rcode = RLM_MODULE_FAIL;
 			goto error;
 		}
 
-		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, params);
+		TALLOC_FREE(params);
 		if (rows < 0) {
 			REDEBUG("Failed getting check attributes");
 			rcode = RLM_MODULE_FAIL;
@@ -1317,15 +1498,15 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		/*
 		 *	Now get the reply pairs since the paircompare matched
 		 */
-		if (radius_axlat(&expanded, request, inst->config->authorize_reply_query,
-				 inst->sql_escape_func, handle) < 0) {
+		if (rlm_sql_xlat_params(request, &params, inst, request, handle,
+					inst->config->authorize_reply_query) < 0) {
 			REDEBUG("Error generating query");
 			rcode = RLM_MODULE_FAIL;
 			goto error;
 		}
 
-		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, params);
+		TALLOC_FREE(params);
 		if (rows < 0) {
 			REDEBUG("SQL query error getting reply attributes");
 			rcode = RLM_MODULE_FAIL;
@@ -1468,7 +1649,8 @@ error:
  *	Generic function for failing between a bunch of queries.
  *
  *	Uses the same principle as rlm_linelog, expanding the 'reference' config
- *	item using xlat to figure out what query it should execute.
+ *	item using xlat to figure out what query it should execute.  The queries
+ *	are usually found in the table built by acct_section_init().
  *
  *	If the reference matches multiple config items, and a query fails or
  *	doesn't update any rows, the next matching config item is used.
@@ -1489,7 +1671,10 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
-	char			*expanded = NULL;
+	rlm_sql_params_t	*params = NULL;
+	bool			batch = false;
+	sql_acct_query_t	find, *query;
+	int			i = 0;
 
 	rad_assert(section);
 
@@ -1497,35 +1682,51 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 		*p++ = '.';
 	}
 
-	if (radius_xlat(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
+	if (radius_xlat_struct(p, sizeof(path) - (p - path), request, section->reference_xlat, NULL, NULL) < 0) {
 		rcode = RLM_MODULE_FAIL;
 
 		goto finish;
 	}
 
 	/*
-	 *	If we can't find a matching config item we do
-	 *	nothing so return RLM_MODULE_NOOP.
+	 *	Most references find queries which were
+	 *	pre-compiled during instantiation.
 	 */
-	item = cf_reference_item(NULL, section->cs, path);
-	if (!item) {
-		RWDEBUG("No such configuration item %s", path);
-		rcode = RLM_MODULE_NOOP;
+	find.path = path;
+	query = rbtree_finddata(section->queries, &find);
+	if (query) {
+		pair = query->cp[0];
+		attr = query->attr;
+		batch = query->batch;
 
-		goto finish;
-	}
-	if (cf_item_is_section(item)){
-		RWDEBUG("Sections are not supported as references");
-		rcode = RLM_MODULE_NOOP;
+	} else {
+		/*
+		 *	If we can't find a matching config item we do
+		 *	nothing so return RLM_MODULE_NOOP.
+		 */
+		item = cf_reference_item(NULL, section->cs, path);
+		if (!item) {
+			RWDEBUG("No such configuration item %s", path);
+			rcode = RLM_MODULE_NOOP;
 
-		goto finish;
-	}
+			goto finish;
+		}
+		if (cf_item_is_section(item)){
+			RWDEBUG("Sections are not supported as references");
+			rcode = RLM_MODULE_NOOP;
+
+			goto finish;
+		}
 
-	pair = cf_item_to_pair(item);
-	attr = cf_pair_attr(pair);
+		pair = cf_item_to_pair(item);
+		attr = cf_pair_attr(pair);
+		batch = acct_batch_enabled(pair);
+	}
 
 	RDEBUG2("Using query template '%s'", attr);
 
+	if (!section->batch) batch = false;
+
 	handle = fr_connection_get(inst->pool, request);
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
@@ -1544,24 +1745,64 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 			goto finish;
 		}
 
-		if (radius_axlat(&expanded, request, value, inst->sql_escape_func, handle) < 0) {
+		if (query) {
+			sql_ret = rlm_sql_xlat_struct_params(request, &params, inst, request, handle, query->xlat[i]);
+		} else {
+			sql_ret = rlm_sql_xlat_params(request, &params, inst, request, handle, value);
+		}
+		if (sql_ret < 0) {
 			rcode = RLM_MODULE_FAIL;
 
 			goto finish;
 		}
 
-		if (!*expanded) {
+		if (!*params->escaped) {
 			RDEBUG("Ignoring null query");
 			rcode = RLM_MODULE_NOOP;
-			talloc_free(expanded);
+			talloc_free(params);
 
 			goto finish;
 		}
 
-		rlm_sql_query_log(inst, request, section, expanded);
+		rlm_sql_query_log(inst, request, section, params->escaped);
+
+		/*
+		 *  Only the first query is batched.  Alternatives
+		 *  are only needed for a few requests.
+		 */
+		if (batch) {
+			batch = false;
+
+			fr_connection_release(inst->pool, request, handle);
+			handle = NULL;
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
-		TALLOC_FREE(expanded);
+			numaffected = sql_batch_query(section->batch, request, params);
+			if (numaffected > 0) {
+				RDEBUG("%i record(s) updated", numaffected);
+				break;
+			}
+
+			handle = fr_connection_get(inst->pool, request);
+			if (!handle) {
+				rcode = RLM_MODULE_FAIL;
+
+				goto finish;
+			}
+
+			if (numaffected == 0) {
+				TALLOC_FREE(params);
+				RDEBUG("0 record(s) updated");
+				goto next;
+			}
+
+			/*
+			 *  Nothing in the batch was committed,
+			 *  so run the query on its own.
+			 */
+		}
+
+		sql_ret = rlm_sql_query_params(inst, request, &handle, params);
+		TALLOC_FREE(params);
 		RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, sql_ret, "<INVALID>"));
 
 		switch (sql_ret) {
@@ -1615,7 +1856,11 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 		 *  We assume all entries with the same name form a redundant
 		 *  set of queries.
 		 */
-		pair = cf_pair_find_next(section->cs, pair, attr);
+		if (query) {
+			pair = (++i < query->num) ? query->cp[i] : NULL;
+		} else {
+			pair = cf_pair_find_next(section->cs, pair, attr);
+		}
 
 		if (!pair) {
 			RDEBUG("No additional queries configured");
@@ -1629,7 +1874,7 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 
 
 finish:
-	talloc_free(expanded);
+	talloc_free(params);
 	fr_connection_release(inst->pool, request, handle);
 	sql_unset_user(inst, request);
 
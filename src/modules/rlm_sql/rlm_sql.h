@@ -38,6 +38,7 @@ RCSIDH(rlm_sql_h, "$Id$")
 #include <freeradius-devel/connection.h>
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/exfile.h>
+#include <freeradius-devel/batch.h>
 
 #define PW_ITEM_CHECK 0
 #define PW_ITEM_REPLY 1
@@ -77,10 +78,20 @@ typedef struct sql_acct_section {
 	char const		*reference;			//!< Reference string, expanded to point to
 								//!< a group of queries.
 	bool			reference_cp;
+	xlat_exp_t		*reference_xlat;		//!< Pre-compiled reference.
+
+	rbtree_t		*queries;			//!< Pre-compiled groups of queries, keyed by
+								//!< the expanded reference which finds them.
 
 	char const		*logfile;
 
 	char const		**query;			/* for xlat parsing */
+
+	uint32_t		batch_size;			//!< Maximum number of queries per batch.
+								//!< 0 disables batching.
+	struct timeval		batch_latency;			//!< Maximum time a query waits for a running
+								//!< batch to finish.
+	fr_batch_t		*batch;				//!< Queries waiting to be run together.
 } sql_acct_section_t;
 
 typedef struct sql_config {
@@ -135,6 +146,9 @@ typedef struct sql_config {
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
+	bool			prepared_statements;		//!< Pass expanded values as bind parameters
+								//!< of statements prepared once per connection.
+
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
 
@@ -158,14 +172,31 @@ typedef struct rlm_sql_handle {
 	rlm_sql_t		*inst;				//!< The rlm_sql instance this connection belongs to.
 	TALLOC_CTX		*log_ctx;			//!< Talloc pool used to avoid allocing memory
 								//!< when log strings need to be copied.
+	rbtree_t		*stmts;				//!< Statements prepared on this connection,
+								//!< keyed by query text.
 } rlm_sql_handle_t;
 
+/** A query with its expansions split out as bind parameters
+ *
+ * Produced by #rlm_sql_xlat_params.
+ */
+typedef struct rlm_sql_params {
+	char			*query;				//!< Query with placeholders in place of expansions.
+								//!< NULL if the query can't be parameterised.
+	char			*escaped;			//!< Query with escaped expansions, as it would be
+								//!< sent without bind parameters.
+	char const		**value;			//!< Values to bind, in placeholder order.
+								//!< NULL entries are bound as SQL NULL.
+	int			num;				//!< Number of values to bind.
+} rlm_sql_params_t;
+
 extern const FR_NAME_NUMBER sql_rcode_table[];
 /*
  *	Capabilities flags for drivers
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_FLAGS_PARAMS_NUMBERED	2			//!< Placeholders are $1, $2... instead of ?.
 
 /** Retrieve errors from the last query operation
  *
@@ -200,6 +231,18 @@ typedef struct rlm_sql_module_t {
 
 	sql_rcode_t (*sql_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query);
 	sql_rcode_t (*sql_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query);
+
+	/*
+	 *	Optional.  Prepare the query (or find the statement
+	 *	already prepared on this connection), bind the values,
+	 *	and execute it.  Results are retrieved and freed in the
+	 *	same way as for sql_query and sql_select_query.  NULL
+	 *	values must be bound as SQL NULL.
+	 */
+	sql_rcode_t (*sql_query_params)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+					char const * const *value, int num);
+	sql_rcode_t (*sql_select_query_params)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+					       char const * const *value, int num);
 	sql_rcode_t (*sql_store_result)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	int (*sql_num_fields)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
@@ -249,13 +292,30 @@ typedef struct sql_grouplist {
 void		*mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
 int		sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **first_pair, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
-int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query);
+int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, rlm_sql_params_t const *params);
 int		sql_read_clients(rlm_sql_handle_t *handle);
 int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+int		rlm_sql_xlat_params(TALLOC_CTX *ctx, rlm_sql_params_t **out, rlm_sql_t const *inst, REQUEST *request,
+				    rlm_sql_handle_t *handle, char const *fmt) CC_HINT(nonnull);
+int		rlm_sql_xlat_struct_params(TALLOC_CTX *ctx, rlm_sql_params_t **out, rlm_sql_t const *inst,
+					   REQUEST *request, rlm_sql_handle_t *handle, xlat_exp_t const *xlat) CC_HINT(nonnull);
+sql_rcode_t	rlm_sql_query_params(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				     rlm_sql_params_t const *params) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_select_query_params(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+					    rlm_sql_params_t const *params) CC_HINT(nonnull (1, 3, 4));
+void		*rlm_sql_stmt_find(rlm_sql_handle_t *handle, char const *query);
+void		rlm_sql_stmt_add(rlm_sql_handle_t *handle, char const *query, void *stmt);
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username);
+
+/*
+ *	batch.c
+ */
+fr_batch_t	*sql_batch_alloc(TALLOC_CTX *ctx, rlm_sql_t *inst, uint32_t max_size,
+				 struct timeval const *max_latency);
+int		sql_batch_query(fr_batch_t *batch, REQUEST *request, rlm_sql_params_t const *params);
 #endif
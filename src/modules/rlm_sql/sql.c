@@ -39,6 +39,10 @@ RCSID("$Id$")
 
 #include	"rlm_sql.h"
 
+#define SQL_PARAM_MARKER	'\x1f'	//!< Delimits the index of a bind parameter in an expanded query.
+#define SQL_PARAM_NONCE_LEN	16	//!< Hex digits of the nonce in each marker.
+#define SQL_STMT_CACHE_MAX	256	//!< Maximum number of statements prepared on a connection.
+
 /*
  *	Translate rlm_sql rcodes to humanly
  *	readable reason strings.
@@ -52,6 +56,43 @@ const FR_NAME_NUMBER sql_rcode_table[] = {
 	{ NULL, 0 }
 };
 
+/*
+ *	A statement prepared on a connection.
+ */
+typedef struct sql_stmt {
+	char const		*query;			//!< Query text the statement was prepared from.
+	void			*stmt;			//!< Driver specific statement, parented by this entry.
+} sql_stmt_t;
+
+/*
+ *	State for expanding a query with bind parameters.
+ */
+typedef struct sql_params_ctx {
+	rlm_sql_t const		*inst;
+	rlm_sql_handle_t	*handle;
+	rlm_sql_params_t	*params;
+	char const		**value;		//!< Values, in expansion order.
+	char			**escaped;		//!< Escaped values, in expansion order.
+	int			num;			//!< Number of expansions.
+	bool			failed;			//!< An expansion couldn't be replaced with a marker.
+	char			nonce[SQL_PARAM_NONCE_LEN + 1];	//!< Random, and different for each query, so
+							//!< markers can't be forged by attribute values.
+} sql_params_ctx_t;
+
+/*
+ *	Prepared statements have to be released before the driver
+ *	closes the connection.
+ */
+static int _sql_handle_free(rlm_sql_handle_t *handle)
+{
+	if (handle->stmts) {
+		rbtree_free(handle->stmts);
+		handle->stmts = NULL;
+	}
+
+	return 0;
+}
+
 void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout)
 {
 	int rcode;
@@ -76,6 +117,7 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	 *	destructor has access to the module configuration.
 	 */
 	handle->inst = inst;
+	talloc_set_destructor(handle, _sql_handle_free);
 
 	rcode = (inst->module->sql_socket_init)(handle, inst->config, timeout);
 	if (rcode != 0) {
@@ -300,23 +342,8 @@ void rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle
 	talloc_free_children(handle->log_ctx);
 }
 
-/** Call the driver's sql_query method, reconnecting if necessary.
- *
- * @note Caller must call ``(inst->module->sql_finish_query)(handle, inst->config);``
- *	after they're done with the result.
- *
- * @param handle to query the database with. *handle should not be NULL, as this indicates
- * 	previous reconnection attempt has failed.
- * @param request Current request.
- * @param inst #rlm_sql_t instance data.
- * @param query to execute. Should not be zero length.
- * @return
- *	- #RLM_SQL_OK on success.
- *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
- *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
- *	- #RLM_SQL_ALT_QUERY on constraints violation.
- */
-sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+static sql_rcode_t sql_query_run(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				 char const *query, rlm_sql_params_t const *params)
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
@@ -342,7 +369,13 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	for (i = 0; i < (count + 1); i++) {
 		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query);
 
-		ret = (inst->module->sql_query)(*handle, inst->config, query);
+		if (params) {
+			ROPTIONAL(RDEBUG3, DEBUG3, "Prepared as: %s", params->query);
+			ret = (inst->module->sql_query_params)(*handle, inst->config, params->query,
+							       params->value, params->num);
+		} else {
+			ret = (inst->module->sql_query)(*handle, inst->config, query);
+		}
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -402,22 +435,8 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	return RLM_SQL_ERROR;
 }
 
-/** Call the driver's sql_select_query method, reconnecting if necessary.
- *
- * @note Caller must call ``(inst->module->sql_finish_select_query)(handle, inst->config);``
- *	after they're done with the result.
- *
- * @param inst #rlm_sql_t instance data.
- * @param request Current request.
- * @param handle to query the database with. *handle should not be NULL, as this indicates
- *	  previous reconnection attempt has failed.
- * @param query to execute. Should not be zero length.
- * @return
- *	- #RLM_SQL_OK on success.
- *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
- *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
- */
-sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,  char const *query)
+static sql_rcode_t sql_select_query_run(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+					char const *query, rlm_sql_params_t const *params)
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
@@ -443,7 +462,13 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	for (i = 0; i < (count + 1); i++) {
 		ROPTIONAL(RDEBUG2, DEBUG2, "Executing select query: %s", query);
 
-		ret = (inst->module->sql_select_query)(*handle, inst->config, query);
+		if (params) {
+			ROPTIONAL(RDEBUG3, DEBUG3, "Prepared as: %s", params->query);
+			ret = (inst->module->sql_select_query_params)(*handle, inst->config, params->query,
+								      params->value, params->num);
+		} else {
+			ret = (inst->module->sql_select_query)(*handle, inst->config, query);
+		}
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -475,6 +500,466 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	return RLM_SQL_ERROR;
 }
 
+/** Call the driver's sql_query method, reconnecting if necessary.
+ *
+ * @note Caller must call ``(inst->module->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ * 	previous reconnection attempt has failed.
+ * @param request Current request.
+ * @param inst #rlm_sql_t instance data.
+ * @param query to execute. Should not be zero length.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+{
+	return sql_query_run(inst, request, handle, query, NULL);
+}
+
+/** Call the driver's sql_query_params method, reconnecting if necessary.
+ *
+ * Falls back to sql_query with the escaped query, if the query couldn't be
+ * parameterised, or the driver doesn't support bind parameters.
+ *
+ * @note Caller must call ``(inst->module->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ * 	previous reconnection attempt has failed.
+ * @param params produced by #rlm_sql_xlat_params.
+ * @return the same as #rlm_sql_query.
+ */
+sql_rcode_t rlm_sql_query_params(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				 rlm_sql_params_t const *params)
+{
+	if (!params->query || !inst->module->sql_query_params) {
+		return sql_query_run(inst, request, handle, params->escaped, NULL);
+	}
+
+	return sql_query_run(inst, request, handle, params->escaped, params);
+}
+
+/** Call the driver's sql_select_query method, reconnecting if necessary.
+ *
+ * @note Caller must call ``(inst->module->sql_finish_select_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param query to execute. Should not be zero length.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ */
+sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,  char const *query)
+{
+	return sql_select_query_run(inst, request, handle, query, NULL);
+}
+
+/** Call the driver's sql_select_query_params method, reconnecting if necessary.
+ *
+ * Falls back to sql_select_query with the escaped query, if the query couldn't be
+ * parameterised, or the driver doesn't support bind parameters.
+ *
+ * @note Caller must call ``(inst->module->sql_finish_select_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param params produced by #rlm_sql_xlat_params.
+ * @return the same as #rlm_sql_select_query.
+ */
+sql_rcode_t rlm_sql_select_query_params(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+					rlm_sql_params_t const *params)
+{
+	if (!params->query || !inst->module->sql_select_query_params) {
+		return sql_select_query_run(inst, request, handle, params->escaped, NULL);
+	}
+
+	return sql_select_query_run(inst, request, handle, params->escaped, params);
+}
+
+
+/*
+ *	Parse a marker of the form <marker><nonce>:<index><marker>
+ *
+ *	Returns the index, or -1 if p doesn't point to a marker
+ *	for this query.
+ */
+static int sql_params_marker(sql_params_ctx_t const *pctx, char const *p, char const **end)
+{
+	char	*q;
+	long	idx;
+
+	if (p[0] != SQL_PARAM_MARKER) return -1;
+	if (strncmp(p + 1, pctx->nonce, SQL_PARAM_NONCE_LEN) != 0) return -1;
+	p += SQL_PARAM_NONCE_LEN + 1;
+
+	if ((p[0] != ':') || !isdigit((int) p[1])) return -1;
+
+	idx = strtol(p + 1, &q, 10);
+	if ((*q != SQL_PARAM_MARKER) || (idx < 0) || (idx >= pctx->num)) return -1;
+
+	*end = q + 1;
+
+	return idx;
+}
+
+/*
+ *	Record the value of an expansion, and write a marker
+ *	containing its index in place of the escaped value.
+ */
+static size_t sql_params_escape(REQUEST *request, char *out, size_t outlen, char const *in, void *arg)
+{
+	sql_params_ctx_t	*pctx = arg;
+	char			*escaped;
+	char const		*p;
+	size_t			len;
+	int			ret;
+
+	/*
+	 *	Alternations are escaped twice, so the input may
+	 *	already be a marker.
+	 */
+	if ((sql_params_marker(pctx, in, &p) >= 0) && !*p) return strlcpy(out, in, outlen);
+
+	len = (strlen(in) + 1) * 3;
+	MEM(escaped = talloc_array(pctx->params, char, len));
+	pctx->inst->sql_escape_func(request, escaped, len, in, pctx->handle);
+
+	if (!pctx->failed) {
+		ret = snprintf(out, outlen, "%c%s:%i%c", SQL_PARAM_MARKER, pctx->nonce, pctx->num, SQL_PARAM_MARKER);
+		if ((ret > 0) && ((size_t) ret < outlen)) {
+			MEM(pctx->value = talloc_realloc(pctx->params, pctx->value, char const *, pctx->num + 1));
+			MEM(pctx->escaped = talloc_realloc(pctx->params, pctx->escaped, char *, pctx->num + 1));
+			MEM(pctx->value[pctx->num] = talloc_typed_strdup(pctx->params, in));
+			pctx->escaped[pctx->num] = escaped;
+			pctx->num++;
+
+			return ret;
+		}
+
+		/*
+		 *	No room for the marker, the whole query
+		 *	will have to be sent escaped.
+		 */
+		pctx->failed = true;
+	}
+
+	strlcpy(out, escaped, outlen);
+
+	return strlen(out);
+}
+
+/*
+ *	Whether a character can be part of the same SQL token as an
+ *	expansion next to it.
+ */
+static inline bool sql_params_token_char(char c)
+{
+	return isalnum((int) c) || (c == '_') || (c == '.') || (c == '$') || (c == '@') || (c == SQL_PARAM_MARKER);
+}
+
+/*
+ *	The query can't be parameterised, only the escaped form
+ *	will be sent.
+ */
+static void sql_params_unbind(rlm_sql_params_t *params)
+{
+	TALLOC_FREE(params->query);
+	TALLOC_FREE(params->value);
+	params->num = 0;
+}
+
+/*
+ *	Replace markers with escaped values, and with placeholders
+ *	where the expansion is an entire single quoted string, or a
+ *	token on its own outside of quotes.
+ *
+ *	Expansions outside of quotes are numbers, or NULL from an
+ *	alternation such as %{%{Acct-Session-Time}:-NULL}.  Empty
+ *	values and NULL are bound as SQL NULL, so every packet uses
+ *	the same statement text.  Expansions anywhere else mean the
+ *	query is sent escaped.
+ */
+static void sql_params_build(sql_params_ctx_t *pctx, char const *marked)
+{
+	rlm_sql_params_t	*params = pctx->params;
+	char const		*p, *start, *end, *value;
+	char			*e, *q = NULL, *quote_start = NULL;
+	char			quote = '\0';
+	bool			numbered = (pctx->inst->module->flags & RLM_SQL_FLAGS_PARAMS_NUMBERED);
+	size_t			len;
+	int			i, idx;
+
+	len = strlen(marked) + 1;
+	for (i = 0; i < pctx->num; i++) len += strlen(pctx->escaped[i]);
+	MEM(e = params->escaped = talloc_array(params, char, len));
+
+	/*
+	 *	Markers are always longer than placeholders.
+	 */
+	if (!pctx->failed) {
+		MEM(q = params->query = talloc_array(params, char, len));
+		MEM(params->value = talloc_array(params, char const *, pctx->num));
+	}
+
+#define COPY_CHAR do { *(e++) = *p; if (q) *(q++) = *p; p++; } while (0)
+
+	p = marked;
+	while (*p) {
+		idx = sql_params_marker(pctx, p, &end);
+		if (idx < 0) {
+			if (quote) {
+				if ((*p == quote) && (p[1] == quote)) {
+					COPY_CHAR;
+				} else if (*p == quote) {
+					quote = '\0';
+				} else if ((*p == '\\') && p[1] && (p[1] != SQL_PARAM_MARKER)) {
+					COPY_CHAR;
+				}
+				COPY_CHAR;
+				continue;
+			}
+
+			if ((*p == '\'') || (*p == '"') || (*p == '`')) {
+				quote = *p;
+				COPY_CHAR;
+				quote_start = q;
+				continue;
+			}
+
+			COPY_CHAR;
+			continue;
+		}
+
+		start = p;
+		p = end;
+
+		strcpy(e, pctx->escaped[idx]);
+		e += strlen(e);
+
+		if (!q) continue;
+
+		value = pctx->value[idx];
+		if (!quote) {
+			/*
+			 *	Part of a longer token, e.g. a number
+			 *	with a suffix.
+			 */
+			if (((start > marked) && sql_params_token_char(start[-1])) || sql_params_token_char(*p)) {
+				sql_params_unbind(params);
+				q = NULL;
+				continue;
+			}
+
+			if (!*value || (strcasecmp(value, "NULL") == 0)) value = NULL;
+		} else {
+			/*
+			 *	Not an entire single quoted string.
+			 */
+			if ((quote != '\'') || (q != quote_start) || (p[0] != '\'') || (p[1] == '\'')) {
+				sql_params_unbind(params);
+				q = NULL;
+				continue;
+			}
+
+			/*
+			 *	Drop the quotes around the placeholder.
+			 */
+			q--;
+			*(e++) = *(p++);
+			quote = '\0';
+		}
+
+		params->value[params->num++] = value;
+		if (numbered) {
+			q += sprintf(q, "$%i", params->num);
+		} else {
+			*(q++) = '?';
+		}
+	}
+	*e = '\0';
+	if (q) *q = '\0';
+
+#undef COPY_CHAR
+}
+
+/*
+ *	Expand a query from either a format string, or a pre-compiled
+ *	xlat, splitting out expansions as bind parameters.
+ */
+static int sql_xlat_params(TALLOC_CTX *ctx, rlm_sql_params_t **out, rlm_sql_t const *inst, REQUEST *request,
+			   rlm_sql_handle_t *handle, char const *fmt, xlat_exp_t const *xlat)
+{
+	rlm_sql_params_t	*params;
+	sql_params_ctx_t	pctx;
+	char			*marked = NULL;
+	ssize_t			slen;
+
+	MEM(params = talloc_zero(ctx, rlm_sql_params_t));
+
+	if (!inst->config->prepared_statements) {
+		if (xlat) {
+			slen = radius_axlat_struct(&params->escaped, request, xlat, inst->sql_escape_func, handle);
+		} else {
+			slen = radius_axlat(&params->escaped, request, fmt, inst->sql_escape_func, handle);
+		}
+		if (slen < 0) {
+		error:
+			talloc_free(params);
+			return -1;
+		}
+		talloc_steal(params, params->escaped);
+
+		*out = params;
+		return slen;
+	}
+
+	memset(&pctx, 0, sizeof(pctx));
+	pctx.inst = inst;
+	pctx.handle = handle;
+	pctx.params = params;
+	snprintf(pctx.nonce, sizeof(pctx.nonce), "%08x%08x", fr_rand(), fr_rand());
+
+	if (xlat) {
+		slen = radius_axlat_struct(&marked, request, xlat, sql_params_escape, &pctx);
+	} else {
+		slen = radius_axlat(&marked, request, fmt, sql_params_escape, &pctx);
+	}
+	if (slen < 0) goto error;
+
+	sql_params_build(&pctx, marked);
+	talloc_free(marked);
+
+	*out = params;
+	return strlen(params->escaped);
+}
+
+/** Expand a query, splitting out expansions as bind parameters
+ *
+ * Expansions which form the whole of a single quoted string, or a whole
+ * token outside of any quotes, are replaced with placeholders.  Empty
+ * values, and NULL, outside of quotes are bound as SQL NULL.  If any
+ * expansion is elsewhere, or prepared statements are disabled, only the
+ * escaped form of the query is produced.
+ *
+ * @param[in] ctx to allocate the #rlm_sql_params_t in.
+ * @param[out] out Where to write the expanded query.
+ * @param[in] inst #rlm_sql_t instance data.
+ * @param[in] request Current request.
+ * @param[in] handle the query will be run on.  Used by the driver's escape function.
+ * @param[in] fmt query to expand.
+ * @return
+ *	- Length of the escaped query.
+ *	- -1 on error.
+ */
+int rlm_sql_xlat_params(TALLOC_CTX *ctx, rlm_sql_params_t **out, rlm_sql_t const *inst, REQUEST *request,
+			rlm_sql_handle_t *handle, char const *fmt)
+{
+	return sql_xlat_params(ctx, out, inst, request, handle, fmt, NULL);
+}
+
+/** Expand a pre-compiled query, splitting out expansions as bind parameters
+ *
+ * @see rlm_sql_xlat_params
+ *
+ * @param[in] ctx to allocate the #rlm_sql_params_t in.
+ * @param[out] out Where to write the expanded query.
+ * @param[in] inst #rlm_sql_t instance data.
+ * @param[in] request Current request.
+ * @param[in] handle the query will be run on.  Used by the driver's escape function.
+ * @param[in] xlat query to expand, as produced by xlat_tokenize().
+ * @return
+ *	- Length of the escaped query.
+ *	- -1 on error.
+ */
+int rlm_sql_xlat_struct_params(TALLOC_CTX *ctx, rlm_sql_params_t **out, rlm_sql_t const *inst, REQUEST *request,
+			       rlm_sql_handle_t *handle, xlat_exp_t const *xlat)
+{
+	return sql_xlat_params(ctx, out, inst, request, handle, NULL, xlat);
+}
+
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	sql_stmt_t const *a = one;
+	sql_stmt_t const *b = two;
+
+	return strcmp(a->query, b->query);
+}
+
+static void _sql_stmt_free(void *data)
+{
+	talloc_free(data);
+}
+
+/** Find a statement previously prepared on a connection
+ *
+ * @param[in] handle to search in.
+ * @param[in] query text the statement was prepared from.
+ * @return
+ *	- The driver specific statement.
+ *	- NULL if no statement has been prepared for the query.
+ */
+void *rlm_sql_stmt_find(rlm_sql_handle_t *handle, char const *query)
+{
+	sql_stmt_t	find, *found;
+
+	if (!handle->stmts) return NULL;
+
+	find.query = query;
+	found = rbtree_finddata(handle->stmts, &find);
+	if (!found) return NULL;
+
+	return found->stmt;
+}
+
+/** Add a statement prepared on a connection
+ *
+ * The statement is reparented, and freed when the connection is closed,
+ * or when the maximum number of statements has been reached, so it
+ * should have a destructor which releases any driver resources.
+ *
+ * @param[in] handle the statement was prepared on.
+ * @param[in] query text the statement was prepared from.
+ * @param[in] stmt driver specific statement.  Must be a talloc chunk.
+ */
+void rlm_sql_stmt_add(rlm_sql_handle_t *handle, char const *query, void *stmt)
+{
+	sql_stmt_t	*entry;
+
+	/*
+	 *	Queries are built from a fixed set of templates, and
+	 *	values are bound, so this is only hit if an xlat
+	 *	changes the query text itself.  Start again.
+	 */
+	if (handle->stmts && (rbtree_num_elements(handle->stmts) >= SQL_STMT_CACHE_MAX)) {
+		rbtree_free(handle->stmts);
+		handle->stmts = NULL;
+	}
+
+	if (!handle->stmts) {
+		MEM(handle->stmts = rbtree_create(handle, sql_stmt_cmp, _sql_stmt_free, 0));
+	}
+
+	MEM(entry = talloc_zero(handle->stmts, sql_stmt_t));
+	MEM(entry->query = talloc_typed_strdup(entry, query));
+	entry->stmt = talloc_steal(entry, stmt);
+
+	if (!rbtree_insert(handle->stmts, entry)) talloc_free(entry);
+}
 
 /*************************************************************************
  *
@@ -484,7 +969,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
  *
  *************************************************************************/
 int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
-		  VALUE_PAIR **pair, char const *query)
+		  VALUE_PAIR **pair, rlm_sql_params_t const *params)
 {
 	rlm_sql_row_t	row;
 	int		rows = 0;
@@ -492,8 +977,8 @@ int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_
 
 	rad_assert(request);
 
-	rcode = rlm_sql_select_query(inst, request, handle, query);
-	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_query */
+	rcode = rlm_sql_select_query_params(inst, request, handle, params);
+	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_query_params */
 
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == 0) {
 		if (!row) break;
@@ -0,0 +1,388 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file batch.c
+ * @brief Tests for the batch queue used by rlm_sql and rlm_redis.
+ *
+ * Checks that an operation added when no batch is running is run straight
+ * away, that operations added while a batch is running are run together
+ * once it finishes, and that a batch is started early when the queue is
+ * full, or when an operation has waited for the maximum latency.  Also
+ * checks that when one operation in a batch fails, every request waiting
+ * on that batch sees the failure, as rlm_sql relies on this to run the
+ * queries from a failed transaction on their own.
+ *
+ * A batch is kept running by blocking its run callback on a gate, which
+ * the test opens once the other threads have queued their operations.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/batch.h>
+
+#define MAX_SIZE	(8)
+#define MAX_BATCHES	(64)
+
+/*
+ *	How long to give threads to queue their operations.
+ */
+#define SETTLE_USEC	(100000)
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%u]: Check \"%s\" failed: %s\n", __FILE__, __LINE__, #_x, fr_strerror()); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+typedef struct test_op {
+	int		id;		//!< Identifies the operation.
+	bool		gated;		//!< Block the batch containing this operation until
+					//!< the gate is opened.
+	bool		fail;		//!< Fail the batch containing this operation.
+	bool		failed;		//!< The batch containing this operation failed.
+	int		runs;		//!< How many times the operation was run.
+	uint32_t	batch;		//!< Number of the batch the operation was run in.
+	uint32_t	batch_size;	//!< Size of the batch the operation was run in.
+} test_op_t;
+
+typedef struct test_state {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	bool		gate_open;	//!< Whether gated batches may finish.
+	bool		gated;		//!< A gated batch is running.
+	uint32_t	batches;	//!< Number of batches run.
+	uint32_t	sizes[MAX_BATCHES];
+} test_state_t;
+
+typedef struct test_thread {
+	pthread_t	thread;
+	fr_batch_t	*batch;
+	REQUEST		*request;
+	test_op_t	op;
+} test_thread_t;
+
+static test_state_t state;
+
+static void state_reset(void)
+{
+	pthread_mutex_lock(&state.mutex);
+	state.gate_open = false;
+	state.gated = false;
+	state.batches = 0;
+	memset(state.sizes, 0, sizeof(state.sizes));
+	pthread_mutex_unlock(&state.mutex);
+}
+
+static void gate_open(void)
+{
+	pthread_mutex_lock(&state.mutex);
+	state.gate_open = true;
+	pthread_cond_broadcast(&state.cond);
+	pthread_mutex_unlock(&state.mutex);
+}
+
+/*
+ *	Wait until a gated batch is running.
+ */
+static void gate_wait(void)
+{
+	pthread_mutex_lock(&state.mutex);
+	while (!state.gated) pthread_cond_wait(&state.cond, &state.mutex);
+	pthread_mutex_unlock(&state.mutex);
+}
+
+static uint32_t batches_run(void)
+{
+	uint32_t num;
+
+	pthread_mutex_lock(&state.mutex);
+	num = state.batches;
+	pthread_mutex_unlock(&state.mutex);
+
+	return num;
+}
+
+static void test_run(UNUSED REQUEST *request, fr_batch_entry_t *list, uint32_t num, UNUSED void *uctx)
+{
+	fr_batch_entry_t	*entry;
+	test_op_t		*op;
+	uint32_t		count = 0, batch;
+	bool			gated = false, failed = false;
+
+	for (entry = list; entry; entry = entry->next) {
+		op = entry->data;
+		CHECK(!entry->done);
+		if (op->gated) gated = true;
+		if (op->fail) failed = true;
+		count++;
+	}
+	CHECK(count == num);
+	CHECK(num <= MAX_SIZE);
+
+	pthread_mutex_lock(&state.mutex);
+	batch = state.batches++;
+	CHECK(batch < MAX_BATCHES);
+	state.sizes[batch] = num;
+
+	if (gated) {
+		state.gated = true;
+		pthread_cond_broadcast(&state.cond);
+		while (!state.gate_open) pthread_cond_wait(&state.cond, &state.mutex);
+	}
+	pthread_mutex_unlock(&state.mutex);
+
+	for (entry = list; entry; entry = entry->next) {
+		op = entry->data;
+		op->runs++;
+		op->batch = batch;
+		op->batch_size = num;
+		op->failed = failed;
+	}
+}
+
+static void *test_thread(void *arg)
+{
+	test_thread_t		*thread = arg;
+	fr_batch_entry_t	entry;
+
+	fr_batch_add(thread->batch, thread->request, &entry, &thread->op);
+
+	/*
+	 *	The operation must have been run by the time
+	 *	fr_batch_add returns.
+	 */
+	CHECK(thread->op.runs == 1);
+
+	return NULL;
+}
+
+static void thread_start(test_thread_t *thread, fr_batch_t *batch, REQUEST *request, int id, bool gated, bool fail)
+{
+	memset(thread, 0, sizeof(*thread));
+	thread->batch = batch;
+	thread->request = request;
+	thread->op.id = id;
+	thread->op.gated = gated;
+	thread->op.fail = fail;
+
+	CHECK(pthread_create(&thread->thread, NULL, test_thread, thread) == 0);
+}
+
+static void thread_join(test_thread_t *thread)
+{
+	CHECK(pthread_join(thread->thread, NULL) == 0);
+	CHECK(thread->op.runs == 1);
+}
+
+/*
+ *	With nothing running, an operation is run on its own, without
+ *	waiting for the maximum latency.
+ */
+static void test_idle(TALLOC_CTX *ctx, REQUEST *request)
+{
+	struct timeval		latency = { 5, 0 }, start, end, elapsed;
+	fr_batch_t		*batch;
+	fr_batch_entry_t	entry;
+	test_op_t		op = { .id = 1 };
+
+	state_reset();
+	batch = fr_batch_alloc(ctx, MAX_SIZE, &latency, test_run, NULL);
+
+	gettimeofday(&start, NULL);
+	fr_batch_add(batch, request, &entry, &op);
+	gettimeofday(&end, NULL);
+
+	CHECK(op.runs == 1);
+	CHECK(op.batch_size == 1);
+	CHECK(entry.done);
+
+	fr_timeval_subtract(&elapsed, &end, &start);
+	CHECK(elapsed.tv_sec == 0);
+
+	talloc_free(batch);
+}
+
+/*
+ *	Operations added while a batch is running are run together,
+ *	as soon as the running batch finishes.
+ */
+static void test_follow(TALLOC_CTX *ctx, REQUEST **requests)
+{
+	struct timeval		latency = { 5, 0 };
+	fr_batch_t		*batch;
+	test_thread_t		threads[MAX_SIZE];
+	int			i, num = MAX_SIZE - 2;
+
+	state_reset();
+	batch = fr_batch_alloc(ctx, MAX_SIZE, &latency, test_run, NULL);
+
+	thread_start(&threads[0], batch, requests[0], 0, true, false);
+	gate_wait();
+
+	for (i = 1; i <= num; i++) thread_start(&threads[i], batch, requests[i], i, false, false);
+	usleep(SETTLE_USEC);
+
+	/*
+	 *	Nothing else can run until the first batch finishes.
+	 */
+	CHECK(batches_run() == 1);
+	gate_open();
+
+	for (i = 0; i <= num; i++) thread_join(&threads[i]);
+
+	CHECK(batches_run() == 2);
+	CHECK(threads[0].op.batch == 0);
+	for (i = 1; i <= num; i++) {
+		CHECK(threads[i].op.batch == 1);
+		CHECK(threads[i].op.batch_size == (uint32_t)num);
+	}
+
+	talloc_free(batch);
+}
+
+/*
+ *	A full queue is run straight away, even while another batch
+ *	is running.
+ */
+static void test_max_size(TALLOC_CTX *ctx, REQUEST **requests)
+{
+	struct timeval		latency = { 5, 0 };
+	fr_batch_t		*batch;
+	test_thread_t		threads[MAX_SIZE + 1];
+	int			i;
+
+	state_reset();
+	batch = fr_batch_alloc(ctx, MAX_SIZE, &latency, test_run, NULL);
+
+	thread_start(&threads[0], batch, requests[0], 0, true, false);
+	gate_wait();
+
+	for (i = 1; i <= MAX_SIZE; i++) thread_start(&threads[i], batch, requests[i], i, false, false);
+
+	/*
+	 *	The full batch finishes while the first is blocked.
+	 */
+	for (i = 1; i <= MAX_SIZE; i++) thread_join(&threads[i]);
+	CHECK(batches_run() == 2);
+
+	for (i = 1; i <= MAX_SIZE; i++) {
+		CHECK(threads[i].op.batch == 1);
+		CHECK(threads[i].op.batch_size == MAX_SIZE);
+	}
+
+	gate_open();
+	thread_join(&threads[0]);
+
+	talloc_free(batch);
+}
+
+/*
+ *	An operation which has waited for the maximum latency is run,
+ *	even though the batch in front of it hasn't finished.
+ */
+static void test_max_latency(TALLOC_CTX *ctx, REQUEST **requests)
+{
+	struct timeval		latency = { 0, 20000 }, start, end, elapsed;
+	fr_batch_t		*batch;
+	test_thread_t		threads[2];
+
+	state_reset();
+	batch = fr_batch_alloc(ctx, MAX_SIZE, &latency, test_run, NULL);
+
+	thread_start(&threads[0], batch, requests[0], 0, true, false);
+	gate_wait();
+
+	gettimeofday(&start, NULL);
+	thread_start(&threads[1], batch, requests[1], 1, false, false);
+	thread_join(&threads[1]);
+	gettimeofday(&end, NULL);
+
+	CHECK(batches_run() == 2);
+	CHECK(threads[1].op.batch_size == 1);
+
+	fr_timeval_subtract(&elapsed, &end, &start);
+	CHECK((elapsed.tv_sec > 0) || (elapsed.tv_usec >= latency.tv_usec));
+
+	gate_open();
+	thread_join(&threads[0]);
+
+	talloc_free(batch);
+}
+
+/*
+ *	Every operation in a failed batch is told it failed, and
+ *	operations in other batches aren't.
+ */
+static void test_failed(TALLOC_CTX *ctx, REQUEST **requests)
+{
+	struct timeval		latency = { 5, 0 };
+	fr_batch_t		*batch;
+	test_thread_t		threads[4];
+	int			i;
+
+	state_reset();
+	batch = fr_batch_alloc(ctx, MAX_SIZE, &latency, test_run, NULL);
+
+	thread_start(&threads[0], batch, requests[0], 0, true, false);
+	gate_wait();
+
+	for (i = 1; i < 4; i++) thread_start(&threads[i], batch, requests[i], i, false, (i == 2));
+	usleep(SETTLE_USEC);
+	gate_open();
+
+	for (i = 0; i < 4; i++) thread_join(&threads[i]);
+
+	CHECK(batches_run() == 2);
+	CHECK(!threads[0].op.failed);
+	for (i = 1; i < 4; i++) {
+		CHECK(threads[i].op.batch == 1);
+		CHECK(threads[i].op.failed);
+	}
+
+	talloc_free(batch);
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	TALLOC_CTX	*ctx = talloc_init("batch");
+	REQUEST		*requests[MAX_SIZE + 1];
+	int		i;
+
+	pthread_mutex_init(&state.mutex, NULL);
+	pthread_cond_init(&state.cond, NULL);
+
+	/*
+	 *	Each thread gets its own request, as talloc
+	 *	isn't thread safe.
+	 */
+	for (i = 0; i <= MAX_SIZE; i++) MEM(requests[i] = request_alloc(ctx));
+
+	test_idle(ctx, requests[0]);
+	test_follow(ctx, requests);
+	test_max_size(ctx, requests);
+	test_max_latency(ctx, requests);
+	test_failed(ctx, requests);
+
+	talloc_free(ctx);
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+TARGET		:= batch
+SOURCES		:= batch.c
+
+TGT_INSTALLDIR	:=
+TGT_PREREQS	:= libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
+
+#
+#  Run the batch queue tests
+#
+.PHONY: tests.batch
+tests.batch: $(TESTBINDIR)/batch
+	@echo BATCH-TEST
+	@$(TESTBIN)/batch
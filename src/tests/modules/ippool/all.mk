@@ -0,0 +1,7 @@
+#
+#  Test the "ippool" module
+#
+
+#  MODULE.test is the main target for this module.
+ippool.test:
+	@echo OK: ippool.test
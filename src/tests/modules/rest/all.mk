@@ -0,0 +1,13 @@
+#
+#  Test the "rest" module
+#
+
+#  MODULE.test is the main target for this module.
+
+# Don't test rest if REST_TEST_SERVER ENV is not set.
+# The tests expect src/tests/modules/rest/stub_server.py to be
+# listening on port 8080 of that server.
+rest_require_test_server := 1
+
+rest.test:
+	@echo OK: rest.test
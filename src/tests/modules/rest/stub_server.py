@@ -0,0 +1,76 @@
+#!/usr/bin/env python
+#
+#  Minimal HTTP server for the rlm_rest tests.
+#
+#  Usage: stub_server.py [port]
+#
+#  GET /ping                   - "pong", as text/plain.
+#  GET /user/<name>/mac/<mac>  - form encoded attributes for <name>.
+#  GET /delay/<ms>             - "done", after waiting <ms> milliseconds.
+#  GET /requests               - Number of requests received on this
+#                                connection, including this one.
+#
+#  Responses are HTTP/1.1 with a Content-Length, so connections
+#  are kept alive between requests.
+#
+#  $Id$
+#
+import sys
+import time
+
+try:
+    from http.server import BaseHTTPRequestHandler, HTTPServer
+    from socketserver import ThreadingMixIn
+    from urllib.parse import quote, urlparse
+except ImportError:
+    from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+    from SocketServer import ThreadingMixIn
+    from urllib import quote
+    from urlparse import urlparse
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    # One handler is created per connection
+    requests = 0
+
+    def respond(self, code, body, content_type='text/plain'):
+        body = body.encode('utf-8')
+        self.send_response(code)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        path = urlparse(self.path).path.strip('/').split('/')
+        self.requests += 1
+
+        if path == ['ping']:
+            self.respond(200, 'pong')
+        elif path == ['requests']:
+            self.respond(200, str(self.requests))
+        elif len(path) == 4 and path[0] == 'user' and path[2] == 'mac':
+            if path[1] == 'unknown':
+                self.respond(404, '')
+            else:
+                self.respond(200, 'control:Tmp-String-0=authorize&reply:Reply-Message=' +
+                             quote('Hello ' + path[1]), 'application/x-www-form-urlencoded')
+        elif len(path) == 2 and path[0] == 'delay':
+            time.sleep(int(path[1]) / 1000.0)
+            self.respond(200, 'done')
+        else:
+            self.respond(404, '')
+
+    def log_message(self, format, *args):
+        pass
+
+
+class Server(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+
+
+if __name__ == '__main__':
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8080
+    Server(('127.0.0.1', port), Handler).serve_forever()
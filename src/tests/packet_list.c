@@ -0,0 +1,257 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file packet_list.c
+ * @brief Tests for the ID bitmaps and striped hash tables of fr_packet_list_t.
+ *
+ * Opens UDP sockets on the loopback interface, and checks that every ID
+ * of a socket can be allocated exactly once, that freed IDs can be
+ * allocated again, and that packets spread over the stripes can be found
+ * by their replies, walked, and removed.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#define NUM_SOCKETS	(4)
+#define NUM_PACKETS	(NUM_SOCKETS * 256)
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%u]: Check \"%s\" failed: %s\n", __FILE__, __LINE__, #_x, fr_strerror()); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+static fr_ipaddr_t	loopback;
+static uint16_t		dst_port = 1812;
+
+static int socket_add(fr_packet_list_t *pl)
+{
+	int sockfd;
+
+	sockfd = fr_socket(&loopback, 0);
+	CHECK(sockfd >= 0);
+	CHECK(fr_packet_list_socket_add(pl, sockfd, IPPROTO_UDP, &loopback, dst_port, NULL));
+
+	return sockfd;
+}
+
+static RADIUS_PACKET *packet_alloc(TALLOC_CTX *ctx)
+{
+	RADIUS_PACKET *packet;
+
+	packet = fr_radius_alloc(ctx, false);
+	CHECK(packet != NULL);
+
+	packet->code = PW_CODE_ACCESS_REQUEST;
+	packet->dst_ipaddr = loopback;
+	packet->dst_port = dst_port;
+
+	return packet;
+}
+
+/*
+ *	Build the reply the home server would send to a packet.
+ */
+static void packet_reply(RADIUS_PACKET *reply, RADIUS_PACKET const *packet)
+{
+	memset(reply, 0, sizeof(*reply));
+
+	reply->sockfd = packet->sockfd;
+	reply->id = packet->id;
+	reply->code = PW_CODE_ACCESS_ACCEPT;
+	reply->src_ipaddr = packet->dst_ipaddr;
+	reply->src_port = packet->dst_port;
+	reply->dst_ipaddr = packet->src_ipaddr;
+	reply->dst_port = packet->src_port;
+#ifdef WITH_TCP
+	reply->proto = IPPROTO_UDP;
+#endif
+}
+
+/*
+ *	Every ID of a socket is allocated exactly once, and freed IDs
+ *	are allocated again.
+ */
+static void test_id_bitmap(void)
+{
+	TALLOC_CTX		*ctx = talloc_init("test_id_bitmap");
+	fr_packet_list_t	*pl;
+	RADIUS_PACKET		*packets[256], *extra;
+	uint8_t			seen[256];
+	int			sockfd, i;
+
+	pl = fr_packet_list_create(1);
+	CHECK(pl != NULL);
+
+	sockfd = socket_add(pl);
+
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < 256; i++) {
+		packets[i] = packet_alloc(ctx);
+		CHECK(fr_packet_list_id_alloc(pl, IPPROTO_UDP, &packets[i], NULL));
+		CHECK(packets[i]->sockfd == sockfd);
+		CHECK((packets[i]->id >= 0) && (packets[i]->id < 256));
+		CHECK(!seen[packets[i]->id]);
+		seen[packets[i]->id] = 1;
+	}
+	CHECK(fr_packet_list_num_outgoing(pl) == 256);
+	CHECK(fr_packet_list_num_elements(pl) == 256);
+
+	/*
+	 *	All of the IDs are in use.
+	 */
+	extra = packet_alloc(ctx);
+	CHECK(!fr_packet_list_id_alloc(pl, IPPROTO_UDP, &extra, NULL));
+
+	/*
+	 *	Free some IDs from different words of the bitmap, and
+	 *	check they're the only ones which can be allocated.
+	 */
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < 256; i += 63) {
+		seen[packets[i]->id] = 1;
+		CHECK(fr_packet_list_id_free(pl, packets[i], true));
+	}
+	CHECK(fr_packet_list_num_outgoing(pl) == 251);
+
+	for (i = 0; i < 256; i += 63) {
+		CHECK(fr_packet_list_id_alloc(pl, IPPROTO_UDP, &packets[i], NULL));
+		CHECK(seen[packets[i]->id]);
+		seen[packets[i]->id] = 0;
+	}
+	CHECK(!fr_packet_list_id_alloc(pl, IPPROTO_UDP, &extra, NULL));
+
+	/*
+	 *	Once every ID is freed, the list is empty.
+	 */
+	for (i = 0; i < 256; i++) CHECK(fr_packet_list_id_free(pl, packets[i], true));
+	CHECK(fr_packet_list_num_outgoing(pl) == 0);
+	CHECK(fr_packet_list_num_elements(pl) == 0);
+
+	CHECK(fr_packet_list_socket_del(pl, sockfd));
+	close(sockfd);
+
+	fr_packet_list_free(pl);
+	talloc_free(ctx);
+}
+
+static int walk_delete_odd(UNUSED void *ctx, void *data)
+{
+	fr_packet_list_t	*pl = ctx;
+	RADIUS_PACKET		*packet = *(RADIUS_PACKET **)data;
+
+	if ((packet->id & 0x01) == 0) return 0;
+
+	fr_packet_list_id_free(pl, packet, false);
+
+	return 2;
+}
+
+/*
+ *	Packets from several sockets are found by their replies, and
+ *	can be removed by walking the list.
+ */
+static void test_stripes(void)
+{
+	TALLOC_CTX		*ctx = talloc_init("test_stripes");
+	fr_packet_list_t	*pl;
+	RADIUS_PACKET		*packets[NUM_PACKETS], reply, **packet_p;
+	int			sockets[NUM_SOCKETS];
+	int			i;
+
+	pl = fr_packet_list_create(1);
+	CHECK(pl != NULL);
+
+	for (i = 0; i < NUM_SOCKETS; i++) sockets[i] = socket_add(pl);
+
+	for (i = 0; i < NUM_PACKETS; i++) {
+		packets[i] = packet_alloc(ctx);
+		CHECK(fr_packet_list_id_alloc(pl, IPPROTO_UDP, &packets[i], NULL));
+	}
+	CHECK(fr_packet_list_num_elements(pl) == NUM_PACKETS);
+
+	for (i = 0; i < NUM_PACKETS; i++) {
+		packet_reply(&reply, packets[i]);
+
+		packet_p = fr_packet_list_find_byreply(pl, &reply);
+		CHECK(packet_p != NULL);
+		CHECK(*packet_p == packets[i]);
+
+		CHECK(fr_packet_list_find(pl, packets[i]) == packet_p);
+	}
+
+	/*
+	 *	A reply with an ID which was never allocated on the
+	 *	socket doesn't match anything.
+	 */
+	CHECK(fr_packet_list_id_free(pl, packets[0], true));
+	packet_reply(&reply, packets[0]);
+	CHECK(fr_packet_list_find_byreply(pl, &reply) == NULL);
+	CHECK(fr_packet_list_id_alloc(pl, IPPROTO_UDP, &packets[0], NULL));
+
+	/*
+	 *	Remove packets with odd IDs by walking the list, and
+	 *	check that only the even ones can still be found.
+	 */
+	CHECK(fr_packet_list_walk(pl, pl, walk_delete_odd) == 0);
+	CHECK(fr_packet_list_num_elements(pl) == (NUM_PACKETS / 2));
+	CHECK(fr_packet_list_num_outgoing(pl) == (NUM_PACKETS / 2));
+
+	for (i = 0; i < NUM_PACKETS; i++) {
+		if (packets[i]->id < 0) {
+			CHECK(fr_packet_list_find(pl, packets[i]) == NULL);
+			continue;
+		}
+
+		CHECK((packets[i]->id & 0x01) == 0);
+
+		packet_reply(&reply, packets[i]);
+		packet_p = fr_packet_list_find_byreply(pl, &reply);
+		CHECK(packet_p != NULL);
+		CHECK(*packet_p == packets[i]);
+
+		CHECK(fr_packet_list_yank(pl, packets[i]));
+		CHECK(fr_packet_list_find_byreply(pl, &reply) == NULL);
+		CHECK(fr_packet_list_id_free(pl, packets[i], false));
+	}
+	CHECK(fr_packet_list_num_elements(pl) == 0);
+	CHECK(fr_packet_list_num_outgoing(pl) == 0);
+
+	for (i = 0; i < NUM_SOCKETS; i++) {
+		CHECK(fr_packet_list_socket_del(pl, sockets[i]));
+		close(sockets[i]);
+	}
+
+	fr_packet_list_free(pl);
+	talloc_free(ctx);
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	CHECK(fr_inet_pton(&loopback, "127.0.0.1", -1, AF_INET, false, false) == 0);
+
+	test_id_bitmap();
+	test_stripes();
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+TARGET		:= packet_list
+SOURCES		:= packet_list.c
+
+TGT_INSTALLDIR	:=
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
+
+#
+#  Run the packet list tests
+#
+.PHONY: tests.packet_list
+tests.packet_list: $(TESTBINDIR)/packet_list
+	@echo PACKET-LIST-TEST
+	@$(TESTBIN)/packet_list
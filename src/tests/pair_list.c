@@ -0,0 +1,381 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file pair_list.c
+ * @brief Tests for vp_list_t.
+ *
+ * Checks that pairs added to a vp_list_t can be iterated over in order,
+ * found by number both before and after the list is large enough to be
+ * indexed, and removed from the start, middle and end of the list, and
+ * that fr_pair_list_move() keeps the list intact when := removes pairs.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/conf.h>
+#include <freeradius-devel/radpaths.h>
+
+/*
+ *	Enough pairs that the list is indexed.
+ */
+#define NUM_PAIRS	(40)
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%u]: Check \"%s\" failed: %s\n", __FILE__, __LINE__, #_x, fr_strerror()); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+static VALUE_PAIR *pair_alloc(TALLOC_CTX *ctx, unsigned int attr)
+{
+	VALUE_PAIR *vp;
+
+	vp = fr_pair_afrom_num(ctx, 0, attr);
+	CHECK(vp != NULL);
+
+	return vp;
+}
+
+/*
+ *	Check the list is in the expected order, and that the tail
+ *	and count are right.
+ */
+static void check_order(vp_list_t *list, VALUE_PAIR **expected, uint32_t num)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	uint32_t	i = 0;
+
+	for (vp = fr_cursor_init(&cursor, &list->head);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		CHECK(i < num);
+		CHECK(vp == expected[i]);
+		i++;
+	}
+	CHECK(i == num);
+
+	if (list->tail) {
+		CHECK(list->tail == (num ? expected[num - 1] : NULL));
+		CHECK(list->count == num);
+	}
+}
+
+/*
+ *	Pairs are appended in order, singly or as lists, and can be
+ *	found whether or not the list has been indexed.
+ */
+static void test_insert(void)
+{
+	TALLOC_CTX	*ctx = talloc_init("test_insert");
+	vp_list_t	list;
+	VALUE_PAIR	*pairs[NUM_PAIRS + 2], *chain, *vp;
+	vp_cursor_t	cursor;
+	uint32_t	i;
+
+	fr_pair_head_init(&list, NULL);
+	CHECK(fr_pair_head_find_by_num(&list, 0, 1, TAG_ANY) == NULL);
+
+	/*
+	 *	Short lists are searched linearly.
+	 */
+	for (i = 0; i < 8; i++) {
+		pairs[i] = pair_alloc(ctx, i + 1);
+		fr_pair_head_add(&list, pairs[i]);
+	}
+	check_order(&list, pairs, 8);
+	CHECK(fr_pair_head_find_by_num(&list, 0, 8, TAG_ANY) == pairs[7]);
+	CHECK(fr_pair_head_find_by_num(&list, 0, 9, TAG_ANY) == NULL);
+	CHECK(list.index == NULL);
+
+	/*
+	 *	Add two pairs at once.
+	 */
+	pairs[8] = pair_alloc(ctx, 9);
+	pairs[9] = pair_alloc(ctx, 10);
+	pairs[8]->next = pairs[9];
+	fr_pair_head_add(&list, pairs[8]);
+	check_order(&list, pairs, 10);
+
+	/*
+	 *	Pairs appended with a cursor are picked up by the
+	 *	next add.
+	 */
+	pairs[10] = pair_alloc(ctx, 11);
+	fr_cursor_init(&cursor, &list.head);
+	fr_cursor_append(&cursor, pairs[10]);
+
+	for (i = 11; i < NUM_PAIRS; i++) {
+		pairs[i] = pair_alloc(ctx, i + 1);
+		fr_pair_head_add(&list, pairs[i]);
+	}
+	check_order(&list, pairs, NUM_PAIRS);
+
+	/*
+	 *	Long lists are indexed on the first search.
+	 */
+	for (i = 0; i < NUM_PAIRS; i++) CHECK(fr_pair_head_find_by_num(&list, 0, i + 1, TAG_ANY) == pairs[i]);
+	CHECK(list.index != NULL);
+	CHECK(fr_pair_head_find_by_num(&list, 0, NUM_PAIRS + 1, TAG_ANY) == NULL);
+
+	/*
+	 *	Pairs added after the index is built are found, and
+	 *	a duplicate doesn't hide the first pair.
+	 */
+	chain = pair_alloc(ctx, 1);
+	pairs[NUM_PAIRS] = chain;
+	pairs[NUM_PAIRS + 1] = chain->next = pair_alloc(ctx, NUM_PAIRS + 1);
+	fr_pair_head_add(&list, chain);
+	check_order(&list, pairs, NUM_PAIRS + 2);
+
+	CHECK(fr_pair_head_find_by_num(&list, 0, 1, TAG_ANY) == pairs[0]);
+	CHECK(fr_pair_head_find_by_num(&list, 0, NUM_PAIRS + 1, TAG_ANY) == pairs[NUM_PAIRS + 1]);
+	CHECK(fr_pair_head_find_by_da(&list, pairs[NUM_PAIRS + 1]->da, TAG_ANY) == pairs[NUM_PAIRS + 1]);
+
+	vp = fr_pair_head_find_by_num(&list, 0, 1, TAG_ANY);
+	fr_cursor_init(&cursor, &vp->next);
+	CHECK(fr_cursor_next_by_num(&cursor, 0, 1, TAG_ANY) == pairs[NUM_PAIRS]);
+
+	fr_pair_head_free(&list);
+	CHECK(list.head == NULL);
+	CHECK(list.index == NULL);
+
+	talloc_free(ctx);
+}
+
+/*
+ *	Pairs are removed from the start, middle and end of the list,
+ *	and the tail and index are kept up to date.
+ */
+static void test_remove(void)
+{
+	TALLOC_CTX	*ctx = talloc_init("test_remove");
+	vp_list_t	list;
+	VALUE_PAIR	*pairs[NUM_PAIRS], *expected[NUM_PAIRS], *dup, *other;
+	uint32_t	i, num;
+
+	fr_pair_head_init(&list, NULL);
+
+	for (i = 0; i < NUM_PAIRS; i++) {
+		pairs[i] = pair_alloc(ctx, i + 1);
+		fr_pair_head_add(&list, pairs[i]);
+	}
+
+	/*
+	 *	A second pair with the same number as the one we'll
+	 *	remove from the middle.
+	 */
+	dup = pair_alloc(ctx, 20);
+	fr_pair_head_add(&list, dup);
+
+	CHECK(fr_pair_head_find_by_num(&list, 0, 20, TAG_ANY) == pairs[19]);
+	CHECK(list.index != NULL);
+
+	/*
+	 *	Pairs which aren't in the list can't be removed.
+	 */
+	other = pair_alloc(ctx, 1);
+	CHECK(fr_pair_head_remove(&list, other) == NULL);
+
+	CHECK(fr_pair_head_remove(&list, pairs[0]) == pairs[0]);
+	CHECK(pairs[0]->next == NULL);
+	CHECK(fr_pair_head_find_by_num(&list, 0, 1, TAG_ANY) == NULL);
+
+	CHECK(fr_pair_head_remove(&list, pairs[19]) == pairs[19]);
+	CHECK(fr_pair_head_find_by_num(&list, 0, 20, TAG_ANY) == dup);
+
+	CHECK(fr_pair_head_remove(&list, dup) == dup);
+	CHECK(fr_pair_head_find_by_num(&list, 0, 20, TAG_ANY) == NULL);
+
+	num = 0;
+	for (i = 1; i < NUM_PAIRS; i++) {
+		if (i == 19) continue;
+		expected[num++] = pairs[i];
+	}
+	check_order(&list, expected, num);
+	CHECK(list.tail == pairs[NUM_PAIRS - 1]);
+
+	/*
+	 *	Removing the tail moves it back, and appends go after
+	 *	the new tail.
+	 */
+	CHECK(fr_pair_head_remove(&list, pairs[NUM_PAIRS - 1]) == pairs[NUM_PAIRS - 1]);
+	num--;
+	CHECK(list.tail == pairs[NUM_PAIRS - 2]);
+	check_order(&list, expected, num);
+
+	fr_pair_head_add(&list, dup);
+	expected[num++] = dup;
+	check_order(&list, expected, num);
+	CHECK(fr_pair_head_find_by_num(&list, 0, 20, TAG_ANY) == dup);
+
+	/*
+	 *	Empty the list.
+	 */
+	for (i = 0; i < num; i++) CHECK(fr_pair_head_remove(&list, expected[i]) == expected[i]);
+	CHECK(list.head == NULL);
+	CHECK(list.tail == NULL);
+	CHECK(list.count == 0);
+
+	fr_pair_head_reset(&list);
+	talloc_free(ctx);
+}
+
+/*
+ *	Lists created elsewhere can be wrapped, iterated over, and
+ *	appended to.
+ */
+static void test_iterate(void)
+{
+	TALLOC_CTX	*ctx = talloc_init("test_iterate");
+	vp_list_t	list;
+	VALUE_PAIR	*head = NULL, *pairs[NUM_PAIRS + 1];
+	vp_cursor_t	cursor;
+	uint32_t	i;
+
+	fr_cursor_init(&cursor, &head);
+	for (i = 0; i < NUM_PAIRS; i++) {
+		pairs[i] = pair_alloc(ctx, (i % 4) + 1);
+		fr_cursor_append(&cursor, pairs[i]);
+	}
+
+	fr_pair_head_init(&list, head);
+	check_order(&list, pairs, NUM_PAIRS);
+
+	/*
+	 *	Iterate over the pairs with one number, using the
+	 *	index to find the first one.
+	 */
+	fr_pair_head_find_by_num(&list, 0, 1, TAG_ANY);
+	CHECK(list.index != NULL);
+
+	for (i = 0; i < 4; i++) {
+		VALUE_PAIR	*vp, *start;
+		uint32_t	j = i;
+
+		start = fr_pair_head_find_by_num(&list, 0, i + 1, TAG_ANY);
+		CHECK(start == pairs[i]);
+
+		fr_cursor_init(&cursor, &start);
+		for (vp = fr_cursor_next_by_num(&cursor, 0, i + 1, TAG_ANY);
+		     vp;
+		     vp = fr_cursor_next_by_num(&cursor, 0, i + 1, TAG_ANY)) {
+			CHECK(vp == pairs[j]);
+			j += 4;
+		}
+		CHECK(j == (NUM_PAIRS + i));
+	}
+
+	pairs[NUM_PAIRS] = pair_alloc(ctx, 5);
+	fr_pair_head_add(&list, pairs[NUM_PAIRS]);
+	check_order(&list, pairs, NUM_PAIRS + 1);
+	CHECK(fr_pair_head_find_by_num(&list, 0, 5, TAG_ANY) == pairs[NUM_PAIRS]);
+
+	fr_pair_head_reset(&list);
+	CHECK(list.head == head);
+	check_order(&list, pairs, NUM_PAIRS + 1);
+
+	talloc_free(ctx);
+}
+
+/*
+ *	Moving a pair with := replaces the first pair with the same
+ *	number, and removes the others, including the tail.  Pairs
+ *	added after that go at the end of the list.
+ */
+static void test_move(void)
+{
+	TALLOC_CTX	*ctx = talloc_init("test_move");
+	VALUE_PAIR	*to = NULL, *from = NULL, *pairs[NUM_PAIRS], *expected[NUM_PAIRS + 2], *set, *add;
+	vp_cursor_t	cursor;
+	vp_list_t	list;
+	uint32_t	i, num = 0;
+
+	/*
+	 *	NAS-Port (5) is the 5th, 21st and last pair.
+	 */
+	fr_cursor_init(&cursor, &to);
+	for (i = 0; i < NUM_PAIRS; i++) {
+		pairs[i] = pair_alloc(ctx, ((i % 16) == 4) || (i == (NUM_PAIRS - 1)) ? 5 : 30 + (i % 8));
+		fr_cursor_append(&cursor, pairs[i]);
+
+		if ((pairs[i]->da->attr != 5) || (i == 4)) expected[num++] = pairs[i];
+	}
+	CHECK(pairs[NUM_PAIRS - 1]->da->attr == 5);
+
+	set = pair_alloc(ctx, 5);
+	set->op = T_OP_SET;
+	set->vp_integer = 99;
+
+	add = pair_alloc(ctx, 18);
+	add->op = T_OP_ADD;
+	expected[num++] = add;
+
+	fr_cursor_init(&cursor, &from);
+	fr_cursor_append(&cursor, set);
+	fr_cursor_append(&cursor, add);
+
+	fr_pair_list_move(ctx, &to, &from);
+	CHECK(from == NULL);
+
+	fr_pair_head_init(&list, to);
+	check_order(&list, expected, num);
+	CHECK(pairs[4]->vp_integer == 99);
+
+	CHECK(fr_pair_head_find_by_num(&list, 0, 5, TAG_ANY) == pairs[4]);
+	CHECK(fr_pair_head_find_by_num(&list, 0, 18, TAG_ANY) == add);
+
+	expected[num] = pair_alloc(ctx, 1);
+	fr_pair_head_add(&list, expected[num++]);
+	check_order(&list, expected, num);
+
+	fr_pair_head_reset(&list);
+	talloc_free(ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	char const	*dict_dir = DICTDIR;
+	fr_dict_t	*dict = NULL;
+
+	while ((c = getopt(argc, argv, "D:")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		default:
+			fprintf(stderr, "usage: pair_list [-D <dictdir>]\n");
+			exit(EXIT_FAILURE);
+	}
+
+	CHECK(fr_dict_init(NULL, &dict, dict_dir, RADIUS_DICTIONARY, "radius") == 0);
+
+	test_insert();
+	test_remove();
+	test_iterate();
+	test_move();
+
+	talloc_free(dict);
+
+	return 0;
+}
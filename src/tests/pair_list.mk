@@ -0,0 +1,14 @@
+TARGET		:= pair_list
+SOURCES		:= pair_list.c
+
+TGT_INSTALLDIR	:=
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
+
+#
+#  Run the vp_list_t tests
+#
+.PHONY: tests.pair_list
+tests.pair_list: $(TESTBINDIR)/pair_list
+	@echo PAIR-LIST-TEST
+	@$(TESTBIN)/pair_list -D $(top_srcdir)/share
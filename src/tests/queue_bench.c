@@ -0,0 +1,214 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file queue_bench.c
+ * @brief Benchmark for the request queue and thread pool.
+ *
+ * Pushes synthetic requests through request_enqueue(), and measures how
+ * long the thread pool takes to process them.  Run it with different
+ * values of "-s" to compare contention on the queue mutexes.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/process.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+static atomic_uint_fast32_t processed;
+static atomic_uint_fast32_t dropped;
+
+static uint32_t	work_loops = 0;
+static uint32_t num_requests = 500000;
+static uint32_t num_producers = 1;
+
+static REQUEST	**requests;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: queue_bench [options]\n");
+	fprintf(stderr, "  -n <num>        Number of requests to enqueue (default 500000).\n");
+	fprintf(stderr, "  -p <num>        Number of threads calling request_enqueue() (default 1).\n");
+	fprintf(stderr, "  -s <num>        Number of queue shards (default 1).\n");
+	fprintf(stderr, "  -t <num>        Number of worker threads (default 8).\n");
+	fprintf(stderr, "  -w <num>        Busy-loop iterations per request (default 0).\n");
+
+	exit(1);
+}
+
+/*
+ *	Do (optionally) some work, and count the request.
+ */
+static void bench_process(UNUSED REQUEST *request, fr_state_action_t action)
+{
+	volatile uint32_t i;
+
+	switch (action) {
+	case FR_ACTION_RUN:
+		for (i = 0; i < work_loops; i++);
+		atomic_fetch_add_explicit(&processed, 1, memory_order_relaxed);
+		break;
+
+	case FR_ACTION_DONE:
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void *producer(void *arg)
+{
+	uint32_t i, start, end;
+	uintptr_t id = (uintptr_t) arg;
+
+	start = (num_requests / num_producers) * id;
+	end = (id == (num_producers - 1)) ? num_requests : start + (num_requests / num_producers);
+
+	for (i = start; i < end; i++) request_enqueue(requests[i]);
+
+	return NULL;
+}
+
+static void add_pair(CONF_SECTION *cs, char const *attr, uint32_t value)
+{
+	char buffer[32];
+
+	snprintf(buffer, sizeof(buffer), "%u", value);
+	cf_pair_add(cs, cf_pair_alloc(cs, attr, buffer, T_OP_EQ, T_BARE_WORD, T_BARE_WORD));
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	uint32_t	i;
+	uint32_t	num_shards = 1, num_threads = 8;
+	bool		spawn_workers = true;
+	CONF_SECTION	*cs, *pool_cs;
+	pthread_t	*producers;
+	struct timeval	start, end;
+	double		elapsed;
+	TALLOC_CTX	*ctx;
+
+	while ((c = getopt(argc, argv, "n:p:s:t:w:h")) != EOF) switch (c) {
+		case 'n':
+			num_requests = atoi(optarg);
+			break;
+
+		case 'p':
+			num_producers = atoi(optarg);
+			break;
+
+		case 's':
+			num_shards = atoi(optarg);
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+
+		case 'w':
+			work_loops = atoi(optarg);
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (!num_requests || !num_producers || !num_shards || !num_threads) usage();
+
+	fr_debug_lvl = rad_debug_lvl = 0;
+
+	ctx = talloc_init("queue_bench");
+
+	/*
+	 *	Fake up a "thread pool" section.  All of the threads
+	 *	are started up front, and none are ever deleted.
+	 */
+	cs = cf_section_alloc(NULL, "main", NULL);
+	pool_cs = cf_section_alloc(cs, "thread", "pool");
+	cf_section_add(cs, pool_cs);
+
+	add_pair(pool_cs, "start_servers", num_threads);
+	add_pair(pool_cs, "max_servers", num_threads);
+	add_pair(pool_cs, "min_spare_servers", 1);
+	add_pair(pool_cs, "max_spare_servers", num_threads);
+	add_pair(pool_cs, "max_queue_size", (1024 * 1024) - 1);
+	add_pair(pool_cs, "queue_shards", num_shards);
+
+	if ((thread_pool_bootstrap(cs, &spawn_workers) < 0) || (thread_pool_init() < 0)) {
+		fprintf(stderr, "queue_bench: Failed initializing thread pool\n");
+		exit(1);
+	}
+
+	/*
+	 *	Allocate all of the requests before we start timing.
+	 */
+	requests = talloc_array(ctx, REQUEST *, num_requests);
+	for (i = 0; i < num_requests; i++) {
+		REQUEST *request;
+
+		MEM(request = request_alloc(ctx));
+		MEM(request->packet = fr_radius_alloc(request, false));
+		request->packet->code = PW_CODE_ACCESS_REQUEST;
+		request->priority = RAD_LISTEN_AUTH;
+		request->process = bench_process;
+		request->number = i;
+
+		requests[i] = request;
+	}
+
+	producers = talloc_array(ctx, pthread_t, num_producers);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < num_producers; i++) {
+		if (pthread_create(&producers[i], NULL, producer, (void *)(uintptr_t) i) != 0) {
+			fprintf(stderr, "queue_bench: Failed creating producer thread\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < num_producers; i++) pthread_join(producers[i], NULL);
+
+	while ((atomic_load(&processed) + atomic_load(&dropped)) < num_requests) usleep(100);
+
+	gettimeofday(&end, NULL);
+
+	elapsed = (end.tv_sec - start.tv_sec) + ((end.tv_usec - start.tv_usec) / 1000000.0);
+
+	printf("shards=%u threads=%u producers=%u requests=%u processed=%u dropped=%u time=%.3fs rate=%.0f/s\n",
+	       num_shards, num_threads, num_producers, num_requests,
+	       (uint32_t) atomic_load(&processed), (uint32_t) atomic_load(&dropped),
+	       elapsed, num_requests / elapsed);
+
+	thread_pool_stop();
+	talloc_free(ctx);
+	talloc_free(cs);
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET		:= queue_bench
+SOURCES		:= queue_bench.c
+
+TGT_INSTALLDIR	:=
+TGT_PREREQS	:= libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
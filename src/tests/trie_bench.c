@@ -0,0 +1,279 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file trie_bench.c
+ * @brief Benchmark for longest prefix match lookups.
+ *
+ * Adds random prefixes of mixed lengths to a trie, and to one rbtree
+ * per prefix length (the way client lists used to be stored).  It then
+ * times lookups of random addresses in both, and checks that they
+ * return the same results.  Finally it removes the prefixes, and checks
+ * that the results still agree as the trie is pruned.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+typedef struct bench_prefix_t {
+	uint8_t		key[16];
+	uint32_t	bits;
+} bench_prefix_t;
+
+static uint32_t	key_bits = 32;
+static uint32_t	num_lookups = 1000000;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: trie_bench [options]\n");
+	fprintf(stderr, "  -6              Use 128 bit (IPv6) keys.\n");
+	fprintf(stderr, "  -l <num>        Number of lookups (default 1000000).\n");
+	fprintf(stderr, "  -n <num>        Number of prefixes (default 10000 and 100000).\n");
+
+	exit(1);
+}
+
+static int prefix_cmp(void const *one, void const *two)
+{
+	bench_prefix_t const *a = one;
+	bench_prefix_t const *b = two;
+
+	return memcmp(a->key, b->key, key_bits / 8);
+}
+
+static void prefix_mask(uint8_t *key, uint32_t bits)
+{
+	uint32_t i;
+
+	for (i = bits; i < key_bits; i++) key[i >> 3] &= ~(0x80 >> (i & 0x07));
+}
+
+/*
+ *	The old client lookup: probe one tree per prefix length,
+ *	from the longest down.
+ */
+static bench_prefix_t *rbtree_lookup(rbtree_t **trees, uint8_t const *key)
+{
+	int32_t i;
+	bench_prefix_t my;
+
+	for (i = key_bits; i >= 0; i--) {
+		bench_prefix_t *found;
+
+		if (!trees[i]) continue;
+
+		memcpy(my.key, key, sizeof(my.key));
+		prefix_mask(my.key, i);
+
+		found = rbtree_finddata(trees[i], &my);
+		if (found) return found;
+	}
+
+	return NULL;
+}
+
+static void compare(fr_trie_t *trie, rbtree_t **trees, uint8_t const *keys)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_lookups; i++) {
+		if (fr_trie_lookup(trie, keys + (i * 16), NULL, NULL, NULL) != rbtree_lookup(trees, keys + (i * 16))) {
+			fprintf(stderr, "trie_bench: Trie and rbtree results differ for lookup %u\n", i);
+			exit(1);
+		}
+	}
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+
+	return (end.tv_sec - start->tv_sec) + ((end.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+static void bench(uint32_t num_prefixes)
+{
+	TALLOC_CTX	*ctx;
+	fr_trie_t	*trie;
+	rbtree_t	*trees[FR_TRIE_MAX_BITS + 1];
+	bench_prefix_t	*prefixes;
+	uint8_t		*keys;
+	uint32_t	i, j, added = 0, hits = 0;
+	struct timeval	start;
+	double		trie_time, rbtree_time;
+
+	ctx = talloc_init("trie_bench");
+	memset(trees, 0, sizeof(trees));
+
+	trie = fr_trie_create(ctx, key_bits);
+	if (!trie) {
+		fprintf(stderr, "trie_bench: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	/*
+	 *	Mostly long prefixes, as with real client lists, but
+	 *	with some networks of every size.
+	 */
+	prefixes = talloc_array(ctx, bench_prefix_t, num_prefixes);
+	for (i = 0; i < num_prefixes; i++) {
+		bench_prefix_t *p = &prefixes[added];
+
+		for (j = 0; j < sizeof(p->key); j += 4) {
+			uint32_t r = fr_rand();
+
+			memcpy(p->key + j, &r, 4);
+		}
+
+		switch (fr_rand() & 0x03) {
+		case 0:
+			p->bits = fr_rand() % (key_bits + 1);
+			break;
+
+		case 1:
+			p->bits = key_bits - (key_bits / 4);
+			break;
+
+		default:
+			p->bits = key_bits;
+			break;
+		}
+		prefix_mask(p->key, p->bits);
+
+		if (fr_trie_insert(trie, p->key, p->bits, p) < 0) continue;
+
+		if (!trees[p->bits]) trees[p->bits] = rbtree_create(ctx, prefix_cmp, NULL, 0);
+		rbtree_insert(trees[p->bits], p);
+		added++;
+	}
+
+	/*
+	 *	Half of the lookups are for addresses inside a prefix.
+	 */
+	keys = talloc_array(ctx, uint8_t, num_lookups * 16);
+	for (i = 0; i < num_lookups; i++) {
+		uint8_t *key = keys + (i * 16);
+
+		for (j = 0; j < 16; j += 4) {
+			uint32_t r = fr_rand();
+
+			memcpy(key + j, &r, 4);
+		}
+
+		if (fr_rand() & 0x01) {
+			bench_prefix_t *p = &prefixes[fr_rand() % added];
+
+			for (j = 0; j < p->bits; j++) {
+				uint8_t bit = 0x80 >> (j & 0x07);
+
+				key[j >> 3] = (key[j >> 3] & ~bit) | (p->key[j >> 3] & bit);
+			}
+		}
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_lookups; i++) {
+		if (fr_trie_lookup(trie, keys + (i * 16), NULL, NULL, NULL)) hits++;
+	}
+	trie_time = elapsed(&start);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_lookups; i++) {
+		if (rbtree_lookup(trees, keys + (i * 16))) hits--;
+	}
+	rbtree_time = elapsed(&start);
+
+	/*
+	 *	Both methods must return the same prefix.
+	 */
+	compare(trie, trees, keys);
+
+	printf("bits=%u prefixes=%u lookups=%u trie=%.1fns/lookup rbtree=%.1fns/lookup\n",
+	       key_bits, added, num_lookups,
+	       (trie_time * 1e9) / num_lookups, (rbtree_time * 1e9) / num_lookups);
+
+	if (hits != 0) {
+		fprintf(stderr, "trie_bench: Trie and rbtree hit counts differ\n");
+		exit(1);
+	}
+
+	/*
+	 *	Remove every other prefix, so that nodes are pruned
+	 *	from all over the trie, then the rest.
+	 */
+	for (j = 0; j < 2; j++) {
+		for (i = j; i < added; i += 2) {
+			bench_prefix_t *p = &prefixes[i];
+
+			if (fr_trie_remove(trie, p->key, p->bits) != p) {
+				fprintf(stderr, "trie_bench: Failed removing prefix %u\n", i);
+				exit(1);
+			}
+			rbtree_deletebydata(trees[p->bits], p);
+		}
+
+		compare(trie, trees, keys);
+	}
+
+	if (fr_trie_num_elements(trie) != 0) {
+		fprintf(stderr, "trie_bench: Trie is not empty\n");
+		exit(1);
+	}
+
+	talloc_free(ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	uint32_t	num_prefixes = 0;
+
+	while ((c = getopt(argc, argv, "6l:n:h")) != EOF) switch (c) {
+		case '6':
+			key_bits = 128;
+			break;
+
+		case 'l':
+			num_lookups = atoi(optarg);
+			break;
+
+		case 'n':
+			num_prefixes = atoi(optarg);
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (!num_lookups) usage();
+
+	if (num_prefixes) {
+		bench(num_prefixes);
+		return 0;
+	}
+
+	bench(10000);
+	bench(100000);
+
+	return 0;
+}
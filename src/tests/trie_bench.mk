@@ -0,0 +1,6 @@
+TARGET		:= trie_bench
+SOURCES		:= trie_bench.c
+
+TGT_INSTALLDIR	:=
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)